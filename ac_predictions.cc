@@ -11,8 +11,6 @@
 #include "data_parallel.h"
 #include "opsin_inverse.h"
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "bits.h"
 #include "block.h"
 #include "common.h"
@@ -29,72 +27,6 @@
 
 namespace pik {
 namespace {
-// Adds or subtracts block to/from "add_to",
-// except elements 0,H,V,D. May overwrite parts of "block".
-template <bool add>
-SIMD_ATTR void AddBlockExcept0HVDTo(const float* PIK_RESTRICT block,
-                                    float* PIK_RESTRICT add_to) {
-  constexpr int N = kBlockDim;
-
-  const SIMD_PART(float, SIMD_MIN(SIMD_FULL(float)::N, 8)) d;
-
-#if SIMD_TARGET_VALUE == SIMD_NONE
-  // Fallback because SIMD version assumes at least two lanes.
-  block[0] = 0.0f;
-  block[1] = 0.0f;
-  block[N] = 0.0f;
-  block[N + 1] = 0.0f;
-  if (!add) {
-    for (size_t i = 0; i < N * N; ++i) {
-      add_to[i] -= block[i];
-    }
-  } else {
-    for (size_t i = 0; i < N * N; ++i) {
-      add_to[i] += block[i];
-    }
-  }
-#else
-  // Negated to enable default zero-initialization of upper lanes.
-  SIMD_ALIGN uint32_t mask2[d.N] = {~0u, ~0u};
-  const auto only_01 = load(d, reinterpret_cast<float*>(mask2));
-
-  // First block row: don't add block[0, 1].
-  auto prev = load(d, add_to + 0);
-  auto coefs = load(d, block + 0);
-  auto masked_coefs = andnot(only_01, coefs);
-  auto sum = add ? prev + masked_coefs : prev - masked_coefs;
-  store(sum, d, add_to + 0);
-  // Handle remnants of DCT row (for 128-bit SIMD, or N > 8)
-  for (size_t ix = d.N; ix < N; ix += d.N) {
-    prev = load(d, add_to + ix);
-    coefs = load(d, block + ix);
-    sum = add ? prev + coefs : prev - coefs;
-    store(sum, d, add_to + ix);
-  }
-
-  // Second block row: don't add block[V, D].
-  prev = load(d, add_to + N);
-  coefs = load(d, block + N);
-  masked_coefs = andnot(only_01, coefs);
-  sum = add ? prev + masked_coefs : prev - masked_coefs;
-  store(sum, d, add_to + N);
-  // Handle remnants of DCT row (for 128-bit SIMD, or N > 8)
-  for (size_t ix = d.N; ix < N; ix += d.N) {
-    prev = load(d, add_to + N + ix);
-    coefs = load(d, block + N + ix);
-    sum = add ? prev + coefs : prev - coefs;
-    store(sum, d, add_to + N + ix);
-  }
-
-  for (size_t i = 2 * N; i < N * N; i += d.N) {
-    prev = load(d, add_to + i);
-    coefs = load(d, block + i);
-    sum = add ? prev + coefs : prev - coefs;
-    store(sum, d, add_to + i);
-  }
-#endif
-}
-
 // Un-color-correlates, quantizes, dequantizes and color-correlates the
 // specified coefficients inside the given block, using or storing the y-channel
 // values in y_block. Used by predictors to compute the decoder-side values to
@@ -266,132 +198,35 @@ SIMD_ATTR void ComputeUb4Kernel(const float sigma, Ub4Kernel* out) {
   }
 }
 
-// Adds to "add_to" (DCT) an image defined by the following transformations:
-//  1) Upsample image 4x4 with nearest-neighbor
-//  2) Blur with a Gaussian kernel of radius 4 and given sigma
-//  3) perform TransposedScaledDCT()
-//  4) Zero out the top 2x2 corner of each DCT block
-//  5) Negates the prediction if add is false (so the encoder subtracts, and
-//  the decoder adds)
-template <bool add>
-SIMD_ATTR void UpSample4x4BlurDCT(const Rect& dc_rect, const ImageF& img,
-                                  const Ub4Kernel& kernel,
-                                  const AcStrategyImage& ac_strategy,
-                                  const Rect& acs_rect, ImageF* add_to) {
-  PROFILER_FUNC;
-  constexpr size_t N = kBlockDim;
-  constexpr size_t block_size = N * N;
+// Computed once; GaussianKernel allocates, and AddPredictions runs per tile.
+const Ub4Kernel& GetUb4Kernel() {
+  static const Ub4Kernel kernel = [] {
+    Ub4Kernel kernel;
+    ComputeUb4Kernel(k4x4BlurStrength, &kernel);
+    return kernel;
+  }();
+  return kernel;
+}
 
-  // TODO(robryk): There's no good reason to compute the full DCT here. It's
-  // fine if the output is in pixel space, we just need to zero out top 2x2
-  // DCT coefficients. We can do that by computing a "partial DCT" and
-  // subtracting (we can have two outputs: a positive pixel-space output and a
-  // negative DCT-space output).
-
-  // TODO(robryk): Failing that, merge the blur and DCT into a single linear
-  // operation, if feasible.
-
-  const size_t bx0 = dc_rect.x0();
-  const size_t bxs = dc_rect.xsize();
-  PIK_CHECK(bxs >= 1);
-  const size_t bx1 = bx0 + bxs;
-  const size_t bx_max = DivCeil(add_to->xsize(), block_size);
-  const size_t by0 = dc_rect.y0();
-  const size_t bys = dc_rect.ysize();
-  PIK_CHECK(bys >= 1);
-  const size_t by1 = by0 + bys;
-  const size_t by_max = add_to->ysize();
-  PIK_CHECK(bx1 <= bx_max && by1 <= by_max);
-  const size_t xs = bxs * 2;
-  const size_t ys = bys * 2;
-
-  using D = SIMD_PART(float, SIMD_MIN(SIMD_FULL(float)::N, 8));
-  using V = D::V;
-  const D d;
-  V vw0[4] = {set1(d, kernel[0][0]), set1(d, kernel[0][1]),
-              set1(d, kernel[0][2]), set1(d, kernel[0][3])};
-  V vw1[4] = {set1(d, kernel[1][0]), set1(d, kernel[1][1]),
-              set1(d, kernel[1][2]), set1(d, kernel[1][3])};
-  V vw2[4] = {set1(d, kernel[2][0]), set1(d, kernel[2][1]),
-              set1(d, kernel[2][2]), set1(d, kernel[2][3])};
-
-  ImageF blur_x(xs * 4, ys + 2);
-  for (size_t y = 0; y < ys + 2; ++y) {
-    const float* PIK_RESTRICT row = img.ConstRow(y + 1);
-    float* const PIK_RESTRICT row_out = blur_x.Row(y);
-    for (int x = 0; x < xs; ++x) {
-      const float v0 = row[x + 1];
-      const float v1 = row[x + 2];
-      const float v2 = row[x + 3];
-      for (int ix = 0; ix < 4; ++ix) {
-        row_out[4 * x + ix] =
-            v0 * kernel[0][ix] + v1 * kernel[1][ix] + v2 * kernel[2][ix];
-      }
-    }
-  }
+}  // namespace
 
-  {
-    PROFILER_ZONE("dct upsample");
-    for (size_t by = 0; by < bys; ++by) {
-      const D d;
-      SIMD_ALIGN float block[AcStrategy::kMaxCoeffArea];
-      SIMD_ALIGN float temp_block[AcStrategy::kMaxCoeffArea];
-      const size_t out_stride = add_to->PixelsPerRow();
-      const size_t blur_stride = blur_x.PixelsPerRow();
-
-      float* PIK_RESTRICT row_out = add_to->Row(by0 + by);
-      AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(acs_rect, by0 + by);
-      for (int bx = 0; bx < bxs; ++bx) {
-        AcStrategy acs = ac_strategy_row[bx0 + bx];
-        if (!acs.IsFirstBlock()) continue;
-        if (!acs.PredictHF()) continue;
-        for (int idy = 0; idy < acs.covered_blocks_y(); idy++) {
-          const float* PIK_RESTRICT row0d = blur_x.ConstRow(2 * (by + idy));
-          const float* PIK_RESTRICT row1d = row0d + blur_stride;
-          const float* PIK_RESTRICT row2d = row1d + blur_stride;
-          const float* PIK_RESTRICT row3d = row2d + blur_stride;
-          for (int idx = 0; idx < acs.covered_blocks_x(); idx++) {
-            float* PIK_RESTRICT block_ptr =
-                block + AcStrategy::kMaxCoeffBlocks * block_size * idy +
-                8 * idx;
-            for (int ix = 0; ix < 8; ix += d.N) {
-              const auto val0 = load(d, &row0d[(bx + idx) * 8 + ix]);
-              const auto val1 = load(d, &row1d[(bx + idx) * 8 + ix]);
-              const auto val2 = load(d, &row2d[(bx + idx) * 8 + ix]);
-              const auto val3 = load(d, &row3d[(bx + idx) * 8 + ix]);
-              for (int iy = 0; iy < 4; ++iy) {
-                // A mul_add pair is faster but causes 1E-5 difference.
-                const auto vala =
-                    val0 * vw0[iy] + val1 * vw1[iy] + val2 * vw2[iy];
-                const auto valb =
-                    val1 * vw0[iy] + val2 * vw1[iy] + val3 * vw2[iy];
-                store(vala, d, &block_ptr[iy * AcStrategy::kMaxBlockDim + ix]);
-                store(valb, d,
-                      &block_ptr[iy * AcStrategy::kMaxBlockDim +
-                                 AcStrategy::kMaxBlockDim * 4 + ix]);
-              }
-            }
-          }
-        }
+// Calls UpSample4x4BlurDCT<add> compiled for Target (via Dispatch).
+struct UpSample4x4BlurDCTImpl {
+  template <class Target>
+  void operator()(bool add, const Rect& dc_rect, const ImageF& img,
+                  const Ub4Kernel& kernel, const AcStrategyImage& ac_strategy,
+                  const Rect& acs_rect, ImageF* add_to) const;
+};
 
-        acs.TransformFromPixels(block, AcStrategy::kMaxBlockDim, temp_block,
-                                AcStrategy::kMaxCoeffBlocks * block_size);
-        for (size_t iby = 0; iby < acs.covered_blocks_y(); iby++) {
-          for (size_t ibx = 0; ibx < acs.covered_blocks_x(); ibx++) {
-            const float* PIK_RESTRICT in =
-                temp_block +
-                block_size * (AcStrategy::kMaxCoeffBlocks * iby + ibx);
-            float* PIK_RESTRICT out =
-                row_out + block_size * (bx0 + bx + ibx) + out_stride * iby;
-            AddBlockExcept0HVDTo<add>(in, out);
-          }
-        }
-      }
-    }
-  }
-}
+}  // namespace pik
 
-}  // namespace
+// Must include "normally" so the build system understands the dependency.
+#include "ac_predictions_target.cc"
+
+#define SIMD_ATTR_IMPL "ac_predictions_target.cc"
+#include "simd/foreach_target.h"
+
+namespace pik {
 
 // Compute the lowest-frequency coefficients in the DCT block (1x1 for DCT8,
 // 2x2 for DCT16, etc.)
@@ -636,27 +471,22 @@ SIMD_ATTR void ComputePredictionResiduals(const Image3F& pred2x2,
                                           Image3F* PIK_RESTRICT coeffs) {
   Rect dc_rect(0, 0, pred2x2.xsize() / 2 - 2, pred2x2.ysize() / 2 - 2);
   Rect acs_rect(0, 0, ac_strategy.xsize(), ac_strategy.ysize());
-  Ub4Kernel kernel;
-  ComputeUb4Kernel(k4x4BlurStrength, &kernel);
+  const Target target = TargetBitfield().Best();
   for (int c = 0; c < coeffs->kNumPlanes; ++c) {
-    UpSample4x4BlurDCT</*add=*/false>(dc_rect, pred2x2.Plane(c), kernel,
-                                      ac_strategy, acs_rect,
-                                      coeffs->MutablePlane(c));
+    Dispatch(target, UpSample4x4BlurDCTImpl(), /*add=*/false, dc_rect,
+             pred2x2.Plane(c), GetUb4Kernel(), ac_strategy, acs_rect,
+             coeffs->MutablePlane(c));
   }
 }
 
-void AddPredictions(const Image3F& pred2x2, const AcStrategyImage& ac_strategy,
-                    const Rect& acs_rect, Image3F* PIK_RESTRICT dcoeffs) {
+void AddPredictions(const Rect& tile, const ImageF& pred2x2_plane,
+                    const AcStrategyImage& ac_strategy, const Rect& acs_rect,
+                    ImageF* PIK_RESTRICT dcoeffs_plane) {
   PROFILER_FUNC;
-  Rect dc_rect(0, 0, pred2x2.xsize() / 2 - 2, pred2x2.ysize() / 2 - 2);
-  Ub4Kernel kernel;
-  ComputeUb4Kernel(k4x4BlurStrength, &kernel);
-  for (int c = 0; c < dcoeffs->kNumPlanes; ++c) {
-    // Updates dcoeffs _except_ 0HVD.
-    UpSample4x4BlurDCT</*add=*/true>(dc_rect, pred2x2.Plane(c), kernel,
-                                     ac_strategy, acs_rect,
-                                     dcoeffs->MutablePlane(c));
-  }
+  // Updates dcoeffs _except_ 0HVD.
+  Dispatch(TargetBitfield().Best(), UpSample4x4BlurDCTImpl(), /*add=*/true,
+           tile, pred2x2_plane, GetUb4Kernel(), ac_strategy, acs_rect,
+           dcoeffs_plane);
 }
 
 }  // namespace pik
@@ -53,8 +53,8 @@ void ComputePredictionResiduals(const Image3F& pred2x2,
                                 const AcStrategyImage& ac_strategy,
                                 Image3F* PIK_RESTRICT coeffs);
 
-// Decoder API. Encoder-decoder API is currently not symmetric. Ideally both
-// should allow tile-wise processing.
+// Decoder API, called for one tile (in block units) at a time. Encoder-decoder
+// API is currently not symmetric.
 SIMD_ATTR void UpdateLfForDecoder(const Rect& tile, bool predict_lf,
                                   bool predict_hf,
                                   const AcStrategyImage& ac_strategy,
@@ -62,8 +62,12 @@ SIMD_ATTR void UpdateLfForDecoder(const Rect& tile, bool predict_lf,
                                   ImageF* ac64_plane, ImageF* dc2x2_plane,
                                   ImageF* lf2x2_plane);
 
-void AddPredictions(const Image3F& pred2x2, const AcStrategyImage& ac_strategy,
-                    const Rect& acs_rect, Image3F* PIK_RESTRICT dcoeffs);
+// Requires the LF of the tile and of its right/bottom neighbors to have been
+// updated, because the upsampling blur reads one pixel of pred2x2 beyond the
+// tile.
+void AddPredictions(const Rect& tile, const ImageF& pred2x2_plane,
+                    const AcStrategyImage& ac_strategy, const Rect& acs_rect,
+                    ImageF* PIK_RESTRICT dcoeffs_plane);
 
 }  // namespace pik
 
@@ -0,0 +1,241 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+namespace pik {
+
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Adds or subtracts block to/from "add_to",
+// except elements 0,H,V,D. May overwrite parts of "block".
+template <bool add>
+SIMD_ATTR void AddBlockExcept0HVDTo(float* PIK_RESTRICT block,
+                                    float* PIK_RESTRICT add_to) {
+  constexpr int N = kBlockDim;
+
+  const SIMD_PART(float, SIMD_MIN(SIMD_FULL(float)::N, 8)) d;
+
+#if SIMD_TARGET_VALUE == SIMD_NONE
+  // Fallback because SIMD version assumes at least two lanes.
+  block[0] = 0.0f;
+  block[1] = 0.0f;
+  block[N] = 0.0f;
+  block[N + 1] = 0.0f;
+  if (!add) {
+    for (size_t i = 0; i < N * N; ++i) {
+      add_to[i] -= block[i];
+    }
+  } else {
+    for (size_t i = 0; i < N * N; ++i) {
+      add_to[i] += block[i];
+    }
+  }
+#else
+  // Negated to enable default zero-initialization of upper lanes.
+  SIMD_ALIGN uint32_t mask2[d.N] = {~0u, ~0u};
+  const auto only_01 = load(d, reinterpret_cast<float*>(mask2));
+
+  // First block row: don't add block[0, 1].
+  auto prev = load(d, add_to + 0);
+  auto coefs = load(d, block + 0);
+  auto masked_coefs = andnot(only_01, coefs);
+  auto sum = add ? prev + masked_coefs : prev - masked_coefs;
+  store(sum, d, add_to + 0);
+  // Handle remnants of DCT row (for 128-bit SIMD, or N > 8)
+  for (size_t ix = d.N; ix < N; ix += d.N) {
+    prev = load(d, add_to + ix);
+    coefs = load(d, block + ix);
+    sum = add ? prev + coefs : prev - coefs;
+    store(sum, d, add_to + ix);
+  }
+
+  // Second block row: don't add block[V, D].
+  prev = load(d, add_to + N);
+  coefs = load(d, block + N);
+  masked_coefs = andnot(only_01, coefs);
+  sum = add ? prev + masked_coefs : prev - masked_coefs;
+  store(sum, d, add_to + N);
+  // Handle remnants of DCT row (for 128-bit SIMD, or N > 8)
+  for (size_t ix = d.N; ix < N; ix += d.N) {
+    prev = load(d, add_to + N + ix);
+    coefs = load(d, block + N + ix);
+    sum = add ? prev + coefs : prev - coefs;
+    store(sum, d, add_to + N + ix);
+  }
+
+  for (size_t i = 2 * N; i < N * N; i += d.N) {
+    prev = load(d, add_to + i);
+    coefs = load(d, block + i);
+    sum = add ? prev + coefs : prev - coefs;
+    store(sum, d, add_to + i);
+  }
+#endif
+}
+
+// Adds to "add_to" (DCT) an image defined by the following transformations:
+//  1) Upsample image 4x4 with nearest-neighbor
+//  2) Blur with a Gaussian kernel of radius 4 and given sigma
+//  3) perform TransposedScaledDCT()
+//  4) Zero out the top 2x2 corner of each DCT block
+//  5) Negates the prediction if add is false (so the encoder subtracts, and
+//  the decoder adds)
+// Only the blocks in `dc_rect` are updated, one tile at a time; `img` has a
+// border of one block around the same block coordinates.
+template <bool add>
+SIMD_ATTR void UpSample4x4BlurDCT(const Rect& dc_rect, const ImageF& img,
+                                  const Ub4Kernel& kernel,
+                                  const AcStrategyImage& ac_strategy,
+                                  const Rect& acs_rect, ImageF* add_to) {
+  PROFILER_FUNC;
+  constexpr size_t N = kBlockDim;
+  constexpr size_t block_size = N * N;
+
+  // TODO(robryk): There's no good reason to compute the full DCT here. It's
+  // fine if the output is in pixel space, we just need to zero out top 2x2
+  // DCT coefficients. We can do that by computing a "partial DCT" and
+  // subtracting (we can have two outputs: a positive pixel-space output and a
+  // negative DCT-space output).
+
+  // TODO(robryk): Failing that, merge the blur and DCT into a single linear
+  // operation, if feasible.
+
+  const size_t bx0 = dc_rect.x0();
+  const size_t bxs = dc_rect.xsize();
+  PIK_CHECK(bxs >= 1);
+  const size_t bx1 = bx0 + bxs;
+  const size_t bx_max = DivCeil(add_to->xsize(), block_size);
+  const size_t by0 = dc_rect.y0();
+  const size_t bys = dc_rect.ysize();
+  PIK_CHECK(bys >= 1);
+  const size_t by1 = by0 + bys;
+  const size_t by_max = add_to->ysize();
+  PIK_CHECK(bx1 <= bx_max && by1 <= by_max);
+
+  using D = SIMD_PART(float, SIMD_MIN(SIMD_FULL(float)::N, 8));
+  using V = D::V;
+  const D d;
+  V vw0[4] = {set1(d, kernel[0][0]), set1(d, kernel[0][1]),
+              set1(d, kernel[0][2]), set1(d, kernel[0][3])};
+  V vw1[4] = {set1(d, kernel[1][0]), set1(d, kernel[1][1]),
+              set1(d, kernel[1][2]), set1(d, kernel[1][3])};
+  V vw2[4] = {set1(d, kernel[2][0]), set1(d, kernel[2][1]),
+              set1(d, kernel[2][2]), set1(d, kernel[2][3])};
+
+  // Horizontally blurred and upsampled rows of one tile, plus one row of
+  // `img` above and below. AC strategies are aligned to their size and thus
+  // never straddle tiles, so each tile only needs its own rows.
+  constexpr size_t kBlurStride = 4 * 2 * kTileDimInBlocks;
+  SIMD_ALIGN float blur_x[(2 * kTileDimInBlocks + 2) * kBlurStride];
+
+  for (size_t ty0 = by0; ty0 < by1; ty0 += kTileDimInBlocks) {
+    for (size_t tx0 = bx0; tx0 < bx1; tx0 += kTileDimInBlocks) {
+      const size_t txs = std::min(kTileDimInBlocks, bx1 - tx0);
+      const size_t tys = std::min(kTileDimInBlocks, by1 - ty0);
+      const size_t xs = txs * 2;
+      const size_t ys = tys * 2;
+
+      for (size_t y = 0; y < ys + 2; ++y) {
+        // `img` has a border of one block (two pixels), and the blur reads
+        // one pixel to either side.
+        const float* PIK_RESTRICT row = img.ConstRow(2 * ty0 + y + 1) + 2 * tx0;
+        float* const PIK_RESTRICT row_out = blur_x + y * kBlurStride;
+        for (int x = 0; x < xs; ++x) {
+          const float v0 = row[x + 1];
+          const float v1 = row[x + 2];
+          const float v2 = row[x + 3];
+          for (int ix = 0; ix < 4; ++ix) {
+            row_out[4 * x + ix] =
+                v0 * kernel[0][ix] + v1 * kernel[1][ix] + v2 * kernel[2][ix];
+          }
+        }
+      }
+
+      PROFILER_ZONE("dct upsample");
+      for (size_t by = 0; by < tys; ++by) {
+        SIMD_ALIGN float block[AcStrategy::kMaxCoeffArea];
+        SIMD_ALIGN float temp_block[AcStrategy::kMaxCoeffArea];
+        const size_t out_stride = add_to->PixelsPerRow();
+
+        float* PIK_RESTRICT row_out = add_to->Row(ty0 + by);
+        AcStrategyRow ac_strategy_row =
+            ac_strategy.ConstRow(acs_rect, ty0 + by);
+        for (int bx = 0; bx < txs; ++bx) {
+          AcStrategy acs = ac_strategy_row[tx0 + bx];
+          if (!acs.IsFirstBlock()) continue;
+          if (!acs.PredictHF()) continue;
+          for (int idy = 0; idy < acs.covered_blocks_y(); idy++) {
+            const float* PIK_RESTRICT row0d =
+                blur_x + 2 * (by + idy) * kBlurStride;
+            const float* PIK_RESTRICT row1d = row0d + kBlurStride;
+            const float* PIK_RESTRICT row2d = row1d + kBlurStride;
+            const float* PIK_RESTRICT row3d = row2d + kBlurStride;
+            for (int idx = 0; idx < acs.covered_blocks_x(); idx++) {
+              float* PIK_RESTRICT block_ptr =
+                  block + AcStrategy::kMaxCoeffBlocks * block_size * idy +
+                  8 * idx;
+              for (int ix = 0; ix < 8; ix += d.N) {
+                const auto val0 = load(d, &row0d[(bx + idx) * 8 + ix]);
+                const auto val1 = load(d, &row1d[(bx + idx) * 8 + ix]);
+                const auto val2 = load(d, &row2d[(bx + idx) * 8 + ix]);
+                const auto val3 = load(d, &row3d[(bx + idx) * 8 + ix]);
+                for (int iy = 0; iy < 4; ++iy) {
+                  // A mul_add pair is faster but causes 1E-5 difference.
+                  const auto vala =
+                      val0 * vw0[iy] + val1 * vw1[iy] + val2 * vw2[iy];
+                  const auto valb =
+                      val1 * vw0[iy] + val2 * vw1[iy] + val3 * vw2[iy];
+                  store(vala, d,
+                        &block_ptr[iy * AcStrategy::kMaxBlockDim + ix]);
+                  store(valb, d,
+                        &block_ptr[iy * AcStrategy::kMaxBlockDim +
+                                   AcStrategy::kMaxBlockDim * 4 + ix]);
+                }
+              }
+            }
+          }
+
+          acs.TransformFromPixels<SIMD_TARGET>(
+              block, AcStrategy::kMaxBlockDim, temp_block,
+              AcStrategy::kMaxCoeffBlocks * block_size);
+          for (size_t iby = 0; iby < acs.covered_blocks_y(); iby++) {
+            for (size_t ibx = 0; ibx < acs.covered_blocks_x(); ibx++) {
+              float* PIK_RESTRICT in =
+                  temp_block +
+                  block_size * (AcStrategy::kMaxCoeffBlocks * iby + ibx);
+              float* PIK_RESTRICT out =
+                  row_out + block_size * (tx0 + bx + ibx) + out_stride * iby;
+              AddBlockExcept0HVDTo<add>(in, out);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void UpSample4x4BlurDCTImpl::operator()<SIMD_TARGET>(
+    bool add, const Rect& dc_rect, const ImageF& img, const Ub4Kernel& kernel,
+    const AcStrategyImage& ac_strategy, const Rect& acs_rect,
+    ImageF* add_to) const {
+  if (add) {
+    SIMD_NAMESPACE::UpSample4x4BlurDCT<true>(dc_rect, img, kernel, ac_strategy,
+                                             acs_rect, add_to);
+  } else {
+    SIMD_NAMESPACE::UpSample4x4BlurDCT<false>(dc_rect, img, kernel,
+                                              ac_strategy, acs_rect, add_to);
+  }
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
@@ -144,225 +144,51 @@ void IDCT2TopBlock(const float* block, size_t stride, float* out) {
 }
 
 }  // namespace
+}  // namespace pik
 
-SIMD_ATTR void AcStrategy::TransformFromPixels(
-    const float* pixels, size_t pixels_stride, float* coefficients,
-    size_t coefficients_stride) const {
-  if (block_ != 0) return;
-  switch (strategy_) {
-    case Type::IDENTITY: {
-      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
-      for (size_t y = 0; y < 2; y++) {
-        for (size_t x = 0; x < 2; x++) {
-          float block_dc = 0;
-          for (size_t iy = 0; iy < 4; iy++) {
-            for (size_t ix = 0; ix < 4; ix++) {
-              block_dc += pixels[(y * 4 + iy) * pixels_stride + x * 4 + ix];
-            }
-          }
-          block_dc *= 1.0f / 16;
-          for (size_t iy = 0; iy < 4; iy++) {
-            for (size_t ix = 0; ix < 4; ix++) {
-              if (ix == 1 && iy == 1) continue;
-              coeffs[(y + iy * 2) * 8 + x + ix * 2] =
-                  pixels[(y * 4 + iy) * pixels_stride + x * 4 + ix] -
-                  pixels[(y * 4 + 1) * pixels_stride + x * 4 + 1];
-            }
-          }
-          coeffs[(y + 2) * 8 + x + 2] = coeffs[y * 8 + x];
-          coeffs[y * 8 + x] = block_dc;
-        }
-      }
-      float block00 = coeffs[0];
-      float block01 = coeffs[1];
-      float block10 = coeffs[8];
-      float block11 = coeffs[9];
-      coeffs[0] = (block00 + block01 + block10 + block11) * 0.25f;
-      coeffs[1] = (block00 + block01 - block10 - block11) * 0.25f;
-      coeffs[8] = (block00 - block01 + block10 - block11) * 0.25f;
-      coeffs[9] = (block00 - block01 - block10 + block11) * 0.25f;
-      memcpy(coefficients, coeffs, kBlockDim * kBlockDim * sizeof(float));
-      break;
-    }
-    case Type::DCT4X4_NOHF:
-    case Type::DCT4X4: {
-      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
-      for (size_t y = 0; y < 2; y++) {
-        for (size_t x = 0; x < 2; x++) {
-          float block[4 * 4];
-          ComputeTransposedScaledDCT<4>()(
-              FromLines<4>(pixels + y * 4 * pixels_stride + x * 4,
-                           pixels_stride),
-              ScaleToBlock<4>(block));
-          for (size_t iy = 0; iy < 4; iy++) {
-            for (size_t ix = 0; ix < 4; ix++) {
-              coeffs[(y + iy * 2) * 8 + x + ix * 2] = block[iy * 4 + ix];
-            }
-          }
-        }
-      }
-      float block00 = coeffs[0];
-      float block01 = coeffs[1];
-      float block10 = coeffs[8];
-      float block11 = coeffs[9];
-      coeffs[0] = (block00 + block01 + block10 + block11) * 0.25f;
-      coeffs[1] = (block00 + block01 - block10 - block11) * 0.25f;
-      coeffs[8] = (block00 - block01 + block10 - block11) * 0.25f;
-      coeffs[9] = (block00 - block01 - block10 + block11) * 0.25f;
-      memcpy(coefficients, coeffs, kBlockDim * kBlockDim * sizeof(float));
-      break;
-    }
-    case Type::DCT2X2: {
-      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
-      DCT2TopBlock<8>(pixels, pixels_stride, coeffs);
-      DCT2TopBlock<4>(coeffs, kBlockDim, coeffs);
-      DCT2TopBlock<2>(coeffs, kBlockDim, coeffs);
-      memcpy(coefficients, coeffs, kBlockDim * kBlockDim * sizeof(float));
-      break;
-    }
-    case Type::DCT16X16: {
-      SIMD_ALIGN float output[4 * kBlockDim * kBlockDim];
-      ComputeTransposedScaledDCT<2 * kBlockDim>()(
-          FromLines<2 * kBlockDim>(pixels, pixels_stride),
-          ScaleToBlock<2 * kBlockDim>(output));
-      ScatterBlock<2 * kBlockDim, 2 * kBlockDim>(output, coefficients,
-                                                 coefficients_stride);
-      break;
-    }
-    case Type::DCT32X32: {
-      SIMD_ALIGN float output[16 * kBlockDim * kBlockDim];
-      ComputeTransposedScaledDCT<4 * kBlockDim>()(
-          FromLines<4 * kBlockDim>(pixels, pixels_stride),
-          ScaleToBlock<4 * kBlockDim>(output));
-      ScatterBlock<4 * kBlockDim, 4 * kBlockDim>(output, coefficients,
-                                                 coefficients_stride);
-      break;
-    }
-    case Type::DCT_NOHF:
-    case Type::DCT: {
-      ComputeTransposedScaledDCT<kBlockDim>()(
-          FromLines<kBlockDim>(pixels, pixels_stride),
-          ScaleToBlock<kBlockDim>(coefficients));
-      break;
-    }
+// Must include "normally" so the build system understands the dependency.
+#include "ac_strategy_target.cc"
+
+#define SIMD_ATTR_IMPL "ac_strategy_target.cc"
+#include "simd/foreach_target.h"
+
+namespace pik {
+namespace {
+
+struct TransformFromPixelsImpl {
+  template <class Target>
+  void operator()(const AcStrategy& acs, const float* pixels,
+                  size_t pixels_stride, float* coefficients,
+                  size_t coefficients_stride) const {
+    acs.TransformFromPixels<Target>(pixels, pixels_stride, coefficients,
+                                    coefficients_stride);
   }
-}
+};
 
-SIMD_ATTR void AcStrategy::TransformToPixels(const float* coefficients,
-                                             size_t coefficients_stride,
-                                             float* pixels,
-                                             size_t pixels_stride) const {
-  if (block_ != 0) return;
-  switch (strategy_) {
-    case Type::IDENTITY: {
-      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
-      memcpy(coeffs, coefficients, kBlockDim * kBlockDim * sizeof(float));
-      float dcs[4] = {};
-      float block00 = coeffs[0];
-      float block01 = coeffs[1];
-      float block10 = coeffs[8];
-      float block11 = coeffs[9];
-      dcs[0] = block00 + block01 + block10 + block11;
-      dcs[1] = block00 + block01 - block10 - block11;
-      dcs[2] = block00 - block01 + block10 - block11;
-      dcs[3] = block00 - block01 - block10 + block11;
-      for (size_t y = 0; y < 2; y++) {
-        for (size_t x = 0; x < 2; x++) {
-          float block_dc = dcs[y * 2 + x];
-          float residual_sum = 0;
-          for (size_t iy = 0; iy < 4; iy++) {
-            for (size_t ix = 0; ix < 4; ix++) {
-              if (ix == 0 && iy == 0) continue;
-              residual_sum += coeffs[(y + iy * 2) * 8 + x + ix * 2];
-            }
-          }
-          pixels[(4 * y + 1) * pixels_stride + 4 * x + 1] =
-              block_dc - residual_sum * (1.0f / 16);
-          for (size_t iy = 0; iy < 4; iy++) {
-            for (size_t ix = 0; ix < 4; ix++) {
-              if (ix == 1 && iy == 1) continue;
-              pixels[(y * 4 + iy) * pixels_stride + x * 4 + ix] =
-                  coeffs[(y + iy * 2) * 8 + x + ix * 2] +
-                  pixels[(4 * y + 1) * pixels_stride + 4 * x + 1];
-            }
-          }
-          pixels[y * 4 * pixels_stride + x * 4] =
-              coeffs[(y + 2) * 8 + x + 2] +
-              pixels[(4 * y + 1) * pixels_stride + 4 * x + 1];
-        }
-      }
-      break;
-    }
-    case Type::DCT4X4_NOHF:
-    case Type::DCT4X4: {
-      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
-      memcpy(coeffs, coefficients, kBlockDim * kBlockDim * sizeof(float));
-      float dcs[4] = {};
-      float block00 = coeffs[0];
-      float block01 = coeffs[1];
-      float block10 = coeffs[8];
-      float block11 = coeffs[9];
-      dcs[0] = block00 + block01 + block10 + block11;
-      dcs[1] = block00 + block01 - block10 - block11;
-      dcs[2] = block00 - block01 + block10 - block11;
-      dcs[3] = block00 - block01 - block10 + block11;
-      for (size_t y = 0; y < 2; y++) {
-        for (size_t x = 0; x < 2; x++) {
-          float block[4 * 4];
-          block[0] = dcs[y * 2 + x];
-          for (size_t iy = 0; iy < 4; iy++) {
-            for (size_t ix = 0; ix < 4; ix++) {
-              if (ix == 0 && iy == 0) continue;
-              block[iy * 4 + ix] = coeffs[(y + iy * 2) * 8 + x + ix * 2];
-            }
-          }
-          ComputeTransposedScaledIDCT<4>()(
-              FromBlock<4>(block),
-              ToLines<4>(pixels + y * 4 * pixels_stride + x * 4,
-                         pixels_stride));
-        }
-      }
-      break;
-    }
-    case Type::DCT2X2: {
-      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
-      memcpy(coeffs, coefficients, sizeof(float) * kBlockDim * kBlockDim);
-      IDCT2TopBlock<2>(coeffs, kBlockDim, coeffs);
-      IDCT2TopBlock<4>(coeffs, kBlockDim, coeffs);
-      IDCT2TopBlock<8>(coeffs, kBlockDim, coeffs);
-      for (size_t y = 0; y < kBlockDim; y++) {
-        for (size_t x = 0; x < kBlockDim; x++) {
-          pixels[y * pixels_stride + x] = coeffs[y * kBlockDim + x];
-        }
-      }
-      break;
-    }
-    case Type::DCT16X16: {
-      SIMD_ALIGN float output[4 * kBlockDim * kBlockDim];
-      GatherBlock<2 * kBlockDim, 2 * kBlockDim>(coefficients,
-                                                coefficients_stride, output);
-      ComputeTransposedScaledIDCT<2 * kBlockDim>()(
-          FromBlock<2 * kBlockDim>(output),
-          ToLines<2 * kBlockDim>(pixels, pixels_stride));
-      break;
-    }
-    case Type::DCT32X32: {
-      SIMD_ALIGN float output[16 * kBlockDim * kBlockDim];
-      GatherBlock<4 * kBlockDim, 4 * kBlockDim>(coefficients,
-                                                coefficients_stride, output);
-      ComputeTransposedScaledIDCT<4 * kBlockDim>()(
-          FromBlock<4 * kBlockDim>(output),
-          ToLines<4 * kBlockDim>(pixels, pixels_stride));
-      break;
-    }
-    case Type::DCT_NOHF:
-    case Type::DCT: {
-      ComputeTransposedScaledIDCT<kBlockDim>()(
-          FromBlock<kBlockDim>(coefficients),
-          ToLines<kBlockDim>(pixels, pixels_stride));
-      break;
-    }
+struct TransformToPixelsImpl {
+  template <class Target>
+  void operator()(const AcStrategy& acs, const float* coefficients,
+                  size_t coefficients_stride, float* pixels,
+                  size_t pixels_stride) const {
+    acs.TransformToPixels<Target>(coefficients, coefficients_stride, pixels,
+                                  pixels_stride);
   }
+};
+
+}  // namespace
+
+void AcStrategy::TransformFromPixels(const float* pixels, size_t pixels_stride,
+                                     float* coefficients,
+                                     size_t coefficients_stride) const {
+  Dispatch(TargetBitfield().Best(), TransformFromPixelsImpl(), *this, pixels,
+           pixels_stride, coefficients, coefficients_stride);
+}
+
+void AcStrategy::TransformToPixels(const float* coefficients,
+                                   size_t coefficients_stride, float* pixels,
+                                   size_t pixels_stride) const {
+  Dispatch(TargetBitfield().Best(), TransformToPixelsImpl(), *this,
+           coefficients, coefficients_stride, pixels, pixels_stride);
 }
 
 SIMD_ATTR void AcStrategy::LowestFrequenciesFromDC(const float* PIK_RESTRICT dc,
@@ -622,20 +448,23 @@ size_t AcStrategyImage::CountBlocks(AcStrategy::Type type) const {
 
 SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
                                   const ImageF* quant_field, const Image3F& src,
-                                  ThreadPool* pool,
+                                  const Image3F& src_dct, ThreadPool* pool,
                                   AcStrategyImage* ac_strategy,
                                   PikInfo* aux_out) {
   PROFILER_FUNC;
   size_t xsize_blocks = src.xsize() / kBlockDim;
   size_t ysize_blocks = src.ysize() / kBlockDim;
-  Image3F coeffs = Image3F(xsize_blocks * kBlockDim * kBlockDim, ysize_blocks);
-  TransposedScaledDCT(src, &coeffs);
+  PIK_ASSERT(src_dct.xsize() == xsize_blocks * kBlockDim * kBlockDim);
+  PIK_ASSERT(src_dct.ysize() == ysize_blocks);
+  const Image3F& coeffs = src_dct;
   *ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
   if (!kChooseAcStrategy) {
     return;
   }
-  std::vector<bool> disable_dct16(xsize_blocks * ysize_blocks);
-  std::vector<bool> disable_dct32(xsize_blocks * ysize_blocks);
+  // Bytes rather than std::vector<bool> so that concurrent writes to
+  // different elements do not race.
+  std::vector<uint8_t> disable_dct16(xsize_blocks * ysize_blocks);
+  std::vector<uint8_t> disable_dct32(xsize_blocks * ysize_blocks);
   const auto disable_large_transforms = [&](int bx, int by) SIMD_ATTR {
     // If we find a well-fitting DCT4x4 within the larger block,
     // we disable the larger block.
@@ -701,7 +530,7 @@ SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
       loss_4x4 += kMul2 * norm4 / norm2;
       static const double loss_4x4_limit0 = 1.0745851804785773;
       if (loss_4x4 >= loss_4x4_limit0) {
-        // Probably not multi-threading safe.
+        // Only touches rows within the current 4-row band (see below).
         disable_dct32[(by & ~3) * xsize_blocks + (bx & ~3)] = true;
         disable_dct16[(by & ~1) * xsize_blocks + (bx & ~1)] = true;
       }
@@ -1023,17 +852,29 @@ SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
     return AcStrategy::Type::DCT;
   };
   ImageB raw_ac_strategy(xsize_blocks, ysize_blocks);
-  RunOnPool(pool, 0, ysize_blocks, [&](int y, int _) {
-    for (size_t x = 0; x < xsize_blocks; x++) {
-      disable_large_transforms(x, y);
-    }
-  });
-  RunOnPool(pool, 0, ysize_blocks, [&](int y, int _) {
-    uint8_t* PIK_RESTRICT row = raw_ac_strategy.Row(y);
-    for (size_t x = 0; x < xsize_blocks; x++) {
-      row[x] = static_cast<uint8_t>(find_block_strategy(x, y));
-    }
-  });
+  // Blocks in rows [4k, 4k + 4) only mark rows 4k and 4k + 2, so bands of four
+  // block rows can be processed independently.
+  const size_t ysize_bands = DivCeil(ysize_blocks, size_t(4));
+  RunOnPool(
+      pool, 0, ysize_bands,
+      [&](const int band, const int thread) SIMD_ATTR {
+        const size_t y_end = std::min<size_t>(band * 4 + 4, ysize_blocks);
+        for (size_t y = band * 4; y < y_end; y++) {
+          for (size_t x = 0; x < xsize_blocks; x++) {
+            disable_large_transforms(x, y);
+          }
+        }
+      },
+      "AcStrategy disable");
+  RunOnPool(
+      pool, 0, ysize_blocks,
+      [&](const int y, const int thread) SIMD_ATTR {
+        uint8_t* PIK_RESTRICT row = raw_ac_strategy.Row(y);
+        for (size_t x = 0; x < xsize_blocks; x++) {
+          row[x] = static_cast<uint8_t>(find_block_strategy(x, y));
+        }
+      },
+      "AcStrategy find");
   ac_strategy->SetFromRaw(Rect(raw_ac_strategy), raw_ac_strategy);
   if (aux_out != nullptr) {
     aux_out->num_dct2_blocks =
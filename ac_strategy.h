@@ -177,13 +177,23 @@ class AcStrategy {
     }
   }
 
-  // Pixel to coefficients and vice-versa
-  SIMD_ATTR void TransformFromPixels(const float* pixels, size_t pixels_stride,
-                                     float* coefficients,
-                                     size_t coefficients_stride) const;
-  SIMD_ATTR void TransformToPixels(const float* coefficients,
-                                   size_t coefficients_stride, float* pixels,
-                                   size_t pixels_stride) const;
+  // Pixel to coefficients and vice-versa, using the best SIMD target supported
+  // by the CPU.
+  void TransformFromPixels(const float* pixels, size_t pixels_stride,
+                           float* coefficients,
+                           size_t coefficients_stride) const;
+  void TransformToPixels(const float* coefficients, size_t coefficients_stride,
+                         float* pixels, size_t pixels_stride) const;
+
+  // Same as above, but for a given Target. Avoids the per-block dispatch in
+  // code that is itself compiled for each target (see foreach_target.h).
+  template <class Target>
+  void TransformFromPixels(const float* pixels, size_t pixels_stride,
+                           float* coefficients,
+                           size_t coefficients_stride) const;
+  template <class Target>
+  void TransformToPixels(const float* coefficients, size_t coefficients_stride,
+                         float* pixels, size_t pixels_stride) const;
 
   // Same as above, but for DC image.
   SIMD_ATTR void LowestFrequenciesFromDC(const float* PIK_RESTRICT dc,
@@ -280,10 +290,11 @@ class AcStrategyImage {
 };
 
 // `quant_field` is an initial quantization field for this image. `src` is the
-// input image in the XYB color space. `ac_strategy` is the output strategy.
+// input image in the XYB color space and `src_dct` its TransposedScaledDCT.
+// `ac_strategy` is the output strategy.
 SIMD_ATTR void FindBestAcStrategy(float butteraugli_target,
                                   const ImageF* quant_field, const Image3F& src,
-                                  ThreadPool* pool,
+                                  const Image3F& src_dct, ThreadPool* pool,
                                   AcStrategyImage* ac_strategy,
                                   PikInfo* aux_out);
 
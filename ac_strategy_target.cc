@@ -0,0 +1,261 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+// Per-target DCT; must be included for every target (see foreach_target.h).
+#include "dct.h"
+
+namespace pik {
+
+namespace SIMD_NAMESPACE {
+namespace {
+
+SIMD_ATTR void TransformFromPixels(const AcStrategy& acs,
+                                   const float* pixels, size_t pixels_stride,
+                                   float* coefficients,
+                                   size_t coefficients_stride) {
+  if (!acs.IsFirstBlock()) return;
+  switch (acs.Strategy()) {
+    case AcStrategy::Type::IDENTITY: {
+      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 2; x++) {
+          float block_dc = 0;
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              block_dc += pixels[(y * 4 + iy) * pixels_stride + x * 4 + ix];
+            }
+          }
+          block_dc *= 1.0f / 16;
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              if (ix == 1 && iy == 1) continue;
+              coeffs[(y + iy * 2) * 8 + x + ix * 2] =
+                  pixels[(y * 4 + iy) * pixels_stride + x * 4 + ix] -
+                  pixels[(y * 4 + 1) * pixels_stride + x * 4 + 1];
+            }
+          }
+          coeffs[(y + 2) * 8 + x + 2] = coeffs[y * 8 + x];
+          coeffs[y * 8 + x] = block_dc;
+        }
+      }
+      float block00 = coeffs[0];
+      float block01 = coeffs[1];
+      float block10 = coeffs[8];
+      float block11 = coeffs[9];
+      coeffs[0] = (block00 + block01 + block10 + block11) * 0.25f;
+      coeffs[1] = (block00 + block01 - block10 - block11) * 0.25f;
+      coeffs[8] = (block00 - block01 + block10 - block11) * 0.25f;
+      coeffs[9] = (block00 - block01 - block10 + block11) * 0.25f;
+      memcpy(coefficients, coeffs, kBlockDim * kBlockDim * sizeof(float));
+      break;
+    }
+    case AcStrategy::Type::DCT4X4_NOHF:
+    case AcStrategy::Type::DCT4X4: {
+      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 2; x++) {
+          float block[4 * 4];
+          ComputeTransposedScaledDCT<4>()(
+              FromLines<4>(pixels + y * 4 * pixels_stride + x * 4,
+                           pixels_stride),
+              ScaleToBlock<4>(block));
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              coeffs[(y + iy * 2) * 8 + x + ix * 2] = block[iy * 4 + ix];
+            }
+          }
+        }
+      }
+      float block00 = coeffs[0];
+      float block01 = coeffs[1];
+      float block10 = coeffs[8];
+      float block11 = coeffs[9];
+      coeffs[0] = (block00 + block01 + block10 + block11) * 0.25f;
+      coeffs[1] = (block00 + block01 - block10 - block11) * 0.25f;
+      coeffs[8] = (block00 - block01 + block10 - block11) * 0.25f;
+      coeffs[9] = (block00 - block01 - block10 + block11) * 0.25f;
+      memcpy(coefficients, coeffs, kBlockDim * kBlockDim * sizeof(float));
+      break;
+    }
+    case AcStrategy::Type::DCT2X2: {
+      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
+      DCT2TopBlock<8>(pixels, pixels_stride, coeffs);
+      DCT2TopBlock<4>(coeffs, kBlockDim, coeffs);
+      DCT2TopBlock<2>(coeffs, kBlockDim, coeffs);
+      memcpy(coefficients, coeffs, kBlockDim * kBlockDim * sizeof(float));
+      break;
+    }
+    case AcStrategy::Type::DCT16X16: {
+      SIMD_ALIGN float output[4 * kBlockDim * kBlockDim];
+      ComputeTransposedScaledDCT<2 * kBlockDim>()(
+          FromLines<2 * kBlockDim>(pixels, pixels_stride),
+          ScaleToBlock<2 * kBlockDim>(output));
+      ScatterBlock<2 * kBlockDim, 2 * kBlockDim>(output, coefficients,
+                                                 coefficients_stride);
+      break;
+    }
+    case AcStrategy::Type::DCT32X32: {
+      SIMD_ALIGN float output[16 * kBlockDim * kBlockDim];
+      ComputeTransposedScaledDCT<4 * kBlockDim>()(
+          FromLines<4 * kBlockDim>(pixels, pixels_stride),
+          ScaleToBlock<4 * kBlockDim>(output));
+      ScatterBlock<4 * kBlockDim, 4 * kBlockDim>(output, coefficients,
+                                                 coefficients_stride);
+      break;
+    }
+    case AcStrategy::Type::DCT_NOHF:
+    case AcStrategy::Type::DCT: {
+      ComputeTransposedScaledDCT<kBlockDim>()(
+          FromLines<kBlockDim>(pixels, pixels_stride),
+          ScaleToBlock<kBlockDim>(coefficients));
+      break;
+    }
+  }
+}
+
+SIMD_ATTR void TransformToPixels(const AcStrategy& acs,
+                                 const float* coefficients,
+                                 size_t coefficients_stride, float* pixels,
+                                 size_t pixels_stride) {
+  if (!acs.IsFirstBlock()) return;
+  switch (acs.Strategy()) {
+    case AcStrategy::Type::IDENTITY: {
+      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
+      memcpy(coeffs, coefficients, kBlockDim * kBlockDim * sizeof(float));
+      float dcs[4] = {};
+      float block00 = coeffs[0];
+      float block01 = coeffs[1];
+      float block10 = coeffs[8];
+      float block11 = coeffs[9];
+      dcs[0] = block00 + block01 + block10 + block11;
+      dcs[1] = block00 + block01 - block10 - block11;
+      dcs[2] = block00 - block01 + block10 - block11;
+      dcs[3] = block00 - block01 - block10 + block11;
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 2; x++) {
+          float block_dc = dcs[y * 2 + x];
+          float residual_sum = 0;
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              if (ix == 0 && iy == 0) continue;
+              residual_sum += coeffs[(y + iy * 2) * 8 + x + ix * 2];
+            }
+          }
+          pixels[(4 * y + 1) * pixels_stride + 4 * x + 1] =
+              block_dc - residual_sum * (1.0f / 16);
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              if (ix == 1 && iy == 1) continue;
+              pixels[(y * 4 + iy) * pixels_stride + x * 4 + ix] =
+                  coeffs[(y + iy * 2) * 8 + x + ix * 2] +
+                  pixels[(4 * y + 1) * pixels_stride + 4 * x + 1];
+            }
+          }
+          pixels[y * 4 * pixels_stride + x * 4] =
+              coeffs[(y + 2) * 8 + x + 2] +
+              pixels[(4 * y + 1) * pixels_stride + 4 * x + 1];
+        }
+      }
+      break;
+    }
+    case AcStrategy::Type::DCT4X4_NOHF:
+    case AcStrategy::Type::DCT4X4: {
+      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
+      memcpy(coeffs, coefficients, kBlockDim * kBlockDim * sizeof(float));
+      float dcs[4] = {};
+      float block00 = coeffs[0];
+      float block01 = coeffs[1];
+      float block10 = coeffs[8];
+      float block11 = coeffs[9];
+      dcs[0] = block00 + block01 + block10 + block11;
+      dcs[1] = block00 + block01 - block10 - block11;
+      dcs[2] = block00 - block01 + block10 - block11;
+      dcs[3] = block00 - block01 - block10 + block11;
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 2; x++) {
+          float block[4 * 4];
+          block[0] = dcs[y * 2 + x];
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              if (ix == 0 && iy == 0) continue;
+              block[iy * 4 + ix] = coeffs[(y + iy * 2) * 8 + x + ix * 2];
+            }
+          }
+          ComputeTransposedScaledIDCT<4>()(
+              FromBlock<4>(block),
+              ToLines<4>(pixels + y * 4 * pixels_stride + x * 4,
+                         pixels_stride));
+        }
+      }
+      break;
+    }
+    case AcStrategy::Type::DCT2X2: {
+      SIMD_ALIGN float coeffs[kBlockDim * kBlockDim];
+      memcpy(coeffs, coefficients, sizeof(float) * kBlockDim * kBlockDim);
+      IDCT2TopBlock<2>(coeffs, kBlockDim, coeffs);
+      IDCT2TopBlock<4>(coeffs, kBlockDim, coeffs);
+      IDCT2TopBlock<8>(coeffs, kBlockDim, coeffs);
+      for (size_t y = 0; y < kBlockDim; y++) {
+        for (size_t x = 0; x < kBlockDim; x++) {
+          pixels[y * pixels_stride + x] = coeffs[y * kBlockDim + x];
+        }
+      }
+      break;
+    }
+    case AcStrategy::Type::DCT16X16: {
+      SIMD_ALIGN float output[4 * kBlockDim * kBlockDim];
+      GatherBlock<2 * kBlockDim, 2 * kBlockDim>(coefficients,
+                                                coefficients_stride, output);
+      ComputeTransposedScaledIDCT<2 * kBlockDim>()(
+          FromBlock<2 * kBlockDim>(output),
+          ToLines<2 * kBlockDim>(pixels, pixels_stride));
+      break;
+    }
+    case AcStrategy::Type::DCT32X32: {
+      SIMD_ALIGN float output[16 * kBlockDim * kBlockDim];
+      GatherBlock<4 * kBlockDim, 4 * kBlockDim>(coefficients,
+                                                coefficients_stride, output);
+      ComputeTransposedScaledIDCT<4 * kBlockDim>()(
+          FromBlock<4 * kBlockDim>(output),
+          ToLines<4 * kBlockDim>(pixels, pixels_stride));
+      break;
+    }
+    case AcStrategy::Type::DCT_NOHF:
+    case AcStrategy::Type::DCT: {
+      ComputeTransposedScaledIDCT<kBlockDim>()(
+          FromBlock<kBlockDim>(coefficients),
+          ToLines<kBlockDim>(pixels, pixels_stride));
+      break;
+    }
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void AcStrategy::TransformFromPixels<SIMD_TARGET>(
+    const float* pixels, size_t pixels_stride, float* coefficients,
+    size_t coefficients_stride) const {
+  SIMD_NAMESPACE::TransformFromPixels(*this, pixels, pixels_stride,
+                                      coefficients, coefficients_stride);
+}
+
+template <>
+void AcStrategy::TransformToPixels<SIMD_TARGET>(const float* coefficients,
+                                                size_t coefficients_stride,
+                                                float* pixels,
+                                                size_t pixels_stride) const {
+  SIMD_NAMESPACE::TransformToPixels(*this, coefficients, coefficients_stride,
+                                    pixels, pixels_stride);
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
@@ -12,8 +12,6 @@
 #include "ac_strategy.h"
 #include "gradient_map.h"
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "approx_cube_root.h"
 #include "butteraugli_comparator.h"
 #include "common.h"
@@ -102,7 +100,8 @@ static const double kQuant64[64] = {
 };
 
 // Increase precision in 8x8 blocks that are complicated in DCT space.
-SIMD_ATTR void DctModulation(const ImageF& xyb, ImageF* out) {
+SIMD_ATTR void DctModulation(const ImageF& xyb, ThreadPool* pool,
+                             ImageF* out) {
   PIK_ASSERT((xyb.xsize() + 7) / 8 == out->xsize());
   PIK_ASSERT((xyb.ysize() + 7) / 8 == out->ysize());
   const int32_t* natural_coeff_order = NaturalCoeffOrder();
@@ -113,8 +112,9 @@ SIMD_ATTR void DctModulation(const ImageF& xyb, ImageF* out) {
       dct_rescale[i] = dct_scale[i / 8] * dct_scale[i % 8];
     }
   }
-  for (int y = 0; y < xyb.ysize(); y += 8) {
-    float* const PIK_RESTRICT row_out = out->Row(y / 8);
+  const auto process_row = [&](const int by, const int thread) SIMD_ATTR {
+    const int y = by * 8;
+    float* const PIK_RESTRICT row_out = out->Row(by);
     for (int x = 0; x < xyb.xsize(); x += 8) {
       SIMD_ALIGN float dct[64] = {0};
       for (int dy = 0; dy < 8; ++dy) {
@@ -153,15 +153,17 @@ SIMD_ATTR void DctModulation(const ImageF& xyb, ImageF* out) {
       double kMul = 1.2840706752955837;
       row_out[x / 8] += kMul * v;
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "DctModulation");
 }
 
 // Increase precision in 8x8 blocks that have high dynamic range.
-void RangeModulation(const ImageF& xyb, ImageF* out) {
+void RangeModulation(const ImageF& xyb, ThreadPool* pool, ImageF* out) {
   PIK_ASSERT((xyb.xsize() + 7) / 8 == out->xsize());
   PIK_ASSERT((xyb.ysize() + 7) / 8 == out->ysize());
-  for (int y = 0; y < xyb.ysize(); y += 8) {
-    float* const PIK_RESTRICT row_out = out->Row(y / 8);
+  const auto process_row = [&](const int by, const int thread) {
+    const int y = by * 8;
+    float* const PIK_RESTRICT row_out = out->Row(by);
     for (int x = 0; x < xyb.xsize(); x += 8) {
       float minval = 1e30;
       float maxval = -1e30;
@@ -181,15 +183,17 @@ void RangeModulation(const ImageF& xyb, ImageF* out) {
       static const double mul = 0.60277139175670691;
       row_out[x / 8] += mul * range;
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "RangeModulation");
 }
 
 // Change precision in 8x8 blocks that have high frequency content.
-void HfModulation(const ImageF& xyb, ImageF* out) {
+void HfModulation(const ImageF& xyb, ThreadPool* pool, ImageF* out) {
   PIK_ASSERT((xyb.xsize() + 7) / 8 == out->xsize());
   PIK_ASSERT((xyb.ysize() + 7) / 8 == out->ysize());
-  for (int y = 0; y < xyb.ysize(); y += 8) {
-    float* const PIK_RESTRICT row_out = out->Row(y / 8);
+  const auto process_row = [&](const int by, const int thread) {
+    const int y = by * 8;
+    float* const PIK_RESTRICT row_out = out->Row(by);
     for (int x = 0; x < xyb.xsize(); x += 8) {
       float sum = 0;
       int n = 0;
@@ -217,18 +221,22 @@ void HfModulation(const ImageF& xyb, ImageF* out) {
       sum *= kMul;
       row_out[x / 8] += sum;
     }
-  }
+  };
+  RunOnPool(pool, 0, out->ysize(), process_row, "HfModulation");
 }
 
 // We want multiplicative quantization field, so everything until this
 // point has been modulating the exponent.
-void Exp(ImageF* out) {
-  for (int y = 0; y < out->ysize(); ++y) {
-    float* const PIK_RESTRICT row_out = out->Row(y);
-    for (int x = 0; x < out->xsize(); ++x) {
-      row_out[x] = exp(row_out[x]);
-    }
-  }
+void Exp(ThreadPool* pool, ImageF* out) {
+  RunOnPool(
+      pool, 0, out->ysize(),
+      [out](const int y, const int thread) {
+        float* const PIK_RESTRICT row_out = out->Row(y);
+        for (int x = 0; x < out->xsize(); ++x) {
+          row_out[x] = exp(row_out[x]);
+        }
+      },
+      "Exp");
 }
 
 static double SimpleGamma(double v) {
@@ -262,7 +270,7 @@ static double RatioOfCubicRootToSimpleGamma(double v) {
   return v / SimpleGamma(v * v * v);
 }
 
-ImageF DiffPrecompute(const Image3F& xyb, float cutoff) {
+ImageF DiffPrecompute(const Image3F& xyb, float cutoff, ThreadPool* pool) {
   PROFILER_ZONE("aq DiffPrecompute");
   PIK_ASSERT(xyb.xsize() > 1);
   PIK_ASSERT(xyb.ysize() > 1);
@@ -276,9 +284,10 @@ ImageF DiffPrecompute(const Image3F& xyb, float cutoff) {
   // for quantization uses.
   static const double match_gamma_offset = 1.4439853629568109;
   static const float kOverWeightBorders = 1.4;
-  size_t x1, y1;
-  size_t x2, y2;
-  for (size_t y = 0; y + 1 < xyb.ysize(); ++y) {
+  const auto process_row = [&](const int task, const int thread) {
+    const size_t y = task;
+    size_t x1, y1;
+    size_t x2, y2;
     if (y + 1 < xyb.ysize()) {
       y2 = y + 1;
     } else if (y > 0) {
@@ -328,7 +337,8 @@ ImageF DiffPrecompute(const Image3F& xyb, float cutoff) {
       diff *= RatioOfCubicRootToSimpleGamma(row_in[x] + match_gamma_offset);
       row_out[x] = std::min(cutoff, diff);
     }
-  }
+  };
+  RunOnPool(pool, 0, xyb.ysize() - 1, process_row, "DiffPrecompute");
   // Last row.
   {
     const size_t y = xyb.ysize() - 1;
@@ -394,14 +404,14 @@ ImageF Expand(const ImageF& img, size_t out_xsize, size_t out_ysize) {
   return out;
 }
 
-ImageF ComputeMask(const ImageF& diffs) {
+ImageF ComputeMask(const ImageF& diffs, ThreadPool* pool) {
   static const float kBase = 1.1786692762035098;
   static const float kMul1 = 0.011134087946508579;
   static const float kOffset1 = 0.0070057082516685083;
   static const float kMul2 = -0.20545785980711334;
   static const float kOffset2 = 0.080407961356758706;
   ImageF out(diffs.xsize(), diffs.ysize());
-  for (int y = 0; y < diffs.ysize(); ++y) {
+  const auto process_row = [&](const int y, const int thread) {
     const float* const PIK_RESTRICT row_in = diffs.Row(y);
     float* const PIK_RESTRICT row_out = out.Row(y);
     for (int x = 0; x < diffs.xsize(); ++x) {
@@ -410,7 +420,8 @@ ImageF ComputeMask(const ImageF& diffs) {
       double div = std::max<double>(val + kOffset1, 1e-3);
       row_out[x] = kBase + kMul1 / div + kMul2 / (val * val + kOffset2);
     }
-  }
+  };
+  RunOnPool(pool, 0, diffs.ysize(), process_row, "ComputeMask");
   return out;
 }
 
@@ -574,9 +585,12 @@ void AdjustQuantField(const AcStrategyImage& ac_strategy, ImageF* quant_field) {
   }
 }
 
-Image3F RoundtripImage(const CompressParams& cparams,
-                       const PassHeader& pass_header, const GroupHeader& header,
+// Encodes and decodes opsin with the given quantizer, as the decoder would.
+// "coeffs" are the non-quantized coefficients of "opsin" (see
+// TransformToCoefficients), which do not change during the search.
+Image3F RoundtripImage(const PassHeader& pass_header, const GroupHeader& header,
                        const Image3F& opsin_orig, const Image3F& opsin,
+                       const Image3F& coeffs,
                        const AcStrategyImage& ac_strategy,
                        const Quantizer& quantizer,
                        const ColorCorrelationMap& full_cmap, ThreadPool* pool,
@@ -592,8 +606,8 @@ Image3F RoundtripImage(const CompressParams& cparams,
   const size_t num_groups = xsize_groups * ysize_groups;
 
   PassEncCache pass_enc_cache;
-  InitializePassEncCache(pass_header, opsin, ac_strategy, quantizer, full_cmap,
-                         pool, &pass_enc_cache);
+  InitializePassEncCache(pass_header, CopyImage(coeffs), ac_strategy,
+                         quantizer, full_cmap, pool, &pass_enc_cache);
 
   pass_dec_cache.dc = CopyImage(pass_enc_cache.dc_dec);
   pass_dec_cache.gradient = std::move(pass_enc_cache.gradient);
@@ -626,6 +640,7 @@ Image3F RoundtripImage(const CompressParams& cparams,
         DivCeil(block_group_rect.ysize(), kColorTileDimInBlocks));
 
     ColorCorrelationMap cmap = full_cmap.Copy(group_in_color_tiles);
+    // Nested: tiles of this group are shared with otherwise idle workers.
     ComputeCoefficients(quant, cmap, pool, &cache, multipass_manager);
 
     DecCache dec_cache;
@@ -635,12 +650,12 @@ Image3F RoundtripImage(const CompressParams& cparams,
     ReconOpsinImage(pass_header, header, quant, block_group_rect, &dec_cache,
                     &pass_dec_cache, &idct, group_rect);
   };
-  RunOnPool(pool, 0, num_groups, process_group, "PixelsToPikPass");
+  RunOnPool(pool, 0, num_groups, process_group, "RoundtripImage");
 
   multipass_manager->RestoreOpsin(&idct);
   Image3F linear(opsin_orig.xsize(), opsin_orig.ysize());
   FinalizePassDecoding(std::move(idct), pass_header, NoiseParams(), quantizer,
-                       pool, &pass_dec_cache, &linear);
+                       pool, &pass_dec_cache, /*x0=*/0, /*y0=*/0, &linear);
   return linear;
 }
 
@@ -660,7 +675,10 @@ void FindBestQuantization(const Image3F& opsin_orig, const Image3F& opsin_arg,
   const float intensity_multiplier = cparams.GetIntensityMultiplier();
   const float intensity_multiplier3 = std::cbrt(intensity_multiplier);
   ButteraugliComparator comparator(opsin_orig, cparams.hf_asymmetry,
-                                   intensity_multiplier);
+                                   intensity_multiplier, pool);
+  // opsin_arg and ac_strategy are fixed, hence so are the coefficients.
+  const Image3F coeffs =
+      TransformToCoefficients(opsin_arg, ac_strategy, Image3F(), pool);
   const float butteraugli_target_dc =
       std::min<float>(butteraugli_target, pow(butteraugli_target, kDcQuantPow));
   const float initial_quant_dc =
@@ -698,9 +716,9 @@ void FindBestQuantization(const Image3F& opsin_orig, const Image3F& opsin_arg,
     }
 
     if (quantizer->SetQuantField(initial_quant_dc, QuantField(quant_field))) {
-      Image3F linear = RoundtripImage(cparams, pass_header, header, opsin_orig,
-                                      opsin_arg, ac_strategy, *quantizer, cmap,
-                                      pool, multipass_manager);
+      Image3F linear = RoundtripImage(
+          pass_header, header, opsin_orig, opsin_arg, coeffs, ac_strategy,
+          *quantizer, cmap, pool, multipass_manager);
       PROFILER_ZONE("enc Butteraugli");
       comparator.Compare(linear);
       static const int kMargins[100] = {0, 0, 0, 1, 2, 1, 1, 1, 0};
@@ -837,7 +855,10 @@ void FindBestQuantizationHQ(
   const float intensity_multiplier = cparams.GetIntensityMultiplier();
   const float intensity_multiplier3 = std::cbrt(intensity_multiplier);
   ButteraugliComparator comparator(opsin_orig, cparams.hf_asymmetry,
-                                   intensity_multiplier);
+                                   intensity_multiplier, pool);
+  // opsin and ac_strategy are fixed, hence so are the coefficients.
+  const Image3F coeffs =
+      TransformToCoefficients(opsin, ac_strategy, Image3F(), pool);
   AdjustQuantField(ac_strategy, &quant_field);
   ImageF best_quant_field = CopyImage(quant_field);
   float best_butteraugli = 1000.0f;
@@ -866,8 +887,8 @@ void FindBestQuantizationHQ(
     ImageMinMax(quant_field, &qmin, &qmax);
     ++butteraugli_iter;
     if (quantizer->SetQuantField(quant_dc, QuantField(quant_field))) {
-      Image3F linear = RoundtripImage(cparams, pass_header, header, opsin_orig,
-                                      opsin, ac_strategy, *quantizer, cmap,
+      Image3F linear = RoundtripImage(pass_header, header, opsin_orig, opsin,
+                                      coeffs, ac_strategy, *quantizer, cmap,
                                       pool, multipass_manager);
       comparator.Compare(linear);
       bool best_quant_updated = false;
@@ -960,7 +981,8 @@ void FindBestQuantizationHQ(
 }
 
 ImageF AdaptiveQuantizationMap(const Image3F& img, const ImageF& img_ac,
-                               const CompressParams& cparams) {
+                               const CompressParams& cparams,
+                               ThreadPool* pool) {
   PROFILER_ZONE("aq AdaptiveQuantMap");
   static const int kResolution = 8;
   const size_t out_xsize = (img.xsize() + kResolution - 1) / kResolution;
@@ -979,30 +1001,39 @@ ImageF AdaptiveQuantizationMap(const Image3F& img, const ImageF& img_ac,
   static const int kRadius = static_cast<int>(2 * kSigma + 0.5f);
   std::vector<float> kernel = GaussianKernel(kRadius, kSigma);
   static const float kDiffCutoff = 0.11883287948847132;
-  ImageF out = DiffPrecompute(img, kDiffCutoff);
+  ImageF out = DiffPrecompute(img, kDiffCutoff, pool);
   out = Expand(out, kResolution * out_xsize, kResolution * out_ysize);
-  out = ConvolveAndSample(out, kernel, kResolution);
-  out = ComputeMask(out);
-  DctModulation(img_ac, &out);
-  RangeModulation(img_ac, &out);
-  HfModulation(img_ac, &out);
-  Exp(&out);
+  {
+    PROFILER_ZONE("aq ConvolveAndSample");
+    out = ConvolveAndSample(out, kernel, kResolution, pool);
+  }
+  {
+    PROFILER_ZONE("aq Modulation");
+    out = ComputeMask(out, pool);
+    DctModulation(img_ac, pool, &out);
+    RangeModulation(img_ac, pool, &out);
+    HfModulation(img_ac, pool, &out);
+    Exp(pool, &out);
+  }
   return out;
 }
 
-// TODO(veluca): remove or use pool.
 ImageF IntensityAcEstimate(const ImageF& image, float multiplier,
                            ThreadPool* pool) {
+  PROFILER_ZONE("aq IntensityAcEstimate");
   constexpr size_t N = kBlockDim;
   std::vector<float> blur = DCfiedGaussianKernel<N>(5.5);
-  ImageF retval = Convolve(image, blur);
-  for (size_t y = 0; y < retval.ysize(); y++) {
-    float* PIK_RESTRICT retval_row = retval.Row(y);
-    const float* PIK_RESTRICT image_row = image.ConstRow(y);
-    for (size_t x = 0; x < retval.xsize(); ++x) {
-      retval_row[x] = multiplier * (image_row[x] - retval_row[x]);
-    }
-  }
+  ImageF retval = Convolve(image, blur, pool);
+  RunOnPool(
+      pool, 0, retval.ysize(),
+      [&](const int y, const int thread) {
+        float* PIK_RESTRICT retval_row = retval.Row(y);
+        const float* PIK_RESTRICT image_row = image.ConstRow(y);
+        for (size_t x = 0; x < retval.xsize(); ++x) {
+          retval_row[x] = multiplier * (image_row[x] - retval_row[x]);
+        }
+      },
+      "IntensityAcEstimate");
   return retval;
 }
 
@@ -1016,9 +1047,9 @@ ImageF InitialQuantField(double butteraugli_target, double intensity_multiplier,
   const float quant_ac = intensity_multiplier3 * kAcQuant / butteraugli_target;
   ImageF intensity_ac =
       IntensityAcEstimate(opsin_orig.Plane(1), intensity_multiplier3, pool);
-  ImageF quant_field =
-      ScaleImage(quant_ac * (float)rescale,
-                 AdaptiveQuantizationMap(opsin_orig, intensity_ac, cparams));
+  ImageF quant_field = ScaleImage(
+      quant_ac * (float)rescale,
+      AdaptiveQuantizationMap(opsin_orig, intensity_ac, cparams, pool));
   return quant_field;
 }
 
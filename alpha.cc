@@ -57,7 +57,9 @@ Status EncodeAlpha(const CompressParams& params, const ImageU& plane,
   }
   ImageS residuals(rect.xsize(), rect.ysize());
   ShrinkY(Rect(alpha_img), alpha_img, Rect(residuals), &residuals);
-  std::string best;
+  // Both candidates are written to `writer`; the larger one is then removed.
+  BitWriter writer;
+  size_t best_bits = 0;
 
   const size_t rle_sym_start = kRleSymStart[alpha->bytes_per_alpha - 1];
 
@@ -92,15 +94,21 @@ Status EncodeAlpha(const CompressParams& params, const ImageU& plane,
 
     std::vector<ANSEncodingData> codes;
     std::vector<uint8_t> context_map;
-    std::string enc =
-        BuildAndEncodeHistograms(1, tokens, &codes, &context_map, nullptr);
-    enc += WriteTokens(tokens[0], codes, context_map, nullptr);
-    if (best.empty() || best.size() > enc.size()) {
-      best = std::move(enc);
+    const size_t candidate_begin = writer.BitsWritten();
+    BuildAndEncodeHistograms(1, tokens, &codes, &context_map, &writer,
+                             nullptr);
+    WriteTokens(tokens[0], codes, context_map, &writer, nullptr);
+    const size_t candidate_bits = writer.BitsWritten() - candidate_begin;
+    if (candidate_begin == 0) {
+      best_bits = candidate_bits;
+    } else if (candidate_bits < best_bits) {
+      writer.Erase(0, candidate_begin);
+      best_bits = candidate_bits;
+    } else {
+      writer.Rewind(candidate_begin);
     }
   }
-  alpha->encoded.resize(best.size());
-  memcpy(alpha->encoded.data(), best.data(), best.size());
+  alpha->encoded = writer.TakeBytes();
   return true;
 }
 
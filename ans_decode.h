@@ -17,6 +17,7 @@
 #include "ans_params.h"
 #include "bit_reader.h"
 #include "byte_order.h"
+#include "status.h"
 
 namespace pik {
 struct ANSSymbolInfo {
@@ -35,16 +36,29 @@ bool DecodeANSCodes(const size_t num_histograms, const size_t max_alphabet_size,
 
 class ANSSymbolReader {
  public:
-  ANSSymbolReader(const ANSCode* code) : code_(code) {}
+  // "num_states" must match the value passed to WriteTokens. With more than
+  // one state, consecutive symbols are decoded from independent states, so
+  // their table lookups and state updates can overlap in the pipeline.
+  explicit ANSSymbolReader(const ANSCode* code, size_t num_states = 1)
+      : num_states_(num_states), code_(code) {
+    PIK_ASSERT(1 <= num_states && num_states <= kANSMaxStates);
+    for (size_t i = 0; i < kANSMaxStates; ++i) {
+      states_[i] = ANS_SIGNATURE << 16;
+    }
+  }
 
   PIK_INLINE int ReadSymbol(const int histo_idx, BitReader* PIK_RESTRICT br) {
     if (PIK_UNLIKELY(symbols_left_ == 0)) {
-      state_ = br->ReadBits(16);
-      state_ = (state_ << 16) | br->ReadBits(16);
+      for (size_t i = 0; i < num_states_; ++i) {
+        states_[i] = br->ReadBits(16);
+        states_[i] = (states_[i] << 16) | br->ReadBits(16);
+      }
       br->FillBitBuffer();
       symbols_left_ = kANSBufferSize;
+      current_ = 0;
     }
-    const uint32_t res = state_ & (ANS_TAB_SIZE - 1);
+    uint32_t state = states_[current_];
+    const uint32_t res = state & (ANS_TAB_SIZE - 1);
     const int histo_offset = histo_idx << ANS_LOG_TAB_SIZE;
 
 #if PIK_BYTE_ORDER_LITTLE
@@ -55,25 +69,35 @@ class ANSSymbolReader {
     memcpy(&s32, &code_->info[histo_offset + symbol], sizeof(s32));
     const uint32_t offset = s32 & 0xFFFF;
     const uint32_t freq = s32 >> 16;
-    state_ = freq * (state_ >> ANS_LOG_TAB_SIZE) + res - offset;
+    state = freq * (state >> ANS_LOG_TAB_SIZE) + res - offset;
 #else
     const uint16_t symbol = code_->map[histo_offset + res];
     const ANSCode::ANSSymbolInfo s = code_->info[histo_offset + symbol];
-    state_ = s.freq * (state_ >> ANS_LOG_TAB_SIZE) + res - s.offset;
+    state = s.freq * (state >> ANS_LOG_TAB_SIZE) + res - s.offset;
 #endif
     --symbols_left_;
-    if (PIK_UNLIKELY(state_ < (1u << 16))) {
-      state_ = (state_ << 16) | br->PeekFixedBits<16>();
+    if (PIK_UNLIKELY(state < (1u << 16))) {
+      state = (state << 16) | br->PeekFixedBits<16>();
       br->Advance(16);
     }
+    states_[current_] = state;
+    if (++current_ == num_states_) current_ = 0;
     return symbol;
   }
 
-  bool CheckANSFinalState() { return state_ == (ANS_SIGNATURE << 16); }
+  bool CheckANSFinalState() {
+    for (size_t i = 0; i < num_states_; ++i) {
+      if (states_[i] != (ANS_SIGNATURE << 16)) return false;
+    }
+    return true;
+  }
 
  private:
   size_t symbols_left_ = 0;
-  uint32_t state_ = ANS_SIGNATURE << 16;
+  // Index of the state that decodes the next symbol.
+  size_t current_ = 0;
+  const size_t num_states_;
+  uint32_t states_[kANSMaxStates];
   const ANSCode* code_;
 };
 
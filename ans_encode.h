@@ -101,7 +101,7 @@ class ANSSymbolWriter {
  public:
   ANSSymbolWriter(const std::vector<ANSEncodingData>& codes,
                   const std::vector<uint8_t>& context_map, size_t* storage_ix,
-                  uint8_t* storage)
+                  uint8_t* storage, size_t num_states = 1)
       : idx_(0),
         symbol_idx_(0),
         code_words_(2 * kANSBufferSize),
@@ -109,7 +109,9 @@ class ANSSymbolWriter {
         codes_(codes),
         context_map_(context_map),
         storage_ix_(storage_ix),
-        storage_(storage) {
+        storage_(storage),
+        num_states_(num_states) {
+    PIK_ASSERT(1 <= num_states && num_states <= kANSMaxStates);
     num_extra_bits_[0] = num_extra_bits_[1] = num_extra_bits_[2] = 0;
   }
 
@@ -141,7 +143,9 @@ class ANSSymbolWriter {
 
   void FlushToBitStream() {
     const int num_codewords = idx_;
-    ANSCoder ans;
+    // Symbol j of this chunk is coded with ans[j % num_states_], see
+    // ANSSymbolReader.
+    ANSCoder ans[kANSMaxStates];
     int first_symbol = num_codewords;
     // Replace placeholder code words with actual bits by feeding symbols to the
     // ANS encoder in a reverse order.
@@ -149,21 +153,24 @@ class ANSSymbolWriter {
       const uint32_t cw = code_words_[i];
       if ((cw & 0xffff) == 0xffff) {
         const uint32_t sym = symbols_[--symbol_idx_];
+        ANSCoder& coder = ans[symbol_idx_ % num_states_];
         const uint32_t context = sym >> 16;
         const uint8_t histo_idx = context_map_[context];
         const uint32_t symbol = sym & 0xffff;
         const ANSEncSymbolInfo info = codes_[histo_idx].ans_table[symbol];
         uint8_t nbits = 0;
-        uint32_t bits = ans.PutSymbol(info, &nbits);
+        uint32_t bits = coder.PutSymbol(info, &nbits);
         code_words_[i] = (bits << 16) + nbits;
         first_symbol = i;
       }
     }
     for (int i = 0; i < num_codewords; ++i) {
       if (i == first_symbol) {
-        const uint32_t state = ans.GetState();
-        WriteBits(16, (state >> 16) & 0xffff, storage_ix_, storage_);
-        WriteBits(16, state & 0xffff, storage_ix_, storage_);
+        for (size_t s = 0; s < num_states_; ++s) {
+          const uint32_t state = ans[s].GetState();
+          WriteBits(16, (state >> 16) & 0xffff, storage_ix_, storage_);
+          WriteBits(16, state & 0xffff, storage_ix_, storage_);
+        }
       }
       const uint32_t cw = code_words_[i];
       const uint32_t nbits = cw & 0xffff;
@@ -186,6 +193,7 @@ class ANSSymbolWriter {
   size_t num_extra_bits_[3];
   size_t* storage_ix_;
   uint8_t* storage_;
+  const size_t num_states_;
 };
 
 }  // namespace pik
@@ -10,6 +10,7 @@
 // Common parameters that are needed for both the ANS entropy encoding and
 // decoding methods.
 
+#include <stddef.h>
 #include <stdint.h>
 #include <cstdlib>
 
@@ -17,6 +18,10 @@ namespace pik {
 
 static const int kANSBufferSize = 1 << 16;
 
+// Upper bound on the number of interleaved ANS states per stream. Symbol i of
+// each kANSBufferSize chunk is coded with state i % num_states.
+static const size_t kANSMaxStates = 4;
+
 #define ANS_LOG_TAB_SIZE 10
 #define ANS_TAB_SIZE (1 << ANS_LOG_TAB_SIZE)
 #define ANS_TAB_MASK (ANS_TAB_SIZE - 1)
@@ -44,7 +44,7 @@ double InvariantTicksPerSecond();
 #if PIK_ARCH_X64
 
 // This constant avoids image.h depending on simd.h.
-static constexpr size_t kMaxVectorSize = 32;  // AVX2
+static constexpr size_t kMaxVectorSize = 64;  // AVX-512
 
 // Calls CPUID instruction with eax=level and ecx=count and returns the result
 // in abcd array where abcd = {eax, ebx, ecx, edx} (hence the name abcd).
@@ -52,6 +52,18 @@ static inline bool ParseGaborishStrength(const char* arg,
   return true;
 }
 
+// Parses "x0,y0,xsize,ysize".
+static inline bool ParseCropRect(const char* arg, CropRect* out) {
+  char end;
+  if (sscanf(arg, "%zu,%zu,%zu,%zu%c", &out->x0, &out->y0, &out->xsize,
+             &out->ysize, &end) != 4 ||
+      out->IsEmpty()) {
+    fprintf(stderr, "Invalid crop rect, expected x,y,w,h: %s.\n", arg);
+    return PIK_FAILURE("Args");
+  }
+  return true;
+}
+
 static inline bool ParseFloat(const char* arg, float* out) {
   char* end;
   *out = static_cast<float>(strtod(arg, &end));
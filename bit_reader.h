@@ -124,7 +124,10 @@ class BitReader {
   // Returns the (rounded up) number of bytes consumed so far.
   size_t Position() const { return (BitsRead() + 7) / 8; }
 
-  bool Healthy() const { return Position() <= (len32_ << 2) + len_mod4_; }
+  // Returns the size [bytes] of the memory buffer passed to the constructor.
+  size_t TotalBytes() const { return (len32_ << 2) + len_mod4_; }
+
+  bool Healthy() const { return Position() <= TotalBytes(); }
 
  private:
   // *32 counters/pointers are in units of 4 bytes, or 32 bits.
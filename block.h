@@ -4,8 +4,12 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
-#ifndef BLOCK_H_
+#if defined(BLOCK_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef BLOCK_H_
+#undef BLOCK_H_
+#else
 #define BLOCK_H_
+#endif
 
 // Adapters for DCT input/output: from/to contiguous blocks or image rows.
 
@@ -14,6 +18,7 @@
 #include "simd/simd.h"
 
 namespace pik {
+namespace SIMD_NAMESPACE {
 
 // Adapters for source/destination.
 //
@@ -107,7 +112,7 @@ class ScaleToBlock {
   template <size_t SZ>
   SIMD_ATTR PIK_INLINE void StorePart(const typename BlockDesc<SZ>::V& v,
                                       const size_t row, const size_t i) const {
-    using BlockDesc = pik::BlockDesc<SZ>;
+    using BlockDesc = SIMD_NAMESPACE::BlockDesc<SZ>;
     static const typename BlockDesc::V mul_ = set1(BlockDesc(), 1.0f / (N * N));
     store(v * mul_, BlockDesc(), Address(row, i));
   }
@@ -141,10 +146,12 @@ class FromLines {
     return FromLines(Address(dx, dy), stride_);
   }
 
+  // Unaligned because 16x16 and larger transforms may start at any block,
+  // i.e. pixel rows are only aligned to 8 floats, less than an AVX-512 vector.
   template <size_t SZ>
   SIMD_ATTR PIK_INLINE typename BlockDesc<SZ>::V LoadPart(
       const size_t row, const size_t i) const {
-    return load(BlockDesc<SZ>(), Address(row, i));
+    return load_unaligned(BlockDesc<SZ>(), Address(row, i));
   }
 
   SIMD_ATTR PIK_INLINE typename BlockDesc<N>::V Load(const size_t row,
@@ -178,10 +185,11 @@ class ToLines {
     return ToLines(Address(dx, dy), stride_);
   }
 
+  // Unaligned for the same reason as FromLines::LoadPart.
   template <size_t SZ>
   SIMD_ATTR PIK_INLINE void StorePart(const typename BlockDesc<SZ>::V& v,
                                       const size_t row, const size_t i) const {
-    store(v, BlockDesc<SZ>(), Address(row, i));
+    store_unaligned(v, BlockDesc<SZ>(), Address(row, i));
   }
 
   SIMD_ATTR PIK_INLINE void Store(const typename BlockDesc<N>::V& v,
@@ -204,6 +212,10 @@ class ToLines {
   size_t stride_;  // move to next line by adding this to pointer
 };
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
 #endif  // BLOCK_H_
@@ -33,6 +33,9 @@
 #include <array>
 #include <atomic>
 
+#include "common.h"
+#include "simd/simd.h"
+
 #define BUTTERAUGLI_RESTRICT PIK_RESTRICT
 
 #ifndef PROFILER_ENABLED
@@ -165,250 +168,68 @@ std::vector<float> ComputeKernel(float sigma) {
   return kernel;
 }
 
-void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
-                          const float weight_no_border,
-                          const float border_ratio, const size_t x,
-                          float* BUTTERAUGLI_RESTRICT row_out) {
-  const int offset = kernel.size() / 2;
-  int minx = x < offset ? 0 : x - offset;
-  int maxx = std::min<int>(in.xsize() - 1, x + offset);
-  float weight = 0.0f;
-  for (int j = minx; j <= maxx; ++j) {
-    weight += kernel[j - x + offset];
-  }
-  // Interpolate linearly between the no-border scaling and border scaling.
-  weight = (1.0f - border_ratio) * weight + border_ratio * weight_no_border;
-  float scale = 1.0f / weight;
-  for (size_t y = 0; y < in.ysize(); ++y) {
-    const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
-    float sum = 0.0f;
-    for (int j = minx; j <= maxx; ++j) {
-      sum += row_in[j] * kernel[j - x + offset];
-    }
-    row_out[y] = sum * scale;
-  }
-}
+// Per-target kernels, see butteraugli_target.cc.
+
+// Computes a horizontal convolution of "in" with "kernel" (whose left half and
+// center, scaled to unit sum, are in "scaled_kernel") and stores the result
+// transposed in "out".
+struct ConvolutionImpl {
+  template <class Target>
+  void operator()(const ImageF& in, const std::vector<float>& kernel,
+                  const float* scaled_kernel, float weight_no_border,
+                  float border_ratio, ThreadPool* pool, ImageF* out) const;
+};
+
+// Adds the response of the Malta filter (the low-frequency variant if "lf") at
+// each pixel of "diffs", a packed xsize x ysize image, to "block_diff_ac".
+struct MaltaUnitsImpl {
+  template <class Target>
+  void operator()(bool lf, const float* diffs, size_t xsize, size_t ysize,
+                  ThreadPool* pool, ImageF* block_diff_ac) const;
+};
+
+}  // namespace butteraugli
+}  // namespace pik
+
+// Must include "normally" so the build system understands the dependency.
+#include "butteraugli/butteraugli_target.cc"
+
+#define SIMD_ATTR_IMPL "butteraugli/butteraugli_target.cc"
+#include "simd/foreach_target.h"
+
+namespace pik {
+namespace butteraugli {
 
 // Computes a horizontal convolution and transposes the result.
 ImageF Convolution(const ImageF& in,
                    const std::vector<float>& kernel,
-                   const float border_ratio) {
+                   const float border_ratio, ThreadPool* pool) {
   PROFILER_FUNC;
   ImageF out(in.ysize(), in.xsize());
   const int len = kernel.size();
-  const int offset = len / 2;
   float weight_no_border = 0.0f;
   for (int j = 0; j < len; ++j) {
     weight_no_border += kernel[j];
   }
   const float scale_no_border = 1.0f / weight_no_border;
-  const int border1 = in.xsize() <= offset ? in.xsize() : offset;
-  const int border2 = in.xsize() - offset;
   float* BUTTERAUGLI_RESTRICT scaled_kernel =
       (float*)malloc((len / 2 + 1) * sizeof(float));
   for (int i = 0; i <= len / 2; ++i) {
     scaled_kernel[i] = kernel[i] * scale_no_border;
   }
-  // left border
-  for (int x = 0; x < border1; ++x) {
-    ConvolveBorderColumn(in, kernel, weight_no_border, border_ratio, x,
-                         out.Row(x));
-  }
-  // middle
-  switch (len) {
-#if 1  // speed-optimized version
-    case 5: {
-      const float sk0 = scaled_kernel[0];
-      const float sk1 = scaled_kernel[1];
-      const float sk2 = scaled_kernel[2];
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[4]) * sk0;
-          sum += (row_in[1] + row_in[3]) * sk1;
-          sum += (row_in[2]) * sk2;
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-    } break;
-    case 9: {
-      const float sk0 = scaled_kernel[0];
-      const float sk1 = scaled_kernel[1];
-      const float sk2 = scaled_kernel[2];
-      const float sk3 = scaled_kernel[3];
-      const float sk4 = scaled_kernel[4];
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[8]) * sk0;
-          sum += (row_in[1] + row_in[7]) * sk1;
-          sum += (row_in[2] + row_in[6]) * sk2;
-          sum += (row_in[3] + row_in[5]) * sk3;
-          sum += (row_in[4]) * sk4;
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-    } break;
-    case 17:
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[16]) * scaled_kernel[0];
-          sum += (row_in[1] + row_in[15]) * scaled_kernel[1];
-          sum += (row_in[2] + row_in[14]) * scaled_kernel[2];
-          sum += (row_in[3] + row_in[13]) * scaled_kernel[3];
-          sum += (row_in[4] + row_in[12]) * scaled_kernel[4];
-          sum += (row_in[5] + row_in[11]) * scaled_kernel[5];
-          sum += (row_in[6] + row_in[10]) * scaled_kernel[6];
-          sum += (row_in[7] + row_in[9]) * scaled_kernel[7];
-          sum += (row_in[8]) * scaled_kernel[8];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-      break;
-    case 33:
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[32]) * scaled_kernel[0];
-          sum += (row_in[1] + row_in[31]) * scaled_kernel[1];
-          sum += (row_in[2] + row_in[30]) * scaled_kernel[2];
-          sum += (row_in[3] + row_in[29]) * scaled_kernel[3];
-          sum += (row_in[4] + row_in[28]) * scaled_kernel[4];
-          sum += (row_in[5] + row_in[27]) * scaled_kernel[5];
-          sum += (row_in[6] + row_in[26]) * scaled_kernel[6];
-          sum += (row_in[7] + row_in[25]) * scaled_kernel[7];
-          sum += (row_in[8] + row_in[24]) * scaled_kernel[8];
-          sum += (row_in[9] + row_in[23]) * scaled_kernel[9];
-          sum += (row_in[10] + row_in[22]) * scaled_kernel[10];
-          sum += (row_in[11] + row_in[21]) * scaled_kernel[11];
-          sum += (row_in[12] + row_in[20]) * scaled_kernel[12];
-          sum += (row_in[13] + row_in[19]) * scaled_kernel[13];
-          sum += (row_in[14] + row_in[18]) * scaled_kernel[14];
-          sum += (row_in[15] + row_in[17]) * scaled_kernel[15];
-          sum += (row_in[16]) * scaled_kernel[16];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-      break;
-    case 11:
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[10]) * scaled_kernel[0];
-          sum += (row_in[1] + row_in[9]) * scaled_kernel[1];
-          sum += (row_in[2] + row_in[8]) * scaled_kernel[2];
-          sum += (row_in[3] + row_in[7]) * scaled_kernel[3];
-          sum += (row_in[4] + row_in[6]) * scaled_kernel[4];
-          sum += (row_in[5]) * scaled_kernel[5];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-      break;
-    case 41:
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[40]) * scaled_kernel[0];
-          sum += (row_in[1] + row_in[39]) * scaled_kernel[1];
-          sum += (row_in[2] + row_in[38]) * scaled_kernel[2];
-          sum += (row_in[3] + row_in[37]) * scaled_kernel[3];
-          sum += (row_in[4] + row_in[36]) * scaled_kernel[4];
-          sum += (row_in[5] + row_in[35]) * scaled_kernel[5];
-          sum += (row_in[6] + row_in[34]) * scaled_kernel[6];
-          sum += (row_in[7] + row_in[33]) * scaled_kernel[7];
-          sum += (row_in[8] + row_in[32]) * scaled_kernel[8];
-          sum += (row_in[9] + row_in[31]) * scaled_kernel[9];
-          sum += (row_in[10] + row_in[30]) * scaled_kernel[10];
-          sum += (row_in[11] + row_in[29]) * scaled_kernel[11];
-          sum += (row_in[12] + row_in[28]) * scaled_kernel[12];
-          sum += (row_in[13] + row_in[27]) * scaled_kernel[13];
-          sum += (row_in[14] + row_in[26]) * scaled_kernel[14];
-          sum += (row_in[15] + row_in[25]) * scaled_kernel[15];
-          sum += (row_in[16] + row_in[24]) * scaled_kernel[16];
-          sum += (row_in[17] + row_in[23]) * scaled_kernel[17];
-          sum += (row_in[18] + row_in[22]) * scaled_kernel[18];
-          sum += (row_in[19] + row_in[21]) * scaled_kernel[19];
-          sum += (row_in[20]) * scaled_kernel[20];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-      break;
-    case 47:
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (int x = border1; x < border2; ++x, ++row_in) {
-          float sum = (row_in[0] + row_in[46]) * scaled_kernel[0];
-          sum += (row_in[1] + row_in[45]) * scaled_kernel[1];
-          sum += (row_in[2] + row_in[44]) * scaled_kernel[2];
-          sum += (row_in[3] + row_in[43]) * scaled_kernel[3];
-          sum += (row_in[4] + row_in[42]) * scaled_kernel[4];
-          sum += (row_in[5] + row_in[41]) * scaled_kernel[5];
-          sum += (row_in[6] + row_in[40]) * scaled_kernel[6];
-          sum += (row_in[7] + row_in[39]) * scaled_kernel[7];
-          sum += (row_in[8] + row_in[38]) * scaled_kernel[8];
-          sum += (row_in[9] + row_in[37]) * scaled_kernel[9];
-          sum += (row_in[10] + row_in[36]) * scaled_kernel[10];
-          sum += (row_in[11] + row_in[35]) * scaled_kernel[11];
-          sum += (row_in[12] + row_in[34]) * scaled_kernel[12];
-          sum += (row_in[13] + row_in[33]) * scaled_kernel[13];
-          sum += (row_in[14] + row_in[32]) * scaled_kernel[14];
-          sum += (row_in[15] + row_in[31]) * scaled_kernel[15];
-          sum += (row_in[16] + row_in[30]) * scaled_kernel[16];
-          sum += (row_in[17] + row_in[29]) * scaled_kernel[17];
-          sum += (row_in[18] + row_in[28]) * scaled_kernel[18];
-          sum += (row_in[19] + row_in[27]) * scaled_kernel[19];
-          sum += (row_in[20] + row_in[26]) * scaled_kernel[20];
-          sum += (row_in[21] + row_in[25]) * scaled_kernel[21];
-          sum += (row_in[22] + row_in[24]) * scaled_kernel[22];
-          sum += (row_in[23]) * scaled_kernel[23];
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          row_out[y] = sum;
-        }
-      }
-      break;
-    default:
-      //      printf("Warning: Unexpected kernel size! %d\n", len);
-#else
-    default:
-#endif
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
-        for (int j, x = border1; x < border2; ++x) {
-          const int d = x - offset;
-          float* BUTTERAUGLI_RESTRICT row_out = out.Row(x);
-          float sum = 0.0f;
-          for (j = 0; j <= len / 2; ++j) {
-            sum += row_in[d + j] * scaled_kernel[j];
-          }
-          for (; j < len; ++j) {
-            sum += row_in[d + j] * scaled_kernel[len - 1 - j];
-          }
-          row_out[y] = sum;
-        }
-      }
-  }
-  // right border
-  for (int x = border2; x < in.xsize(); ++x) {
-    ConvolveBorderColumn(in, kernel, weight_no_border, border_ratio, x,
-                         out.Row(x));
-  }
+  Dispatch(TargetBitfield().Best(), ConvolutionImpl(), in, kernel,
+           scaled_kernel, weight_no_border, border_ratio, pool, &out);
   free(scaled_kernel);
   return out;
 }
 
 // A blur somewhat similar to a 2D Gaussian blur.
 // See: https://en.wikipedia.org/wiki/Gaussian_blur
-ImageF Blur(const ImageF& in, float sigma, float border_ratio) {
+ImageF Blur(const ImageF& in, float sigma, float border_ratio,
+            ThreadPool* pool) {
   std::vector<float> kernel = ComputeKernel(sigma);
-  return Convolution(Convolution(in, kernel, border_ratio), kernel,
-                     border_ratio);
+  return Convolution(Convolution(in, kernel, border_ratio, pool), kernel,
+                     border_ratio, pool);
 }
 
 // Clamping linear interpolator.
@@ -466,14 +287,15 @@ static inline double Gamma(double v) {
   // return GammaPolynomial(v);
 }
 
-Image3F OpsinDynamicsImage(const Image3F& rgb) {
+Image3F OpsinDynamicsImage(const Image3F& rgb, ThreadPool* pool) {
   PROFILER_FUNC;
   Image3F xyb(rgb.xsize(), rgb.ysize());
   const double kSigma = 1.2;
-  Image3F blurred(Blur(rgb.Plane(0), kSigma, 0.0),
-                  Blur(rgb.Plane(1), kSigma, 0.0),
-                  Blur(rgb.Plane(2), kSigma, 0.0));
-  for (size_t y = 0; y < rgb.ysize(); ++y) {
+  Image3F blurred(Blur(rgb.Plane(0), kSigma, 0.0, pool),
+                  Blur(rgb.Plane(1), kSigma, 0.0, pool),
+                  Blur(rgb.Plane(2), kSigma, 0.0, pool));
+  const auto process_row = [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row_r = rgb.ConstPlaneRow(0, y);
     const float* BUTTERAUGLI_RESTRICT row_g = rgb.ConstPlaneRow(1, y);
     const float* BUTTERAUGLI_RESTRICT row_b = rgb.ConstPlaneRow(2, y);
@@ -504,7 +326,8 @@ Image3F OpsinDynamicsImage(const Image3F& rgb) {
       RgbToXyb(cur_mixed0, cur_mixed1, cur_mixed2,
                &row_out_x[x], &row_out_y[x], &row_out_b[x]);
     }
-  }
+  };
+  RunOnPool(pool, 0, rgb.ysize(), process_row, "Butteraugli OpsinDynamics");
   return xyb;
 }
 
@@ -598,10 +421,12 @@ static ImageF MaximumClamping(size_t xsize, size_t ysize, const ImageF& ix,
 }
 
 static ImageF SuppressXByY(size_t xsize, size_t ysize, const ImageF& ix,
-                           const ImageF& iy, const double yw) {
+                           const ImageF& iy, const double yw,
+                           ThreadPool* pool) {
   static const double s = 0.941388349694;
   ImageF inew(xsize, ysize);
-  for (size_t y = 0; y < ysize; ++y) {
+  const auto suppress_row = [&](const int task, const int thread) {
+    const size_t y = task;
     const float* rowx = ix.Row(y);
     const float* rowy = iy.Row(y);
     float* rownew = inew.Row(y);
@@ -611,12 +436,13 @@ static ImageF SuppressXByY(size_t xsize, size_t ysize, const ImageF& ix,
       const double scaler = s + (yw * (1.0 - s)) / (yw + yval * yval);
       rownew[x] = scaler * xval;
     }
-  }
+  };
+  RunOnPool(pool, 0, ysize, suppress_row, "Butteraugli SuppressXByY");
   return inew;
 }
 
 static void SeparateFrequencies(size_t xsize, size_t ysize,
-                                const Image3F& xyb,
+                                const Image3F& xyb, ThreadPool* pool,
                                 PsychoImage& ps) {
   PROFILER_FUNC;
   // Extract lf ...
@@ -631,7 +457,7 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
   ps.hf[0] = ImageF(xsize, ysize);
   ps.hf[1] = ImageF(xsize, ysize);
   for (int i = 0; i < 3; ++i) {
-    *ps.lf.MutablePlane(i) = Blur(xyb.Plane(i), kSigmaLf, border_lf);
+    *ps.lf.MutablePlane(i) = Blur(xyb.Plane(i), kSigmaLf, border_lf, pool);
     // (Cannot CheckSizesSame - not all planes are initialized.)
 
     // ... and keep everything else in mf.
@@ -642,7 +468,7 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
       }
     }
     if (i == 2) {
-      *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf);
+      *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf, pool);
       ps.mf.CheckSizesSame();
       break;
     }
@@ -654,7 +480,7 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
         row_hf[x] = row_mf[x];
       }
     }
-    *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf);
+    *ps.mf.MutablePlane(i) = Blur(ps.mf.Plane(i), kSigmaHf, border_mf, pool);
     ps.mf.CheckSizesSame();
     static const double kRemoveMfRange = 0.3;
     static const double kAddMfRange = 0.1;
@@ -680,7 +506,7 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
   }
   // Suppress red-green by intensity change in the high freq channels.
   static const double suppress = 286.09942757;
-  ps.hf[0] = SuppressXByY(xsize, ysize, ps.hf[0], ps.hf[1], suppress);
+  ps.hf[0] = SuppressXByY(xsize, ysize, ps.hf[0], ps.hf[1], suppress, pool);
 
   ps.uhf[0] = ImageF(xsize, ysize);
   ps.uhf[1] = ImageF(xsize, ysize);
@@ -693,7 +519,7 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
         row_uhf[x] = row_hf[x];
       }
     }
-    ps.hf[i] = Blur(ps.hf[i], kSigmaUhf, border_hf);
+    ps.hf[i] = Blur(ps.hf[i], kSigmaUhf, border_hf, pool);
     static const double kRemoveHfRange = 0.12;
     static const double kAddHfRange = 0.03;
     static const double kRemoveUhfRange = 0.08;
@@ -703,7 +529,8 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
     static double kMulYHf = 1.16155986803;
     static double kMulYUhf = 2.32552960949;
     if (i == 0) {
-      for (size_t y = 0; y < ysize; ++y) {
+      const auto split_hf_row = [&](const int task, const int thread) {
+        const size_t y = task;
         float* BUTTERAUGLI_RESTRICT row_uhf = ps.uhf[0].Row(y);
         float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[0].Row(y);
         for (size_t x = 0; x < xsize; ++x) {
@@ -711,9 +538,11 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
           row_hf[x] = RemoveRangeAroundZero(kRemoveHfRange, row_hf[x]);
           row_uhf[x] = RemoveRangeAroundZero(kRemoveUhfRange, row_uhf[x]);
         }
-      }
+      };
+      RunOnPool(pool, 0, ysize, split_hf_row, "Butteraugli SplitHfX");
     } else {
-      for (size_t y = 0; y < ysize; ++y) {
+      const auto split_hf_row = [&](const int task, const int thread) {
+        const size_t y = task;
         float* BUTTERAUGLI_RESTRICT row_uhf = ps.uhf[1].Row(y);
         float* BUTTERAUGLI_RESTRICT row_hf = ps.hf[1].Row(y);
         for (size_t x = 0; x < xsize; ++x) {
@@ -725,14 +554,16 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
           row_hf[x] = AmplifyRangeAroundZero(kAddHfRange, row_hf[x]);
           row_uhf[x] = AmplifyRangeAroundZero(kAddUhfRange, row_uhf[x]);
         }
-      }
+      };
+      RunOnPool(pool, 0, ysize, split_hf_row, "Butteraugli SplitHfY");
     }
   }
   // Modify range around zero code only concerns the high frequency
   // planes and only the X and Y channels.
   // Convert low freq xyb to vals space so that we can do a simple squared sum
   // diff on the low frequencies later.
-  for (size_t y = 0; y < ysize; ++y) {
+  const auto lf_to_vals_row = [&](const int task, const int thread) {
+    const size_t y = task;
     float* BUTTERAUGLI_RESTRICT row_x = ps.lf.PlaneRow(0, y);
     float* BUTTERAUGLI_RESTRICT row_y = ps.lf.PlaneRow(1, y);
     float* BUTTERAUGLI_RESTRICT row_b = ps.lf.PlaneRow(2, y);
@@ -743,15 +574,17 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
       row_y[x] = valy;
       row_b[x] = valb;
     }
-  }
+  };
+  RunOnPool(pool, 0, ysize, lf_to_vals_row, "Butteraugli XybLowFreqToVals");
 }
 
 static void L2Diff(const ImageF& i0, const ImageF& i1, const float w,
-                   ImageF* BUTTERAUGLI_RESTRICT diffmap) {
+                   ThreadPool* pool, ImageF* BUTTERAUGLI_RESTRICT diffmap) {
   if (w == 0) {
     return;
   }
-  for (size_t y = 0; y < i0.ysize(); ++y) {
+  const auto l2_row = [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row0 = i0.ConstRow(y);
     const float* BUTTERAUGLI_RESTRICT row1 = i1.ConstRow(y);
     float* BUTTERAUGLI_RESTRICT row_diff = diffmap->Row(y);
@@ -759,21 +592,23 @@ static void L2Diff(const ImageF& i0, const ImageF& i1, const float w,
       const float diff = row0[x] - row1[x];
       row_diff[x] += w * diff * diff;
     }
-  }
+  };
+  RunOnPool(pool, 0, i0.ysize(), l2_row, "Butteraugli L2Diff");
 }
 
 // i0 is the original image.
 // i1 is the deformed copy.
 static void L2DiffAsymmetric(const ImageF& i0, const ImageF& i1,
                              double w_0gt1,
-                             double w_0lt1,
+                             double w_0lt1, ThreadPool* pool,
                              ImageF* BUTTERAUGLI_RESTRICT diffmap) {
   if (w_0gt1 == 0 && w_0lt1 == 0) {
     return;
   }
   w_0gt1 *= 0.8;
   w_0lt1 *= 0.8;
-  for (size_t y = 0; y < i0.ysize(); ++y) {
+  const auto l2_row = [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row0 = i0.Row(y);
     const float* BUTTERAUGLI_RESTRICT row1 = i1.Row(y);
     float* BUTTERAUGLI_RESTRICT row_diff = diffmap->Row(y);
@@ -805,15 +640,17 @@ static void L2DiffAsymmetric(const ImageF& i0, const ImageF& i1,
         }
       }
     }
-  }
+  };
+  RunOnPool(pool, 0, i0.ysize(), l2_row, "Butteraugli L2DiffAsymmetric");
 }
 
-ImageF CalculateDiffmap(const ImageF& diffmap_in) {
+ImageF CalculateDiffmap(const ImageF& diffmap_in, ThreadPool* pool) {
   PROFILER_FUNC;
   // Take square root.
   ImageF diffmap(diffmap_in.xsize(), diffmap_in.ysize());
   static const float kInitialSlope = 100.0f;
-  for (size_t y = 0; y < diffmap.ysize(); ++y) {
+  const auto sqrt_row = [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row_in = diffmap_in.Row(y);
     float* BUTTERAUGLI_RESTRICT row_out = diffmap.Row(y);
     for (size_t x = 0; x < diffmap.xsize(); ++x) {
@@ -824,7 +661,8 @@ ImageF CalculateDiffmap(const ImageF& diffmap_in) {
                         ? kInitialSlope * orig_val
                         : std::sqrt(orig_val));
     }
-  }
+  };
+  RunOnPool(pool, 0, diffmap.ysize(), sqrt_row, "Butteraugli CalculateDiffmap");
   return diffmap;
 }
 
@@ -832,7 +670,7 @@ void MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
                      const size_t xsize, const size_t ysize,
                      Image3F* BUTTERAUGLI_RESTRICT mask,
                      Image3F* BUTTERAUGLI_RESTRICT mask_dc,
-                     ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
+                     ImageF* BUTTERAUGLI_RESTRICT diff_ac, ThreadPool* pool) {
   Image3F mask_xyb0(xsize, ysize);
   Image3F mask_xyb1(xsize, ysize);
   static const double muls[4] = {
@@ -857,25 +695,27 @@ void MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
       }
     }
   }
-  Mask(mask_xyb0, mask_xyb1, mask, mask_dc, diff_ac);
+  Mask(mask_xyb0, mask_xyb1, mask, mask_dc, diff_ac, pool);
 }
 
 ButteraugliComparator::ButteraugliComparator(const Image3F& rgb0,
-                                             double hf_asymmetry)
+                                             double hf_asymmetry,
+                                             ThreadPool* pool)
     : xsize_(rgb0.xsize()),
       ysize_(rgb0.ysize()),
       hf_asymmetry_(hf_asymmetry),
+      pool_(pool),
       sub_(nullptr) {
   if (xsize_ < 8 || ysize_ < 8) {
     return;
   }
-  Image3F xyb0 = OpsinDynamicsImage(rgb0);
-  SeparateFrequencies(xsize_, ysize_, xyb0, pi0_);
+  Image3F xyb0 = OpsinDynamicsImage(rgb0, pool_);
+  SeparateFrequencies(xsize_, ysize_, xyb0, pool_, pi0_);
 
   // Awful recursive construction of samples of different resolution.
   // This is an after-thought and possibly somewhat parallel in
   // functionality with the PsychoImage multi-resolution approach.
-  sub_ = new ButteraugliComparator(SubSample2x(rgb0), hf_asymmetry);
+  sub_ = new ButteraugliComparator(SubSample2x(rgb0), hf_asymmetry, pool_);
 }
 
 ButteraugliComparator::~ButteraugliComparator() {
@@ -885,7 +725,7 @@ ButteraugliComparator::~ButteraugliComparator() {
 
 void ButteraugliComparator::Mask(Image3F* BUTTERAUGLI_RESTRICT mask,
                                  Image3F* BUTTERAUGLI_RESTRICT mask_dc) const {
-  MaskPsychoImage(pi0_, pi0_, xsize_, ysize_, mask, mask_dc, nullptr);
+  MaskPsychoImage(pi0_, pi0_, xsize_, ysize_, mask, mask_dc, nullptr, pool_);
 }
 
 void ButteraugliComparator::Diffmap(const Image3F& rgb1, ImageF& result) const {
@@ -893,14 +733,14 @@ void ButteraugliComparator::Diffmap(const Image3F& rgb1, ImageF& result) const {
   if (xsize_ < 8 || ysize_ < 8) {
     return;
   }
-  DiffmapOpsinDynamicsImage(OpsinDynamicsImage(rgb1), result);
+  DiffmapOpsinDynamicsImage(OpsinDynamicsImage(rgb1, pool_), result);
   if (sub_) {
     if (sub_->xsize_ < 8 || sub_->ysize_ < 8) {
       return;
     }
     ImageF subresult;
     sub_->DiffmapOpsinDynamicsImage(
-        OpsinDynamicsImage(SubSample2x(rgb1)), subresult);
+        OpsinDynamicsImage(SubSample2x(rgb1), pool_), subresult);
     AddSupersampled2x(subresult, 0.5, result);
   }
 }
@@ -912,7 +752,7 @@ void ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
     return;
   }
   PsychoImage pi1;
-  SeparateFrequencies(xsize_, ysize_, xyb1, pi1);
+  SeparateFrequencies(xsize_, ysize_, xyb1, pool_, pi1);
   result = ImageF(xsize_, ysize_);
   DiffmapPsychoImage(pi1, result);
 }
@@ -970,12 +810,12 @@ void ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
     if (c < 2) {  // No blue channel error accumulated at HF.
       L2DiffAsymmetric(pi0_.hf[c], pi1.hf[c],
                        wmul[c] * hf_asymmetry_,
-                       wmul[c] / hf_asymmetry_,
+                       wmul[c] / hf_asymmetry_, pool_,
                        block_diff_ac.MutablePlane(c));
     }
-    L2Diff(pi0_.mf.Plane(c), pi1.mf.Plane(c), wmul[3 + c],
+    L2Diff(pi0_.mf.Plane(c), pi1.mf.Plane(c), wmul[3 + c], pool_,
            block_diff_ac.MutablePlane(c));
-    L2Diff(pi0_.lf.Plane(c), pi1.lf.Plane(c), wmul[6 + c],
+    L2Diff(pi0_.lf.Plane(c), pi1.lf.Plane(c), wmul[6 + c], pool_,
            block_diff_dc.MutablePlane(c));
   }
 
@@ -985,390 +825,21 @@ void ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
   Image3F mask_xyb;
   Image3F mask_xyb_dc;
   MaskPsychoImage(pi0_, pi1, xsize_, ysize_, &mask_xyb, &mask_xyb_dc,
-                  block_diff_ac.MutablePlane(1));
+                  block_diff_ac.MutablePlane(1), pool_);
 
   result = CalculateDiffmap(
-      CombineChannels(mask_xyb, mask_xyb_dc, block_diff_dc, block_diff_ac));
+      CombineChannels(mask_xyb, mask_xyb_dc, block_diff_dc, block_diff_ac),
+      pool_);
 }
 
-// Allows PaddedMaltaUnit to call either function via overloading.
-struct MaltaTagLF {};
-struct MaltaTag {};
-
-static float MaltaUnit(MaltaTagLF, const float* BUTTERAUGLI_RESTRICT d,
-                       const int xs) {
-  const int xs3 = 3 * xs;
-  float retval = 0;
-  {
-    // x grows, y constant
-    float sum = d[-4] + d[-2] + d[0] + d[2] + d[4];
-    retval += sum * sum;
-  }
-  {
-    // y grows, x constant
-    float sum = d[-xs3 - xs] + d[-xs - xs] + d[0] + d[xs + xs] + d[xs3 + xs];
-    retval += sum * sum;
-  }
-  {
-    // both grow
-    float sum =
-        d[-xs3 - 3] + d[-xs - xs - 2] + d[0] + d[xs + xs + 2] + d[xs3 + 3];
-    retval += sum * sum;
-  }
-  {
-    // y grows, x shrinks
-    float sum =
-        d[-xs3 + 3] + d[-xs - xs + 2] + d[0] + d[xs + xs - 2] + d[xs3 - 3];
-    retval += sum * sum;
-  }
-  {
-    // y grows -4 to 4, x shrinks 1 -> -1
-    float sum = d[-xs3 - xs + 1] + d[-xs - xs + 1] + d[0] + d[xs + xs - 1] +
-                d[xs3 + xs - 1];
-    retval += sum * sum;
-  }
-  {
-    //  y grows -4 to 4, x grows -1 -> 1
-    float sum = d[-xs3 - xs - 1] + d[-xs - xs - 1] + d[0] + d[xs + xs + 1] +
-                d[xs3 + xs + 1];
-    retval += sum * sum;
-  }
-  {
-    // x grows -4 to 4, y grows -1 to 1
-    float sum = d[-4 - xs] + d[-2 - xs] + d[0] + d[2 + xs] + d[4 + xs];
-    retval += sum * sum;
-  }
-  {
-    // x grows -4 to 4, y shrinks 1 to -1
-    float sum = d[-4 + xs] + d[-2 + xs] + d[0] + d[2 - xs] + d[4 - xs];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1__*______
-       2___*_____
-       3_________
-       4____0____
-       5_________
-       6_____*___
-       7______*__
-       8_________ */
-    float sum =
-        d[-xs3 - 2] + d[-xs - xs - 1] + d[0] + d[xs + xs + 1] + d[xs3 + 2];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1______*__
-       2_____*___
-       3_________
-       4____0____
-       5_________
-       6___*_____
-       7__*______
-       8_________ */
-    float sum =
-        d[-xs3 + 2] + d[-xs - xs + 1] + d[0] + d[xs + xs - 1] + d[xs3 - 2];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2_*_______
-       3__*______
-       4____0____
-       5______*__
-       6_______*_
-       7_________
-       8_________ */
-    float sum =
-        d[-xs - xs - 3] + d[-xs - 2] + d[0] + d[xs + 2] + d[xs + xs + 3];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2_______*_
-       3______*__
-       4____0____
-       5__*______
-       6_*_______
-       7_________
-       8_________ */
-    float sum =
-        d[-xs - xs + 3] + d[-xs + 2] + d[0] + d[xs - 2] + d[xs + xs - 3];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2________*
-       3______*__
-       4____0____
-       5__*______
-       6*________
-       7_________
-       8_________ */
-
-    float sum =
-        d[xs + xs - 4] + d[xs - 2] + d[0] + d[-xs + 2] + d[-xs - xs + 4];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2*________
-       3__*______
-       4____0____
-       5______*__
-       6________*
-       7_________
-       8_________ */
-    float sum =
-        d[-xs - xs - 4] + d[-xs - 2] + d[0] + d[xs + 2] + d[xs + xs + 4];
-    retval += sum * sum;
-  }
-  {
-    /* 0__*______
-       1_________
-       2___*_____
-       3_________
-       4____0____
-       5_________
-       6_____*___
-       7_________
-       8______*__ */
-    float sum = d[-xs3 - xs - 2] + d[-xs - xs - 1] + d[0] + d[xs + xs + 1] +
-                d[xs3 + xs + 2];
-    retval += sum * sum;
-  }
-  {
-    /* 0______*__
-       1_________
-       2_____*___
-       3_________
-       4____0____
-       5_________
-       6___*_____
-       7_________
-       8__*______ */
-    float sum = d[-xs3 - xs + 2] + d[-xs - xs + 1] + d[0] + d[xs + xs - 1] +
-                d[xs3 + xs - 2];
-    retval += sum * sum;
-  }
-  return retval;
-}
-
-static float MaltaUnit(MaltaTag, const float* BUTTERAUGLI_RESTRICT d,
-                       const int xs) {
-  const int xs3 = 3 * xs;
-  float retval = 0;
-  {
-    // x grows, y constant
-    float sum =
-        d[-4] + d[-3] + d[-2] + d[-1] + d[0] + d[1] + d[2] + d[3] + d[4];
-    retval += sum * sum;
-  }
-  {
-    // y grows, x constant
-    float sum = d[-xs3 - xs] + d[-xs3] + d[-xs - xs] + d[-xs] + d[0] + d[xs] +
-                d[xs + xs] + d[xs3] + d[xs3 + xs];
-    retval += sum * sum;
-  }
-  {
-    // both grow
-    float sum = d[-xs3 - 3] + d[-xs - xs - 2] + d[-xs - 1] + d[0] + d[xs + 1] +
-                d[xs + xs + 2] + d[xs3 + 3];
-    retval += sum * sum;
-  }
-  {
-    // y grows, x shrinks
-    float sum = d[-xs3 + 3] + d[-xs - xs + 2] + d[-xs + 1] + d[0] + d[xs - 1] +
-                d[xs + xs - 2] + d[xs3 - 3];
-    retval += sum * sum;
-  }
-  {
-    // y grows -4 to 4, x shrinks 1 -> -1
-    float sum = d[-xs3 - xs + 1] + d[-xs3 + 1] + d[-xs - xs + 1] + d[-xs] +
-                d[0] + d[xs] + d[xs + xs - 1] + d[xs3 - 1] + d[xs3 + xs - 1];
-    retval += sum * sum;
-  }
-  {
-    //  y grows -4 to 4, x grows -1 -> 1
-    float sum = d[-xs3 - xs - 1] + d[-xs3 - 1] + d[-xs - xs - 1] + d[-xs] +
-                d[0] + d[xs] + d[xs + xs + 1] + d[xs3 + 1] + d[xs3 + xs + 1];
-    retval += sum * sum;
-  }
-  {
-    // x grows -4 to 4, y grows -1 to 1
-    float sum = d[-4 - xs] + d[-3 - xs] + d[-2 - xs] + d[-1] + d[0] + d[1] +
-                d[2 + xs] + d[3 + xs] + d[4 + xs];
-    retval += sum * sum;
-  }
-  {
-    // x grows -4 to 4, y shrinks 1 to -1
-    float sum = d[-4 + xs] + d[-3 + xs] + d[-2 + xs] + d[-1] + d[0] + d[1] +
-                d[2 - xs] + d[3 - xs] + d[4 - xs];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1__*______
-       2___*_____
-       3___*_____
-       4____0____
-       5_____*___
-       6_____*___
-       7______*__
-       8_________ */
-    float sum = d[-xs3 - 2] + d[-xs - xs - 1] + d[-xs - 1] + d[0] + d[xs + 1] +
-                d[xs + xs + 1] + d[xs3 + 2];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1______*__
-       2_____*___
-       3_____*___
-       4____0____
-       5___*_____
-       6___*_____
-       7__*______
-       8_________ */
-    float sum = d[-xs3 + 2] + d[-xs - xs + 1] + d[-xs + 1] + d[0] + d[xs - 1] +
-                d[xs + xs - 1] + d[xs3 - 2];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2_*_______
-       3__**_____
-       4____0____
-       5_____**__
-       6_______*_
-       7_________
-       8_________ */
-    float sum = d[-xs - xs - 3] + d[-xs - 2] + d[-xs - 1] + d[0] + d[xs + 1] +
-                d[xs + 2] + d[xs + xs + 3];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2_______*_
-       3_____**__
-       4____0____
-       5__**_____
-       6_*_______
-       7_________
-       8_________ */
-    float sum = d[-xs - xs + 3] + d[-xs + 2] + d[-xs + 1] + d[0] + d[xs - 1] +
-                d[xs - 2] + d[xs + xs - 3];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2_________
-       3______**_
-       4____0*___
-       5__**_____
-       6**_______
-       7_________
-       8_________ */
-
-    float sum = d[xs + xs - 4] + d[xs + xs - 3] + d[xs - 2] + d[xs - 1] + d[0] +
-                d[1] + d[-xs + 2] + d[-xs + 3];
-    retval += sum * sum;
-  }
-  {
-    /* 0_________
-       1_________
-       2**_______
-       3__**_____
-       4____0*___
-       5______**_
-       6_________
-       7_________
-       8_________ */
-    float sum = d[-xs - xs - 4] + d[-xs - xs - 3] + d[-xs - 2] + d[-xs - 1] +
-                d[0] + d[1] + d[xs + 2] + d[xs + 3];
-    retval += sum * sum;
-  }
-  {
-    /* 0__*______
-       1__*______
-       2___*_____
-       3___*_____
-       4____0____
-       5____*____
-       6_____*___
-       7_____*___
-       8_________ */
-    float sum = d[-xs3 - xs - 2] + d[-xs3 - 2] + d[-xs - xs - 1] + d[-xs - 1] +
-                d[0] + d[xs] + d[xs + xs + 1] + d[xs3 + 1];
-    retval += sum * sum;
-  }
-  {
-    /* 0______*__
-       1______*__
-       2_____*___
-       3_____*___
-       4____0____
-       5____*____
-       6___*_____
-       7___*_____
-       8_________ */
-    float sum = d[-xs3 - xs + 2] + d[-xs3 + 2] + d[-xs - xs + 1] + d[-xs + 1] +
-                d[0] + d[xs] + d[xs + xs - 1] + d[xs3 - 1];
-    retval += sum * sum;
-  }
-  return retval;
-}
-
-// Returns MaltaUnit. "fastMode" avoids bounds-checks when x0 and y0 are known
-// to be far enough from the image borders. "diffs" is a packed image.
-template <bool fastMode, class Tag>
-static BUTTERAUGLI_INLINE float PaddedMaltaUnit(
-    float* BUTTERAUGLI_RESTRICT diffs, const size_t x0, const size_t y0,
-    const size_t xsize_, const size_t ysize_) {
-  int ix0 = y0 * xsize_ + x0;
-  const float* BUTTERAUGLI_RESTRICT d = &diffs[ix0];
-  if (fastMode ||
-      (x0 >= 4 && y0 >= 4 && x0 < (xsize_ - 4) && y0 < (ysize_ - 4))) {
-    return MaltaUnit(Tag(), d, xsize_);
-  }
-
-  float borderimage[9 * 9];
-  for (int dy = 0; dy < 9; ++dy) {
-    int y = y0 + dy - 4;
-    if (y < 0 || y >= ysize_) {
-      for (int dx = 0; dx < 9; ++dx) {
-        borderimage[dy * 9 + dx] = 0.0f;
-      }
-    } else {
-      for (int dx = 0; dx < 9; ++dx) {
-        int x = x0 + dx - 4;
-        if (x < 0 || x >= xsize_) {
-          borderimage[dy * 9 + dx] = 0.0f;
-        } else {
-          borderimage[dy * 9 + dx] = diffs[y * xsize_ + x];
-        }
-      }
-    }
-  }
-  return MaltaUnit(Tag(), &borderimage[4 * 9 + 4], 9);
-}
-
-template <class Tag>
-static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
-                             const size_t xsize_, const size_t ysize_,
+static void MaltaDiffMapImpl(const bool lf, const ImageF& lum0,
+                             const ImageF& lum1, const size_t xsize_,
+                             const size_t ysize_,
                              const double w_0gt1,
                              const double w_0lt1,
                              const double norm1,
                              const double len, const double mulli,
-                             ImageF* block_diff_ac) {
+                             ThreadPool* pool, ImageF* block_diff_ac) {
   const float kWeight0 = 0.5;
   const float kWeight1 = 0.33;
 
@@ -1378,10 +849,11 @@ static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
   const float norm2_0lt1 = w_pre0lt1 * norm1;
 
   std::vector<float> diffs(ysize_ * xsize_);
-  for (size_t y = 0, ix = 0; y < ysize_; ++y) {
+  const auto diff_row = [&](const int task, const int thread) {
+    const size_t y = task;
     const float* BUTTERAUGLI_RESTRICT row0 = lum0.Row(y);
     const float* BUTTERAUGLI_RESTRICT row1 = lum1.Row(y);
-    for (size_t x = 0; x < xsize_; ++x, ++ix) {
+    for (size_t x = 0, ix = y * xsize_; x < xsize_; ++x, ++ix) {
       const float absval = 0.5f * (std::abs(row0[x]) + std::abs(row1[x]));
       const float diff = row0[x] - row1[x];
       const float scaler = norm2_0gt1 / (static_cast<float>(norm1) + absval);
@@ -1430,45 +902,11 @@ static void MaltaDiffMapImpl(const ImageF& lum0, const ImageF& lum1,
         }
       }
     }
-  }
-
-  size_t y0 = 0;
-  // Top
-  for (; y0 < 4; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    for (size_t x0 = 0; x0 < xsize_; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
-    }
-  }
-
-  // Middle
-  for (; y0 < ysize_ - 4; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    size_t x0 = 0;
-    for (; x0 < 4; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
-    }
-    for (; x0 < xsize_ - 4; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<true, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
-    }
-
-    for (; x0 < xsize_; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
-    }
-  }
+  };
+  RunOnPool(pool, 0, ysize_, diff_row, "Butteraugli MaltaDiffs");
 
-  // Bottom
-  for (; y0 < ysize_; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    for (size_t x0 = 0; x0 < xsize_; ++x0) {
-      row_diff[x0] +=
-          PaddedMaltaUnit<false, Tag>(&diffs[0], x0, y0, xsize_, ysize_);
-    }
-  }
+  Dispatch(TargetBitfield().Best(), MaltaUnitsImpl(), lf, diffs.data(),
+           xsize_, ysize_, pool, block_diff_ac);
 }
 
 void ButteraugliComparator::MaltaDiffMap(
@@ -1479,8 +917,8 @@ void ButteraugliComparator::MaltaDiffMap(
   PROFILER_FUNC;
   const double len = 3.75;
   static const double mulli = 0.371226387683;
-  MaltaDiffMapImpl<MaltaTag>(lum0, lum1, xsize_, ysize_, w_0gt1, w_0lt1, norm1,
-                             len, mulli, block_diff_ac);
+  MaltaDiffMapImpl(/*lf=*/false, lum0, lum1, xsize_, ysize_, w_0gt1, w_0lt1,
+                   norm1, len, mulli, pool_, block_diff_ac);
 }
 
 void ButteraugliComparator::MaltaDiffMapLF(
@@ -1491,8 +929,8 @@ void ButteraugliComparator::MaltaDiffMapLF(
   PROFILER_FUNC;
   const double len = 3.75;
   static const double mulli = 0.692743715861;
-  MaltaDiffMapImpl<MaltaTagLF>(lum0, lum1, xsize_, ysize_, w_0gt1, w_0lt1,
-                               norm1, len, mulli, block_diff_ac);
+  MaltaDiffMapImpl(/*lf=*/true, lum0, lum1, xsize_, ysize_, w_0gt1, w_0lt1,
+                   norm1, len, mulli, pool_, block_diff_ac);
 }
 
 ImageF ButteraugliComparator::CombineChannels(
@@ -1500,7 +938,8 @@ ImageF ButteraugliComparator::CombineChannels(
     const Image3F& block_diff_dc, const Image3F& block_diff_ac) const {
   PROFILER_FUNC;
   ImageF result(xsize_, ysize_);
-  for (size_t y = 0; y < ysize_; ++y) {
+  const auto combine_row = [&](const int task, const int thread) {
+    const size_t y = task;
     float* BUTTERAUGLI_RESTRICT row_out = result.Row(y);
     for (size_t x = 0; x < xsize_; ++x) {
       float mask[3];
@@ -1515,7 +954,8 @@ ImageF ButteraugliComparator::CombineChannels(
       }
       row_out[x] = (DotProduct(diff_dc, dc_mask) + DotProduct(diff_ac, mask));
     }
-  }
+  };
+  RunOnPool(pool_, 0, ysize_, combine_row, "Butteraugli CombineChannels");
   return result;
 }
 
@@ -1593,14 +1033,15 @@ double MaskDcY(double delta) {
 }
 
 ImageF DiffPrecomputeX(const ImageF& xyb0, const ImageF& xyb1,
-                       float mul, float cutoff) {
+                       float mul, float cutoff, ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize = xyb0.xsize();
   const size_t ysize = xyb0.ysize();
   ImageF result(xsize, ysize);
-  size_t x1, y1;
-  size_t x2, y2;
-  for (size_t y = 0; y < ysize; ++y) {
+  const auto process_row = [&](const int task, const int thread) {
+    const size_t y = task;
+    size_t x1, y1;
+    size_t x2, y2;
     if (y + 1 < ysize) {
       y2 = y + 1;
     } else if (y > 0) {
@@ -1671,7 +1112,8 @@ ImageF DiffPrecomputeX(const ImageF& xyb0, const ImageF& xyb1,
         }
       }
     }
-  }
+  };
+  RunOnPool(pool, 0, ysize, process_row, "Butteraugli DiffPrecomputeX");
   return result;
 }
 
@@ -1679,14 +1121,15 @@ ImageF DiffPrecomputeX(const ImageF& xyb0, const ImageF& xyb1,
 // both images back so that they can be used for similarity comparisons
 // too.
 void DiffPrecomputeY(const ImageF& xyb0, const ImageF& xyb1,
-                     float mul, float mul2,
+                     float mul, float mul2, ThreadPool* pool,
                      ImageF *out0, ImageF *out1) {
   PROFILER_FUNC;
   const size_t xsize = xyb0.xsize();
   const size_t ysize = xyb0.ysize();
-  size_t x1, y1;
-  size_t x2, y2;
-  for (size_t y = 0; y < ysize; ++y) {
+  const auto process_row = [&](const int task, const int thread) {
+    const size_t y = task;
+    size_t x1, y1;
+    size_t x2, y2;
     if (y + 1 < ysize) {
       y2 = y + 1;
     } else if (y > 0) {
@@ -1743,13 +1186,14 @@ void DiffPrecomputeY(const ImageF& xyb0, const ImageF& xyb1,
       row_out0[x] = mul * (log(sup0 * sup0 * mul2 + kBias) - log(kBias));
       row_out1[x] = mul * (log(sup1 * sup1 * mul2 + kBias) - log(kBias));
     }
-  }
+  };
+  RunOnPool(pool, 0, ysize, process_row, "Butteraugli DiffPrecomputeY");
 }
 
 void Mask(const Image3F& xyb0, const Image3F& xyb1,
           Image3F* BUTTERAUGLI_RESTRICT mask,
           Image3F* BUTTERAUGLI_RESTRICT mask_dc,
-          ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
+          ImageF* BUTTERAUGLI_RESTRICT diff_ac, ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize = xyb0.xsize();
   const size_t ysize = xyb0.ysize();
@@ -1771,8 +1215,9 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
     // X component
     static const double mul = 0.533043878407;
     static const double cutoff = 0.5;
-    ImageF diff = DiffPrecomputeX(xyb0.Plane(0), xyb1.Plane(0), mul, cutoff);
-    ImageF blurred = Blur(diff, r2, border_ratio);
+    ImageF diff =
+        DiffPrecomputeX(xyb0.Plane(0), xyb1.Plane(0), mul, cutoff, pool);
+    ImageF blurred = Blur(diff, r2, border_ratio, pool);
     for (size_t y = 0; y < ysize; ++y) {
       for (size_t x = 0; x < xsize; ++x) {
         mask->PlaneRow(0, y)[x] = blurred.Row(y)[x];
@@ -1785,12 +1230,14 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
     static const double mul2 = 1.0;
     ImageF diff0(xyb0.xsize(), xyb0.ysize());
     ImageF diff1(xyb0.xsize(), xyb0.ysize());
-    DiffPrecomputeY(xyb0.Plane(1), xyb1.Plane(1), mul, mul2, &diff0, &diff1);
-    ImageF blurred0_a = Blur(diff0, r0, border_ratio);
-    ImageF blurred0_b = Blur(diff0, r1, border_ratio);
-    ImageF blurred1_a = Blur(diff1, r0, border_ratio);
-    ImageF blurred1_b = Blur(diff1, r1, border_ratio);
-    for (size_t y = 0; y < ysize; ++y) {
+    DiffPrecomputeY(xyb0.Plane(1), xyb1.Plane(1), mul, mul2, pool, &diff0,
+                    &diff1);
+    ImageF blurred0_a = Blur(diff0, r0, border_ratio, pool);
+    ImageF blurred0_b = Blur(diff0, r1, border_ratio, pool);
+    ImageF blurred1_a = Blur(diff1, r0, border_ratio, pool);
+    ImageF blurred1_b = Blur(diff1, r1, border_ratio, pool);
+    const auto mask_y_row = [&](const int task, const int thread) {
+      const size_t y = task;
       for (size_t x = 0; x < xsize; ++x) {
         const double val = normalizer * (
             muls[0] * blurred1_a.Row(y)[x] +
@@ -1805,7 +1252,8 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
           diff_ac->Row(y)[x] += wa * wa + wb * wb;
         }
       }
-    }
+    };
+    RunOnPool(pool, 0, ysize, mask_y_row, "Butteraugli MaskY");
   }
   // B component
   static const double w00 = 425.68063445;
@@ -1814,7 +1262,8 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
   static const double w_ytob_lf = 30.6362338596;
   static const double p1_to_p0 = 0.0812601733358;
 
-  for (size_t y = 0; y < ysize; ++y) {
+  const auto mask_row = [&](const int task, const int thread) {
+    const size_t y = task;
     for (size_t x = 0; x < xsize; ++x) {
       const double s0 = mask->PlaneRow(0, y)[x];
       const double s1 = mask->PlaneRow(1, y)[x];
@@ -1828,11 +1277,13 @@ void Mask(const Image3F& xyb0, const Image3F& xyb1,
       mask_dc->PlaneRow(1, y)[x] = MaskDcY(p1);
       mask_dc->PlaneRow(2, y)[x] = w_ytob_lf * MaskDcY(p1);
     }
-  }
+  };
+  RunOnPool(pool, 0, ysize, mask_row, "Butteraugli Mask");
 }
 
 bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
-                        double hf_asymmetry, ImageF& result_image) {
+                        double hf_asymmetry, ImageF& result_image,
+                        ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize = rgb0.xsize();
   const size_t ysize = rgb0.ysize();
@@ -1865,8 +1316,8 @@ bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
       }
     }
     ImageF diffmap_scaled;
-    const bool ok =
-        ButteraugliDiffmap(scaled0, scaled1, hf_asymmetry, diffmap_scaled);
+    const bool ok = ButteraugliDiffmap(scaled0, scaled1, hf_asymmetry,
+                                       diffmap_scaled, pool);
     result_image = ImageF(xsize, ysize);
     for (size_t y = 0; y < ysize; ++y) {
       for (size_t x = 0; x < xsize; ++x) {
@@ -1875,7 +1326,7 @@ bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
     }
     return ok;
   }
-  ButteraugliComparator butteraugli(rgb0, hf_asymmetry);
+  ButteraugliComparator butteraugli(rgb0, hf_asymmetry, pool);
   butteraugli.Diffmap(rgb1, result_image);
   return true;
 }
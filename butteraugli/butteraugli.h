@@ -20,6 +20,7 @@
 #include <memory>
 #include <vector>
 
+#include "data_parallel.h"
 #include "image.h"
 
 #define BUTTERAUGLI_ENABLE_CHECKS 0
@@ -128,7 +129,11 @@ struct PsychoImage {
 
 class ButteraugliComparator {
  public:
-  ButteraugliComparator(const Image3F &rgb0, double hf_asymmetry);
+  // "pool" is used for all subsequent computations, including those of the
+  // subsampled comparator; it may be null. Results do not depend on the
+  // number of threads.
+  ButteraugliComparator(const Image3F &rgb0, double hf_asymmetry,
+                        ThreadPool *pool = nullptr);
   virtual ~ButteraugliComparator();
 
   // Computes the butteraugli map between the original image given in the
@@ -159,12 +164,14 @@ class ButteraugliComparator {
   const size_t xsize_;
   const size_t ysize_;
   float hf_asymmetry_;
+  ThreadPool *pool_;  // not owned
   PsychoImage pi0_;
   ButteraugliComparator *sub_;
 };
 
 bool ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
-                        double hf_asymmetry, ImageF &diffmap);
+                        double hf_asymmetry, ImageF &diffmap,
+                        ThreadPool *pool = nullptr);
 
 double ButteraugliScoreFromDiffmap(const ImageF& distmap);
 
@@ -175,7 +182,8 @@ Image3B CreateHeatMapImage(const ImageF &distmap, double good_threshold,
 // Compute values of local frequency and dc masking based on the activity
 // in the two images.
 void Mask(const Image3F &xyb0, const Image3F &xyb1, Image3F *PIK_RESTRICT mask,
-          Image3F *PIK_RESTRICT mask_dc, ImageF *diff_ac = nullptr);
+          Image3F *PIK_RESTRICT mask_dc, ImageF *diff_ac = nullptr,
+          ThreadPool *pool = nullptr);
 
 template <class V>
 BUTTERAUGLI_INLINE void RgbToXyb(const V &r, const V &g, const V &b,
@@ -223,9 +231,10 @@ BUTTERAUGLI_INLINE void OpsinAbsorbance(const V &in0, const V &in1,
   *out2 = mix8 * in0 + mix9 * in1 + mix10 * in2 + mix11;
 }
 
-Image3F OpsinDynamicsImage(const Image3F &rgb);
+Image3F OpsinDynamicsImage(const Image3F &rgb, ThreadPool *pool = nullptr);
 
-ImageF Blur(const ImageF& in, float sigma, float border_ratio);
+ImageF Blur(const ImageF& in, float sigma, float border_ratio,
+            ThreadPool* pool = nullptr);
 
 double SimpleGamma(double v);
 
@@ -0,0 +1,624 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+namespace pik {
+namespace butteraugli {
+
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Computes output column "x" for input rows [y_begin, y_end), renormalizing
+// the kernel where it extends past the image border. Inlined because GCC omits
+// the vzeroupper before this call, and the dirty upper halves of the vector
+// registers would then slow down all SSE4 code running after ConvolutionRows.
+SIMD_ATTR BUTTERAUGLI_INLINE void ConvolveBorderColumn(
+    const ImageF& in, const std::vector<float>& kernel,
+    const float weight_no_border, const float border_ratio, const size_t x,
+    const size_t y_begin, const size_t y_end,
+    float* BUTTERAUGLI_RESTRICT row_out) {
+  const int offset = kernel.size() / 2;
+  int minx = x < offset ? 0 : x - offset;
+  int maxx = std::min<int>(in.xsize() - 1, x + offset);
+  float weight = 0.0f;
+  for (int j = minx; j <= maxx; ++j) {
+    weight += kernel[j - x + offset];
+  }
+  // Interpolate linearly between the no-border scaling and border scaling.
+  weight = (1.0f - border_ratio) * weight + border_ratio * weight_no_border;
+  float scale = 1.0f / weight;
+  for (size_t y = y_begin; y < y_end; ++y) {
+    const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
+    float sum = 0.0f;
+    for (int j = minx; j <= maxx; ++j) {
+      sum += row_in[j] * kernel[j - x + offset];
+    }
+    row_out[y] = sum * scale;
+  }
+}
+
+// Returns the convolution of the "len" pixels starting at "row_in" + i in lane
+// i. Lanes are independent and each accumulates in the same order as scalar
+// code would, so the results do not depend on the vector size.
+template <class D, class V = typename D::V>
+SIMD_ATTR BUTTERAUGLI_INLINE V ConvolveLanes(
+    D d, const float* BUTTERAUGLI_RESTRICT row_in,
+    const float* BUTTERAUGLI_RESTRICT scaled_kernel, const int len,
+    const bool paired) {
+  const int half = len / 2;
+  if (paired) {
+    V sum = (load_unaligned(d, row_in) + load_unaligned(d, row_in + len - 1)) *
+            set1(d, scaled_kernel[0]);
+    for (int j = 1; j < half; ++j) {
+      sum += (load_unaligned(d, row_in + j) +
+              load_unaligned(d, row_in + len - 1 - j)) *
+             set1(d, scaled_kernel[j]);
+    }
+    sum += load_unaligned(d, row_in + half) * set1(d, scaled_kernel[half]);
+    return sum;
+  }
+  V sum = setzero(d);
+  int j = 0;
+  for (; j <= half; ++j) {
+    sum += load_unaligned(d, row_in + j) * set1(d, scaled_kernel[j]);
+  }
+  for (; j < len; ++j) {
+    sum += load_unaligned(d, row_in + j) * set1(d, scaled_kernel[len - 1 - j]);
+  }
+  return sum;
+}
+
+// Convolves input rows [y_begin, y_end) horizontally and stores the results
+// transposed, i.e. in the same range of each column of "out".
+SIMD_ATTR void ConvolutionRows(
+    const ImageF& in, const std::vector<float>& kernel,
+    const float* BUTTERAUGLI_RESTRICT scaled_kernel,
+    const float weight_no_border, const float border_ratio,
+    const size_t y_begin, const size_t y_end, ImageF* out_image) {
+  ImageF& out = *out_image;
+  const int len = kernel.size();
+  const int offset = len / 2;
+  const int border1 = in.xsize() <= offset ? in.xsize() : offset;
+  const int border2 = in.xsize() - offset;
+  // left border
+  for (int x = 0; x < border1; ++x) {
+    ConvolveBorderColumn(in, kernel, weight_no_border, border_ratio, x,
+                         y_begin, y_end, out.Row(x));
+  }
+  // middle
+  using D = SIMD_FULL(float);
+  const D d;
+  const Scalar<float> d1;
+  // The kernel sizes used by Butteraugli sum symmetric pairs first.
+  const bool paired = len == 5 || len == 9 || len == 11 || len == 17 ||
+                      len == 33 || len == 41 || len == 47;
+  for (size_t y = y_begin; y < y_end; ++y) {
+    const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
+    int x = border1;
+    for (; x + static_cast<int>(d.N) <= border2; x += d.N) {
+      SIMD_ALIGN float sums[D::N];
+      store(ConvolveLanes(d, row_in + x - offset, scaled_kernel, len, paired),
+            d, sums);
+      for (size_t i = 0; i < d.N; ++i) {
+        out.Row(x + i)[y] = sums[i];
+      }
+    }
+    for (; x < border2; ++x) {
+      store(ConvolveLanes(d1, row_in + x - offset, scaled_kernel, len, paired),
+            d1, out.Row(x) + y);
+    }
+  }
+  // right border
+  for (int x = border2; x < in.xsize(); ++x) {
+    ConvolveBorderColumn(in, kernel, weight_no_border, border_ratio, x,
+                         y_begin, y_end, out.Row(x));
+  }
+}
+
+
+// Computes a horizontal convolution of "in" and stores it transposed in "out".
+SIMD_ATTR void ConvolutionWithTranspose(
+    const ImageF& in, const std::vector<float>& kernel,
+    const float* BUTTERAUGLI_RESTRICT scaled_kernel,
+    const float weight_no_border, const float border_ratio, ThreadPool* pool,
+    ImageF* out) {
+  // Tasks write disjoint ranges of each output row; 16 floats are one cache
+  // line, which avoids false sharing between threads.
+  const size_t kBandRows = 16;
+  const size_t ysize = in.ysize();
+  RunOnPool(pool, 0, DivCeil(ysize, kBandRows),
+            [&](const int task, const int thread) SIMD_ATTR {
+              const size_t y_begin = task * kBandRows;
+              const size_t y_end = std::min(y_begin + kBandRows, ysize);
+              ConvolutionRows(in, kernel, scaled_kernel, weight_no_border,
+                              border_ratio, y_begin, y_end, out);
+            },
+            "Butteraugli Convolution");
+}
+
+// Allows PaddedMaltaUnit to call either function via overloading.
+struct MaltaTagLF {};
+struct MaltaTag {};
+
+// Loads the vector of pixels at "offset" relative to the current pixel. Lane i
+// of each MaltaUnit result only depends on lane i of the loaded vectors, so
+// the vector code computes the same sums as for one pixel at a time.
+template <class D>
+class VecLoader {
+ public:
+  explicit VecLoader(const float* BUTTERAUGLI_RESTRICT pos) : pos_(pos) {}
+
+  SIMD_ATTR BUTTERAUGLI_INLINE typename D::V operator[](
+      const int offset) const {
+    return load_unaligned(D(), pos_ + offset);
+  }
+
+ private:
+  const float* BUTTERAUGLI_RESTRICT pos_;
+};
+
+template <class D, class V = typename D::V>
+SIMD_ATTR BUTTERAUGLI_INLINE V MaltaUnit(MaltaTagLF, const VecLoader<D> d,
+                                         const int xs) {
+  const int xs3 = 3 * xs;
+  V retval = setzero(D());
+  {
+    // x grows, y constant
+    const V sum = d[-4] + d[-2] + d[0] + d[2] + d[4];
+    retval += sum * sum;
+  }
+  {
+    // y grows, x constant
+    const V sum = d[-xs3 - xs] + d[-xs - xs] + d[0] + d[xs + xs] + d[xs3 + xs];
+    retval += sum * sum;
+  }
+  {
+    // both grow
+    const V sum = d[-xs3 - 3] + d[-xs - xs - 2] + d[0] + d[xs + xs + 2] +
+                  d[xs3 + 3];
+    retval += sum * sum;
+  }
+  {
+    // y grows, x shrinks
+    const V sum = d[-xs3 + 3] + d[-xs - xs + 2] + d[0] + d[xs + xs - 2] +
+                  d[xs3 - 3];
+    retval += sum * sum;
+  }
+  {
+    // y grows -4 to 4, x shrinks 1 -> -1
+    const V sum = d[-xs3 - xs + 1] + d[-xs - xs + 1] + d[0] + d[xs + xs - 1] +
+                  d[xs3 + xs - 1];
+    retval += sum * sum;
+  }
+  {
+    //  y grows -4 to 4, x grows -1 -> 1
+    const V sum = d[-xs3 - xs - 1] + d[-xs - xs - 1] + d[0] + d[xs + xs + 1] +
+                  d[xs3 + xs + 1];
+    retval += sum * sum;
+  }
+  {
+    // x grows -4 to 4, y grows -1 to 1
+    const V sum = d[-4 - xs] + d[-2 - xs] + d[0] + d[2 + xs] + d[4 + xs];
+    retval += sum * sum;
+  }
+  {
+    // x grows -4 to 4, y shrinks 1 to -1
+    const V sum = d[-4 + xs] + d[-2 + xs] + d[0] + d[2 - xs] + d[4 - xs];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1__*______
+       2___*_____
+       3_________
+       4____0____
+       5_________
+       6_____*___
+       7______*__
+       8_________ */
+    const V sum = d[-xs3 - 2] + d[-xs - xs - 1] + d[0] + d[xs + xs + 1] +
+                  d[xs3 + 2];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1______*__
+       2_____*___
+       3_________
+       4____0____
+       5_________
+       6___*_____
+       7__*______
+       8_________ */
+    const V sum = d[-xs3 + 2] + d[-xs - xs + 1] + d[0] + d[xs + xs - 1] +
+                  d[xs3 - 2];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2_*_______
+       3__*______
+       4____0____
+       5______*__
+       6_______*_
+       7_________
+       8_________ */
+    const V sum = d[-xs - xs - 3] + d[-xs - 2] + d[0] + d[xs + 2] +
+                  d[xs + xs + 3];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2_______*_
+       3______*__
+       4____0____
+       5__*______
+       6_*_______
+       7_________
+       8_________ */
+    const V sum = d[-xs - xs + 3] + d[-xs + 2] + d[0] + d[xs - 2] +
+                  d[xs + xs - 3];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2________*
+       3______*__
+       4____0____
+       5__*______
+       6*________
+       7_________
+       8_________ */
+
+    const V sum = d[xs + xs - 4] + d[xs - 2] + d[0] + d[-xs + 2] +
+                  d[-xs - xs + 4];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2*________
+       3__*______
+       4____0____
+       5______*__
+       6________*
+       7_________
+       8_________ */
+    const V sum = d[-xs - xs - 4] + d[-xs - 2] + d[0] + d[xs + 2] +
+                  d[xs + xs + 4];
+    retval += sum * sum;
+  }
+  {
+    /* 0__*______
+       1_________
+       2___*_____
+       3_________
+       4____0____
+       5_________
+       6_____*___
+       7_________
+       8______*__ */
+    const V sum = d[-xs3 - xs - 2] + d[-xs - xs - 1] + d[0] + d[xs + xs + 1] +
+                  d[xs3 + xs + 2];
+    retval += sum * sum;
+  }
+  {
+    /* 0______*__
+       1_________
+       2_____*___
+       3_________
+       4____0____
+       5_________
+       6___*_____
+       7_________
+       8__*______ */
+    const V sum = d[-xs3 - xs + 2] + d[-xs - xs + 1] + d[0] + d[xs + xs - 1] +
+                  d[xs3 + xs - 2];
+    retval += sum * sum;
+  }
+  return retval;
+}
+
+template <class D, class V = typename D::V>
+SIMD_ATTR BUTTERAUGLI_INLINE V MaltaUnit(MaltaTag, const VecLoader<D> d,
+                                         const int xs) {
+  const int xs3 = 3 * xs;
+  V retval = setzero(D());
+  {
+    // x grows, y constant
+    const V sum = d[-4] + d[-3] + d[-2] + d[-1] + d[0] + d[1] + d[2] + d[3] +
+                  d[4];
+    retval += sum * sum;
+  }
+  {
+    // y grows, x constant
+    const V sum = d[-xs3 - xs] + d[-xs3] + d[-xs - xs] + d[-xs] + d[0] + d[xs] +
+                  d[xs + xs] + d[xs3] + d[xs3 + xs];
+    retval += sum * sum;
+  }
+  {
+    // both grow
+    const V sum = d[-xs3 - 3] + d[-xs - xs - 2] + d[-xs - 1] + d[0] +
+                  d[xs + 1] + d[xs + xs + 2] + d[xs3 + 3];
+    retval += sum * sum;
+  }
+  {
+    // y grows, x shrinks
+    const V sum = d[-xs3 + 3] + d[-xs - xs + 2] + d[-xs + 1] + d[0] +
+                  d[xs - 1] + d[xs + xs - 2] + d[xs3 - 3];
+    retval += sum * sum;
+  }
+  {
+    // y grows -4 to 4, x shrinks 1 -> -1
+    const V sum = d[-xs3 - xs + 1] + d[-xs3 + 1] + d[-xs - xs + 1] + d[-xs] +
+                  d[0] + d[xs] + d[xs + xs - 1] + d[xs3 - 1] + d[xs3 + xs - 1];
+    retval += sum * sum;
+  }
+  {
+    //  y grows -4 to 4, x grows -1 -> 1
+    const V sum = d[-xs3 - xs - 1] + d[-xs3 - 1] + d[-xs - xs - 1] + d[-xs] +
+                  d[0] + d[xs] + d[xs + xs + 1] + d[xs3 + 1] + d[xs3 + xs + 1];
+    retval += sum * sum;
+  }
+  {
+    // x grows -4 to 4, y grows -1 to 1
+    const V sum = d[-4 - xs] + d[-3 - xs] + d[-2 - xs] + d[-1] + d[0] + d[1] +
+                  d[2 + xs] + d[3 + xs] + d[4 + xs];
+    retval += sum * sum;
+  }
+  {
+    // x grows -4 to 4, y shrinks 1 to -1
+    const V sum = d[-4 + xs] + d[-3 + xs] + d[-2 + xs] + d[-1] + d[0] + d[1] +
+                  d[2 - xs] + d[3 - xs] + d[4 - xs];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1__*______
+       2___*_____
+       3___*_____
+       4____0____
+       5_____*___
+       6_____*___
+       7______*__
+       8_________ */
+    const V sum = d[-xs3 - 2] + d[-xs - xs - 1] + d[-xs - 1] + d[0] +
+                  d[xs + 1] + d[xs + xs + 1] + d[xs3 + 2];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1______*__
+       2_____*___
+       3_____*___
+       4____0____
+       5___*_____
+       6___*_____
+       7__*______
+       8_________ */
+    const V sum = d[-xs3 + 2] + d[-xs - xs + 1] + d[-xs + 1] + d[0] +
+                  d[xs - 1] + d[xs + xs - 1] + d[xs3 - 2];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2_*_______
+       3__**_____
+       4____0____
+       5_____**__
+       6_______*_
+       7_________
+       8_________ */
+    const V sum = d[-xs - xs - 3] + d[-xs - 2] + d[-xs - 1] + d[0] + d[xs + 1] +
+                  d[xs + 2] + d[xs + xs + 3];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2_______*_
+       3_____**__
+       4____0____
+       5__**_____
+       6_*_______
+       7_________
+       8_________ */
+    const V sum = d[-xs - xs + 3] + d[-xs + 2] + d[-xs + 1] + d[0] + d[xs - 1] +
+                  d[xs - 2] + d[xs + xs - 3];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2_________
+       3______**_
+       4____0*___
+       5__**_____
+       6**_______
+       7_________
+       8_________ */
+
+    const V sum = d[xs + xs - 4] + d[xs + xs - 3] + d[xs - 2] + d[xs - 1] +
+                  d[0] + d[1] + d[-xs + 2] + d[-xs + 3];
+    retval += sum * sum;
+  }
+  {
+    /* 0_________
+       1_________
+       2**_______
+       3__**_____
+       4____0*___
+       5______**_
+       6_________
+       7_________
+       8_________ */
+    const V sum = d[-xs - xs - 4] + d[-xs - xs - 3] + d[-xs - 2] + d[-xs - 1] +
+                  d[0] + d[1] + d[xs + 2] + d[xs + 3];
+    retval += sum * sum;
+  }
+  {
+    /* 0__*______
+       1__*______
+       2___*_____
+       3___*_____
+       4____0____
+       5____*____
+       6_____*___
+       7_____*___
+       8_________ */
+    const V sum = d[-xs3 - xs - 2] + d[-xs3 - 2] + d[-xs - xs - 1] +
+                  d[-xs - 1] + d[0] + d[xs] + d[xs + xs + 1] + d[xs3 + 1];
+    retval += sum * sum;
+  }
+  {
+    /* 0______*__
+       1______*__
+       2_____*___
+       3_____*___
+       4____0____
+       5____*____
+       6___*_____
+       7___*_____
+       8_________ */
+    const V sum = d[-xs3 - xs + 2] + d[-xs3 + 2] + d[-xs - xs + 1] +
+                  d[-xs + 1] + d[0] + d[xs] + d[xs + xs - 1] + d[xs3 - 1];
+    retval += sum * sum;
+  }
+  return retval;
+}
+
+template <class Tag>
+SIMD_ATTR BUTTERAUGLI_INLINE float MaltaUnitScalar(
+    const float* BUTTERAUGLI_RESTRICT d, const int xs) {
+  using D = Scalar<float>;
+  float result;
+  store(MaltaUnit(Tag(), VecLoader<D>(d), xs), D(), &result);
+  return result;
+}
+
+// Returns MaltaUnit. "fastMode" avoids bounds-checks when x0 and y0 are known
+// to be far enough from the image borders. "diffs" is a packed image.
+template <bool fastMode, class Tag>
+SIMD_ATTR BUTTERAUGLI_INLINE float PaddedMaltaUnit(
+    const float* BUTTERAUGLI_RESTRICT diffs, const size_t x0, const size_t y0,
+    const size_t xsize_, const size_t ysize_) {
+  int ix0 = y0 * xsize_ + x0;
+  const float* BUTTERAUGLI_RESTRICT d = &diffs[ix0];
+  if (fastMode ||
+      (x0 >= 4 && y0 >= 4 && x0 < (xsize_ - 4) && y0 < (ysize_ - 4))) {
+    return MaltaUnitScalar<Tag>(d, xsize_);
+  }
+
+  float borderimage[9 * 9];
+  for (int dy = 0; dy < 9; ++dy) {
+    int y = y0 + dy - 4;
+    if (y < 0 || y >= ysize_) {
+      for (int dx = 0; dx < 9; ++dx) {
+        borderimage[dy * 9 + dx] = 0.0f;
+      }
+    } else {
+      for (int dx = 0; dx < 9; ++dx) {
+        int x = x0 + dx - 4;
+        if (x < 0 || x >= xsize_) {
+          borderimage[dy * 9 + dx] = 0.0f;
+        } else {
+          borderimage[dy * 9 + dx] = diffs[y * xsize_ + x];
+        }
+      }
+    }
+  }
+  return MaltaUnitScalar<Tag>(&borderimage[4 * 9 + 4], 9);
+}
+
+
+// Adds PaddedMaltaUnit of each pixel of "diffs", a packed image, to the
+// corresponding pixel of "block_diff_ac".
+template <class Tag>
+SIMD_ATTR void AddMaltaUnits(const float* BUTTERAUGLI_RESTRICT diffs,
+                             const size_t xsize_, const size_t ysize_,
+                             ThreadPool* pool, ImageF* block_diff_ac) {
+  // Each output row only reads "diffs", so rows are independent.
+  using D = SIMD_FULL(float);
+  const D d;
+  const auto malta_row = [&](const int task, const int thread) SIMD_ATTR {
+    const size_t y0 = task;
+    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
+    if (y0 < 4 || y0 >= ysize_ - 4) {
+      // Top and bottom
+      for (size_t x0 = 0; x0 < xsize_; ++x0) {
+        row_diff[x0] +=
+            PaddedMaltaUnit<false, Tag>(diffs, x0, y0, xsize_, ysize_);
+      }
+      return;
+    }
+
+    // Middle
+    size_t x0 = 0;
+    for (; x0 < 4; ++x0) {
+      row_diff[x0] +=
+          PaddedMaltaUnit<false, Tag>(diffs, x0, y0, xsize_, ysize_);
+    }
+    for (; x0 < xsize_ - 4 && x0 % d.N != 0; ++x0) {
+      row_diff[x0] +=
+          PaddedMaltaUnit<true, Tag>(diffs, x0, y0, xsize_, ysize_);
+    }
+    for (; x0 + d.N <= xsize_ - 4; x0 += d.N) {
+      const VecLoader<D> loader(diffs + y0 * xsize_ + x0);
+      const auto malta = MaltaUnit(Tag(), loader, xsize_);
+      store(load(d, row_diff + x0) + malta, d, row_diff + x0);
+    }
+    for (; x0 < xsize_ - 4; ++x0) {
+      row_diff[x0] +=
+          PaddedMaltaUnit<true, Tag>(diffs, x0, y0, xsize_, ysize_);
+    }
+
+    for (; x0 < xsize_; ++x0) {
+      row_diff[x0] +=
+          PaddedMaltaUnit<false, Tag>(diffs, x0, y0, xsize_, ysize_);
+    }
+  };
+  RunOnPool(pool, 0, ysize_, malta_row, "Butteraugli MaltaDiffMap");
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void ConvolutionImpl::operator()<SIMD_TARGET>(
+    const ImageF& in, const std::vector<float>& kernel,
+    const float* scaled_kernel, const float weight_no_border,
+    const float border_ratio, ThreadPool* pool, ImageF* out) const {
+  SIMD_NAMESPACE::ConvolutionWithTranspose(in, kernel, scaled_kernel,
+                                           weight_no_border, border_ratio,
+                                           pool, out);
+}
+
+template <>
+void MaltaUnitsImpl::operator()<SIMD_TARGET>(const bool lf,
+                                             const float* diffs,
+                                             const size_t xsize,
+                                             const size_t ysize,
+                                             ThreadPool* pool,
+                                             ImageF* block_diff_ac) const {
+  if (lf) {
+    SIMD_NAMESPACE::AddMaltaUnits<SIMD_NAMESPACE::MaltaTagLF>(
+        diffs, xsize, ysize, pool, block_diff_ac);
+  } else {
+    SIMD_NAMESPACE::AddMaltaUnits<SIMD_NAMESPACE::MaltaTag>(
+        diffs, xsize, ysize, pool, block_diff_ac);
+  }
+}
+
+}  // namespace butteraugli
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
@@ -22,10 +22,12 @@ Image3F LinearFromOpsin(const Image3F& opsin) {
 
 ButteraugliComparator::ButteraugliComparator(const Image3F& opsin,
                                              float hf_asymmetry,
-                                             float multiplier)
+                                             float multiplier,
+                                             ThreadPool* pool)
     : xsize_(opsin.xsize()),
       ysize_(opsin.ysize()),
-      comparator_(ScaleImage(multiplier, LinearFromOpsin(opsin)), hf_asymmetry),
+      comparator_(ScaleImage(multiplier, LinearFromOpsin(opsin)), hf_asymmetry,
+                  pool),
       distance_(0.0),
       multiplier_(multiplier),
       distmap_(xsize_, ysize_) {
@@ -8,14 +8,16 @@
 #define BUTTERAUGLI_COMPARATOR_H_
 
 #include "butteraugli/butteraugli.h"
+#include "data_parallel.h"
 #include "image.h"
 
 namespace pik {
 
 class ButteraugliComparator {
  public:
+  // "pool" may be null; it is used by every subsequent Compare().
   ButteraugliComparator(const Image3F& opsin, float hf_asymmetry,
-                        float multiplier);
+                        float multiplier, ThreadPool* pool = nullptr);
 
   void Compare(const Image3F& linear_rgb);
 
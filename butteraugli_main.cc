@@ -5,6 +5,8 @@
 // https://opensource.org/licenses/MIT.
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <thread>
 
 #include "butteraugli_distance.h"
 #include "codec.h"
@@ -14,10 +16,23 @@
 namespace pik {
 namespace {
 
-Status RunButteraugli(const char* pathname1, const char* pathname2) {
+// Returns false unless "arg" is a decimal number of threads (at most 1024).
+bool ParseNumThreads(const char* arg, int* num_threads) {
+  char* end;
+  const unsigned long value = strtoul(arg, &end, 10);
+  // strtoul would also accept leading whitespace and negate a "-" prefix.
+  if (arg[0] < '0' || arg[0] > '9' || end[0] != '\0' || value > 1024) {
+    return false;
+  }
+  *num_threads = static_cast<int>(value);
+  return true;
+}
+
+Status RunButteraugli(const char* pathname1, const char* pathname2,
+                      const int num_threads) {
   CodecContext codec_context;
   CodecInOut io1(&codec_context);
-  ThreadPool pool(4);
+  ThreadPool pool(num_threads);
   if (!io1.SetFromFile(pathname1, &pool)) {
     fprintf(stderr, "Failed to read image from %s\n", pathname1);
     return false;
@@ -49,9 +64,16 @@ Status RunButteraugli(const char* pathname1, const char* pathname2) {
 }  // namespace pik
 
 int main(int argc, char** argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <reference> <distorted>\n", argv[0]);
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <reference> <distorted> [num_threads]\n",
+            argv[0]);
+    return 1;
+  }
+  // Defaults to one worker per hardware thread; 0 runs on the main thread.
+  int num_threads = std::thread::hardware_concurrency();
+  if (argc == 4 && !pik::ParseNumThreads(argv[3], &num_threads)) {
+    fprintf(stderr, "Invalid number of threads: %s\n", argv[3]);
     return 1;
   }
-  return pik::RunButteraugli(argv[1], argv[2]) ? 0 : 1;
+  return pik::RunButteraugli(argv[1], argv[2], num_threads) ? 0 : 1;
 }
@@ -12,12 +12,14 @@
 // Interface for encoding/decoding images and their metadata.
 
 #include <stddef.h>
+#include <memory>
 #include <string>
 #include <vector>
 #include "color_management.h"
 #include "common.h"
 #include "data_parallel.h"
 #include "image.h"
+#include "image_allocator.h"
 #include "metadata.h"
 
 namespace pik {
@@ -44,6 +46,9 @@ struct CodecContext {
   // Index with IsGray().
   const std::array<ColorEncoding, 2> c_srgb;
   const std::array<ColorEncoding, 2> c_linear_srgb;
+
+  // Recycles image buffers across decodes that use this context.
+  std::shared_ptr<ImageBufferPool> image_pool;
 };
 
 // Allows passing arbitrary metadata to decoders (required for PNM).
@@ -8,8 +8,6 @@
 
 #include <algorithm>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "byte_order.h"
 #include "codec_png.h"
 #include "codec_pnm.h"
@@ -185,7 +183,8 @@ Codec CodecFromExtension(const std::string& extension) {
 
 CodecContext::CodecContext(size_t ignored)
     : c_srgb(MakeC2(Primaries::kSRGB, TransferFunction::kSRGB)),
-      c_linear_srgb(MakeC2(Primaries::kSRGB, TransferFunction::kLinear)) {
+      c_linear_srgb(MakeC2(Primaries::kSRGB, TransferFunction::kLinear)),
+      image_pool(ImageBufferPool::Create()) {
   // For all supported targets:
   TargetBitfield supported;
   do {
@@ -5,12 +5,14 @@
 // https://opensource.org/licenses/MIT.
 
 #include "color_correlation.h"
+
+#include <array>
+#include <vector>
+
 #include "huffman_decode.h"
 #include "huffman_encode.h"
 #include "write_bits.h"
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "common.h"
 #include "dct_util.h"
 #include "profiler.h"
@@ -38,9 +40,9 @@ inline void FindIndexOfSumMaximum(const V* array, const size_t len, R* idx,
 }
 
 template <int MAIN_CHANNEL, int SIDE_CHANNEL, int SCALE, int OFFSET>
-void FindBestCorrelation(const Image3F& dct, ImageI* PIK_RESTRICT map,
-                         ImageF* PIK_RESTRICT tmp_map, int* PIK_RESTRICT dc,
-                         float acceptance) {
+void FindBestCorrelation(const Image3F& dct, ThreadPool* pool,
+                         ImageI* PIK_RESTRICT map, ImageF* PIK_RESTRICT tmp_map,
+                         int* PIK_RESTRICT dc, float acceptance) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
   constexpr float kScale = SCALE;
@@ -52,8 +54,16 @@ void FindBestCorrelation(const Image3F& dct, ImageI* PIK_RESTRICT map,
   for (int k = 0; k < block_size; ++k) {
     qm[k] = 1.0f / kDequantMatrix[k];
   }
-  int32_t d_num_zeros_global[256] = {0};
-  for (int ty = 0; ty < map->ysize(); ++ty) {
+  // Per-thread partial histograms; integer sums are order-independent, so the
+  // result does not depend on the number of threads.
+  std::vector<std::array<int32_t, 256>> d_num_zeros_per_thread(
+      NumThreads(pool));
+  for (std::array<int32_t, 256>& d_num_zeros : d_num_zeros_per_thread) {
+    d_num_zeros.fill(0);
+  }
+  const auto process_row = [&](const int ty, const int thread) {
+    int32_t* PIK_RESTRICT d_num_zeros_global =
+        d_num_zeros_per_thread[thread].data();
     int* PIK_RESTRICT row_out = map->Row(ty);
     float* PIK_RESTRICT row_tmp_out = tmp_map->Row(ty);
     for (int tx = 0; tx < map->xsize(); ++tx) {
@@ -116,6 +126,14 @@ void FindBestCorrelation(const Image3F& dct, ImageI* PIK_RESTRICT map,
       row_out[tx] = best;
       row_tmp_out[tx] = (float)best_sum / ((x1 - x0) * (y1 - y0));
     }
+  };
+  RunOnPool(pool, 0, map->ysize(), process_row, "FindBestCorrelation");
+
+  int32_t d_num_zeros_global[256] = {0};
+  for (const std::array<int32_t, 256>& d_num_zeros : d_num_zeros_per_thread) {
+    for (size_t i = 0; i < 256; ++i) {
+      d_num_zeros_global[i] += d_num_zeros[i];
+    }
   }
 
   int global_best = 0;
@@ -211,18 +229,15 @@ template void ApplyColorCorrelationDC<true>(const ColorCorrelationMap&,
 template void ApplyColorCorrelationDC<false>(const ColorCorrelationMap&,
                                              const ImageF&, Image3F*);
 
-void FindBestColorCorrelationMap(const Image3F& opsin,
+void FindBestColorCorrelationMap(const Image3F& dct, ThreadPool* pool,
                                  ColorCorrelationMap* cmap) {
   PROFILER_ZONE("enc YTo* correlation");
 
   constexpr int block_size = kBlockDim * kBlockDim;
-  const size_t xsize_blocks = opsin.xsize() / kBlockDim;
-  const size_t ysize_blocks = opsin.ysize() / kBlockDim;
-  Image3F dct(xsize_blocks * block_size, ysize_blocks);
-  TransposedScaledDCT(opsin, &dct);
+  const size_t xsize = dct.xsize() / block_size * kBlockDim;
+  const size_t ysize = dct.ysize() * kBlockDim;
 
-  ImageF tmp(DivCeil(opsin.xsize(), kColorTileDim),
-             DivCeil(opsin.ysize(), kColorTileDim));
+  ImageF tmp(DivCeil(xsize, kColorTileDim), DivCeil(ysize, kColorTileDim));
 
   // These two coefficients are eligible for optimization.
   // Perhaps, they also could be made quality-dependent.
@@ -232,11 +247,11 @@ void FindBestColorCorrelationMap(const Image3F& opsin,
   float y_to_x_acceptance = -0.625f;
 
   FindBestCorrelation</* from Y */ 1, /* to B */ 2, kColorFactorB,
-                      kColorOffsetB>(dct, &cmap->ytob_map, &tmp, &cmap->ytob_dc,
-                                     y_to_b_acceptance);
+                      kColorOffsetB>(dct, pool, &cmap->ytob_map, &tmp,
+                                     &cmap->ytob_dc, y_to_b_acceptance);
   FindBestCorrelation</* from Y */ 1, /* to X */ 0, kColorFactorX,
-                      kColorOffsetX>(dct, &cmap->ytox_map, &tmp, &cmap->ytox_dc,
-                                     y_to_x_acceptance);
+                      kColorOffsetX>(dct, pool, &cmap->ytox_map, &tmp,
+                                     &cmap->ytox_dc, y_to_x_acceptance);
 }
 
 bool DecodeColorMap(BitReader* PIK_RESTRICT br, ImageI* PIK_RESTRICT ac_map,
@@ -259,14 +274,14 @@ bool DecodeColorMap(BitReader* PIK_RESTRICT br, ImageI* PIK_RESTRICT ac_map,
   return true;
 }
 
-std::string EncodeColorMap(const ImageI& ac_map, const Rect& rect,
-                           const int dc_val, PikImageSizeInfo* info) {
+void EncodeColorMap(const ImageI& ac_map, const Rect& rect, const int dc_val,
+                    BitWriter* writer, PikImageSizeInfo* info) {
   PIK_ASSERT(rect.IsInside(ac_map));
   const size_t max_out_size = rect.xsize() * rect.ysize() + 1024;
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  const size_t begin = writer->BitsWritten();
+  writer->ReserveBits(max_out_size * kBitsPerByte);
+  size_t* storage_ix = writer->storage_ix();
+  uint8_t* storage = writer->storage();
   std::vector<uint32_t> histogram(256);
   ++histogram[dc_val];
   for (int y = 0; y < rect.ysize(); ++y) {
@@ -277,25 +292,24 @@ std::string EncodeColorMap(const ImageI& ac_map, const Rect& rect,
   std::vector<uint8_t> bit_depths(256);
   std::vector<uint16_t> bit_codes(256);
   BuildAndStoreHuffmanTree(histogram.data(), histogram.size(),
-                           bit_depths.data(), bit_codes.data(), &storage_ix,
+                           bit_depths.data(), bit_codes.data(), storage_ix,
                            storage);
-  const size_t histo_bits = storage_ix;
-  WriteBits(bit_depths[dc_val], bit_codes[dc_val], &storage_ix, storage);
+  const size_t histo_bits = *storage_ix - begin;
+  WriteBits(bit_depths[dc_val], bit_codes[dc_val], storage_ix, storage);
   for (int y = 0; y < rect.ysize(); ++y) {
     const int* PIK_RESTRICT row = rect.ConstRow(ac_map, y);
     for (int x = 0; x < rect.xsize(); ++x) {
-      WriteBits(bit_depths[row[x]], bit_codes[row[x]], &storage_ix, storage);
+      WriteBits(bit_depths[row[x]], bit_codes[row[x]], storage_ix, storage);
     }
   }
-  WriteZeroesToByteBoundary(&storage_ix, storage);
-  PIK_ASSERT((storage_ix >> 3) <= output.size());
-  output.resize(storage_ix >> 3);
+  WriteZeroesToByteBoundary(storage_ix, storage);
+  const size_t num_bits = *storage_ix - begin;
+  PIK_ASSERT((num_bits >> 3) <= max_out_size);
   if (info) {
     info->histogram_size += histo_bits >> 3;
-    info->entropy_coded_bits += storage_ix - histo_bits;
-    info->total_size += output.size();
+    info->entropy_coded_bits += num_bits - histo_bits;
+    info->total_size += num_bits >> 3;
   }
-  return output;
 }
 
 }  // namespace pik
@@ -6,11 +6,13 @@
 
 #include "color_management.h"
 
+#include <string.h>
 #include <mutex>
 #include "lcms2.h"
 
 #include "rational_polynomial.h"
 #include "simd/simd.h"
+#include "transfer_functions.h"
 
 namespace pik {
 namespace {
@@ -287,62 +289,6 @@ class TF_PQ {
   static constexpr double kC3 = (2392.0 / 4096) * 32;
 };
 
-// sRGB
-class TF_SRGB {
- public:
-  template <typename V>
-  SIMD_ATTR PIK_INLINE V DisplayFromEncoded(V x) const {
-    // Computed via af_cheb_rational (k=100); replicated 4x.
-    SIMD_ALIGN constexpr float p[(4 + 1) * 4] = {
-        2.200248328e-04, 2.200248328e-04, 2.200248328e-04, 2.200248328e-04,
-        1.043637593e-02, 1.043637593e-02, 1.043637593e-02, 1.043637593e-02,
-        1.624820318e-01, 1.624820318e-01, 1.624820318e-01, 1.624820318e-01,
-        7.961564959e-01, 7.961564959e-01, 7.961564959e-01, 7.961564959e-01,
-        8.210152774e-01, 8.210152774e-01, 8.210152774e-01, 8.210152774e-01,
-    };
-    SIMD_ALIGN constexpr float q[(4 + 1) * 4] = {
-        2.631846970e-01,  2.631846970e-01,  2.631846970e-01,  2.631846970e-01,
-        1.076976492e+00,  1.076976492e+00,  1.076976492e+00,  1.076976492e+00,
-        4.987528350e-01,  4.987528350e-01,  4.987528350e-01,  4.987528350e-01,
-        -5.512498495e-02, -5.512498495e-02, -5.512498495e-02, -5.512498495e-02,
-        6.521209011e-03,  6.521209011e-03,  6.521209011e-03,  6.521209011e-03,
-    };
-    const SIMD_FULL(float) d;
-    const V linear = x * set1(d, kLowDivInv);
-    const V poly = EvalRationalPolynomial(x, p, q);
-    return select(linear, poly, x > set1(d, kThreshSRGBToLinear));
-  }
-
-  template <class V>
-  SIMD_ATTR PIK_INLINE V EncodedFromDisplay(const V x) const {
-    // Computed via af_cheb_rational (k=100); replicated 4x.
-    SIMD_ALIGN constexpr float p[(4 + 1) * 4] = {
-        -5.135152395e-04, -5.135152395e-04, -5.135152395e-04, -5.135152395e-04,
-        5.287254571e-03,  5.287254571e-03,  5.287254571e-03,  5.287254571e-03,
-        3.903842876e-01,  3.903842876e-01,  3.903842876e-01,  3.903842876e-01,
-        1.474205315e+00,  1.474205315e+00,  1.474205315e+00,  1.474205315e+00,
-        7.352629620e-01,  7.352629620e-01,  7.352629620e-01,  7.352629620e-01,
-    };
-    SIMD_ALIGN constexpr float q[(4 + 1) * 4] = {
-        1.004519624e-02, 1.004519624e-02, 1.004519624e-02, 1.004519624e-02,
-        3.036675394e-01, 3.036675394e-01, 3.036675394e-01, 3.036675394e-01,
-        1.340816930e+00, 1.340816930e+00, 1.340816930e+00, 1.340816930e+00,
-        9.258482155e-01, 9.258482155e-01, 9.258482155e-01, 9.258482155e-01,
-        2.424867759e-02, 2.424867759e-02, 2.424867759e-02, 2.424867759e-02,
-    };
-    const SIMD_FULL(float) d;
-    const V linear = x * set1(d, kLowDiv);
-    const V poly = EvalRationalPolynomial(sqrt(x), p, q);
-    return select(linear, poly, x > set1(d, kThreshLinearToSRGB));
-  }
-
- private:
-  static constexpr double kThreshSRGBToLinear = 0.04045;
-  static constexpr double kThreshLinearToSRGB = 0.0031308;
-  static constexpr double kLowDiv = 12.92;
-  static constexpr double kLowDivInv = 1.0 / kLowDiv;
-};
-
 // NOTE: this is only used to provide a reasonable ICC profile that other
 // software can read. Our own transforms use ExtraTF instead because that is
 // more precise and supports unbounded mode.
@@ -702,25 +648,83 @@ Status ColorManagement::MaybeRemoveProfile(ColorEncoding* PIK_RESTRICT c) {
   return true;
 }
 
-ColorSpaceTransform::~ColorSpaceTransform() {
-  std::unique_lock<std::mutex> lock(lcms_mutex);
-  for (void* p : transforms_) {
-    TransformDeleter()(p);
+// Profiles and idle lcms transforms for one pair of encodings. Repeated
+// conversions (e.g. when decoding many images) thus skip decoding/creating
+// profiles and reuse the transforms' precomputed tables. Guarded by lcms_mutex.
+struct ColorSpaceTransform::CacheEntry {
+  bool Matches(const ColorEncoding& c_src, const ColorEncoding& c_dst) const {
+    return SameBytes(icc_src, c_src.icc) && SameBytes(icc_dst, c_dst.icc) &&
+           intent == static_cast<uint32_t>(c_dst.rendering_intent);
+  }
+
+  static bool SameBytes(const PaddedBytes& a, const PaddedBytes& b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
   }
+
+  PaddedBytes icc_src;
+  PaddedBytes icc_dst;
+  uint32_t intent;
+
+  Profile profile_src;
+  Profile profile_dst;
+  uint32_t type_src;
+  uint32_t type_dst;
+  bool skip_lcms = false;
+  ExtraTF preprocess = ExtraTF::kNone;
+  ExtraTF postprocess = ExtraTF::kNone;
+
+  std::vector<void*> idle_transforms;
+  size_t num_users = 0;  // ColorSpaceTransform instances holding transforms.
+};
+
+namespace {
+
+// Entries not in use beyond this are evicted.
+constexpr size_t kMaxCacheEntries = 16;
+
+}  // namespace
+
+std::vector<std::unique_ptr<ColorSpaceTransform::CacheEntry>>&
+ColorSpaceTransform::Cache() {
+  // Never freed: transforms may be in use until the process exits.
+  static auto* entries = new std::vector<std::unique_ptr<CacheEntry>>;
+  return *entries;
 }
 
-Status ColorSpaceTransform::Init(const ColorEncoding& c_src,
-                                 const ColorEncoding& c_dst, size_t xsize,
-                                 const size_t num_threads) {
+ColorSpaceTransform::~ColorSpaceTransform() {
   std::unique_lock<std::mutex> lock(lcms_mutex);
-  Profile profile_src, profile_dst;
+  ReleaseTransforms();
+}
+
+void ColorSpaceTransform::ReleaseTransforms() {
+  if (entry_ == nullptr) return;
+  entry_->idle_transforms.insert(entry_->idle_transforms.end(),
+                                 transforms_.begin(), transforms_.end());
+  transforms_.clear();
+  entry_->num_users -= 1;
+  entry_ = nullptr;
+}
+
+ColorSpaceTransform::CacheEntry* ColorSpaceTransform::FindOrAddEntry(
+    const ColorEncoding& c_src, const ColorEncoding& c_dst) {
+  auto& entries = Cache();
+  for (const auto& entry : entries) {
+    if (entry->Matches(c_src, c_dst)) return entry.get();
+  }
+
+  std::unique_ptr<CacheEntry> entry(new CacheEntry);
   const cmsContext context = GetContext();
-  PIK_RETURN_IF_ERROR(DecodeProfile(context, c_src.icc, &profile_src));
-  PIK_RETURN_IF_ERROR(DecodeProfile(context, c_dst.icc, &profile_dst));
-  skip_lcms_ = false;
+  if (!DecodeProfile(context, c_src.icc, &entry->profile_src) ||
+      !DecodeProfile(context, c_dst.icc, &entry->profile_dst)) {
+    return nullptr;
+  }
+  entry->icc_src = c_src.icc;
+  entry->icc_dst = c_dst.icc;
+  entry->intent = static_cast<uint32_t>(c_dst.rendering_intent);
+
   if (c_src.SameColorSpace(c_dst) &&
       c_src.transfer_function == c_dst.transfer_function) {
-    skip_lcms_ = true;
+    entry->skip_lcms = true;
   }
 
   // Special-case for BT.2100 HLG/PQ and SRGB <=> linear:
@@ -741,21 +745,23 @@ Status ColorSpaceTransform::Init(const ColorEncoding& c_src,
         DecodeProfile(context, icc_src, &new_src) &&
         DecodeProfile(context, icc_dst, &new_dst)) {
       if (c_src.SameColorSpace(c_dst)) {
-        skip_lcms_ = true;
+        entry->skip_lcms = true;
       }
-      profile_src.swap(new_src);
-      profile_dst.swap(new_dst);
+      entry->profile_src.swap(new_src);
+      entry->profile_dst.swap(new_dst);
       if (IsLinear(c_dst.transfer_function)) {
-        preprocess_ = IsSRGB(c_src.transfer_function)
-                          ? ExtraTF::kSRGB
-                          : (IsPQ(c_src.transfer_function) ? ExtraTF::kPQ
-                                                           : ExtraTF::kHLG);
+        entry->preprocess = IsSRGB(c_src.transfer_function)
+                                ? ExtraTF::kSRGB
+                                : (IsPQ(c_src.transfer_function)
+                                       ? ExtraTF::kPQ
+                                       : ExtraTF::kHLG);
       } else {
         PIK_ASSERT(IsLinear(c_src.transfer_function));
-        postprocess_ = IsSRGB(c_dst.transfer_function)
-                           ? ExtraTF::kSRGB
-                           : (IsPQ(c_dst.transfer_function) ? ExtraTF::kPQ
-                                                            : ExtraTF::kHLG);
+        entry->postprocess = IsSRGB(c_dst.transfer_function)
+                                 ? ExtraTF::kSRGB
+                                 : (IsPQ(c_dst.transfer_function)
+                                        ? ExtraTF::kPQ
+                                        : ExtraTF::kHLG);
       }
     } else {
       fprintf(stderr, "Failed to create extra linear profiles");
@@ -763,26 +769,63 @@ Status ColorSpaceTransform::Init(const ColorEncoding& c_src,
   }
 
   // Type includes color space (XYZ vs RGB), so can be different.
-  const uint32_t type_src = Type32(c_src);
-  const uint32_t type_dst = Type32(c_dst);
+  entry->type_src = Type32(c_src);
+  entry->type_dst = Type32(c_dst);
+
+  // Make room by evicting the oldest entries that are not in use.
+  for (auto it = entries.begin();
+       entries.size() >= kMaxCacheEntries && it != entries.end();) {
+    if ((*it)->num_users == 0) {
+      for (void* p : (*it)->idle_transforms) {
+        TransformDeleter()(p);
+      }
+      it = entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  entries.push_back(std::move(entry));
+  return entries.back().get();
+}
+
+Status ColorSpaceTransform::Init(const ColorEncoding& c_src,
+                                 const ColorEncoding& c_dst, size_t xsize,
+                                 const size_t num_threads) {
+  std::unique_lock<std::mutex> lock(lcms_mutex);
+  ReleaseTransforms();
+
   // Not including alpha channel (copied separately).
   const size_t channels_src = c_src.Channels();
   const size_t channels_dst = c_dst.Channels();
   PIK_CHECK(channels_src == channels_dst);
 
-  transforms_.clear();
+  entry_ = FindOrAddEntry(c_src, c_dst);
+  if (entry_ == nullptr) return PIK_FAILURE("Failed to decode profiles");
+  entry_->num_users += 1;
+  skip_lcms_ = entry_->skip_lcms;
+  preprocess_ = entry_->preprocess;
+  postprocess_ = entry_->postprocess;
+
+  const cmsContext context = GetContext();
   for (size_t i = 0; i < num_threads; ++i) {
-    const uint32_t intent = static_cast<uint32_t>(c_dst.rendering_intent);
+    if (!entry_->idle_transforms.empty()) {
+      transforms_.push_back(entry_->idle_transforms.back());
+      entry_->idle_transforms.pop_back();
+      continue;
+    }
+
     const uint32_t flags =
         cmsFLAGS_BLACKPOINTCOMPENSATION | cmsFLAGS_HIGHRESPRECALC;
     // NOTE: we're using the current thread's context and assuming all state
     // modified by cmsDoTransform resides in the transform, not the context.
-    transforms_.emplace_back(cmsCreateTransformTHR(context, profile_src.get(),
-                                                   type_src, profile_dst.get(),
-                                                   type_dst, intent, flags));
-    if (transforms_.back() == nullptr) {
+    void* transform = cmsCreateTransformTHR(
+        context, entry_->profile_src.get(), entry_->type_src,
+        entry_->profile_dst.get(), entry_->type_dst, entry_->intent, flags);
+    if (transform == nullptr) {
       return PIK_FAILURE("Failed to create transform");
     }
+    transforms_.push_back(transform);
   }
 
   // Ideally LCMS would convert directly from External to Image3. However,
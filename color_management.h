@@ -79,7 +79,17 @@ class ColorSpaceTransform {
     kSRGB,
   };
 
-  // One per thread - cannot share because of caching.
+  // Shared by all instances converting between the same encodings.
+  struct CacheEntry;
+  static std::vector<std::unique_ptr<CacheEntry>>& Cache();
+  // Returns nullptr if the profiles are invalid. Requires lcms_mutex.
+  static CacheEntry* FindOrAddEntry(const ColorEncoding& c_src,
+                                    const ColorEncoding& c_dst);
+  // Returns transforms_ to entry_. Requires lcms_mutex.
+  void ReleaseTransforms();
+
+  CacheEntry* entry_ = nullptr;  // Not owned; non-null after Init.
+  // One per thread - cannot share because of caching. Borrowed from entry_.
   std::vector<void*> transforms_;
 
   ImageF buf_src_;
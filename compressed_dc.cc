@@ -6,6 +6,9 @@
 
 #include "compressed_dc.h"
 
+#include <algorithm>
+#include <numeric>
+
 #include "common.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
@@ -16,6 +19,7 @@
 #include "lossless8.h"
 #include "padded_bytes.h"
 #include "pik_info.h"
+#include "profiler.h"
 #include "size_coder.h"
 
 namespace pik {
@@ -88,8 +92,8 @@ bool Image3SCompress(const Image3S& img, const Rect& rect, bool grayscale,
 }
 
 // If grayscale, only the second channel (y) is decoded.
-bool Image3SDecompress(const PaddedBytes& bytes, bool grayscale, size_t* pos,
-                       Image3S* result) {
+bool Image3SDecompress(const Span<const uint8_t> bytes, bool grayscale,
+                       size_t* pos, Image3S* result) {
   if (bytes.size() < *pos + 12) return PIK_FAILURE("Could not decode range");
   std::array<int16_t, 3> min;
   for (int c = 0; c < 3; c++) {
@@ -226,25 +230,23 @@ SIMD_ATTR void DequantDC(const Image3S& img_dc16, const Rect& rect,
 }
 
 // `rect`: block units
-std::string CompressDCGroup(const Image3S& dc, const Rect& rect,
-                            bool use_new_dc, bool grayscale,
-                            PikImageSizeInfo* dc_info) {
-  std::string dc_code;
+void CompressDCGroup(const Image3S& dc, const Rect& rect, bool use_new_dc,
+                     bool grayscale, BitWriter* writer,
+                     PikImageSizeInfo* dc_info) {
   if (use_new_dc) {
     PaddedBytes enc_dc;
     Image3SCompress(dc, rect, grayscale, &enc_dc);
-    dc_code.assign(enc_dc.data(), enc_dc.data() + enc_dc.size());
+    writer->Append(enc_dc);
   } else {
     Image3S tmp_dc_residuals(rect.xsize(), rect.ysize());
     ShrinkDC(rect, dc, &tmp_dc_residuals);
-    dc_code =
-        EncodeImageData(Rect(tmp_dc_residuals), tmp_dc_residuals, dc_info);
+    EncodeImageData(Rect(tmp_dc_residuals), tmp_dc_residuals, writer,
+                    dc_info);
   }
-  return dc_code;
 }
 
 // `rect`: block units.
-Status DecodeDCGroup(BitReader* reader, const PaddedBytes& compressed,
+Status DecodeDCGroup(BitReader* reader, const Span<const uint8_t> compressed,
                      const Rect& rect, bool use_new_dc, bool grayscale,
                      const float* mul_dc, const float ytox_dc,
                      const float ytob_dc, PassDecCache* pass_dec_cache) {
@@ -275,11 +277,8 @@ using DCGroupSizeCoder = SizeCoderT<0x150F0E0C>;
 
 }  // namespace
 
-PaddedBytes EncodeDC(const Quantizer& quantizer,
-                     const PassEncCache& pass_enc_cache, ThreadPool* pool,
-                     PikImageSizeInfo* dc_info) {
-  PaddedBytes out;
-
+void EncodeDC(const Quantizer& quantizer, const PassEncCache& pass_enc_cache,
+              ThreadPool* pool, BitWriter* writer, PikImageSizeInfo* dc_info) {
   const size_t xsize_blocks = pass_enc_cache.dc.xsize();
   const size_t ysize_blocks = pass_enc_cache.dc.ysize();
   const size_t xsize_groups =
@@ -296,19 +295,18 @@ PaddedBytes EncodeDC(const Quantizer& quantizer,
     }
   }
 
-  std::vector<PaddedBytes> group_codes(num_groups);
+  GroupWriters group_writers(NumThreads(pool), num_groups);
   const auto process_group = [&](const int group_index, const int thread) {
-    size_t group_pos = 0;
     const size_t gx = group_index % xsize_groups;
     const size_t gy = group_index / xsize_groups;
     const Rect rect(gx * kDcGroupDimInBlocks, gy * kDcGroupDimInBlocks,
                     kDcGroupDimInBlocks, kDcGroupDimInBlocks, xsize_blocks,
                     ysize_blocks);
-    std::string group_code = CompressDCGroup(
-        pass_enc_cache.dc, rect, pass_enc_cache.use_new_dc,
-        pass_enc_cache.grayscale_opt, size_info[group_index].get());
-    group_codes[group_index].resize(group_code.size());
-    Append(group_code, &group_codes[group_index], &group_pos);
+    CompressDCGroup(pass_enc_cache.dc, rect, pass_enc_cache.use_new_dc,
+                    pass_enc_cache.grayscale_opt,
+                    group_writers.Begin(group_index, thread),
+                    size_info[group_index].get());
+    group_writers.Finish(group_index);
   };
   RunOnPool(pool, 0, num_groups, process_group, "EncodeDC");
 
@@ -318,123 +316,137 @@ PaddedBytes EncodeDC(const Quantizer& quantizer,
     }
   }
 
-  // Build TOC.
-  PaddedBytes group_toc(DCGroupSizeCoder::MaxSize(num_groups));
-  size_t group_toc_pos = 0;
-  uint8_t* group_toc_storage = group_toc.data();
-  size_t total_groups_size = 0;
+  // Write TOC, then the groups.
+  writer->ReserveBits(DCGroupSizeCoder::MaxSize(num_groups) * kBitsPerByte);
   for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    size_t group_size = group_codes[group_index].size();
-    DCGroupSizeCoder::Encode(group_size, &group_toc_pos, group_toc_storage);
-    total_groups_size += group_size;
+    DCGroupSizeCoder::Encode(group_writers.SectionSize(group_index),
+                             writer->storage_ix(), writer->storage());
   }
-  WriteZeroesToByteBoundary(&group_toc_pos, group_toc_storage);
-  group_toc.resize(group_toc_pos / kBitsPerByte);
+  writer->ZeroPadToByte();
+  group_writers.Gather(writer);
 
-  PaddedBytes serialized_gradient_map;
   if (pass_enc_cache.use_gradient) {
     SerializeGradientMap(pass_enc_cache.gradient, Rect(pass_enc_cache.dc),
-                         quantizer, &serialized_gradient_map);
+                         quantizer, writer);
   }
-
-  // Push output.
-  size_t pos = 0;
-  out.reserve(group_toc.size() + total_groups_size +
-              serialized_gradient_map.size());
-  out.append(group_toc);
-  pos += group_toc.size() * kBitsPerByte;
-  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    const PaddedBytes& group_code = group_codes[group_index];
-    out.append(group_code);
-    pos += group_code.size() * kBitsPerByte;
-  }
-  out.append(serialized_gradient_map);
-
-  return out;
 }
 
-Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
-                const PassHeader& pass_header, size_t xsize_blocks,
-                size_t ysize_blocks, const Quantizer& quantizer,
-                const ColorCorrelationMap& cmap, ThreadPool* pool,
-                PassDecCache* pass_dec_cache) {
+Status DCDecoder::ReadHeaders(BitReader* reader,
+                              const Span<const uint8_t> compressed,
+                              const PassHeader& pass_header,
+                              size_t xsize_blocks, size_t ysize_blocks,
+                              const Quantizer& quantizer,
+                              const ColorCorrelationMap& cmap,
+                              PassDecCache* pass_dec_cache) {
+  quantizer_ = &quantizer;
+  xsize_blocks_ = xsize_blocks;
+  ysize_blocks_ = ysize_blocks;
+
   const float* dequant_matrices = quantizer.DequantMatrix(0, kQuantKindDCT8);
-  float mul_dc[3];
   for (int c = 0; c < 3; ++c) {
-    mul_dc[c] = dequant_matrices[DequantMatrixOffset(0, kQuantKindDCT8, c) *
-                                 kBlockDim * kBlockDim] *
-                quantizer.inv_quant_dc();
+    mul_dc_[c] = dequant_matrices[DequantMatrixOffset(0, kQuantKindDCT8, c) *
+                                  kBlockDim * kBlockDim] *
+                 quantizer.inv_quant_dc();
   }
 
   pass_dec_cache->dc = Image3F(xsize_blocks, ysize_blocks);
 
   // Precompute DC inverse color transform.
-  float ytox_dc = ColorCorrelationMap::YtoX(1.0f, cmap.ytox_dc);
-  float ytob_dc = ColorCorrelationMap::YtoB(1.0f, cmap.ytob_dc);
+  ytox_dc_ = ColorCorrelationMap::YtoX(1.0f, cmap.ytox_dc);
+  ytob_dc_ = ColorCorrelationMap::YtoB(1.0f, cmap.ytob_dc);
 
-  const size_t xsize_groups = DivCeil(xsize_blocks, kDcGroupDimInBlocks);
-  const size_t ysize_groups = DivCeil(ysize_blocks, kDcGroupDimInBlocks);
-  const size_t num_groups = xsize_groups * ysize_groups;
+  xsize_groups_ = DivCeil(xsize_blocks, kDcGroupDimInBlocks);
+  ysize_groups_ = DivCeil(ysize_blocks, kDcGroupDimInBlocks);
+  const size_t num_groups = NumGroups();
 
   // Read TOC.
-  std::vector<size_t> group_offsets;
   {
-    group_offsets.reserve(num_groups + 1);
-    group_offsets.push_back(0);
+    group_offsets_.clear();
+    group_offsets_.reserve(num_groups + 1);
+    group_offsets_.push_back(0);
     for (size_t group_index = 0; group_index < num_groups; ++group_index) {
       const uint32_t size = DCGroupSizeCoder::Decode(reader);
-      group_offsets.push_back(group_offsets.back() + size);
+      group_offsets_.push_back(group_offsets_.back() + size);
     }
     PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
   }
 
-  // Pretend all groups are read.
-  size_t group_codes_begin = reader->Position();
-  reader->SkipBits(group_offsets.back() * kBitsPerByte);
+  // Skip the groups; they are decoded by DecodeGroup.
+  group_codes_begin_ = reader->Position();
+  reader->SkipBits(group_offsets_.back() * kBitsPerByte);
   if (reader->Position() > compressed.size()) {
     return PIK_FAILURE("Group code extends after stream end");
   }
 
-  // Decode groups.
-  std::atomic<int> num_errors{0};
-  const auto process_group = [&](const int group_index, const int thread) {
-    size_t group_code_offset = group_offsets[group_index];
-    size_t group_reader_limit = group_offsets[group_index + 1];
-    // TODO(user): this looks ugly; we should get rid of PaddedBytes parameter
-    //               once it is wrapped into BitReader; otherwise it is easy to
-    //               screw the things up.
-    BitReader group_reader(compressed.data(),
-                           group_codes_begin + group_reader_limit);
-    group_reader.SkipBits((group_codes_begin + group_code_offset) *
-                          kBitsPerByte);
-    const size_t gx = group_index % xsize_groups;
-    const size_t gy = group_index / xsize_groups;
-    const Rect rect(gx * kDcGroupDimInBlocks, gy * kDcGroupDimInBlocks,
-                    kDcGroupDimInBlocks, kDcGroupDimInBlocks, xsize_blocks,
-                    ysize_blocks);
-    if (!DecodeDCGroup(&group_reader, compressed, rect,
-                       pass_dec_cache->use_new_dc, pass_dec_cache->grayscale,
-                       mul_dc, ytox_dc, ytob_dc, pass_dec_cache)) {
-      num_errors.fetch_add(1);
-      return;
-    }
-  };
-  RunOnPool(pool, 0, num_groups, process_group, "DecodeDC");
-
-  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
-
-  if (pass_header.flags & PassHeader::kGradientMap) {
+  has_gradient_map_ = pass_header.flags & PassHeader::kGradientMap;
+  if (has_gradient_map_) {
     size_t byte_pos = reader->Position();
     PIK_RETURN_IF_ERROR(DeserializeGradientMap(
         xsize_blocks, ysize_blocks,
         pass_header.flags & PassHeader::kGrayscaleOpt, quantizer, compressed,
         &byte_pos, &pass_dec_cache->gradient));
     reader->SkipBits((byte_pos - reader->Position()) * 8);
-    ApplyGradientMap(pass_dec_cache->gradient, quantizer, &pass_dec_cache->dc);
   }
   return true;
 }
 
+std::vector<uint32_t> DCDecoder::GroupsNeededFor(const Rect& rect) const {
+  std::vector<uint32_t> group_indices;
+  if (has_gradient_map_) {
+    // ApplyGradientMap reads all of the DC.
+    group_indices.resize(NumGroups());
+    std::iota(group_indices.begin(), group_indices.end(), 0);
+    return group_indices;
+  }
+
+  // InitializeDecCache reads one block of border, clamped to the image.
+  const size_t bx0 = rect.x0() / kBlockDim;
+  const size_t by0 = rect.y0() / kBlockDim;
+  const size_t bx1 = DivCeil(rect.x0() + rect.xsize(), kBlockDim);
+  const size_t by1 = DivCeil(rect.y0() + rect.ysize(), kBlockDim);
+  const size_t gx0 = (bx0 == 0 ? 0 : bx0 - 1) / kDcGroupDimInBlocks;
+  const size_t gy0 = (by0 == 0 ? 0 : by0 - 1) / kDcGroupDimInBlocks;
+  const size_t gx1 = std::min(bx1 / kDcGroupDimInBlocks, xsize_groups_ - 1);
+  const size_t gy1 = std::min(by1 / kDcGroupDimInBlocks, ysize_groups_ - 1);
+  for (size_t gy = gy0; gy <= gy1; ++gy) {
+    for (size_t gx = gx0; gx <= gx1; ++gx) {
+      group_indices.push_back(gy * xsize_groups_ + gx);
+    }
+  }
+  return group_indices;
+}
+
+Status DCDecoder::DecodeGroup(const Span<const uint8_t> compressed,
+                              const size_t group_index,
+                              PassDecCache* pass_dec_cache) const {
+  PROFILER_FUNC;
+  const size_t group_code_offset = group_offsets_[group_index];
+  const size_t group_reader_limit = group_offsets_[group_index + 1];
+  // TODO(user): this looks ugly; we should get rid of PaddedBytes parameter
+  //               once it is wrapped into BitReader; otherwise it is easy to
+  //               screw the things up.
+  BitReader group_reader(compressed.data(),
+                         group_codes_begin_ + group_reader_limit);
+  group_reader.SkipBits((group_codes_begin_ + group_code_offset) *
+                        kBitsPerByte);
+  const size_t gx = group_index % xsize_groups_;
+  const size_t gy = group_index / xsize_groups_;
+  const Rect rect(gx * kDcGroupDimInBlocks, gy * kDcGroupDimInBlocks,
+                  kDcGroupDimInBlocks, kDcGroupDimInBlocks, xsize_blocks_,
+                  ysize_blocks_);
+  return DecodeDCGroup(&group_reader, compressed, rect,
+                       pass_dec_cache->use_new_dc, pass_dec_cache->grayscale,
+                       mul_dc_, ytox_dc_, ytob_dc_, pass_dec_cache);
+}
+
+void DCDecoder::Finish(PassDecCache* pass_dec_cache) const {
+  if (has_gradient_map_) {
+    PROFILER_ZONE("ApplyGradientMap");
+    ApplyGradientMap(pass_dec_cache->gradient, *quantizer_,
+                     &pass_dec_cache->dc);
+  }
+}
+
 void InitializeDecCache(const PassDecCache& pass_dec_cache, const Rect& rect,
                         DecCache* dec_cache) {
   const size_t full_xsize_blocks = pass_dec_cache.dc.xsize();
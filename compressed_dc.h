@@ -7,13 +7,20 @@
 #ifndef COMPRESSED_DC_H_
 #define COMPRESSED_DC_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
 #include "color_correlation.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
 #include "headers.h"
+#include "image.h"
 #include "padded_bytes.h"
 #include "pik_info.h"
 #include "quantizer.h"
+#include "span.h"
+#include "write_bits.h"
 
 // DC handling functions: encoding and decoding of DC to and from bitstream, and
 // related function to initialize the per-group decoder cache.
@@ -22,17 +29,54 @@ namespace pik {
 
 // Encodes the DC-related information from pass_enc_cache: quantized dc itself
 // and gradient map.
-PaddedBytes EncodeDC(const Quantizer& quantizer,
-                     const PassEncCache& pass_enc_cache, ThreadPool* pool,
-                     PikImageSizeInfo* dc_info);
-
-// Decodes and dequantizes DC, and optionally decodes and applies the
-// gradient map if requested.
-Status DecodeDC(BitReader* reader, const PaddedBytes& compressed,
-                const PassHeader& pass_header, size_t xsize_blocks,
-                size_t ysize_blocks, const Quantizer& quantizer,
-                const ColorCorrelationMap& cmap, ThreadPool* pool,
-                PassDecCache* pass_dec_cache);
+void EncodeDC(const Quantizer& quantizer, const PassEncCache& pass_enc_cache,
+              ThreadPool* pool, BitWriter* writer, PikImageSizeInfo* dc_info);
+
+// Decodes and dequantizes DC, and optionally decodes and applies the gradient
+// map if requested. The DC groups are decoded independently (see DecodeGroup),
+// so that the AC of a group can be decoded as soon as the DC groups it reads
+// (GroupsNeededFor) are done, without waiting for the others.
+class DCDecoder {
+ public:
+  // Reads the table of contents and gradient map and leaves `reader` after
+  // the DC. Allocates pass_dec_cache->dc. `quantizer` must remain valid until
+  // Finish.
+  Status ReadHeaders(BitReader* reader, const Span<const uint8_t> compressed,
+                     const PassHeader& pass_header, size_t xsize_blocks,
+                     size_t ysize_blocks, const Quantizer& quantizer,
+                     const ColorCorrelationMap& cmap,
+                     PassDecCache* pass_dec_cache);
+
+  size_t NumGroups() const { return xsize_groups_ * ysize_groups_; }
+
+  // Returns the DC groups that InitializeDecCache reads for `rect` (pixel
+  // units), or all groups if the gradient map requires them.
+  std::vector<uint32_t> GroupsNeededFor(const Rect& rect) const;
+
+  // Decodes one group into pass_dec_cache->dc. Thread-safe for different
+  // `group_index`.
+  Status DecodeGroup(const Span<const uint8_t> compressed, size_t group_index,
+                     PassDecCache* pass_dec_cache) const;
+
+  // Applies the gradient map (if any); must be called after all groups were
+  // decoded and before using pass_dec_cache->dc.
+  void Finish(PassDecCache* pass_dec_cache) const;
+
+  bool HasGradientMap() const { return has_gradient_map_; }
+
+ private:
+  const Quantizer* quantizer_ = nullptr;
+  size_t xsize_blocks_ = 0;
+  size_t ysize_blocks_ = 0;
+  size_t xsize_groups_ = 0;
+  size_t ysize_groups_ = 0;
+  float mul_dc_[3];
+  float ytox_dc_;
+  float ytob_dc_;
+  std::vector<size_t> group_offsets_;
+  size_t group_codes_begin_ = 0;
+  bool has_gradient_map_ = false;
+};
 
 // Clamps the input coordinate `candidate` to the [0, size) interval, using 1 px
 // of border (extended by cloning, not mirroring).
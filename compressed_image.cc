@@ -16,8 +16,6 @@
 #include <cstdint>
 #include <string>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "ac_predictions.h"
 #include "ac_strategy.h"
 #include "ans_decode.h"
@@ -51,13 +49,18 @@
 #include "resample.h"
 #include "resize.h"
 #include "simd/simd.h"
+#include "size_coder.h"
 #include "status.h"
+#include "tile_flow.h"
 #include "upscaler.h"
 
 namespace pik {
 
 namespace {
 
+// Sizes of the per-tile AC streams (GroupHeader::kTileTOC), in bytes.
+using TileSizeCoder = SizeCoderT<0x140C0A08>;
+
 void ZeroDcValues(Image3F* image) {
   const constexpr size_t N = kBlockDim;
   const size_t xsize_blocks = image->xsize() / (N * N);
@@ -191,8 +194,48 @@ struct GrayXyb {
 
 static const std::unique_ptr<GrayXyb> kGrayXyb(new GrayXyb);
 
+SIMD_ATTR Image3F TransformToCoefficients(const Image3F& opsin_full,
+                                          const AcStrategyImage& ac_strategy,
+                                          Image3F&& opsin_dct,
+                                          ThreadPool* pool) {
+  PROFILER_FUNC;
+  constexpr size_t N = kBlockDim;
+  constexpr int block_size = N * N;
+  const size_t xsize_blocks = opsin_full.xsize() / N;
+  const size_t ysize_blocks = opsin_full.ysize() / N;
+  const bool have_dct = opsin_dct.xsize() != 0;
+  Image3F coeffs;
+  if (have_dct) {
+    PIK_ASSERT(opsin_dct.xsize() == xsize_blocks * block_size);
+    PIK_ASSERT(opsin_dct.ysize() == ysize_blocks);
+    coeffs = std::move(opsin_dct);
+  } else {
+    coeffs = Image3F(xsize_blocks * block_size, ysize_blocks);
+  }
+
+  // Only the first block of a (multi-block) transform writes its
+  // coefficients, hence rows are independent.
+  auto transform = [&](int by, int _) {
+    for (int c = 0; c < 3; ++c) {
+      for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+        AcStrategy acs = ac_strategy.ConstRow(by)[bx];
+        if (have_dct && (acs.Strategy() == AcStrategy::Type::DCT ||
+                         acs.Strategy() == AcStrategy::Type::DCT_NOHF)) {
+          continue;  // Already equal to TransformFromPixels.
+        }
+        acs.TransformFromPixels(opsin_full.ConstPlaneRow(c, by * N) + bx * N,
+                                opsin_full.PixelsPerRow(),
+                                coeffs.PlaneRow(c, by) + bx * block_size,
+                                coeffs.PixelsPerRow());
+      }
+    }
+  };
+  RunOnPool(pool, 0, ysize_blocks, transform, "TransformToCoefficients");
+  return coeffs;
+}
+
 SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
-                                      const Image3F& opsin_full,
+                                      Image3F&& coeffs,
                                       const AcStrategyImage& ac_strategy,
                                       const Quantizer& quantizer,
                                       const ColorCorrelationMap& cmap,
@@ -203,21 +246,16 @@ SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
   constexpr int block_size = N * N;
   pass_enc_cache->use_gradient = pass_header.flags & PassHeader::kGradientMap;
   pass_enc_cache->grayscale_opt = pass_header.flags & PassHeader::kGrayscaleOpt;
-  const size_t xsize_blocks = opsin_full.xsize() / N;
-  const size_t ysize_blocks = opsin_full.ysize() / N;
+  const size_t xsize_blocks = coeffs.xsize() / block_size;
+  const size_t ysize_blocks = coeffs.ysize();
 
-  pass_enc_cache->coeffs = Image3F(xsize_blocks * block_size, ysize_blocks);
+  pass_enc_cache->coeffs = std::move(coeffs);
   Image3F dc = Image3F(xsize_blocks, ysize_blocks);
 
   auto compute_dc = [&](int by, int _) {
     for (int c = 0; c < 3; ++c) {
       for (size_t bx = 0; bx < xsize_blocks; ++bx) {
         AcStrategy acs = ac_strategy.ConstRow(by)[bx];
-        acs.TransformFromPixels(
-            opsin_full.ConstPlaneRow(c, by * N) + bx * N,
-            opsin_full.PixelsPerRow(),
-            pass_enc_cache->coeffs.PlaneRow(c, by) + bx * block_size,
-            pass_enc_cache->coeffs.PixelsPerRow());
         acs.DCFromLowestFrequencies(
             pass_enc_cache->coeffs.ConstPlaneRow(c, by) + bx * block_size,
             pass_enc_cache->coeffs.PixelsPerRow(), dc.PlaneRow(c, by) + bx,
@@ -400,15 +438,11 @@ SIMD_ATTR void ComputeCoefficients(const Quantizer& quantizer,
   }
 }
 
-PaddedBytes EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
-                              const Quantizer& quantizer,
-                              const NoiseParams& noise_params,
-                              const ColorCorrelationMap& cmap, bool fast_mode,
-                              MultipassHandler* handler, PikInfo* info) {
+GroupTokens TokenizeGroup(const EncCache& enc_cache, const Rect& rect,
+                          const int32_t* PIK_RESTRICT order,
+                          MultipassHandler* handler) {
   PROFILER_FUNC;
   constexpr size_t N = kBlockDim;
-  constexpr size_t block_size = N * N;
-  PIK_ASSERT(quantizer.block_dim() == N);
   PIK_ASSERT(rect.x0() % kTileDim == 0);
   PIK_ASSERT(rect.xsize() % N == 0);
   PIK_ASSERT(rect.y0() % kTileDim == 0);
@@ -419,33 +453,24 @@ PaddedBytes EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
   const size_t ysize_tiles = DivCeil(ysize_blocks, kTileDimInBlocks);
   const Rect group_acs_qf_area_rect(rect.x0() / N, rect.y0() / N, xsize_blocks,
                                     ysize_blocks);
-  const Rect tile_rect(rect.x0() / kTileDim, rect.y0() / kTileDim, xsize_tiles,
-                       ysize_tiles);
-
-  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
-  std::string noise_code = EncodeNoise(noise_params);
-
-  const Rect ac_rect(8 * rect.x0(), rect.y0() / 8, 8 * rect.xsize(),
-                     rect.ysize() / 8);
-
-  int32_t order[kOrderContexts * block_size];
-  std::vector<uint8_t> context_map;
-  ComputeCoeffOrder(enc_cache.ac, ac_rect, order);
-
-  std::string order_code = EncodeCoeffOrders(order, info);
 
-  std::vector<std::vector<Token>> all_tokens(2);
-  std::vector<Token>& ac_tokens = all_tokens[0];
-  std::vector<Token>& ac_strategy_and_quant_field_tokens = all_tokens[1];
+  GroupTokens tokens;
+  tokens.all_tokens.resize(2);
+  std::vector<Token>& ac_tokens = tokens.all_tokens[0];
+  std::vector<Token>& ac_strategy_and_quant_field_tokens =
+      tokens.all_tokens[1];
 
+  tokens.tile_token_begin.reserve(xsize_tiles * ysize_tiles + 1);
   for (size_t y = 0; y < ysize_tiles; y++) {
     for (size_t x = 0; x < xsize_tiles; x++) {
       const Rect tile_rect(x * kTileDimInBlocks, y * kTileDimInBlocks,
                            kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
                            ysize_blocks);
+      tokens.tile_token_begin.push_back(ac_tokens.size());
       TokenizeCoefficients(order, tile_rect, enc_cache.ac, &ac_tokens);
     }
   }
+  tokens.tile_token_begin.push_back(ac_tokens.size());
 
   TokenizeAcStrategy(group_acs_qf_area_rect, enc_cache.ac_strategy,
                      handler->HintAcStrategy(),
@@ -454,38 +479,112 @@ PaddedBytes EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
   TokenizeQuantField(group_acs_qf_area_rect, enc_cache.quant_field,
                      handler->HintQuantField(), enc_cache.ac_strategy,
                      &ac_strategy_and_quant_field_tokens);
+  return tokens;
+}
 
-  std::vector<ANSEncodingData> codes;
-  std::string histo_code = "";
+void ComputePassCoeffOrder(const std::vector<EncCache>& caches,
+                           ThreadPool* pool, PassEntropyCode* code) {
+  PROFILER_FUNC;
+  constexpr size_t kNumCounts = kOrderContexts * kBlockDim * kBlockDim;
+  std::vector<std::array<int32_t, kNumCounts>> num_zeros(NumThreads(pool));
+  RunOnPool(
+      pool, 0, caches.size(),
+      [&](const int task, const int thread) {
+        const Image3S& ac = caches[task].ac;
+        CountZeroCoefficients(ac, Rect(ac), num_zeros[thread].data());
+      },
+      "CountZeroCoefficients");
+  for (size_t thread = 1; thread < num_zeros.size(); ++thread) {
+    for (size_t i = 0; i < kNumCounts; ++i) {
+      num_zeros[0][i] += num_zeros[thread][i];
+    }
+  }
+  ComputeCoeffOrder(num_zeros[0].data(), code->order);
+}
+
+void EncodePassEntropyCode(std::vector<GroupTokens>* group_tokens,
+                           bool fast_mode, PassEntropyCode* code,
+                           BitWriter* writer, PikInfo* info) {
+  PROFILER_FUNC;
+  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
+  EncodeCoeffOrders(code->order, writer, info);
+
+  // The histograms are built from the token lists of all groups, which are
+  // moved (not copied) into all_tokens and back.
+  std::vector<std::vector<Token>> all_tokens;
+  for (GroupTokens& tokens : *group_tokens) {
+    for (std::vector<Token>& token_list : tokens.all_tokens) {
+      all_tokens.push_back(std::move(token_list));
+    }
+  }
+
+  code->codes.clear();
   if (fast_mode) {
-    histo_code =
-        BuildAndEncodeHistogramsFast(all_tokens, &codes, &context_map, ac_info);
+    BuildAndEncodeHistogramsFast(all_tokens, &code->codes, &code->context_map,
+                                 writer, ac_info);
   } else {
-    histo_code = BuildAndEncodeHistograms(kNumContexts, all_tokens, &codes,
-                                          &context_map, ac_info);
+    BuildAndEncodeHistograms(kNumContexts, all_tokens, &code->codes,
+                             &code->context_map, writer, ac_info);
   }
 
-  // TODO(user): consider either merging to AC or encoding separately.
-  std::string ac_strategy_and_quant_field_code = WriteTokens(
-      ac_strategy_and_quant_field_tokens, codes, context_map, ac_info);
+  size_t i = 0;
+  for (GroupTokens& tokens : *group_tokens) {
+    for (std::vector<Token>& token_list : tokens.all_tokens) {
+      token_list = std::move(all_tokens[i++]);
+    }
+  }
+}
 
-  std::string ac_code = WriteTokens(ac_tokens, codes, context_map, ac_info);
+namespace {
 
-  if (info) {
-    info->layers[kLayerHeader].total_size += noise_code.size();
-  }
+// Writes the AC strategy and quantization field tokens of a group, then its AC
+// tokens (preceded by the tile TOC if kTileTOC). Returns the size [bytes] of
+// the latter.
+size_t WriteGroupTokens(const GroupTokens& tokens,
+                        const std::vector<ANSEncodingData>& codes,
+                        const std::vector<uint8_t>& context_map,
+                        const GroupHeader& header, BitWriter* writer,
+                        PikImageSizeInfo* ac_info) {
+  const std::vector<Token>& ac_tokens = tokens.all_tokens[0];
 
-  PaddedBytes out(noise_code.size() + order_code.size() + histo_code.size() +
-                  ac_strategy_and_quant_field_code.size() + ac_code.size());
-  size_t byte_pos = 0;
-  Append(noise_code, &out, &byte_pos);
-  Append(order_code, &out, &byte_pos);
-  Append(histo_code, &out, &byte_pos);
-  Append(ac_strategy_and_quant_field_code, &out, &byte_pos);
-  Append(ac_code, &out, &byte_pos);
+  // TODO(user): consider either merging to AC or encoding separately.
+  WriteTokens(tokens.all_tokens[1], codes, context_map, writer, ac_info);
+
+  const size_t ac_begin = writer->BitsWritten();
+  if (header.extensions & GroupHeader::kTileTOC) {
+    // Each tile is a separate (byte-aligned) ANS stream, preceded by the TOC,
+    // which is inserted once the tile sizes are known.
+    const size_t num_tiles = tokens.tile_token_begin.size() - 1;
+    PaddedBytes tile_toc(TileSizeCoder::MaxSize(num_tiles));
+    size_t tile_toc_pos = 0;
+    for (size_t i = 0; i < num_tiles; ++i) {
+      const std::vector<Token> tile_tokens(
+          ac_tokens.begin() + tokens.tile_token_begin[i],
+          ac_tokens.begin() + tokens.tile_token_begin[i + 1]);
+      const size_t tile_begin = writer->BitsWritten();
+      WriteTokens(tile_tokens, codes, context_map, writer, ac_info,
+                  header.num_ac_ans_states);
+      TileSizeCoder::Encode(
+          (writer->BitsWritten() - tile_begin) / kBitsPerByte, &tile_toc_pos,
+          tile_toc.data());
+    }
+    WriteZeroesToByteBoundary(&tile_toc_pos, tile_toc.data());
+    const size_t tile_toc_bytes = tile_toc_pos / kBitsPerByte;
+    tile_toc.resize(tile_toc_bytes);
+    writer->Insert(ac_begin, tile_toc);
+    if (ac_info) {
+      ac_info->total_size += tile_toc_bytes;
+    }
+  } else {
+    WriteTokens(ac_tokens, codes, context_map, writer, ac_info,
+                header.num_ac_ans_states);
+  }
+  return (writer->BitsWritten() - ac_begin) / kBitsPerByte;
+}
 
+// Returns the estimated size [bytes] of the entropy-coded tokens.
+float EstimateTokenBytes(const std::vector<std::vector<Token>>& all_tokens) {
   // TODO(veluca): fix this with DC supergroups.
-  float output_size_estimate = out.size() - ac_code.size() - histo_code.size();
   std::vector<std::array<size_t, 256>> counts(kNumContexts);
   size_t extra_bits = 0;
   for (const auto& token_list : all_tokens) {
@@ -508,10 +607,84 @@ PaddedBytes EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
     }
     entropy_coded_bits += entropy * total / std::log(2);
   }
-  output_size_estimate +=
-      static_cast<float>(extra_bits + entropy_coded_bits) / kBitsPerByte;
-  if (info != nullptr) info->entropy_estimate = output_size_estimate;
-  return out;
+  return static_cast<float>(extra_bits + entropy_coded_bits) / kBitsPerByte;
+}
+
+}  // namespace
+
+void EncodeToBitstream(const EncCache& enc_cache, const Rect& rect,
+                       const Quantizer& quantizer,
+                       const NoiseParams& noise_params,
+                       const ColorCorrelationMap& cmap, bool fast_mode,
+                       const GroupHeader& header, MultipassHandler* handler,
+                       BitWriter* writer, PikInfo* info) {
+  PROFILER_FUNC;
+  constexpr size_t N = kBlockDim;
+  constexpr size_t block_size = N * N;
+  PIK_ASSERT(quantizer.block_dim() == N);
+
+  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
+  const size_t begin = writer->BitsWritten();
+  EncodeNoise(noise_params, writer);
+  if (info) {
+    info->layers[kLayerHeader].total_size +=
+        (writer->BitsWritten() - begin) / kBitsPerByte;
+  }
+
+  const Rect ac_rect(8 * rect.x0(), rect.y0() / 8, 8 * rect.xsize(),
+                     rect.ysize() / 8);
+
+  int32_t order[kOrderContexts * block_size];
+  std::vector<uint8_t> context_map;
+  ComputeCoeffOrder(enc_cache.ac, ac_rect, order);
+
+  EncodeCoeffOrders(order, writer, info);
+
+  const GroupTokens tokens = TokenizeGroup(enc_cache, rect, order, handler);
+
+  std::vector<ANSEncodingData> codes;
+  const size_t histo_begin = writer->BitsWritten();
+  if (fast_mode) {
+    BuildAndEncodeHistogramsFast(tokens.all_tokens, &codes, &context_map,
+                                 writer, ac_info);
+  } else {
+    BuildAndEncodeHistograms(kNumContexts, tokens.all_tokens, &codes,
+                             &context_map, writer, ac_info);
+  }
+  const size_t histo_bytes =
+      (writer->BitsWritten() - histo_begin) / kBitsPerByte;
+
+  const size_t ac_bytes = WriteGroupTokens(tokens, codes, context_map, header,
+                                           writer, ac_info);
+
+  if (info != nullptr) {
+    const size_t size = (writer->BitsWritten() - begin) / kBitsPerByte;
+    info->entropy_estimate = size - ac_bytes - histo_bytes +
+                             EstimateTokenBytes(tokens.all_tokens);
+  }
+}
+
+void EncodeToBitstream(const GroupTokens& tokens,
+                       const NoiseParams& noise_params,
+                       const PassEntropyCode& code, const GroupHeader& header,
+                       BitWriter* writer, PikInfo* info) {
+  PROFILER_FUNC;
+  PikImageSizeInfo* ac_info = info ? &info->layers[kLayerAC] : nullptr;
+  const size_t begin = writer->BitsWritten();
+  EncodeNoise(noise_params, writer);
+  if (info) {
+    info->layers[kLayerHeader].total_size +=
+        (writer->BitsWritten() - begin) / kBitsPerByte;
+  }
+
+  const size_t ac_bytes = WriteGroupTokens(tokens, code.codes, code.context_map,
+                                           header, writer, ac_info);
+
+  if (info != nullptr) {
+    const size_t size = (writer->BitsWritten() - begin) / kBitsPerByte;
+    info->entropy_estimate =
+        size - ac_bytes + EstimateTokenBytes(tokens.all_tokens);
+  }
 }
 
 class Dequant {
@@ -524,139 +697,14 @@ class Dequant {
   // Dequantizes and inverse color-transforms one tile, i.e. the window
   // `rect` (in block units) within the entire output image `dec_cache->ac`.
   // Reads the rect `rect16` (in block units) in `img_ac16`. Reads and write
-  // only to the `block_group_rect` part of ac_strategy/quant_field.
-  SIMD_ATTR void DoAC(const Rect& rect16, const Image3S& img_ac16,
-                      const Rect& rect, const Rect& block_group_rect,
-                      const ImageI& img_ytox, const ImageI& img_ytob,
-                      DecCache* PIK_RESTRICT dec_cache,
-                      PassDecCache* PIK_RESTRICT pass_dec_cache) const {
-    PROFILER_FUNC;
-    PIK_ASSERT(SameSize(rect, rect16));
-    constexpr size_t N = kBlockDim;
-    constexpr size_t block_size = N * N;
-    const size_t xsize = rect.xsize();  // [blocks]
-    const size_t ysize = rect.ysize();
-    PIK_ASSERT(img_ac16.xsize() % block_size == 0);
-    PIK_ASSERT(xsize <= img_ac16.xsize() / block_size);
-    PIK_ASSERT(ysize <= img_ac16.ysize());
-    PIK_ASSERT(SameSize(img_ytox, img_ytob));
-
-    using D = SIMD_FULL(float);
-    constexpr D d;
-    constexpr SIMD_PART(int16_t, D::N) d16;
-    constexpr SIMD_PART(int32_t, D::N) d32;
-
-    // Rect representing the current tile inside the current group, in an image
-    // in which each block is 1x1.
-    const Rect block_tile_group_rect(block_group_rect.x0() + rect.x0(),
-                                     block_group_rect.y0() + rect.y0(),
-                                     rect.xsize(), rect.ysize());
-
-    const size_t x0_cmap = rect.x0() / kColorTileDimInBlocks;
-    const size_t y0_cmap = rect.y0() / kColorTileDimInBlocks;
-    const size_t x0_dct = rect.x0() * block_size;
-    const size_t x0_dct16 = rect16.x0() * block_size;
-
-    for (size_t by = 0; by < ysize; ++by) {
-      const int16_t* PIK_RESTRICT row_y16 =
-          img_ac16.PlaneRow(1, by + rect16.y0()) + x0_dct16;
-      const int* PIK_RESTRICT row_quant_field =
-          block_tile_group_rect.ConstRow(pass_dec_cache->raw_quant_field, by);
-      float* PIK_RESTRICT row_y =
-          dec_cache->ac.PlaneRow(1, rect.y0() + by) + x0_dct;
-      AcStrategyRow ac_strategy_row =
-          pass_dec_cache->ac_strategy.ConstRow(block_tile_group_rect, by);
-      for (size_t bx = 0; bx < xsize; ++bx) {
-        const auto scaled_dequant =
-            set1(d, SafeDiv(inv_global_scale_, row_quant_field[bx]));
-
-        size_t kind = ac_strategy_row[bx].GetQuantKind();
-        for (size_t k = 0; k < block_size; k += d.N) {
-          const size_t x = bx * block_size + k;
-
-          // Y-channel quantization matrix for the given kind.
-          const auto dequant = load(
-              d,
-              &dequant_matrices_[DequantMatrixOffset(0, kind, 1) * block_size] +
-                  k);
-          const auto y_mul = dequant * scaled_dequant;
-
-          const auto quantized_y16 = load(d16, row_y16 + x);
-          const auto quantized_y =
-              convert_to(d, convert_to(d32, quantized_y16));
-
-          const auto dequant_y = AdjustQuantBias<1>(quantized_y) * y_mul;
-          store(dequant_y, d, row_y + x);
-        }
-      }
-    }
-
-    for (int c = 0; c < 3; c += 2) {  // === for c in {0, 2}
-      const ImageI& img_cmap = (c == 0) ? img_ytox : img_ytob;
-      for (size_t by = 0; by < ysize; ++by) {
-        const size_t ty = by / kColorTileDimInBlocks;
-        const int16_t* PIK_RESTRICT row_xb16 =
-            img_ac16.PlaneRow(c, by + rect16.y0()) + x0_dct16;
-        const int* PIK_RESTRICT row_quant_field =
-            block_tile_group_rect.ConstRow(pass_dec_cache->raw_quant_field, by);
-        const int* PIK_RESTRICT row_cmap =
-            img_cmap.ConstRow(y0_cmap + ty) + x0_cmap;
-        const float* PIK_RESTRICT row_y =
-            dec_cache->ac.ConstPlaneRow(1, rect.y0() + by) + x0_dct;
-        float* PIK_RESTRICT row_xb =
-            dec_cache->ac.PlaneRow(c, rect.y0() + by) + x0_dct;
-
-        AcStrategyRow ac_strategy_row =
-            pass_dec_cache->ac_strategy.ConstRow(block_tile_group_rect, by);
-        for (size_t bx = 0; bx < xsize; ++bx) {
-          const auto scaled_dequant =
-              set1(d, SafeDiv(inv_global_scale_, row_quant_field[bx]));
-
-          size_t kind = ac_strategy_row[bx].GetQuantKind();
-          const float* dequant_matrix =
-              &dequant_matrices_[DequantMatrixOffset(0, kind, c) * block_size];
-          const size_t tx = bx / kColorTileDimInBlocks;
-          const int32_t cmap = row_cmap[tx];
-
-          if (c == 0) {
-            const auto y_mul = set1(d, ColorCorrelationMap::YtoX(1.0f, cmap));
-
-            for (size_t k = 0; k < block_size; k += d.N) {
-              const size_t x = bx * block_size + k;
-
-              const auto xb_mul = load(d, dequant_matrix + k) * scaled_dequant;
-
-              const auto quantized_xb16 = load(d16, row_xb16 + x);
-              const auto quantized_xb =
-                  convert_to(d, convert_to(d32, quantized_xb16));
-
-              const auto out_y = load(d, row_y + x);
-
-              const auto dequant_xb = AdjustQuantBias<0>(quantized_xb) * xb_mul;
-              store(mul_add(y_mul, out_y, dequant_xb), d, row_xb + x);
-            }
-          } else {
-            const auto y_mul = set1(d, ColorCorrelationMap::YtoB(1.0f, cmap));
-
-            for (size_t k = 0; k < block_size; k += d.N) {
-              const size_t x = bx * block_size + k;
-
-              const auto xb_mul = load(d, dequant_matrix + k) * scaled_dequant;
-
-              const auto quantized_xb16 = load(d16, row_xb16 + x);
-              const auto quantized_xb =
-                  convert_to(d, convert_to(d32, quantized_xb16));
-
-              const auto out_y = load(d, row_y + x);
-
-              const auto dequant_xb = AdjustQuantBias<2>(quantized_xb) * xb_mul;
-              store(mul_add(y_mul, out_y, dequant_xb), d, row_xb + x);
-            }
-          }
-        }
-      }
-    }
-  }
+  // only to the `block_group_rect` part of ac_strategy/quant_field. Called via
+  // Dispatch; defined in compressed_image_target.cc.
+  template <class Target>
+  void operator()(const Rect& rect16, const Image3S& img_ac16,
+                  const Rect& rect, const Rect& block_group_rect,
+                  const ImageI& img_ytox, const ImageI& img_ytob,
+                  DecCache* PIK_RESTRICT dec_cache,
+                  PassDecCache* PIK_RESTRICT pass_dec_cache) const;
 
  private:
   static PIK_INLINE float SafeDiv(float num, int32_t div) {
@@ -697,9 +745,10 @@ bool DecodeCoefficientsAndDequantize(
     const PassHeader& pass_header, const GroupHeader& header,
     const Rect& group_rect, MultipassHandler* handler,
     const size_t xsize_blocks, const size_t ysize_blocks,
-    const PaddedBytes& compressed, BitReader* reader,
+    const Span<const uint8_t> compressed, BitReader* reader,
     const ColorCorrelationMap& cmap, DecCache* dec_cache,
-    PassDecCache* pass_dec_cache, const Quantizer& quantizer) {
+    PassDecCache* pass_dec_cache, const Quantizer& quantizer,
+    ThreadPool* pool) {
   PROFILER_FUNC;
   constexpr size_t N = kBlockDim;
   constexpr size_t block_size = N * N;
@@ -715,33 +764,42 @@ bool DecodeCoefficientsAndDequantize(
   const size_t ysize_tiles = DivCeil(ysize_blocks, kTileDimInBlocks);
   const size_t num_tiles = xsize_tiles * ysize_tiles;
 
-  DecoderBuffers tmp;
-  tmp.InitOnce();
-
-  int coeff_order[kOrderContexts * block_size];
-  for (size_t c = 0; c < kOrderContexts; ++c) {
-    DecodeCoeffOrder(&coeff_order[c * block_size], reader);
+  // Coefficient orders and histograms: either shared by all groups of the
+  // pass (see DecodePassEntropyCode) or decoded here.
+  const int32_t* coeff_order = pass_dec_cache->coeff_order.data();
+  const ANSCode* code = &pass_dec_cache->code;
+  const std::vector<uint8_t>* context_map = &pass_dec_cache->context_map;
+  int32_t group_coeff_order[kOrderContexts * block_size];
+  ANSCode group_code;
+  std::vector<uint8_t> group_context_map;
+  if (!(pass_header.extensions & PassHeader::kSharedEntropyCode)) {
+    for (size_t c = 0; c < kOrderContexts; ++c) {
+      DecodeCoeffOrder(&group_coeff_order[c * block_size], reader);
+    }
+    PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+
+    // Histogram data size is small and does not require parallelization.
+    PIK_RETURN_IF_ERROR(DecodeHistograms(reader, kNumContexts, 256,
+                                         &group_code, &group_context_map));
+    PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+    coeff_order = group_coeff_order;
+    code = &group_code;
+    context_map = &group_context_map;
+  } else if (pass_dec_cache->coeff_order.empty()) {
+    return PIK_FAILURE("Missing pass entropy code");
   }
-  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
-  ANSCode code;
-  std::vector<uint8_t> context_map;
-  // Histogram data size is small and does not require parallelization.
-  PIK_RETURN_IF_ERROR(
-      DecodeHistograms(reader, kNumContexts, 256, &code, &context_map));
-  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
-
-  ANSSymbolReader ac_strategy_and_quant_field_decoder(&code);
-  ANSSymbolReader strategy_decoder(&code);
+  ANSSymbolReader ac_strategy_and_quant_field_decoder(code);
+  ANSSymbolReader strategy_decoder(code);
   if (!DecodeAcStrategy(reader, &ac_strategy_and_quant_field_decoder,
-                        context_map, group_acs_qf_rect,
+                        *context_map, group_acs_qf_rect,
                         &pass_dec_cache->ac_strategy,
                         handler->HintAcStrategy())) {
     return PIK_FAILURE("Failed to decode AcStrategy.");
   }
 
   if (!DecodeQuantField(
-          reader, &ac_strategy_and_quant_field_decoder, context_map,
+          reader, &ac_strategy_and_quant_field_decoder, *context_map,
           group_acs_qf_rect, pass_dec_cache->ac_strategy,
           &pass_dec_cache->raw_quant_field, handler->HintQuantField())) {
     return PIK_FAILURE("Failed to decode QuantField.");
@@ -754,9 +812,12 @@ bool DecodeCoefficientsAndDequantize(
   Dequant dequant;
   dequant.Init(cmap, quantizer);
   dec_cache->ac = Image3F(xsize_blocks * block_size, ysize_blocks);
+  const Target target = TargetBitfield().Best();
 
-  ANSSymbolReader ac_decoder(&code);
-  for (size_t task = 0; task < num_tiles; ++task) {
+  // Decodes and dequantizes the tile with index `task` (in raster order).
+  const auto decode_tile = [&](const size_t task, BitReader* tile_reader,
+                               ANSSymbolReader* ac_decoder,
+                               DecoderBuffers* tmp) -> bool {
     const size_t tile_x = task % xsize_tiles;
     const size_t tile_y = task / xsize_tiles;
     const Rect rect(tile_x * kTileDimInBlocks, tile_y * kTileDimInBlocks,
@@ -764,35 +825,105 @@ bool DecodeCoefficientsAndDequantize(
                     ysize_blocks);
     const Rect quantized_rect(0, 0, rect.xsize(), rect.ysize());
 
-    if (!DecodeAC(context_map, coeff_order, reader, &ac_decoder,
-                  &tmp.quantized_ac, rect, &tmp.num_nzeroes)) {
+    if (!DecodeAC(*context_map, coeff_order, tile_reader, ac_decoder,
+                  &tmp->quantized_ac, rect, &tmp->num_nzeroes)) {
       return PIK_FAILURE("Failed to decode AC.");
     }
 
-    dequant.DoAC(quantized_rect, tmp.quantized_ac, rect, group_acs_qf_rect,
-                 cmap.ytox_map, cmap.ytob_map, dec_cache, pass_dec_cache);
+    Dispatch(target, dequant, quantized_rect, tmp->quantized_ac, rect,
+             group_acs_qf_rect, cmap.ytox_map, cmap.ytob_map, dec_cache,
+             pass_dec_cache);
+    return true;
+  };
+
+  if (!(header.extensions & GroupHeader::kTileTOC)) {
+    DecoderBuffers tmp;
+    tmp.InitOnce();
+    ANSSymbolReader ac_decoder(code, header.num_ac_ans_states);
+    for (size_t task = 0; task < num_tiles; ++task) {
+      PIK_RETURN_IF_ERROR(decode_tile(task, reader, &ac_decoder, &tmp));
+    }
+    if (!ac_decoder.CheckANSFinalState()) {
+      return PIK_FAILURE("ANS checksum failure.");
+    }
+    PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+    return true;
   }
-  if (!ac_decoder.CheckANSFinalState()) {
-    return PIK_FAILURE("ANS checksum failure.");
+
+  // Read tile TOC.
+  std::vector<size_t> tile_offsets;
+  tile_offsets.reserve(num_tiles + 1);
+  tile_offsets.push_back(0);
+  for (size_t task = 0; task < num_tiles; ++task) {
+    const uint32_t size = TileSizeCoder::Decode(reader);
+    tile_offsets.push_back(tile_offsets.back() + size);
   }
   PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
+  // The group reader ends at the group end, so tiles must not extend beyond
+  // it (into the next group) even if the stream is larger.
+  const size_t tile_codes_begin = reader->Position();
+  const size_t group_end = reader->TotalBytes();
+  if (tile_codes_begin > group_end ||
+      tile_offsets.back() > group_end - tile_codes_begin) {
+    return PIK_FAILURE("Tile code extends after group end");
+  }
+  // Pretend all tiles are read.
+  reader->SkipBits(tile_offsets.back() * kBitsPerByte);
+
+  std::vector<DecoderBuffers> tmp(NumThreads(pool));
+  std::atomic<int> num_errors{0};
+  const auto process_tile = [&](const int task, const int thread) {
+    BitReader tile_reader(
+        compressed.data(),
+        std::min(tile_codes_begin + tile_offsets[task + 1], group_end));
+    tile_reader.SkipBits((tile_codes_begin + tile_offsets[task]) *
+                         kBitsPerByte);
+    tmp[thread].InitOnce();
+    ANSSymbolReader ac_decoder(code, header.num_ac_ans_states);
+    if (!decode_tile(task, &tile_reader, &ac_decoder, &tmp[thread]) ||
+        !ac_decoder.CheckANSFinalState()) {
+      num_errors.fetch_add(1);
+    }
+  };
+  RunOnPool(pool, 0, num_tiles, process_tile, "DecodeAcTiles");
+  if (num_errors.load(std::memory_order_relaxed) != 0) {
+    return PIK_FAILURE("Failed to decode AC tiles.");
+  }
   return true;
 }
 
+Status DecodePassEntropyCode(BitReader* reader,
+                             PassDecCache* pass_dec_cache) {
+  PROFILER_FUNC;
+  constexpr size_t block_size = kBlockDim * kBlockDim;
+  pass_dec_cache->coeff_order.resize(kOrderContexts * block_size);
+  for (size_t c = 0; c < kOrderContexts; ++c) {
+    DecodeCoeffOrder(&pass_dec_cache->coeff_order[c * block_size], reader);
+  }
+  PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
+
+  PIK_RETURN_IF_ERROR(DecodeHistograms(reader, kNumContexts, 256,
+                                       &pass_dec_cache->code,
+                                       &pass_dec_cache->context_map));
+  return reader->JumpToByteBoundary();
+}
+
 bool DecodeFromBitstream(const PassHeader& pass_header,
                          const GroupHeader& header,
-                         const PaddedBytes& compressed, BitReader* reader,
+                         const Span<const uint8_t> compressed,
+                         BitReader* reader,
                          const Rect& group_rect, MultipassHandler* handler,
                          const size_t xsize_blocks, const size_t ysize_blocks,
                          const ColorCorrelationMap& cmap,
                          NoiseParams* noise_params, const Quantizer& quantizer,
-                         DecCache* dec_cache, PassDecCache* pass_dec_cache) {
+                         DecCache* dec_cache, PassDecCache* pass_dec_cache,
+                         ThreadPool* pool) {
   PIK_RETURN_IF_ERROR(DecodeNoise(reader, noise_params));
 
   return DecodeCoefficientsAndDequantize(
       pass_header, header, group_rect, handler, xsize_blocks, ysize_blocks,
-      compressed, reader, cmap, dec_cache, pass_dec_cache, quantizer);
+      compressed, reader, cmap, dec_cache, pass_dec_cache, quantizer, pool);
 }
 
 void DequantImageAC(const Quantizer& quantizer, const ColorCorrelationMap& cmap,
@@ -816,6 +947,7 @@ void DequantImageAC(const Quantizer& quantizer, const ColorCorrelationMap& cmap,
   Dequant dequant;
   dequant.Init(cmap, quantizer);
   dec_cache->ac = Image3F(xsize_blocks * block_size, ysize_blocks);
+  const Target target = TargetBitfield().Best();
 
   std::vector<DecoderBuffers> decoder_buf(NumThreads(pool));
 
@@ -839,40 +971,30 @@ void DequantImageAC(const Quantizer& quantizer, const ColorCorrelationMap& cmap,
                     kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
                     ysize_blocks);
 
-    dequant.DoAC(rect, quantized_ac, rect, block_group_rect, cmap.ytox_map,
-                 cmap.ytob_map, dec_cache, pass_dec_cache);
+    Dispatch(target, dequant, rect, quantized_ac, rect, block_group_rect,
+             cmap.ytox_map, cmap.ytob_map, dec_cache, pass_dec_cache);
   };
   RunOnPool(pool, 0, num_tiles, dequant_tile, "DequantImage");
 }
 
-static SIMD_ATTR void InverseIntegralTransform(
-    const size_t xsize_blocks, const size_t ysize_blocks,
-    const Image3F& ac_image, const AcStrategyImage& ac_strategy,
-    const Rect& acs_rect, Image3F* PIK_RESTRICT idct, const Rect& idct_rect) {
-  PROFILER_ZONE("IDCT");
-
-  constexpr size_t N = kBlockDim;
-  constexpr size_t block_size = N * N;
-  const size_t idct_stride = idct->PixelsPerRow();
+// Inverse DCT of the blocks of `ac_image` within `tile` (in block units),
+// called via Dispatch.
+struct InverseIntegralTransform {
+  template <class Target>
+  void operator()(const Rect& tile, const Image3F& ac_image,
+                  const AcStrategyImage& ac_strategy, const Rect& acs_rect,
+                  Image3F* PIK_RESTRICT idct, const Rect& idct_rect) const;
+};
 
-  for (int c = 0; c < 3; ++c) {
-    const size_t ac_per_row = ac_image.PixelsPerRow();
+}  // namespace pik
 
-    for (size_t by = 0; by < ysize_blocks; ++by) {
-      const float* PIK_RESTRICT ac_row = ac_image.ConstPlaneRow(c, by);
-      const AcStrategyRow& acs_row = ac_strategy.ConstRow(acs_rect, by);
-      float* PIK_RESTRICT idct_row = idct_rect.PlaneRow(idct, c, by * N);
+// Must include "normally" so the build system understands the dependency.
+#include "compressed_image_target.cc"
 
-      for (size_t bx = 0; bx < xsize_blocks; ++bx) {
-        const float* PIK_RESTRICT ac_pos = ac_row + bx * block_size;
-        const AcStrategy& acs = acs_row[bx];
-        float* PIK_RESTRICT idct_pos = idct_row + bx * N;
+#define SIMD_ATTR_IMPL "compressed_image_target.cc"
+#include "simd/foreach_target.h"
 
-        acs.TransformToPixels(ac_pos, ac_per_row, idct_pos, idct_stride);
-      }
-    }
-  }
-}
+namespace pik {
 
 void ReconOpsinImage(const PassHeader& pass_header, const GroupHeader& header,
                      const Quantizer& quantizer, const Rect& block_group_rect,
@@ -979,63 +1101,62 @@ void ReconOpsinImage(const PassHeader& pass_header, const GroupHeader& header,
     }
   }
 
-  // tile_stage is used to make calculation dispatching simple; each pixel
-  // corresponds to tile. Each bit corresponds to stage:
-  // * 0-th bit for calculation or lf2x2 / pred2x2 & initial LF AC update;
-  ImageB tile_stage(xsize_tiles + 1, ysize_tiles + 1);
-
-  for (size_t c = 0; c < dec_cache->ac.kNumPlanes; c++) {
-    PROFILER_ZONE("Reset tile stages");
-    // Reset tile stages.
-    for (size_t ty = 0; ty < ysize_tiles; ++ty) {
-      uint8_t* PIK_RESTRICT tile_stage_row = tile_stage.Row(ty);
-      memset(tile_stage_row, 0, xsize_tiles * sizeof(uint8_t));
-      tile_stage_row[xsize_tiles] = 255;
-    }
-    uint8_t* PIK_RESTRICT tile_stage_row = tile_stage.Row(ysize_tiles);
-    memset(tile_stage_row, 255, (xsize_tiles + 1) * sizeof(uint8_t));
-
-    const ImageF& llf_plane = llf.Plane(c);
-    ImageF* PIK_RESTRICT ac64_plane = ac64->MutablePlane(c);
-    ImageF* PIK_RESTRICT pred2x2_plane =
-        predict_hf ? pred2x2.MutablePlane(c) : nullptr;
-    ImageF* PIK_RESTRICT lf2x2_plane =
-        predict_lf ? lf2x2.MutablePlane(c) : nullptr;
-    for (size_t ty = 0; ty < ysize_tiles; ++ty) {
-      for (size_t tx = 0; tx < xsize_tiles; ++tx) {
+  PIK_ASSERT(idct_rect.xsize() == xsize_blocks * N);
+  PIK_ASSERT(idct_rect.ysize() == ysize_blocks * N);
+
+  // Each tile runs LF update, HF prediction and IDCT back to back, so that
+  // its coefficients stay in cache. The HF prediction of a tile also reads
+  // pred2x2 of its right/bottom neighbors, so their LF is updated first. Bit
+  // c of tile_stage is set once channel c of that tile has its LF updated;
+  // the extra row and column are never updated.
+  constexpr size_t kMaxTilesX = kGroupWidthInBlocks / kTileDimInBlocks;
+  constexpr size_t kMaxTilesY = kGroupHeightInBlocks / kTileDimInBlocks;
+  PIK_CHECK(xsize_tiles <= kMaxTilesX && ysize_tiles <= kMaxTilesY);
+  uint8_t tile_stage[kMaxTilesY + 1][kMaxTilesX + 1] = {};
+  for (size_t ty = 0; ty <= ysize_tiles; ++ty) {
+    tile_stage[ty][xsize_tiles] = 255;
+  }
+  for (size_t tx = 0; tx <= xsize_tiles; ++tx) {
+    tile_stage[ysize_tiles][tx] = 255;
+  }
+
+  const Target target = TargetBitfield().Best();
+  for (size_t ty = 0; ty < ysize_tiles; ++ty) {
+    for (size_t tx = 0; tx < xsize_tiles; ++tx) {
+      const Rect tile(tx * kTileDimInBlocks, ty * kTileDimInBlocks,
+                      kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
+                      ysize_blocks);
+      for (size_t c = 0; c < ac64->kNumPlanes; c++) {
+        const ImageF& llf_plane = llf.Plane(c);
+        ImageF* PIK_RESTRICT ac64_plane = ac64->MutablePlane(c);
+        ImageF* PIK_RESTRICT pred2x2_plane =
+            predict_hf ? pred2x2.MutablePlane(c) : nullptr;
+        ImageF* PIK_RESTRICT lf2x2_plane =
+            predict_lf ? lf2x2.MutablePlane(c) : nullptr;
         for (size_t lfty = ty; lfty < ty + 2; ++lfty) {
-          uint8_t* tile_stage_row = tile_stage.Row(lfty);
           for (size_t lftx = tx; lftx < tx + 2; ++lftx) {
-            if ((tile_stage_row[lftx] & 1) != 0) continue;
-            const Rect tile(lftx * kTileDimInBlocks, lfty * kTileDimInBlocks,
-                            kTileDimInBlocks, kTileDimInBlocks, xsize_blocks,
-                            ysize_blocks);
-            UpdateLfForDecoder(tile, predict_lf, predict_hf,
+            if ((tile_stage[lfty][lftx] & (1 << c)) != 0) continue;
+            const Rect lf_tile(lftx * kTileDimInBlocks,
+                               lfty * kTileDimInBlocks, kTileDimInBlocks,
+                               kTileDimInBlocks, xsize_blocks, ysize_blocks);
+            UpdateLfForDecoder(lf_tile, predict_lf, predict_hf,
                                pass_dec_cache->ac_strategy, block_group_rect,
                                llf_plane, ac64_plane, pred2x2_plane,
                                lf2x2_plane);
-            tile_stage_row[lftx] |= 1;
+            tile_stage[lfty][lftx] |= 1 << c;
           }
         }
         if (predict_hf) {
-          // TODO(user): invoke AddPredictions for (tx, ty) tile here.
+          AddPredictions(tile, *pred2x2_plane, pass_dec_cache->ac_strategy,
+                         block_group_rect, ac64_plane);
         }
       }
-    }
-  }
 
-  if (predict_hf) {
-    // TODO(user): make UpSample4x4BlurDCT tile-wise-able.
-    AddPredictions(pred2x2, pass_dec_cache->ac_strategy, block_group_rect,
-                   &dec_cache->ac);
+      Dispatch(target, InverseIntegralTransform(), tile, *ac64,
+               pass_dec_cache->ac_strategy, block_group_rect, idct, idct_rect);
+    }
   }
 
-  PIK_ASSERT(idct_rect.xsize() == xsize_blocks * N);
-  PIK_ASSERT(idct_rect.ysize() == ysize_blocks * N);
-  InverseIntegralTransform(xsize_blocks, ysize_blocks, dec_cache->ac,
-                           pass_dec_cache->ac_strategy, block_group_rect, idct,
-                           idct_rect);
-
   if (pik_info && pik_info->testing_aux.ac_prediction != nullptr) {
     PROFILER_ZONE("Subtract ac_prediction");
     Subtract(dec_cache->ac, *pik_info->testing_aux.ac_prediction,
@@ -1072,30 +1193,173 @@ Image3F DoAdaptiveReconstruction(Image3F&& idct, const PassHeader& pass_header,
       pass_dec_cache->ac_strategy, pass_header.epf_params, pool, ar_aux);
 }
 
-}  // namespace
+// Whether the pass adds noise that only depends on pixel coordinates.
+bool HasTileNoise(const PassHeader& pass_header) {
+  return (pass_header.flags & PassHeader::kNoise) &&
+         (pass_header.extensions & PassHeader::kTileNoise);
+}
 
-void FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
-                          const NoiseParams& noise_params,
-                          const Quantizer& quantizer, ThreadPool* pool,
-                          PassDecCache* pass_dec_cache,
-                          Image3F* PIK_RESTRICT linear, PikInfo* pik_info) {
-  idct = DoAdaptiveReconstruction(std::move(idct), pass_header, quantizer, pool,
-                                  pass_dec_cache, pik_info);
+// Adds the stages following the source: Gaborish and, if HasTileNoise, noise.
+// (x0, y0) is the position of the source within the image.
+TFNode* AddSmoothingAndNoise(TFNode* source, const PassHeader& pass_header,
+                             const size_t x0, const size_t y0,
+                             TFBuilder* builder) {
+  TFNode* smoothed = AddGaborish(source, pass_header.gaborish, builder);
+  if (!HasTileNoise(pass_header)) return smoothed;
+  return AddTileNoise(smoothed, DequantizeNoiseParams(pass_header.noise_params),
+                      x0, y0, builder);
+}
+
+// Same as ConvolveGaborish (and AddTileNoise) followed by OpsinToLinear, but
+// each tile is smoothed and converted while still in cache, without
+// materializing the smoothed image. Writes the valid pixels of "linear".
+TFGraphPtr MakeGaborishToLinear(const Image3F& opsin, const size_t x0,
+                                const size_t y0, const PassHeader& pass_header,
+                                ThreadPool* pool,
+                                Image3F* PIK_RESTRICT linear) {
+  TFBuilder builder;
+  TFNode* source = builder.AddSource("opsin", 3, TFType::kF32, TFWrap::kMirror);
+  builder.SetSource(source, &opsin);
+  TFNode* smoothed = AddSmoothingAndNoise(source, pass_header, x0, y0, &builder);
+  TFNode* sink = AddOpsinToLinear(smoothed, &builder);
+  builder.SetSink(sink, linear);
+
+  const ImageSize sink_size = ImageSize::Make(linear->xsize(), linear->ysize());
+  const ImageSize tile_size = ImageSize::Make(kTileDim, kTileDim);
+  return builder.Finalize(sink_size, tile_size, pool);
+}
 
-  idct = ConvolveGaborish(std::move(idct), pass_header.gaborish, pool);
+void GaborishToLinear(const Image3F& opsin, const size_t x0, const size_t y0,
+                      const PassHeader& pass_header, ThreadPool* pool,
+                      Image3F* PIK_RESTRICT linear) {
+  PROFILER_FUNC;
+  MakeGaborishToLinear(opsin, x0, y0, pass_header, pool, linear)->Run();
+}
+
+// As above, but writes sRGB samples to "out" (see AddOpsinToInterleaved).
+TFGraphPtr MakeGaborishToInterleaved(const Image3F& opsin, const size_t x0,
+                                     const size_t y0,
+                                     const PassHeader& pass_header,
+                                     ThreadPool* pool,
+                                     const InterleavedOutput& out) {
+  const bool grayscale = pass_header.flags & PassHeader::kGrayscaleOpt;
+  TFBuilder builder;
+  TFNode* source = builder.AddSource("opsin", 3, TFType::kF32, TFWrap::kMirror);
+  builder.SetSource(source, &opsin);
+  TFNode* smoothed = AddSmoothingAndNoise(source, pass_header, x0, y0, &builder);
+  AddOpsinToInterleaved(smoothed, grayscale, out, &builder);
+
+  // Same size as GaborishToLinear's sink so that the mirroring is identical.
+  const ImageSize sink_size = ImageSize::Make(opsin.xsize(), opsin.ysize());
+  const ImageSize tile_size = ImageSize::Make(kTileDim, kTileDim);
+  return builder.Finalize(sink_size, tile_size, pool);
+}
 
-  if (pass_header.flags & PassHeader::kNoise) {
+void GaborishToInterleaved(const Image3F& opsin, const size_t x0,
+                           const size_t y0, const PassHeader& pass_header,
+                           ThreadPool* pool, const InterleavedOutput& out) {
+  PROFILER_FUNC;
+  MakeGaborishToInterleaved(opsin, x0, y0, pass_header, pool, out)->Run();
+}
+
+// Whether the stages after adaptive reconstruction are the fused Gaborish, tile
+// noise and color conversion, which only read pixels near each tile.
+bool IsTileLocalAfterReconstruction(const PassHeader& pass_header) {
+  return pass_header.gaborish != GaborishStrength::kOff &&
+         (!(pass_header.flags & PassHeader::kNoise) ||
+          HasTileNoise(pass_header)) &&
+         pass_header.resampling_factor2 == 2;
+}
+
+// Whether FinalizePassDecoding only consists of the tile-local stages above.
+bool IsTileLocalFinalization(const PassHeader& pass_header) {
+  return !pass_header.have_adaptive_reconstruction &&
+         IsTileLocalAfterReconstruction(pass_header);
+}
+
+// Runs the post processing that precedes color conversion. Returns true in the
+// common case where no full-image stages follow Gaborish, which the caller
+// then fuses with the color conversion; otherwise, "idct" is ready for it.
+bool PostProcessOpsin(const PassHeader& pass_header,
+                      const NoiseParams& noise_params,
+                      const Quantizer& quantizer, ThreadPool* pool,
+                      PassDecCache* pass_dec_cache, const size_t x0,
+                      const size_t y0, Image3F* PIK_RESTRICT idct,
+                      PikInfo* pik_info) {
+  *idct = DoAdaptiveReconstruction(std::move(*idct), pass_header, quantizer,
+                                   pool, pass_dec_cache, pik_info);
+
+  // (AddNoise is sequential and UpsampleImage changes the size.)
+  if (IsTileLocalAfterReconstruction(pass_header)) return true;
+
+  *idct = ConvolveGaborish(std::move(*idct), pass_header.gaborish, pool);
+
+  if (HasTileNoise(pass_header)) {
+    PROFILER_ZONE("AddTileNoise");
+    AddTileNoise(DequantizeNoiseParams(pass_header.noise_params), x0, y0, pool,
+                 idct);
+  } else if (pass_header.flags & PassHeader::kNoise) {
     PROFILER_ZONE("AddNoise");
-    AddNoise(noise_params, &idct);
+    AddNoise(noise_params, idct);
   }
 
   if (pass_header.resampling_factor2 != 2) {
     PROFILER_ZONE("UpsampleImage");
-    idct = UpsampleImage(idct, idct.xsize(), idct.ysize(),
-                         pass_header.resampling_factor2);
+    *idct = UpsampleImage(*idct, idct->xsize(), idct->ysize(),
+                          pass_header.resampling_factor2);
+  }
+  return false;
+}
+
+}  // namespace
+
+void FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
+                          const NoiseParams& noise_params,
+                          const Quantizer& quantizer, ThreadPool* pool,
+                          PassDecCache* pass_dec_cache, const size_t x0,
+                          const size_t y0, Image3F* PIK_RESTRICT linear,
+                          PikInfo* pik_info) {
+  if (PostProcessOpsin(pass_header, noise_params, quantizer, pool,
+                       pass_dec_cache, x0, y0, &idct, pik_info)) {
+    GaborishToLinear(idct, x0, y0, pass_header, pool, linear);
+    return;
   }
 
   OpsinToLinear(idct, pool, linear);
 }
 
+void FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
+                          const NoiseParams& noise_params,
+                          const Quantizer& quantizer, ThreadPool* pool,
+                          PassDecCache* pass_dec_cache, const size_t x0,
+                          const size_t y0, const InterleavedOutput& out,
+                          PikInfo* pik_info) {
+  if (PostProcessOpsin(pass_header, noise_params, quantizer, pool,
+                       pass_dec_cache, x0, y0, &idct, pik_info)) {
+    GaborishToInterleaved(idct, x0, y0, pass_header, pool, out);
+    return;
+  }
+
+  const bool grayscale = pass_header.flags & PassHeader::kGrayscaleOpt;
+  OpsinToInterleaved(idct, grayscale, pool, out);
+}
+
+TFGraphPtr MakeFinalizePassGraph(const Image3F& idct,
+                                 const PassHeader& pass_header,
+                                 ThreadPool* pool,
+                                 Image3F* PIK_RESTRICT linear) {
+  if (!IsTileLocalFinalization(pass_header)) return nullptr;
+  return MakeGaborishToLinear(idct, /*x0=*/0, /*y0=*/0, pass_header, pool,
+                              linear);
+}
+
+TFGraphPtr MakeFinalizePassGraph(const Image3F& idct,
+                                 const PassHeader& pass_header,
+                                 ThreadPool* pool,
+                                 const InterleavedOutput& out) {
+  if (!IsTileLocalFinalization(pass_header)) return nullptr;
+  return MakeGaborishToInterleaved(idct, /*x0=*/0, /*y0=*/0, pass_header, pool,
+                                   out);
+}
+
 }  // namespace pik
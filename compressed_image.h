@@ -9,6 +9,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include "adaptive_reconstruction.h"
 #include "bit_reader.h"
@@ -16,14 +18,19 @@
 #include "common.h"
 #include "compressed_image_fwd.h"
 #include "data_parallel.h"
+#include "entropy_coder.h"
 #include "headers.h"
 #include "image.h"
 #include "multipass_handler.h"
 #include "noise.h"
+#include "opsin_inverse.h"
 #include "padded_bytes.h"
 #include "pik_info.h"
 #include "pik_params.h"
 #include "quantizer.h"
+#include "span.h"
+#include "tile_flow.h"
+#include "write_bits.h"
 
 // Methods to encode (decode) an image into (from) the bit stream:
 // initialization of per-pass information and per-group information, actual
@@ -34,9 +41,20 @@ namespace pik {
 
 struct GradientMap;
 
-// Initialize per-pass information.
+// Returns the (non-quantized) coefficients of `opsin_full` for the given
+// `ac_strategy`, in the layout of PassEncCache::coeffs. `opsin_dct` is either
+// empty or TransposedScaledDCT(opsin_full); in the latter case, blocks using an
+// 8x8 DCT are taken from it rather than transformed again, and its storage is
+// reused for the result.
+SIMD_ATTR Image3F TransformToCoefficients(const Image3F& opsin_full,
+                                          const AcStrategyImage& ac_strategy,
+                                          Image3F&& opsin_dct,
+                                          ThreadPool* pool);
+
+// Initialize per-pass information. `coeffs` = TransformToCoefficients for
+// `ac_strategy`.
 SIMD_ATTR void InitializePassEncCache(const PassHeader& pass_header,
-                                      const Image3F& opsin_full,
+                                      Image3F&& coeffs,
                                       const AcStrategyImage& ac_strategy,
                                       const Quantizer& quantizer,
                                       const ColorCorrelationMap& cmap,
@@ -58,25 +76,68 @@ SIMD_ATTR void ComputeCoefficients(const Quantizer& quantizer,
                                    MultipassManager* manager,
                                    const PikInfo* aux_out = nullptr);
 
-// Encodes AC quantized coefficients from the given encoder cache.
-PaddedBytes EncodeToBitstream(const EncCache& cache, const Rect& rect,
-                              const Quantizer& quantizer,
-                              const NoiseParams& noise_params,
-                              const ColorCorrelationMap& cmap, bool fast_mode,
-                              MultipassHandler* handler,
-                              PikInfo* info = nullptr);
+// Encodes AC quantized coefficients from the given encoder cache to the
+// byte-aligned `writer`. The extensions of `header` select the layout of the
+// AC stream.
+void EncodeToBitstream(const EncCache& cache, const Rect& rect,
+                       const Quantizer& quantizer,
+                       const NoiseParams& noise_params,
+                       const ColorCorrelationMap& cmap, bool fast_mode,
+                       const GroupHeader& header, MultipassHandler* handler,
+                       BitWriter* writer, PikInfo* info = nullptr);
+
+// Coefficient orders and clustered histograms shared by all groups of a pass
+// (PassHeader::kSharedEntropyCode).
+struct PassEntropyCode {
+  int32_t order[kOrderContexts * kBlockDim * kBlockDim];
+  std::vector<ANSEncodingData> codes;
+  std::vector<uint8_t> context_map;
+};
+
+// Entropy coder input of one group.
+struct GroupTokens {
+  // AC coefficients, then AC strategy and quantization field.
+  std::vector<std::vector<Token>> all_tokens;
+  // Index of the first AC token of each tile, plus the total number.
+  std::vector<size_t> tile_token_begin;
+};
+
+// The steps of EncodeToBitstream for kSharedEntropyCode: computes the order
+// from the quantized coefficients of all groups of the pass, tokenizes each
+// group (in parallel), builds the histograms from the tokens of all groups
+// and writes the encoded orders and histograms (which precede the group TOC),
+// and finally encodes each group with them.
+void ComputePassCoeffOrder(const std::vector<EncCache>& caches,
+                           ThreadPool* pool, PassEntropyCode* code);
+GroupTokens TokenizeGroup(const EncCache& cache, const Rect& rect,
+                          const int32_t* PIK_RESTRICT order,
+                          MultipassHandler* handler);
+void EncodePassEntropyCode(std::vector<GroupTokens>* group_tokens,
+                           bool fast_mode, PassEntropyCode* code,
+                           BitWriter* writer, PikInfo* info);
+void EncodeToBitstream(const GroupTokens& tokens,
+                       const NoiseParams& noise_params,
+                       const PassEntropyCode& code, const GroupHeader& header,
+                       BitWriter* writer, PikInfo* info = nullptr);
+
+// Decodes the output of EncodePassEntropyCode into `pass_dec_cache`, which
+// DecodeFromBitstream then uses for all groups.
+Status DecodePassEntropyCode(BitReader* reader, PassDecCache* pass_dec_cache);
 
 // Decodes AC coefficients from the bit stream, populating the AC
 // fields of the decoder cache, and the corresponding rectangles in the global
 // information (quant_field and ac_strategy) in the per-pass decoder cache.
+// If the group has a tile TOC, its tiles are decoded in parallel on `pool`.
 bool DecodeFromBitstream(const PassHeader& pass_header,
                          const GroupHeader& header,
-                         const PaddedBytes& compressed, BitReader* reader,
+                         const Span<const uint8_t> compressed,
+                         BitReader* reader,
                          const Rect& group_rect, MultipassHandler* handler,
                          const size_t xsize_blocks, const size_t ysize_blocks,
                          const ColorCorrelationMap& cmap,
                          NoiseParams* noise_params, const Quantizer& quantizer,
-                         DecCache* cache, PassDecCache* pass_dec_cache);
+                         DecCache* cache, PassDecCache* pass_dec_cache,
+                         ThreadPool* pool = nullptr);
 
 // Dequantizes the provided quantized_ac image into the decoder cache. Used in
 // the encoder loop in adaptive_quantization.cc
@@ -95,14 +156,47 @@ void ReconOpsinImage(const PassHeader& pass_header, const GroupHeader& header,
 
 // Finalizes the decoding of a pass by running per-pass post processing:
 // smoothing and adaptive reconstruction. Writes linear sRGB to `linear`.
+// `idct` is the region of the padded opsin image starting at (x0, y0), which
+// determines the PassHeader::kTileNoise added to it.
 // TODO(janwas): move NoiseParams into PassHeader.
 void FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
                           const NoiseParams& noise_params,
                           const Quantizer& quantizer, ThreadPool* pool,
-                          PassDecCache* pass_dec_cache,
+                          PassDecCache* pass_dec_cache, size_t x0, size_t y0,
                           Image3F* PIK_RESTRICT linear,
                           PikInfo* pik_info = nullptr);
 
+// As above, but fuses the color conversion with quantization to sRGB samples,
+// which are written to `out` (including the kGrayscaleOpt conversion).
+void FinalizePassDecoding(Image3F&& idct, const PassHeader& pass_header,
+                          const NoiseParams& noise_params,
+                          const Quantizer& quantizer, ThreadPool* pool,
+                          PassDecCache* pass_dec_cache, size_t x0, size_t y0,
+                          const InterleavedOutput& out,
+                          PikInfo* pik_info = nullptr);
+
+// Pixels beyond a tile of MakeFinalizePassGraph that it may read from `idct`:
+// the Gaborish radius, rounded up to whole vectors.
+constexpr size_t kFinalizeTileBorder = 16;
+
+// Returns a graph whose tiles (see TFGraph::RunTile) together are equivalent
+// to FinalizePassDecoding, or nullptr if the post processing includes
+// whole-image stages (adaptive reconstruction, resampling, or noise without
+// PassHeader::kTileNoise). Allows finalizing each tile as soon as the groups
+// it reads have been decoded. Note that the encoder enables adaptive
+// reconstruction by default (kMinButteraugliForAdaptiveReconstruction), so
+// most passes are still finalized as a whole: even with PassHeader::kEpfRange,
+// which makes its edge-preserving filter local, there is no tile stage for it.
+// `idct` and the output must outlive the graph.
+TFGraphPtr MakeFinalizePassGraph(const Image3F& idct,
+                                 const PassHeader& pass_header,
+                                 ThreadPool* pool,
+                                 Image3F* PIK_RESTRICT linear);
+TFGraphPtr MakeFinalizePassGraph(const Image3F& idct,
+                                 const PassHeader& pass_header,
+                                 ThreadPool* pool,
+                                 const InterleavedOutput& out);
+
 }  // namespace pik
 
 #endif  // COMPRESSED_IMAGE_H_
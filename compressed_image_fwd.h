@@ -8,6 +8,7 @@
 #define COMPRESSED_IMAGE_FWD_H_
 
 #include "ac_strategy.h"
+#include "ans_decode.h"
 #include "common.h"
 #include "data_parallel.h"
 #include "gauss_blur.h"
@@ -110,6 +111,12 @@ struct PassDecCache {
   ImageI raw_quant_field;
 
   AcStrategyImage ac_strategy;
+
+  // Only if PassHeader::kSharedEntropyCode: coefficient orders and histograms
+  // used by all groups (see DecodePassEntropyCode).
+  std::vector<int32_t> coeff_order;
+  ANSCode code;
+  std::vector<uint8_t> context_map;
 };
 
 template <size_t N>
@@ -0,0 +1,184 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+// Provides SIMD_NAMESPACE::AdjustQuantBias for the current target.
+#include "quant_bias.h"
+
+namespace pik {
+
+template <>
+SIMD_ATTR void Dequant::operator()<SIMD_TARGET>(
+    const Rect& rect16, const Image3S& img_ac16, const Rect& rect,
+    const Rect& block_group_rect, const ImageI& img_ytox,
+    const ImageI& img_ytob, DecCache* PIK_RESTRICT dec_cache,
+    PassDecCache* PIK_RESTRICT pass_dec_cache) const {
+  PROFILER_FUNC;
+  PIK_ASSERT(SameSize(rect, rect16));
+  constexpr size_t N = kBlockDim;
+  constexpr size_t block_size = N * N;
+  const size_t xsize = rect.xsize();  // [blocks]
+  const size_t ysize = rect.ysize();
+  PIK_ASSERT(img_ac16.xsize() % block_size == 0);
+  PIK_ASSERT(xsize <= img_ac16.xsize() / block_size);
+  PIK_ASSERT(ysize <= img_ac16.ysize());
+  PIK_ASSERT(SameSize(img_ytox, img_ytob));
+
+  using D = SIMD_FULL(float);
+  constexpr D d;
+  constexpr SIMD_PART(int16_t, D::N) d16;
+  constexpr SIMD_PART(int32_t, D::N) d32;
+
+  // Rect representing the current tile inside the current group, in an image
+  // in which each block is 1x1.
+  const Rect block_tile_group_rect(block_group_rect.x0() + rect.x0(),
+                                   block_group_rect.y0() + rect.y0(),
+                                   rect.xsize(), rect.ysize());
+
+  const size_t x0_cmap = rect.x0() / kColorTileDimInBlocks;
+  const size_t y0_cmap = rect.y0() / kColorTileDimInBlocks;
+  const size_t x0_dct = rect.x0() * block_size;
+  const size_t x0_dct16 = rect16.x0() * block_size;
+
+  for (size_t by = 0; by < ysize; ++by) {
+    const int16_t* PIK_RESTRICT row_y16 =
+        img_ac16.PlaneRow(1, by + rect16.y0()) + x0_dct16;
+    const int* PIK_RESTRICT row_quant_field =
+        block_tile_group_rect.ConstRow(pass_dec_cache->raw_quant_field, by);
+    float* PIK_RESTRICT row_y =
+        dec_cache->ac.PlaneRow(1, rect.y0() + by) + x0_dct;
+    AcStrategyRow ac_strategy_row =
+        pass_dec_cache->ac_strategy.ConstRow(block_tile_group_rect, by);
+    for (size_t bx = 0; bx < xsize; ++bx) {
+      const auto scaled_dequant =
+          set1(d, SafeDiv(inv_global_scale_, row_quant_field[bx]));
+
+      size_t kind = ac_strategy_row[bx].GetQuantKind();
+      for (size_t k = 0; k < block_size; k += d.N) {
+        const size_t x = bx * block_size + k;
+
+        // Y-channel quantization matrix for the given kind.
+        const auto dequant = load(
+            d,
+            &dequant_matrices_[DequantMatrixOffset(0, kind, 1) * block_size] +
+                k);
+        const auto y_mul = dequant * scaled_dequant;
+
+        const auto quantized_y16 = load(d16, row_y16 + x);
+        const auto quantized_y =
+            convert_to(d, convert_to(d32, quantized_y16));
+
+        const auto dequant_y =
+            SIMD_NAMESPACE::AdjustQuantBias<1>(quantized_y) * y_mul;
+        store(dequant_y, d, row_y + x);
+      }
+    }
+  }
+
+  for (int c = 0; c < 3; c += 2) {  // === for c in {0, 2}
+    const ImageI& img_cmap = (c == 0) ? img_ytox : img_ytob;
+    for (size_t by = 0; by < ysize; ++by) {
+      const size_t ty = by / kColorTileDimInBlocks;
+      const int16_t* PIK_RESTRICT row_xb16 =
+          img_ac16.PlaneRow(c, by + rect16.y0()) + x0_dct16;
+      const int* PIK_RESTRICT row_quant_field =
+          block_tile_group_rect.ConstRow(pass_dec_cache->raw_quant_field, by);
+      const int* PIK_RESTRICT row_cmap =
+          img_cmap.ConstRow(y0_cmap + ty) + x0_cmap;
+      const float* PIK_RESTRICT row_y =
+          dec_cache->ac.ConstPlaneRow(1, rect.y0() + by) + x0_dct;
+      float* PIK_RESTRICT row_xb =
+          dec_cache->ac.PlaneRow(c, rect.y0() + by) + x0_dct;
+
+      AcStrategyRow ac_strategy_row =
+          pass_dec_cache->ac_strategy.ConstRow(block_tile_group_rect, by);
+      for (size_t bx = 0; bx < xsize; ++bx) {
+        const auto scaled_dequant =
+            set1(d, SafeDiv(inv_global_scale_, row_quant_field[bx]));
+
+        size_t kind = ac_strategy_row[bx].GetQuantKind();
+        const float* dequant_matrix =
+            &dequant_matrices_[DequantMatrixOffset(0, kind, c) * block_size];
+        const size_t tx = bx / kColorTileDimInBlocks;
+        const int32_t cmap = row_cmap[tx];
+
+        if (c == 0) {
+          const auto y_mul = set1(d, ColorCorrelationMap::YtoX(1.0f, cmap));
+
+          for (size_t k = 0; k < block_size; k += d.N) {
+            const size_t x = bx * block_size + k;
+
+            const auto xb_mul = load(d, dequant_matrix + k) * scaled_dequant;
+
+            const auto quantized_xb16 = load(d16, row_xb16 + x);
+            const auto quantized_xb =
+                convert_to(d, convert_to(d32, quantized_xb16));
+
+            const auto out_y = load(d, row_y + x);
+
+            const auto dequant_xb =
+                SIMD_NAMESPACE::AdjustQuantBias<0>(quantized_xb) * xb_mul;
+            store(mul_add(y_mul, out_y, dequant_xb), d, row_xb + x);
+          }
+        } else {
+          const auto y_mul = set1(d, ColorCorrelationMap::YtoB(1.0f, cmap));
+
+          for (size_t k = 0; k < block_size; k += d.N) {
+            const size_t x = bx * block_size + k;
+
+            const auto xb_mul = load(d, dequant_matrix + k) * scaled_dequant;
+
+            const auto quantized_xb16 = load(d16, row_xb16 + x);
+            const auto quantized_xb =
+                convert_to(d, convert_to(d32, quantized_xb16));
+
+            const auto out_y = load(d, row_y + x);
+
+            const auto dequant_xb =
+                SIMD_NAMESPACE::AdjustQuantBias<2>(quantized_xb) * xb_mul;
+            store(mul_add(y_mul, out_y, dequant_xb), d, row_xb + x);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <>
+SIMD_ATTR void InverseIntegralTransform::operator()<SIMD_TARGET>(
+    const Rect& tile, const Image3F& ac_image,
+    const AcStrategyImage& ac_strategy, const Rect& acs_rect,
+    Image3F* PIK_RESTRICT idct, const Rect& idct_rect) const {
+  PROFILER_ZONE("IDCT");
+
+  constexpr size_t N = kBlockDim;
+  constexpr size_t block_size = N * N;
+  const size_t idct_stride = idct->PixelsPerRow();
+  const size_t ac_per_row = ac_image.PixelsPerRow();
+
+  for (int c = 0; c < 3; ++c) {
+    for (size_t by = tile.y0(); by < tile.y0() + tile.ysize(); ++by) {
+      const float* PIK_RESTRICT ac_row = ac_image.ConstPlaneRow(c, by);
+      const AcStrategyRow& acs_row = ac_strategy.ConstRow(acs_rect, by);
+      float* PIK_RESTRICT idct_row = idct_rect.PlaneRow(idct, c, by * N);
+
+      for (size_t bx = tile.x0(); bx < tile.x0() + tile.xsize(); ++bx) {
+        const float* PIK_RESTRICT ac_pos = ac_row + bx * block_size;
+        const AcStrategy& acs = acs_row[bx];
+        float* PIK_RESTRICT idct_pos = idct_row + bx * N;
+
+        acs.TransformToPixels<SIMD_TARGET>(ac_pos, ac_per_row, idct_pos,
+                                           idct_stride);
+      }
+    }
+  }
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
@@ -13,9 +13,6 @@
 #include <stdint.h>
 #include <cassert>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
-
 #include "compiler_specific.h"
 #include "data_parallel.h"
 #include "image.h"
@@ -356,6 +353,42 @@ class SymmetricConvolution {
 
 }  // namespace slow
 
+// Requires kRadius valid (mirrored or neighbor) columns on either side of
+// [0, xsize). It is also safe to load entire vectors. This behavior is
+// required by TFNode with Borders(>0). In other cases, this assumption requires
+// ConvolveT to PadImage, so LeftRightInvalid would be more efficient.
+struct LeftRightValid {};
+
+// No valid values outside [0, xsize), but the strategy may still safely load
+// the preceding vector, and/or round xsize up to the vector lane count. This
+// avoids needing PadImage.
+struct LeftRightInvalid {};
+
+// LeftRightInvalid requires xsize >= SIMD_FULL(float)::N + kConvolveMaxRadius.
+static constexpr size_t kConvolveMaxRadius = 3;
+
+// Avoids PadImage, but requires a strategy that supports LeftRightInvalid.
+struct BorderNeverUsed {};
+
+// Slow: Convolve calls PadImage and requires bounds checks.
+struct BorderNeedsInit {};
+
+}  // namespace pik
+
+#endif  // CONVOLVE_H_
+
+// The SIMD implementation is compiled for every target if included from a
+// foreach_target.h file, see the guard protocol described there.
+#if defined(CONVOLVE_TARGET_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef CONVOLVE_TARGET_H_
+#undef CONVOLVE_TARGET_H_
+#else
+#define CONVOLVE_TARGET_H_
+#endif
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+
 // Synthesizes left/right neighbors from a vector of center pixels.
 class Neighbors {
   using D = SIMD_FULL(float);
@@ -365,11 +398,16 @@ class Neighbors {
  public:
   // Returns l[i] == c[i - 1].
   static SIMD_ATTR PIK_INLINE V L1(const V c, const V p) {
-    // For AVX-512: try permutex2var_ps.
 #if SIMD_TARGET_VALUE == SIMD_AVX2
     // c = PONM'LKJI, p = Hxxx'xxxx
     const V L_H = concat_lo_hi(c, p);
     return combine_shift_right_bytes<12>(c, L_H);  // ONML'KJIH
+#elif SIMD_TARGET_VALUE == SIMD_AVX512
+    // Index 31 is the uppermost lane of p.
+    SIMD_ALIGN constexpr int32_t lanes[16] = {31, 0, 1, 2,  3,  4,  5,  6,
+                                              7,  8, 9, 10, 11, 12, 13, 14};
+    const auto indices = load(SIMD_FULL(int32_t)(), lanes);
+    return V(_mm512_permutex2var_ps(c.raw, indices.raw, p.raw));
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     return p;
 #else
@@ -385,6 +423,10 @@ class Neighbors {
     const auto indices = set_table_indices(d, lanes);
     // c = PONM'LKJI
     return table_lookup_lanes(c, indices);  // ONML'KJII
+#elif SIMD_TARGET_VALUE == SIMD_AVX512
+    SIMD_ALIGN constexpr int lanes[16] = {0, 0, 1, 2,  3,  4,  5,  6,
+                                          7, 8, 9, 10, 11, 12, 13, 14};
+    return table_lookup_lanes(c, set_table_indices(d, lanes));
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     return c;
 #else
@@ -400,6 +442,10 @@ class Neighbors {
     const auto indices = set_table_indices(d, lanes);
     // c = PONM'LKJI
     return table_lookup_lanes(c, indices);  // NMLK'JIIJ
+#elif SIMD_TARGET_VALUE == SIMD_AVX512
+    SIMD_ALIGN constexpr int lanes[16] = {1, 0, 0, 1,  2,  3,  4,  5,
+                                          6, 7, 8, 9, 10, 11, 12, 13};
+    return table_lookup_lanes(c, set_table_indices(d, lanes));
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     return setzero(d);  // unsupported, avoid calling this.
 #else
@@ -414,6 +460,12 @@ class Neighbors {
     // c = PONM'LKJI, n = xxxx'xxxQ
     const V Q_M = concat_lo_hi(n, c);             // Right-aligned (lower lane)
     return combine_shift_right_bytes<4>(Q_M, c);  // QPON'MLKJ
+#elif SIMD_TARGET_VALUE == SIMD_AVX512
+    // Index 16 is the lowest lane of n.
+    SIMD_ALIGN constexpr int32_t lanes[16] = {1, 2,  3,  4,  5,  6,  7,  8,
+                                              9, 10, 11, 12, 13, 14, 15, 16};
+    const auto indices = load(SIMD_FULL(int32_t)(), lanes);
+    return V(_mm512_permutex2var_ps(c.raw, indices.raw, n.raw));
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     return n;
 #else
@@ -429,6 +481,10 @@ class Neighbors {
     const auto indices = load(SIMD_FULL(uint32_t)(), lanes);
     // c = PONM'LKJI
     return V(_mm256_permutevar8x32_ps(c.raw, indices.raw));  // PPON'MLKJ
+#elif SIMD_TARGET_VALUE == SIMD_AVX512
+    SIMD_ALIGN constexpr int lanes[16] = {1, 2,  3,  4,  5,  6,  7,  8,
+                                          9, 10, 11, 12, 13, 14, 15, 15};
+    return table_lookup_lanes(c, set_table_indices(d, lanes));
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     return c;
 #else
@@ -439,20 +495,6 @@ class Neighbors {
   }
 };
 
-// Requires kRadius valid (mirrored or neighbor) columns on either side of
-// [0, xsize). It is also safe to load entire vectors. This behavior is
-// required by TFNode with Borders(>0). In other cases, this assumption requires
-// ConvolveT to PadImage, so LeftRightInvalid would be more efficient.
-struct LeftRightValid {};
-
-// No valid values outside [0, xsize), but the strategy may still safely load
-// the preceding vector, and/or round xsize up to the vector lane count. This
-// avoids needing PadImage.
-struct LeftRightInvalid {};
-
-// LeftRightInvalid requires xsize >= SIMD_FULL(float)::N + kConvolveMaxRadius.
-static constexpr size_t kConvolveMaxRadius = 3;
-
 // For use by set_table_indices.
 static inline const int32_t* MirrorLanes(const size_t mod) {
   SIMD_FULL(float) d;
@@ -477,6 +519,28 @@ static inline const int32_t* MirrorLanes(const size_t mod) {
       1, 2, 3, 4, 5, 6, 7, 7,  // 7
   };
   return idx_lanes + mod * d.N;
+#elif SIMD_TARGET_VALUE == SIMD_AVX512
+  // Same pattern as above: lane j of row "mod" is
+  // j < mod ? N - mod + j : N - 1 - (j - mod).
+  SIMD_ALIGN static constexpr int32_t idx_lanes[d.N * d.N] = {
+      15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,  // 0
+      15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  // 1
+      14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  // 2
+      13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  // 3
+      12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  // 4
+      11, 12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  // 5
+      10, 11, 12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  // 6
+       9, 10, 11, 12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  7,  // 7
+       8,  9, 10, 11, 12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  8,  // 8
+       7,  8,  9, 10, 11, 12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  9,  // 9
+       6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 15, 14, 13, 12, 11, 10,  // 10
+       5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 15, 14, 13, 12, 11,  // 11
+       4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 15, 14, 13, 12,  // 12
+       3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 15, 14, 13,  // 13
+       2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 15, 14,  // 14
+       1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 15,  // 15
+  };
+  return idx_lanes + mod * d.N;
 #elif SIMD_TARGET_VALUE == SIMD_NONE
   (void)d;         // silence warning about unused d
   return nullptr;  // do not call
@@ -1353,12 +1417,6 @@ class Separable5 {
 
 }  // namespace strategy
 
-// Avoids PadImage, but requires a strategy that supports LeftRightInvalid.
-struct BorderNeverUsed {};
-
-// Slow: Convolve calls PadImage and requires bounds checks.
-struct BorderNeedsInit {};
-
 // 3x3 kernels require inputs at least this wide - for the first vector, they
 // load right neighbors (N lanes starting from x + 1).
 static constexpr size_t kConvolveMinWidth = SIMD_FULL(float)::N + 1;
@@ -1445,7 +1503,7 @@ class ConvolveT {
     const int64_t stride = in.bytes_per_row() / sizeof(float);
     executor.Run(
         ybegin, yend,
-        [&in, stride, &kernel, out](const int y, const int thread) {
+        [&in, stride, &kernel, out](const int y, const int thread) SIMD_ATTR {
           RunRow<kSizeModN, LeftRight>(in.ConstRow(y), in.xsize(), stride,
                                        WrapRowUnchanged(), kernel, out->Row(y));
         },
@@ -1613,6 +1671,10 @@ class ConvolveT {
   }
 };
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
-#endif  // CONVOLVE_H_
+#endif  // CONVOLVE_TARGET_H_
@@ -10,8 +10,6 @@
 #include <cstdio>
 #include <cstdlib>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "arch_specific.h"
 #include "args.h"
 #include "codec.h"
@@ -26,15 +24,6 @@
 #include "simd/targets.h"
 
 namespace pik {
-namespace {
-
-// Proposes a distance to try for a given bpp target. This could depend
-// on the entropy in the image, too, but let's start with something.
-static double ApproximateDistanceForBPP(double bpp) {
-  return 1.704 * pow(bpp, -0.804);
-}
-
-}  // namespace
 
 CompressArgs::CompressArgs() {
   // TODO(janwas): differentiate between cores/HT
@@ -84,6 +73,22 @@ Status CompressArgs::AddCommandLineOptions(tools::CommandLineParser* cmdline) {
                           "chooses deblocking strength (4=normal).",
                           &params.gaborish, &ParseGaborishStrength);
 
+  cmdline->AddOptionValue('\0', "ans_states", "1..4",
+                          "interleaved ANS states for AC (faster decoding).",
+                          &params.num_ac_ans_states, &ParseUnsigned);
+
+  cmdline->AddOptionFlag('\0', "tile_toc",
+                         "Index AC tiles so groups decode in parallel.",
+                         &params.tile_toc, &SetBooleanTrue);
+
+  cmdline->AddOptionFlag('\0', "tile_noise",
+                         "Synthesize noise per tile (parallel decoding).",
+                         &params.tile_noise, &SetBooleanTrue);
+
+  cmdline->AddOptionFlag('\0', "shared_entropy_code",
+                         "Share orders and histograms across groups.",
+                         &params.shared_entropy_code, &SetBooleanTrue);
+
   cmdline->AddOptionValue('\0', "resampleX2", "N",
                           "is twice the downsampling factor, 3 for 1.5x.",
                           &params.resampling_factor2, &ParseUnsigned);
@@ -97,14 +102,19 @@ Status CompressArgs::AddCommandLineOptions(tools::CommandLineParser* cmdline) {
   opt_target_size_id = cmdline->AddOptionValue(
       '\0', "target_size", "N",
       ("Aim at file size of N bytes.\n"
-       "    Compresses to 1 % of the target size in ideal conditions.\n"
+       "    Compresses to within --target_tolerance of the target size.\n"
        "    Runs the same algorithm as --target_bpp"),
       &params.target_size, &ParseUnsigned);
   opt_target_bpp_id = cmdline->AddOptionValue(
       '\0', "target_bpp", "BPP",
       ("Aim at file size that has N bits per pixel.\n"
-       "    Compresses to 1 % of the target BPP in ideal conditions."),
+       "    Compresses to within --target_tolerance of the target BPP."),
       &params.target_bitrate, &ParseFloat);
+  cmdline->AddOptionValue(
+      '\0', "target_tolerance", "F",
+      ("Stops the --target_size/--target_bpp search once the size is\n"
+       "    within this fraction of the target. Default: 0.01."),
+      &params.target_size_tolerance, &ParseFloat);
 
   cmdline->AddOptionValue(
       '\0', "intensity_target", "N",
@@ -204,7 +214,7 @@ Status Compress(ThreadPool* pool, CompressArgs& args, PaddedBytes* compressed) {
   CodecInOut io(&codec_context);
   io.dec_hints = args.dec_hints;
   t0 = Now();
-  if (!io.SetFromFile(args.params.file_in)) {
+  if (!io.SetFromFile(args.params.file_in, pool)) {
     fprintf(stderr, "Failed to read image %s.\n", args.params.file_in);
     return false;
   }
@@ -213,71 +223,39 @@ Status Compress(ThreadPool* pool, CompressArgs& args, PaddedBytes* compressed) {
 
   const size_t xsize = io.xsize();
   const size_t ysize = io.ysize();
-  if (args.params.target_size > 0 || args.params.target_bitrate > 0) {
-    // Search algorithm for target bpp / size.
-    CompressArgs s = args;  // Args for search.
-    if (s.params.target_size > 0) {
-      s.params.target_bitrate =
-          s.params.target_size * 8.0 / (io.xsize() * io.ysize());
-      s.params.target_size = 0;
-    }
-    double dist = ApproximateDistanceForBPP(s.params.target_bitrate);
-    s.params.butteraugli_distance = dist;
-    double target_size =
-        s.params.target_bitrate * (1 / 8.) * io.xsize() * io.ysize();
-    s.params.target_bitrate = 0;
-    double best_dist = 1.0;
-    double best_loss = 1e99;
-    for (int i = 0; i < 7; ++i) {
-      s.params.butteraugli_distance = dist;
-      PaddedBytes candidate;
-      bool ok = Compress(pool, s, &candidate);
-      if (!ok) {
-        printf(
-            "Compression error occurred during the search for best size."
-            " Trying with butteraugli distance %.15g\n",
-            best_dist);
-        break;
-      }
-      printf("Butteraugli distance %g yields %zu bytes, %g bpp.\n", dist,
-             candidate.size(),
-             candidate.size() * 8.0 / (io.xsize() * io.ysize()));
-      const double ratio = static_cast<double>(candidate.size()) / target_size;
-      const double loss = std::max(ratio, 1.0 / std::max(ratio, 1e-30));
-      if (best_loss > loss) {
-        best_dist = dist;
-        best_loss = loss;
-      }
-      dist *= ratio;
-      if (dist < 0.01) {
-        dist = 0.01;
-      }
-      if (dist >= 16.0) {
-        dist = 16.0;
-      }
-    }
-    printf("Choosing butteraugli distance %.15g\n", best_dist);
-    args.params.butteraugli_distance = best_dist;
-    args.params.target_bitrate = 0;
-    args.params.target_size = 0;
-  }
   char mode[200];
   if (args.params.fast_mode) {
     strcpy(mode, "in fast mode ");
   }
-  snprintf(mode, sizeof(mode), "with maximum Butteraugli distance %f",
-           args.params.butteraugli_distance);
+  const bool target_size_search =
+      args.params.target_size > 0 || args.params.target_bitrate > 0;
+  if (target_size_search) {
+    snprintf(mode, sizeof(mode), "to %zu bytes",
+             args.params.TargetSize(Rect(io.color())));
+  } else {
+    snprintf(mode, sizeof(mode), "with maximum Butteraugli distance %f",
+             args.params.butteraugli_distance);
+  }
   fprintf(stderr,
           "Read %zu bytes (%zux%zu, %.1f MP/s); compressing %s, %zu threads.\n",
           io.enc_size, xsize, ysize, decode_mps, mode, NumWorkerThreads(pool));
 
   PikInfo aux_out;
   t0 = Now();
-  if (!PixelsToPik(args.params, &io, compressed, &aux_out, pool)) {
+  if (target_size_search) {
+    if (!PixelsToPikTargetSize(args.params, &io, compressed, &aux_out, pool)) {
+      fprintf(stderr, "Failed to compress.\n");
+      return false;
+    }
+  } else if (!PixelsToPik(args.params, &io, compressed, &aux_out, pool)) {
     fprintf(stderr, "Failed to compress.\n");
     return false;
   }
   t1 = Now();
+  if (target_size_search) {
+    fprintf(stderr, "Chose Butteraugli distance %.15g after %zu candidates.\n",
+            aux_out.target_size_distance, aux_out.num_target_size_candidates);
+  }
   const size_t channels = io.c_current().Channels() + io.HasAlpha();
   const size_t bytes = xsize * ysize * channels *
                        DivCeil(io.original_bits_per_sample(), kBitsPerByte);
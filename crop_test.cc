@@ -0,0 +1,175 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Verifies that decoding a crop (DecompressParams::crop) yields the same pixels
+// as the corresponding region of a full decode. Returns nonzero on failure.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "codec.h"
+#include "data_parallel.h"
+#include "image.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_params.h"
+
+namespace pik {
+namespace {
+
+// Smooth gradients plus texture, so that the encoder estimates a nonzero
+// noise level.
+Image3F MakeTestImage(const size_t xsize, const size_t ysize) {
+  Image3F image(xsize, ysize);
+  std::mt19937 rng(123);
+  std::uniform_real_distribution<float> texture(-12.0f, 12.0f);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      float* PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        const float smooth = 128.0f + 90.0f * std::sin(0.011f * x * (c + 1)) *
+                                          std::cos(0.017f * y);
+        row[x] = std::min(255.0f, std::max(0.0f, smooth + texture(rng)));
+      }
+    }
+  }
+  return image;
+}
+
+// Returns the largest difference between "crop" and the region of "full" at
+// (x0, y0).
+float MaxDifference(const Image3F& full, const size_t x0, const size_t y0,
+                    const Image3F& crop) {
+  float max_diff = 0.0f;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < crop.ysize(); ++y) {
+      const float* PIK_RESTRICT row_full = full.ConstPlaneRow(c, y0 + y);
+      const float* PIK_RESTRICT row_crop = crop.ConstPlaneRow(c, y);
+      for (size_t x = 0; x < crop.xsize(); ++x) {
+        max_diff = std::max(max_diff, std::abs(row_full[x0 + x] - row_crop[x]));
+      }
+    }
+  }
+  return max_diff;
+}
+
+bool Decode(const PaddedBytes& compressed, const DecompressParams& dparams,
+            ThreadPool* pool, CodecContext* context, Image3F* color) {
+  CodecInOut io(context);
+  if (!PikToPixels(dparams, compressed, &io, /*aux_out=*/nullptr, pool)) {
+    fprintf(stderr, "Failed to decode.\n");
+    return false;
+  }
+  *color = CopyImage(io.color());
+  return true;
+}
+
+bool Encode(const CompressParams& cparams, ThreadPool* pool,
+            CodecContext* context, PaddedBytes* compressed) {
+  CodecInOut io(context);
+  io.SetFromImage(MakeTestImage(700, 600), context->c_srgb[0]);
+  io.SetOriginalBitsPerSample(8);
+  if (!PixelsToPik(cparams, &io, compressed, /*aux_out=*/nullptr, pool)) {
+    fprintf(stderr, "Failed to encode.\n");
+    return false;
+  }
+  return true;
+}
+
+// Compares crops, including ones spanning group boundaries, with "full".
+bool CropsMatch(const PaddedBytes& compressed, const Image3F& full,
+                ThreadPool* pool, CodecContext* context) {
+  // Not aligned to tiles nor groups; spans a group boundary.
+  const size_t kX0[3] = {0, 137, 450};
+  const size_t kY0[3] = {0, 301, 515};
+  DecompressParams dparams;
+  for (size_t i = 0; i < 3; ++i) {
+    dparams.crop.x0 = kX0[i];
+    dparams.crop.y0 = kY0[i];
+    dparams.crop.xsize = std::min<size_t>(230, full.xsize() - kX0[i]);
+    dparams.crop.ysize = std::min<size_t>(190, full.ysize() - kY0[i]);
+    Image3F crop;
+    if (!Decode(compressed, dparams, pool, context, &crop)) return false;
+    const float max_diff = MaxDifference(full, kX0[i], kY0[i], crop);
+    if (max_diff > 1E-4f) {
+      fprintf(stderr, "Crop at %zu, %zu differs from full decode by %f.\n",
+              kX0[i], kY0[i], max_diff);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Tile noise only depends on the image coordinates, so a crop must receive the
+// same noise as the full image.
+bool TestTileNoiseCrop(ThreadPool* pool) {
+  CompressParams cparams;
+  cparams.butteraugli_distance = 1.5f;
+  cparams.fast_mode = true;
+  cparams.noise = Override::kOn;
+  cparams.tile_noise = true;
+  // Only noise should depend on the crop origin.
+  cparams.adaptive_reconstruction = Override::kOff;
+  CodecContext context;
+  PaddedBytes compressed;
+  if (!Encode(cparams, pool, &context, &compressed)) return false;
+
+  DecompressParams dparams;
+  Image3F full;
+  if (!Decode(compressed, dparams, pool, &context, &full)) return false;
+
+  // Ensures the comparison below would detect misplaced noise.
+  DecompressParams no_noise = dparams;
+  no_noise.noise = Override::kOff;
+  Image3F full_without_noise;
+  if (!Decode(compressed, no_noise, pool, &context, &full_without_noise)) {
+    return false;
+  }
+  if (MaxDifference(full, 0, 0, full_without_noise) < 1E-3f) {
+    fprintf(stderr, "Tile noise had no effect.\n");
+    return false;
+  }
+
+  return CropsMatch(compressed, full, pool, &context);
+}
+
+// The edge-preserving filter normalizes by the value range stored in the pass
+// header (kEpfRange), so a crop only reconstructs its neighborhood yet must
+// match the full image.
+bool TestAdaptiveReconstructionCrop(ThreadPool* pool) {
+  CompressParams cparams;
+  cparams.butteraugli_distance = 1.5f;
+  cparams.fast_mode = true;
+  cparams.adaptive_reconstruction = Override::kOn;
+  CodecContext context;
+  PaddedBytes compressed;
+  if (!Encode(cparams, pool, &context, &compressed)) return false;
+
+  DecompressParams dparams;
+  Image3F full;
+  if (!Decode(compressed, dparams, pool, &context, &full)) return false;
+  return CropsMatch(compressed, full, pool, &context);
+}
+
+int RunTests() {
+  ThreadPool pool(4);
+  bool ok = true;
+  for (ThreadPool* p : {static_cast<ThreadPool*>(nullptr), &pool}) {
+    ok &= TestTileNoiseCrop(p);
+    ok &= TestAdaptiveReconstructionCrop(p);
+  }
+  if (!ok) return 1;
+  printf("Crop tests passed.\n");
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main() { return pik::RunTests(); }
@@ -8,8 +8,249 @@
 #include "profiler.h"
 
 namespace pik {
+namespace {
+
+// Identifies the pool and index of worker threads, see CurrentWorker.
+thread_local const ThreadPool* tls_pool = nullptr;
+thread_local int tls_worker = -1;
+
+// Number of unsuccessful attempts to steal work before an idle worker blocks.
+// Nested ranges usually appear within microseconds, so spinning briefly avoids
+// the cost of a wakeup, but workers must not burn a core for the rest of a
+// long Run.
+constexpr size_t kIdleSpins = 256;
+
+}  // namespace
+
+int ThreadPool::CurrentWorker() const {
+  return tls_pool == this ? tls_worker : -1;
+}
+
+void ThreadPool::RunNested(const int begin, const int end,
+                           const TypeErasedFunc func, const void* arg,
+                           const int thread) {
+  NestedRange range(begin, end, func, arg);
+  const int num_tasks = end - begin;
+  const int num_worker_threads = static_cast<int>(num_worker_threads_);
+  WorkerDeque& deque = deques_[thread];
+  {
+    std::lock_guard<std::mutex> lock(deque.mutex);
+    deque.ranges.push_back(&range);
+  }
+  WakeIdleWorkers();
+
+  int num_finished = 0;
+  for (;;) {
+    int my_begin;
+    const int my_size = ReserveChunk(num_tasks, num_worker_threads,
+                                     &range.num_reserved, &my_begin);
+    if (my_size == 0) {
+      break;
+    }
+    for (int task = begin + my_begin; task < begin + my_begin + my_size;
+         ++task) {
+      func(arg, task, thread);
+    }
+    num_finished += my_size;
+  }
+
+  // All tasks are reserved; thieves no longer need to see the range.
+  {
+    std::lock_guard<std::mutex> lock(deque.mutex);
+    PIK_ASSERT(deque.ranges.back() == &range);
+    deque.ranges.pop_back();
+  }
+
+  // Wait for the chunks that were stolen. Helping other ranges here could
+  // reuse per-thread storage of a task that is still on our stack.
+  if (num_finished != num_tasks) {
+    PROFILER_ZONE("ThreadPool join");
+    const int num_stolen = num_tasks - num_finished;
+    size_t num_spins = 0;
+    while (range.num_finished.load(std::memory_order_acquire) != num_stolen) {
+      if (++num_spins < kIdleSpins) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      // Stolen chunks may take as long as any task; block until a thief
+      // reports that it finished one. See TrySteal.
+      std::unique_lock<std::mutex> lock(mutex_);
+      num_joining_workers_.fetch_add(1, std::memory_order_seq_cst);
+      while (range.num_finished.load(std::memory_order_seq_cst) !=
+             num_stolen) {
+        range_finished_cv_.wait(lock);
+      }
+      num_joining_workers_.fetch_sub(1, std::memory_order_relaxed);
+      break;
+    }
+  }
+}
+
+bool ThreadPool::TrySteal(const int thread) {
+  const int num_worker_threads = static_cast<int>(num_worker_threads_);
+  for (int i = 1; i < num_worker_threads; ++i) {
+    WorkerDeque& deque = deques_[(thread + i) % num_worker_threads];
+    NestedRange* range = nullptr;
+    int my_begin;
+    int my_size = 0;
+    {
+      std::lock_guard<std::mutex> lock(deque.mutex);
+      // Outermost ranges first: they are likely to have the most work left.
+      for (NestedRange* candidate : deque.ranges) {
+        my_size =
+            ReserveChunk(candidate->end - candidate->begin, num_worker_threads,
+                         &candidate->num_reserved, &my_begin);
+        if (my_size != 0) {
+          range = candidate;
+          break;
+        }
+      }
+    }
+    if (range == nullptr) continue;
+
+    // The owner waits for our chunk, so "range" remains valid until the
+    // num_finished update below.
+    const int task_begin = range->begin + my_begin;
+    for (int task = task_begin; task < task_begin + my_size; ++task) {
+      range->func(range->arg, task, thread);
+    }
+    // Pairs with the num_joining_workers_ increment in RunNested: either the
+    // owner sees our update, or we see the owner and notify it. "range" may
+    // already be gone after the update, hence the pool-wide counter.
+    range->num_finished.fetch_add(my_size, std::memory_order_seq_cst);
+    if (num_joining_workers_.load(std::memory_order_seq_cst) != 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      range_finished_cv_.notify_all();
+    }
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::WakeIdleWorkers() {
+  // Pairs with the num_idle_workers_ increment in HelpUntilDone: either the
+  // worker sees the new epoch, or we see the worker and notify it.
+  work_epoch_.fetch_add(1, std::memory_order_seq_cst);
+  if (num_idle_workers_.load(std::memory_order_seq_cst) != 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    work_available_cv_.notify_all();
+  }
+}
+
+void ThreadPool::HelpUntilDone(const int thread) {
+  size_t num_spins = 0;
+  for (;;) {
+    // Read before TrySteal so that ranges published afterwards prevent
+    // blocking below.
+    const uint32_t epoch = work_epoch_.load(std::memory_order_seq_cst);
+    if (num_busy_workers_.load(std::memory_order_acquire) == 0) return;
+    if (TrySteal(thread)) {
+      num_spins = 0;
+      continue;
+    }
+    if (++num_spins < kIdleSpins) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    WaitForNewEpoch(epoch);
+    num_spins = 0;
+  }
+}
+
+void ThreadPool::WaitForNewEpoch(const uint32_t epoch) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  num_idle_workers_.fetch_add(1, std::memory_order_seq_cst);
+  while (work_epoch_.load(std::memory_order_seq_cst) == epoch) {
+    work_available_cv_.wait(lock);
+  }
+  num_idle_workers_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ThreadPool::RunGraph(const TaskGraph& graph, const TypeErasedFunc func,
+                          const void* arg, const char* caller) {
+  const size_t num_tasks = graph.NumTasks();
+  if (num_tasks == 0) return;
+
+  // Each task is appended exactly once, so a vector with a read position
+  // suffices as the queue of ready tasks.
+  std::vector<int> ready;
+  ready.reserve(num_tasks);
+  size_t next_ready = 0;
+  std::mutex ready_mutex;
+
+  std::unique_ptr<std::atomic<uint32_t>[]> num_pending(
+      new std::atomic<uint32_t>[num_tasks]);
+  for (size_t task = 0; task < num_tasks; ++task) {
+    const uint32_t num_dependencies = graph.num_dependencies_[task];
+    num_pending[task].store(num_dependencies, std::memory_order_relaxed);
+    if (num_dependencies == 0) ready.push_back(static_cast<int>(task));
+  }
+  std::atomic<size_t> num_finished{0};
+
+  // Runs until all tasks have finished. One per worker, but the pool may also
+  // run several on one thread (e.g. if called from within a task). Threads
+  // without a ready task block like HelpUntilDone; publishing ready tasks and
+  // finishing the last task call WakeIdleWorkers.
+  const auto run_ready_tasks = [&](const int, const int thread) {
+    std::vector<int> newly_ready;
+    size_t num_spins = 0;
+    for (;;) {
+      // Read before checking for tasks so that tasks published afterwards
+      // prevent blocking below.
+      const uint32_t epoch = work_epoch_.load(std::memory_order_seq_cst);
+      int task = -1;
+      {
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        if (next_ready != ready.size()) task = ready[next_ready++];
+      }
+
+      if (task < 0) {
+        if (num_finished.load(std::memory_order_acquire) == num_tasks) return;
+        // Tasks may call Run; help with those rather than only waiting.
+        if (TrySteal(thread)) {
+          num_spins = 0;
+        } else if (++num_spins < kIdleSpins) {
+          std::this_thread::yield();
+        } else {
+          WaitForNewEpoch(epoch);
+          num_spins = 0;
+        }
+        continue;
+      }
+      num_spins = 0;
+
+      func(arg, task, thread);
+
+      newly_ready.clear();
+      for (const int dependent : graph.dependents_[task]) {
+        if (num_pending[dependent].fetch_sub(1, std::memory_order_acq_rel) ==
+            1) {
+          newly_ready.push_back(dependent);
+        }
+      }
+      if (!newly_ready.empty()) {
+        {
+          std::lock_guard<std::mutex> lock(ready_mutex);
+          ready.insert(ready.end(), newly_ready.begin(), newly_ready.end());
+        }
+        WakeIdleWorkers();
+      }
+      // After publishing dependents, so that no worker returns early.
+      if (num_finished.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+          num_tasks) {
+        WakeIdleWorkers();
+      }
+    }
+  };
+  Run(0, std::max<int>(num_worker_threads_, 1), run_ready_tasks, caller);
+}
 
 void ThreadPool::ThreadFunc(ThreadPool* self, const int thread) {
+  tls_pool = self;
+  tls_worker = thread;
+
   // Until kWorkerExit command received:
   for (;;) {
     std::unique_lock<std::mutex> lock(self->mutex_);
@@ -33,6 +274,14 @@ void ThreadPool::ThreadFunc(ThreadPool* self, const int thread) {
       default:
         lock.unlock();
         RunRange(self, command, thread);
+        // Help with nested ranges until no task of this Run is running. The
+        // last worker to finish wakes those that are blocked.
+        if (self->num_busy_workers_.fetch_sub(1, std::memory_order_acq_rel) ==
+            1) {
+          self->WakeIdleWorkers();
+        } else {
+          self->HelpUntilDone(thread);
+        }
         break;
     }
   }
@@ -46,9 +295,11 @@ ThreadPool::ThreadPool(const int num_worker_threads)
   PIK_CHECK(num_worker_threads >= 0);
   PIK_CHECK(num_worker_threads <= kMaxThreads);
   threads_.reserve(num_worker_threads);
+  deques_.reset(new WorkerDeque[num_worker_threads]);
 
   // Suppress "unused-private-field" warning.
   (void)padding;
+  (void)padding2;
 
   // Safely handle spurious worker wakeups.
   worker_start_command_ = kWorkerWait;
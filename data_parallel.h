@@ -17,6 +17,7 @@
 #include <atomic>
 #include <condition_variable>  //NOLINT
 #include <cstdlib>
+#include <memory>
 #include <mutex>   //NOLINT
 #include <thread>  //NOLINT
 #include <vector>
@@ -26,6 +27,34 @@
 
 namespace pik {
 
+// Tasks [0, NumTasks()) and the order in which they must run, for RunGraph.
+// Replaces a sequence of Run calls (one per phase) when the tasks of a later
+// phase only depend on some tasks of the previous ones: they can then start
+// without waiting for stragglers, e.g. groups whose decoding is expensive.
+class TaskGraph {
+ public:
+  explicit TaskGraph(const size_t num_tasks)
+      : num_dependencies_(num_tasks, 0), dependents_(num_tasks) {}
+
+  size_t NumTasks() const { return dependents_.size(); }
+
+  // "task" will not start before "dependency" has finished. Requiring lower
+  // numbers for dependencies rules out cycles; calling this more than once for
+  // the same pair is allowed.
+  void AddDependency(const int dependency, const int task) {
+    PIK_ASSERT(0 <= dependency && dependency < task);
+    PIK_ASSERT(static_cast<size_t>(task) < NumTasks());
+    ++num_dependencies_[task];
+    dependents_[dependency].push_back(task);
+  }
+
+ private:
+  friend class ThreadPool;
+
+  std::vector<uint32_t> num_dependencies_;
+  std::vector<std::vector<int>> dependents_;
+};
+
 // Scalable, lower-overhead thread pool, especially suitable for data-parallel
 // computations in the fork-join model, where clients need to know when all
 // tasks have completed.
@@ -49,6 +78,11 @@ namespace pik {
 // all worker threads have exited cleanly. "thread" is useful for accessing
 // thread-local data, typically a pre-allocated array of kMaxThreads
 // cache-aligned elements.
+//
+// Tasks may themselves call Run (e.g. a group task that splits into tiles).
+// Such nested ranges are pushed onto the calling worker's deque; the caller
+// works on them and workers that ran out of tasks steal chunks from the other
+// deques, so images with fewer groups than threads still use all workers.
 class ThreadPool {
  public:
   // For per-thread arrays. Can increase if needed.
@@ -77,7 +111,8 @@ class ThreadPool {
 
   // Runs func(task, thread) on worker thread(s) for every task in [begin, end).
   // "thread" is 0 if NumThreads() == 0, otherwise [0, NumThreads()).
-  // Not thread-safe - no two calls to Run may overlap.
+  // Not thread-safe - no two calls to Run may overlap, except for nested calls
+  // from within func, which are allowed (on the thread that called func).
   // Subsequent calls will reuse the same threads.
   //
   // Precondition: 0 <= begin <= end.
@@ -98,8 +133,14 @@ class ThreadPool {
       return;
     }
 
+    const int worker = CurrentWorker();
+    if (worker >= 0) {
+      RunNested(begin, end, &CallClosure<Func>, &func, worker);
+      return;
+    }
+
     if (depth_.fetch_add(1, std::memory_order_acq_rel) != 0) {
-      PIK_ASSERT(false);  // Must not re-enter.
+      PIK_ASSERT(false);  // Must not re-enter from another thread.
     }
 
     const WorkerCommand worker_command = (WorkerCommand(end) << 32) + begin;
@@ -111,6 +152,7 @@ class ThreadPool {
     func_ = &CallClosure<Func>;
     arg_ = &func;
     num_reserved_.store(0, std::memory_order_relaxed);
+    num_busy_workers_.store(num_worker_threads_, std::memory_order_relaxed);
 
     StartWorkers(worker_command);
     WorkersReadyBarrier();
@@ -137,6 +179,16 @@ class ThreadPool {
     WorkersReadyBarrier();
   }
 
+  // Runs func(task, thread) for every task of "graph" such that each task
+  // starts only after all of its dependencies have finished. Ready tasks are
+  // started in the order in which they became ready. Same threading rules as
+  // Run; workers waiting for a task to become ready help with nested ranges.
+  template <class Func>
+  void RunGraph(const TaskGraph& graph, const Func& func,
+                const char* caller = "") {
+    RunGraph(graph, &CallClosure<Func>, &func, caller);
+  }
+
  private:
   // After construction and between calls to Run, workers are "ready", i.e.
   // waiting on worker_start_cv_. They are "started" by sending a "command"
@@ -178,6 +230,35 @@ class ThreadPool {
     worker_start_cv_.notify_all();
   }
 
+  // Reserves the next chunk of "num_tasks" tasks, of which "num_reserved" are
+  // already reserved. Returns the size of the chunk starting at *chunk_begin,
+  // or zero if another thread already reserved the last task.
+  static int ReserveChunk(const int num_tasks, const int num_worker_threads,
+                          std::atomic<int>* num_reserved, int* chunk_begin) {
+    // OpenMP introduced several "schedule" strategies:
+    // "single" (static assignment of exactly one chunk per thread): slower.
+    // "dynamic" (allocates k tasks at a time): competitive for well-chosen k.
+    // "guided" (allocates k tasks, decreases k): computing k = remaining/n
+    //   is faster than halving k each iteration. We prefer this strategy
+    //   because it avoids user-specified parameters.
+#if 0
+    // dynamic
+    const int my_size = std::max(num_tasks / (num_worker_threads * 4), 1);
+#else
+    // guided
+    const int already_reserved = num_reserved->load(std::memory_order_relaxed);
+    // Also avoids overflowing the counter while thieves poll finished ranges.
+    if (already_reserved >= num_tasks) return 0;
+    const int num_remaining = num_tasks - already_reserved;
+    const int my_size = std::max(num_remaining / (num_worker_threads * 4), 1);
+#endif
+    const int my_begin =
+        num_reserved->fetch_add(my_size, std::memory_order_relaxed);
+    const int my_end = std::min(my_begin + my_size, num_tasks);
+    *chunk_begin = my_begin;
+    return std::max(my_end - my_begin, 0);
+  }
+
   // Attempts to reserve and perform some work from the global range of tasks,
   // which is encoded within "command". Returns after all tasks are reserved.
   static void RunRange(ThreadPool* self, const WorkerCommand command,
@@ -187,32 +268,15 @@ class ThreadPool {
     const int num_tasks = end - begin;
     const int num_worker_threads = static_cast<int>(self->num_worker_threads_);
 
-    // OpenMP introduced several "schedule" strategies:
-    // "single" (static assignment of exactly one chunk per thread): slower.
-    // "dynamic" (allocates k tasks at a time): competitive for well-chosen k.
-    // "guided" (allocates k tasks, decreases k): computing k = remaining/n
-    //   is faster than halving k each iteration. We prefer this strategy
-    //   because it avoids user-specified parameters.
-
     for (;;) {
-#if 0
-      // dynamic
-      const int my_size = std::max(num_tasks / (num_worker_threads * 4), 1);
-#else
-      // guided
-      const int num_reserved =
-          self->num_reserved_.load(std::memory_order_relaxed);
-      const int num_remaining = num_tasks - num_reserved;
-      const int my_size = std::max(num_remaining / (num_worker_threads * 4), 1);
-#endif
-      const int my_begin = begin + self->num_reserved_.fetch_add(
-                                       my_size, std::memory_order_relaxed);
-      const int my_end = std::min(my_begin + my_size, begin + num_tasks);
-      // Another thread already reserved the last task.
-      if (my_begin >= my_end) {
+      int my_begin;
+      const int my_size = ReserveChunk(num_tasks, num_worker_threads,
+                                       &self->num_reserved_, &my_begin);
+      if (my_size == 0) {
         break;
       }
-      for (int task = my_begin; task < my_end; ++task) {
+      for (int task = begin + my_begin; task < begin + my_begin + my_size;
+           ++task) {
         self->func_(self->arg_, task, thread);
       }
     }
@@ -222,6 +286,57 @@ class ThreadPool {
   // CallClosure. Arguments are arg_ (points to the lambda), task, thread.
   using TypeErasedFunc = void (*)(const void*, int, int);
 
+  // A range of tasks submitted by a nested Run. Lives on the stack of the
+  // submitting worker, which only returns after all tasks have finished.
+  struct NestedRange {
+    NestedRange(const int begin, const int end, const TypeErasedFunc func,
+                const void* arg)
+        : begin(begin), end(end), func(func), arg(arg) {}
+
+    const int begin;
+    const int end;
+    const TypeErasedFunc func;
+    const void* const arg;
+    std::atomic<int> num_reserved{0};
+    std::atomic<int> num_finished{0};
+  };
+
+  // Nested ranges submitted by one worker, outermost first. Thieves reserve
+  // chunks while holding the mutex, which prevents the owner from removing
+  // the range in the meantime.
+  struct WorkerDeque {
+    std::mutex mutex;
+    std::vector<NestedRange*> ranges;
+  };
+
+  // Returns the index of the calling thread if it is one of our workers,
+  // otherwise -1.
+  int CurrentWorker() const;
+
+  void RunGraph(const TaskGraph& graph, TypeErasedFunc func, const void* arg,
+                const char* caller);
+
+  // Called by worker "thread" from within a task: runs func for all tasks in
+  // [begin, end) with help from idle workers and returns when all finished.
+  void RunNested(int begin, int end, TypeErasedFunc func, const void* arg,
+                 int thread);
+
+  // Runs one chunk of a nested range of another worker. Returns false if
+  // there was nothing to steal.
+  bool TrySteal(int thread);
+
+  // Wakes workers blocked in HelpUntilDone or RunGraph after publishing a
+  // nested range or ready tasks, or finishing the last task of a Run/graph.
+  void WakeIdleWorkers();
+
+  // Steals nested ranges until num_busy_workers_ reaches zero; blocks on
+  // work_available_cv_ after kIdleSpins unsuccessful attempts.
+  void HelpUntilDone(int thread);
+
+  // Blocks until WakeIdleWorkers is called after the caller read "epoch" from
+  // work_epoch_ (returns immediately if it was already called).
+  void WaitForNewEpoch(uint32_t epoch);
+
   static void ThreadFunc(ThreadPool* self, const int thread);
 
   // Unmodified after ctor, but cannot be const because we call thread::join().
@@ -230,13 +345,27 @@ class ThreadPool {
   const size_t num_worker_threads_;  // == threads_.size()
   const size_t num_threads_;
 
-  std::atomic<int> depth_{0};  // detects if Run is re-entered (not supported).
+  // Detects if Run is re-entered by a thread other than our workers (not
+  // supported).
+  std::atomic<int> depth_{0};
+
+  // One per worker thread.
+  std::unique_ptr<WorkerDeque[]> deques_;
 
-  std::mutex mutex_;  // guards both cv and their variables.
+  std::mutex mutex_;  // guards all cv and their variables.
   std::condition_variable workers_ready_cv_;
   size_t workers_ready_ = 0;
   std::condition_variable worker_start_cv_;
   WorkerCommand worker_start_command_;
+  // Signaled (with work_epoch_ incremented) when workers blocked in
+  // HelpUntilDone or RunGraph should look for work or return.
+  std::condition_variable work_available_cv_;
+  std::atomic<uint32_t> work_epoch_{0};
+  std::atomic<int> num_idle_workers_{0};
+  // Signaled when a thief finishes a chunk while an owner of a nested range
+  // (num_joining_workers_ of them) waits for its stolen chunks.
+  std::condition_variable range_finished_cv_;
+  std::atomic<int> num_joining_workers_{0};
 
   // Written by main thread, read by workers (after mutex lock/unlock).
   TypeErasedFunc func_;
@@ -245,6 +374,10 @@ class ThreadPool {
   // Updated by workers; alignment/padding avoids false sharing.
   alignas(64) std::atomic<int> num_reserved_{0};
   int padding[15];
+  // Number of workers still running tasks of the current Run; the others
+  // steal nested ranges until this reaches zero.
+  alignas(64) std::atomic<int> num_busy_workers_{0};
+  int padding2[15];
 };
 
 // Wrappers to enable ThreadPool* == nullptr (cheaper than constructing a
@@ -271,6 +404,21 @@ void RunOnPool(ThreadPool* pool, const int begin, const int end,
   pool->Run(begin, end, func, caller);
 }
 
+// Tasks are numbered such that dependencies come first, so running them in
+// order satisfies the graph.
+template <class Func>
+void RunGraphOnPool(ThreadPool* pool, const TaskGraph& graph, const Func& func,
+                    const char* caller = "") {
+  if (pool == nullptr) {
+    const int thread = 0;
+    for (size_t task = 0; task < graph.NumTasks(); ++task) {
+      func(static_cast<int>(task), thread);
+    }
+    return;
+  }
+  pool->RunGraph(graph, func, caller);
+}
+
 template <class Func>
 void RunOnEachThread(ThreadPool* pool, const Func& func) {
   if (pool == nullptr) {
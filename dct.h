@@ -4,8 +4,12 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
-#ifndef DCT_H_
+#if defined(DCT_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef DCT_H_
+#undef DCT_H_
+#else
 #define DCT_H_
+#endif
 
 // Fast SIMD floating-point DCT8-32.
 
@@ -13,14 +17,18 @@
 #include <cstring>
 #include "block.h"
 #include "compiler_specific.h"
-#include "dct.h"
 #include "dct_simd_4.h"
 #include "dct_simd_8.h"
 #include "dct_simd_any.h"
 #include "simd/simd.h"
 #include "status.h"
 
+// Compiled for every target if included from a foreach_target.h file. The
+// 8x8 kernels use 8-lane parts (AVX2 instructions) on AVX-512, whereas 16 and
+// 32-point column transforms use full vectors.
+
 namespace pik {
+namespace SIMD_NAMESPACE {
 
 // Final scaling factors of outputs/inputs in the Arai, Agui, and Nakajima
 // algorithm computing the DCT/IDCT (described in the book JPEG: Still Image
@@ -298,7 +306,7 @@ SIMD_ATTR PIK_INLINE void GenericTransposeBlock(const From& from,
 
 template <class From, class To>
 SIMD_ATTR PIK_INLINE void TransposeBlock8(const From& from, const To& to) {
-#if SIMD_TARGET_VALUE == SIMD_AVX2
+#if SIMD_TARGET_VALUE == SIMD_AVX2 || SIMD_TARGET_VALUE == SIMD_AVX512
   TransposeBlock8_V8(from, to);
 #elif SIMD_TARGET_VALUE == SIMD_NONE
   if (from.Address(0, 0) == to.Address(0, 0)) {
@@ -388,7 +396,7 @@ template <>
 struct ComputeTransposedScaledDCT<8> {
   template <class From, class To>
   SIMD_ATTR PIK_INLINE void operator()(const From& from, const To& to) {
-#if SIMD_TARGET_VALUE == SIMD_AVX2
+#if SIMD_TARGET_VALUE == SIMD_AVX2 || SIMD_TARGET_VALUE == SIMD_AVX512
     ComputeTransposedScaledDCT8_V8(from, to);
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     SIMD_ALIGN float block[8 * 8];
@@ -467,7 +475,7 @@ template <>
 struct ComputeTransposedScaledIDCT<8> {
   template <class From, class To>
   SIMD_ATTR PIK_INLINE void operator()(const From& from, const To& to) {
-#if SIMD_TARGET_VALUE == SIMD_AVX2
+#if SIMD_TARGET_VALUE == SIMD_AVX2 || SIMD_TARGET_VALUE == SIMD_AVX512
     ComputeTransposedScaledIDCT8_V8(from, to);
 #elif SIMD_TARGET_VALUE == SIMD_NONE
     SIMD_ALIGN float block[8 * 8];
@@ -511,7 +519,7 @@ template <size_t N, class From>
 static SIMD_ATTR PIK_INLINE float ComputeScaledDC(const From& from) {
   static_assert(N == 8, "Currently only 8x8 is supported");
 
-#if SIMD_TARGET_VALUE == SIMD_AVX2
+#if SIMD_TARGET_VALUE == SIMD_AVX2 || SIMD_TARGET_VALUE == SIMD_AVX512
   return ComputeScaledDC8_V8(from);
 #elif SIMD_TARGET_VALUE == SIMD_NONE
   const BlockDesc<N> d;
@@ -528,6 +536,10 @@ static SIMD_ATTR PIK_INLINE float ComputeScaledDC(const From& from) {
 #endif
 }
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
 #endif  // DCT_H_
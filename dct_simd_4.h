@@ -4,17 +4,23 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
-#ifndef DCT_SIMD_4_H_
+#if defined(DCT_SIMD_4_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef DCT_SIMD_4_H_
+#undef DCT_SIMD_4_H_
+#else
 #define DCT_SIMD_4_H_
+#endif
 
 #include "block.h"
 #include "compiler_specific.h"
 #include "dct_simd_any.h"
 #include "simd/simd.h"
 
-#if (SIMD_TARGET_VALUE != SIMD_AVX2) && (SIMD_TARGET_VALUE != SIMD_NONE)
+#if (SIMD_TARGET_VALUE != SIMD_AVX2) && (SIMD_TARGET_VALUE != SIMD_AVX512) && \
+    (SIMD_TARGET_VALUE != SIMD_NONE)
 
 namespace pik {
+namespace SIMD_NAMESPACE {
 
 // DCT building blocks that require SIMD vector length to be 4, e.g. SSE4.
 static_assert(BlockDesc<8>().N == 4, "Wrong vector size, must be 4");
@@ -156,6 +162,10 @@ SIMD_ATTR PIK_INLINE void ComputeTransposedScaledIDCT8_V4(const From& from,
   ColumnIDCT8(FromBlock<8>(block), to);
 }
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
 #endif  // SIMD_TARGET_VALUE
@@ -4,19 +4,25 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
-#ifndef DCT_SIMD_8_H_
+#if defined(DCT_SIMD_8_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef DCT_SIMD_8_H_
+#undef DCT_SIMD_8_H_
+#else
 #define DCT_SIMD_8_H_
+#endif
 
 #include "block.h"
 #include "compiler_specific.h"
 #include "dct_simd_any.h"
 #include "simd/simd.h"
 
-#if SIMD_TARGET_VALUE == SIMD_AVX2
+#if SIMD_TARGET_VALUE == SIMD_AVX2 || SIMD_TARGET_VALUE == SIMD_AVX512
 
 namespace pik {
+namespace SIMD_NAMESPACE {
 
-// DCT building blocks that require SIMD vector length to be 8, e.g. AVX2.
+// DCT building blocks that require 8-lane vectors, i.e. AVX2 (also used for
+// AVX-512, where BlockDesc<8> is an AVX2 part).
 static_assert(BlockDesc<8>().N == 8, "Wrong vector size, must be 8");
 
 // Each vector holds one row of the input/output block.
@@ -55,14 +61,14 @@ SIMD_ATTR PIK_INLINE void TransposeBlock8_V8(V& i0, V& i1, V& i2, V& i3, V& i4,
 
 template <class From>
 static SIMD_ATTR PIK_INLINE float ComputeScaledDC8_V8(const From& from) {
-  const auto q0 = from.Load(0, 0);
-  const auto q1 = from.Load(1, 0);
-  const auto q2 = from.Load(2, 0);
-  const auto q3 = from.Load(3, 0);
-  const auto q4 = from.Load(4, 0);
-  const auto q5 = from.Load(5, 0);
-  const auto q6 = from.Load(6, 0);
-  const auto q7 = from.Load(7, 0);
+  const auto q0 = from.template LoadPart<8>(0, 0);
+  const auto q1 = from.template LoadPart<8>(1, 0);
+  const auto q2 = from.template LoadPart<8>(2, 0);
+  const auto q3 = from.template LoadPart<8>(3, 0);
+  const auto q4 = from.template LoadPart<8>(4, 0);
+  const auto q5 = from.template LoadPart<8>(5, 0);
+  const auto q6 = from.template LoadPart<8>(6, 0);
+  const auto q7 = from.template LoadPart<8>(7, 0);
 
   const auto r0 = q0 + q1;
   const auto r2 = q2 + q3;
@@ -79,23 +85,23 @@ static SIMD_ATTR PIK_INLINE float ComputeScaledDC8_V8(const From& from) {
 
 template <class From, class To>
 SIMD_ATTR PIK_INLINE void TransposeBlock8_V8(const From& from, const To& to) {
-  auto i0 = from.Load(0, 0);
-  auto i1 = from.Load(1, 0);
-  auto i2 = from.Load(2, 0);
-  auto i3 = from.Load(3, 0);
-  auto i4 = from.Load(4, 0);
-  auto i5 = from.Load(5, 0);
-  auto i6 = from.Load(6, 0);
-  auto i7 = from.Load(7, 0);
+  auto i0 = from.template LoadPart<8>(0, 0);
+  auto i1 = from.template LoadPart<8>(1, 0);
+  auto i2 = from.template LoadPart<8>(2, 0);
+  auto i3 = from.template LoadPart<8>(3, 0);
+  auto i4 = from.template LoadPart<8>(4, 0);
+  auto i5 = from.template LoadPart<8>(5, 0);
+  auto i6 = from.template LoadPart<8>(6, 0);
+  auto i7 = from.template LoadPart<8>(7, 0);
   TransposeBlock8_V8(i0, i1, i2, i3, i4, i5, i6, i7);
-  to.Store(i0, 0, 0);
-  to.Store(i1, 1, 0);
-  to.Store(i2, 2, 0);
-  to.Store(i3, 3, 0);
-  to.Store(i4, 4, 0);
-  to.Store(i5, 5, 0);
-  to.Store(i6, 6, 0);
-  to.Store(i7, 7, 0);
+  to.template StorePart<8>(i0, 0, 0);
+  to.template StorePart<8>(i1, 1, 0);
+  to.template StorePart<8>(i2, 2, 0);
+  to.template StorePart<8>(i3, 3, 0);
+  to.template StorePart<8>(i4, 4, 0);
+  to.template StorePart<8>(i5, 5, 0);
+  to.template StorePart<8>(i6, 6, 0);
+  to.template StorePart<8>(i7, 7, 0);
 }
 
 template <class From, class To>
@@ -292,24 +298,24 @@ SIMD_ATTR PIK_INLINE void ComputeTransposedScaledIDCT8_V8(const From& from,
   // Finish d5,d7 and d0,d2 first so we can overlap more port5 (shuffles) with
   // other computations; they have a shorter dependency chain than d13/46.
 
-  auto i1 = from.Load(1, 0);
-  auto i7 = from.Load(7, 0);
+  auto i1 = from.template LoadPart<8>(1, 0);
+  auto i7 = from.template LoadPart<8>(7, 0);
   auto t05 = i7 - i1;           // !
   auto t04 = fadd(i7, k1, i1);  // 1
 
-  auto i3 = from.Load(3, 0);
-  auto i5 = from.Load(5, 0);
+  auto i3 = from.template LoadPart<8>(3, 0);
+  auto i5 = from.template LoadPart<8>(5, 0);
   auto t07 = i5 - i3;           // +1
   auto t06 = fadd(i5, k1, i3);  // +1
 
-  auto i2 = from.Load(2, 0);
-  auto i6 = from.Load(6, 0);
+  auto i2 = from.template LoadPart<8>(2, 0);
+  auto i6 = from.template LoadPart<8>(6, 0);
   auto t02 = i6 + i2;  // 1
   const auto c2 = broadcast<1>(c1234);
   SIMD_FENCE;
 
-  auto i0 = from.Load(0, 0);
-  auto i4 = from.Load(4, 0);
+  auto i0 = from.template LoadPart<8>(0, 0);
+  auto i4 = from.template LoadPart<8>(4, 0);
   auto t03 = i6 - i2;    // !
   auto ct05 = c2 * t05;  // !
   SIMD_FENCE;
@@ -452,12 +458,12 @@ SIMD_ATTR PIK_INLINE void ComputeTransposedScaledIDCT8_V8(const From& from,
   ct09 = _c1 * t09;
 
   const auto _c4 = broadcast<3>(_c1234);
-  to.Store(d0, 0, 0);
+  to.template StorePart<8>(d0, 0, 0);
   SIMD_FENCE;
 
   t19 = t08 + t17;   // !
   ct07 = _c4 * t07;  // !
-  to.Store(d7, 7, 0);
+  to.template StorePart<8>(d7, 7, 0);
   SIMD_FENCE;
 
   t11 = t00 - t02;  // 8
@@ -473,25 +479,29 @@ SIMD_ATTR PIK_INLINE void ComputeTransposedScaledIDCT8_V8(const From& from,
   t18 = mul_add(_c3, t12, ct07);  // !
 
   d2 = t16 + t20;
-  to.Store(d1, 1, 0);
+  to.template StorePart<8>(d1, 1, 0);
   SIMD_FENCE;
 
   d5 = t16 - t20;
-  to.Store(d6, 6, 0);
+  to.template StorePart<8>(d6, 6, 0);
   SIMD_FENCE;
 
   t21 = t18 - t20;  // !
 
   d4 = t11 - t21;
-  to.Store(d2, 2, 0);
+  to.template StorePart<8>(d2, 2, 0);
 
   d3 = t11 + t21;
-  to.Store(d5, 5, 0);
+  to.template StorePart<8>(d5, 5, 0);
 
-  to.Store(d4, 4, 0);
-  to.Store(d3, 3, 0);
+  to.template StorePart<8>(d4, 4, 0);
+  to.template StorePart<8>(d3, 3, 0);
 }
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
 #endif  // SIMD_TARGET_VALUE
@@ -4,14 +4,19 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
-#ifndef DCT_SIMD_ANY_H_
+#if defined(DCT_SIMD_ANY_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef DCT_SIMD_ANY_H_
+#undef DCT_SIMD_ANY_H_
+#else
 #define DCT_SIMD_ANY_H_
+#endif
 
 #include "block.h"
 #include "compiler_specific.h"
 #include "simd/simd.h"
 
 namespace pik {
+namespace SIMD_NAMESPACE {
 
 // DCT building blocks that does not require specific SIMD vector length.
 
@@ -19,22 +24,22 @@ template <class From, class To>
 SIMD_ATTR PIK_INLINE void CopyBlock8(const From& from, const To& to) {
   const BlockDesc<8> d;
   for (size_t i = 0; i < 8; i += d.N) {
-    const auto i0 = from.Load(0, i);
-    const auto i1 = from.Load(1, i);
-    const auto i2 = from.Load(2, i);
-    const auto i3 = from.Load(3, i);
-    const auto i4 = from.Load(4, i);
-    const auto i5 = from.Load(5, i);
-    const auto i6 = from.Load(6, i);
-    const auto i7 = from.Load(7, i);
-    to.Store(i0, 0, i);
-    to.Store(i1, 1, i);
-    to.Store(i2, 2, i);
-    to.Store(i3, 3, i);
-    to.Store(i4, 4, i);
-    to.Store(i5, 5, i);
-    to.Store(i6, 6, i);
-    to.Store(i7, 7, i);
+    const auto i0 = from.template LoadPart<8>(0, i);
+    const auto i1 = from.template LoadPart<8>(1, i);
+    const auto i2 = from.template LoadPart<8>(2, i);
+    const auto i3 = from.template LoadPart<8>(3, i);
+    const auto i4 = from.template LoadPart<8>(4, i);
+    const auto i5 = from.template LoadPart<8>(5, i);
+    const auto i6 = from.template LoadPart<8>(6, i);
+    const auto i7 = from.template LoadPart<8>(7, i);
+    to.template StorePart<8>(i0, 0, i);
+    to.template StorePart<8>(i1, 1, i);
+    to.template StorePart<8>(i2, 2, i);
+    to.template StorePart<8>(i3, 3, i);
+    to.template StorePart<8>(i4, 4, i);
+    to.template StorePart<8>(i5, 5, i);
+    to.template StorePart<8>(i6, 6, i);
+    to.template StorePart<8>(i7, 7, i);
   }
 }
 
@@ -1342,6 +1347,10 @@ SIMD_ATTR PIK_INLINE void ColumnIDCT32(const From& from, const To& to) {
   }
 }
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
 #endif  // THIRD_PARTY_DCT_SIMD_ANY_H_
@@ -55,8 +55,10 @@ void GatherBlock(const float* PIK_RESTRICT row, size_t stride,
 // afterwards, so that ComputeTransposedScaledIDCT() applied to each block will
 // return exactly the input image block.
 // REQUIRES: img.xsize() == N*W, img.ysize() == N*H
-SIMD_ATTR void TransposedScaledDCT(const Image3F& img,
-                                   Image3F* PIK_RESTRICT dct);
+// Block rows are independent, hence they are transformed in parallel on "pool"
+// (may be null). Uses the best SIMD target supported by the CPU.
+void TransposedScaledDCT(const Image3F& img, ThreadPool* pool,
+                         Image3F* PIK_RESTRICT dct);
 
 }  // namespace pik
 
@@ -0,0 +1,61 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+// Compiled once per target; see foreach_target.h.
+#include "dct.h"
+
+namespace pik {
+
+namespace SIMD_NAMESPACE {
+namespace {
+
+SIMD_ATTR void TransposedScaledDCT(const Image3F& img, ThreadPool* pool,
+                                   Image3F* PIK_RESTRICT dct) {
+  const constexpr size_t N = kBlockDim;
+  constexpr int block_size = N * N;
+  PIK_ASSERT(img.xsize() % N == 0);
+  PIK_ASSERT(img.ysize() % N == 0);
+  const size_t xsize_blocks = img.xsize() / N;
+  const size_t ysize_blocks = img.ysize() / N;
+  PIK_ASSERT(dct->xsize() == xsize_blocks * N * N);
+  PIK_ASSERT(dct->ysize() == ysize_blocks);
+
+  {
+    PROFILER_ZONE("dct TransposedScaled2");
+    const size_t stride = img.PixelsPerRow();
+    RunOnPool(
+        pool, 0, ysize_blocks,
+        [&](const int by, const int thread) SIMD_ATTR {
+          for (int c = 0; c < 3; ++c) {
+            const float* PIK_RESTRICT row_in = img.PlaneRow(c, by * N);
+            float* PIK_RESTRICT row_out = dct->PlaneRow(c, by);
+
+            for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+              ComputeTransposedScaledDCT<N>()(
+                  FromLines<N>(row_in + bx * N, stride),
+                  ScaleToBlock<N>(row_out + bx * block_size));
+            }
+          }
+        },
+        "TransposedScaledDCT");
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void TransposedScaledDCTImpl::operator()<SIMD_TARGET>(
+    const Image3F& img, ThreadPool* pool, Image3F* PIK_RESTRICT dct) const {
+  SIMD_NAMESPACE::TransposedScaledDCT(img, pool, dct);
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
@@ -9,16 +9,19 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "data_parallel.h"
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "arch_specific.h"
 #include "args.h"
 #include "common.h"
 #include "file_io.h"
 #include "image.h"
+#include "image_allocator.h"
 #include "os_specific.h"
 #include "padded_bytes.h"
 #include "pik.h"
@@ -73,6 +76,15 @@ void DecompressArgs::AddCommandLineOptions(
                           "chooses deblocking strength (4=normal).",
                           &params.gaborish, &ParseGaborishStrength);
 
+  cmdline->AddOptionValue('\0', "crop", "x,y,w,h",
+                          "decodes only the given region of the image",
+                          &params.crop, &ParseCropRect);
+
+  cmdline->AddOptionFlag('\0', "batch",
+                         "INPUT is a directory or list of files; OUTPUT, if "
+                         "any, a directory",
+                         &batch, &SetBooleanTrue);
+
   cmdline->AddOptionValue('\0', "print_profile", "0|1",
                           "print timing information before exiting",
                           &print_profile, &ParseOverride);
@@ -100,6 +112,10 @@ void DecompressStats::NotifyElapsed(double elapsed_seconds) {
   elapsed_.push_back(elapsed_seconds);
 }
 
+void DecompressStats::NotifyMemory(const Memory& memory) {
+  memory_.push_back(memory);
+}
+
 Status DecompressStats::Print(const CodecInOut& io, ThreadPool* pool) {
   ElapsedStats s;
   PIK_RETURN_IF_ERROR(SummarizeElapsed(&s));
@@ -125,6 +141,33 @@ Status DecompressStats::Print(const CodecInOut& io, ThreadPool* pool) {
           "%zu x %zu, %s%.2f MB/s [%.2f, %.2f]%s, %zu reps, %zu threads).\n",
           xsize, ysize, s.type, mbps, mbps_min, mbps_max, variability,
           elapsed_.size(), NumWorkerThreads(pool));
+
+  if (!memory_.empty()) {
+    const Memory& first = memory_.front();
+    const Memory& last = memory_.back();
+    fprintf(stderr,
+            "Image allocations: first decode %zu (%.2f MB, %zu page faults), "
+            "last %zu (%.2f MB, %zu page faults).\n",
+            static_cast<size_t>(first.num_allocated),
+            first.bytes_allocated * 1E-6,
+            static_cast<size_t>(first.page_faults),
+            static_cast<size_t>(last.num_allocated),
+            last.bytes_allocated * 1E-6,
+            static_cast<size_t>(last.page_faults));
+  }
+  return true;
+}
+
+Status DecompressStats::PrintBatch(const size_t num_images,
+                                   const size_t num_pixels, ThreadPool* pool) {
+  ElapsedStats s;
+  PIK_RETURN_IF_ERROR(SummarizeElapsed(&s));
+  fprintf(stderr,
+          "%zu images, %.2f MP, %s%.1f images/s, %.2f MP/s, %zu reps, %zu "
+          "threads.\n",
+          num_images, num_pixels * 1E-6, s.type, num_images / s.central_tendency,
+          num_pixels * 1E-6 / s.central_tendency, elapsed_.size(),
+          NumWorkerThreads(pool));
   return true;
 }
 
@@ -173,11 +216,14 @@ Status DecompressStats::SummarizeElapsed(ElapsedStats* s) {
 }
 
 // Called num_reps times.
-Status Decompress(CodecContext* codec_context, const PaddedBytes& compressed,
+Status Decompress(CodecContext* codec_context,
+                  const Span<const uint8_t> compressed,
                   const DecompressParams& params, ThreadPool* pool,
                   CodecInOut* PIK_RESTRICT io,
                   DecompressStats* PIK_RESTRICT stats) {
   PikInfo info;
+  const ImageMemoryCounters counters0 = GetImageMemoryCounters();
+  const uint64_t page_faults0 = PageFaults();
   const double t0 = Now();
   if (!PikToPixels(params, compressed, io, &info, pool)) {
     fprintf(stderr, "Failed to decompress.\n");
@@ -185,6 +231,14 @@ Status Decompress(CodecContext* codec_context, const PaddedBytes& compressed,
   }
   const double t1 = Now();
   stats->NotifyElapsed(t1 - t0);
+
+  const ImageMemoryCounters counters1 = GetImageMemoryCounters();
+  DecompressStats::Memory memory;
+  memory.num_allocated = counters1.num_allocated - counters0.num_allocated;
+  memory.bytes_allocated =
+      counters1.bytes_allocated - counters0.bytes_allocated;
+  memory.page_faults = PageFaults() - page_faults0;
+  stats->NotifyMemory(memory);
   return true;
 }
 
@@ -217,4 +271,108 @@ Status WriteOutput(const DecompressArgs& args, const CodecInOut& io) {
   return true;
 }
 
+namespace {
+
+// Reads pathnames from a directory or a file with one per line.
+Status ListInputs(const std::string& list, std::vector<std::string>* inputs) {
+  std::vector<std::string> names;
+  if (ListDirectory(list, &names)) {
+    inputs->clear();
+    for (const std::string& name : names) {
+      inputs->push_back(list + "/" + name);
+    }
+    return true;
+  }
+
+  PaddedBytes bytes;
+  PIK_RETURN_IF_ERROR(ReadFile(list, &bytes));
+  const std::string text(reinterpret_cast<const char*>(bytes.data()),
+                         bytes.size());
+  inputs->clear();
+  size_t begin = 0;
+  while (begin < text.size()) {
+    size_t end = text.find('\n', begin);
+    if (end == std::string::npos) end = text.size();
+    std::string line = text.substr(begin, end - begin);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (!line.empty()) inputs->push_back(line);
+    begin = end + 1;
+  }
+  return true;
+}
+
+// Returns the filename without directory and extension.
+std::string Stem(const std::string& pathname) {
+  const size_t slash = pathname.find_last_of("/\\");
+  const size_t begin = slash == std::string::npos ? 0 : slash + 1;
+  const size_t dot = pathname.find_last_of('.');
+  const size_t end = (dot == std::string::npos || dot < begin) ? pathname.size()
+                                                                : dot;
+  return pathname.substr(begin, end - begin);
+}
+
+}  // namespace
+
+Status DecompressBatch(const DecompressArgs& args, ThreadPool* pool,
+                       DecompressStats* PIK_RESTRICT stats) {
+  std::vector<std::string> pathnames;
+  if (!ListInputs(args.file_in, &pathnames)) {
+    fprintf(stderr, "Failed to list inputs from %s.\n", args.file_in);
+    return false;
+  }
+
+  // Map (or read) all inputs up front so that I/O is not included in timing.
+  std::vector<std::unique_ptr<MappedFile>> mapped(pathnames.size());
+  std::vector<PaddedBytes> read(pathnames.size());
+  std::vector<Span<const uint8_t>> inputs(pathnames.size());
+  for (size_t i = 0; i < pathnames.size(); ++i) {
+    mapped[i].reset(new MappedFile);
+    if (mapped[i]->Map(pathnames[i])) {
+      inputs[i] = Span<const uint8_t>(mapped[i]->data(), mapped[i]->size());
+    } else if (ReadFile(pathnames[i], &read[i])) {
+      inputs[i] = read[i];
+    } else {
+      fprintf(stderr, "Failed to read %s.\n", pathnames[i].c_str());
+      return false;
+    }
+  }
+
+  PikDecoder decoder(pool);
+  std::atomic<size_t> num_pixels{0};
+  for (size_t rep = 0; rep < args.num_reps; ++rep) {
+    const bool is_last = rep == args.num_reps - 1;
+    num_pixels.store(0, std::memory_order_relaxed);
+    const double t0 = Now();
+    const bool ok = decoder.DecodeBatch(
+        args.params, inputs, [&](const size_t index, const CodecInOut* io) {
+          num_pixels.fetch_add(io->xsize() * io->ysize(),
+                               std::memory_order_relaxed);
+          if (!is_last || args.file_out == nullptr) return true;
+          const std::string pathname =
+              std::string(args.file_out) + "/" + Stem(pathnames[index]) +
+              ".png";
+          const size_t bits_per_sample = args.bits_per_sample == 0
+                                             ? io->original_bits_per_sample()
+                                             : args.bits_per_sample;
+          if (!io->EncodeToFile(io->dec_c_original, bits_per_sample,
+                                pathname)) {
+            fprintf(stderr, "Failed to write %s.\n", pathname.c_str());
+            return false;
+          }
+          return true;
+        });
+    if (!ok) {
+      fprintf(stderr, "Failed to decompress or write some images.\n");
+      return false;
+    }
+    // Writing is not representative of decode speed; only time earlier reps
+    // unless there is just one.
+    if (!is_last || args.file_out == nullptr || args.num_reps == 1) {
+      stats->NotifyElapsed(Now() - t0);
+    }
+  }
+
+  return stats->PrintBatch(inputs.size(), num_pixels.load(), pool);
+}
+
 }  // namespace pik
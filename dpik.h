@@ -15,6 +15,7 @@
 #include "data_parallel.h"
 #include "padded_bytes.h"
 #include "pik_params.h"
+#include "span.h"
 #include "status.h"
 
 namespace pik {
@@ -40,14 +41,29 @@ struct DecompressArgs {
   DecompressParams params;
   size_t num_reps = 1;
   Override print_profile = Override::kDefault;
+  // INPUT is a directory or a file listing one path per line, and OUTPUT (if
+  // any) a directory for the decoded images.
+  bool batch = false;
 };
 
 class DecompressStats {
  public:
   void NotifyElapsed(double elapsed_seconds);
 
+  // Image memory obtained from the system and page faults during one decode.
+  // Once buffers are recycled, repeated decodes should not allocate.
+  struct Memory {
+    uint64_t num_allocated;
+    uint64_t bytes_allocated;
+    uint64_t page_faults;
+  };
+  void NotifyMemory(const Memory& memory);
+
   Status Print(const CodecInOut& io, ThreadPool* pool);
 
+  // For DecompressBatch, which calls NotifyElapsed once per batch.
+  Status PrintBatch(size_t num_images, size_t num_pixels, ThreadPool* pool);
+
  private:
   struct ElapsedStats {
     double central_tendency;
@@ -60,16 +76,23 @@ class DecompressStats {
   Status SummarizeElapsed(ElapsedStats* s);
 
   std::vector<double> elapsed_;
+  std::vector<Memory> memory_;
 };
 
 
-Status Decompress(CodecContext* codec_context, const PaddedBytes& compressed,
+Status Decompress(CodecContext* codec_context,
+                  const Span<const uint8_t> compressed,
                   const DecompressParams& params, ThreadPool* pool,
                   CodecInOut* PIK_RESTRICT io,
                   DecompressStats* PIK_RESTRICT stats);
 
 Status WriteOutput(const DecompressArgs& args, const CodecInOut& io);
 
+// Decodes all images listed by args.file_in num_reps times, reusing the
+// decoder state, and writes them to the args.file_out directory (as PNG).
+Status DecompressBatch(const DecompressArgs& args, ThreadPool* pool,
+                       DecompressStats* PIK_RESTRICT stats);
+
 }  // namespace pik
 
 #endif  // DPIK_H_
@@ -6,14 +6,12 @@
 
 #include "dpik.h"
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
-
 #include "cmdline.h"
 #include "file_io.h"
 #include "os_specific.h"
 #include "padded_bytes.h"
 #include "profiler.h"
+#include "span.h"
 
 namespace pik {
 namespace {
@@ -28,16 +26,12 @@ int DecompressMain(int argc, char* argv[]) {
   }
 
   const int bits = TargetBitfield().Bits();
-  if ((bits & SIMD_ENABLE) != SIMD_ENABLE) {
-    fprintf(stderr, "CPU does not support all enabled targets => exiting.\n");
+  // Dispatched code (e.g. AVX-512) is optional; static code is not.
+  if ((bits & SIMD_TARGET::value) != SIMD_TARGET::value) {
+    fprintf(stderr, "CPU does not support the static target => exiting.\n");
     return 1;
   }
 
-  PaddedBytes compressed;
-  if (!ReadFile(args.file_in, &compressed)) return 1;
-  fprintf(stderr, "Read %zu compressed bytes\n", compressed.size());
-
-  CodecContext codec_context;
   ThreadPool pool(args.num_threads);
   DecompressStats stats;
 
@@ -51,6 +45,28 @@ int DecompressMain(int argc, char* argv[]) {
     }
   });
 
+  if (args.batch) {
+    if (!DecompressBatch(args, &pool, &stats)) return 1;
+    if (args.print_profile == Override::kOn) {
+      PROFILER_PRINT_RESULTS();
+    }
+    return 0;
+  }
+
+  // Mapping avoids copying the whole file before decoding can begin. Falls
+  // back to reading, e.g. for pipes or file systems that cannot be mapped.
+  MappedFile mapped;
+  PaddedBytes read;
+  Span<const uint8_t> compressed;
+  if (mapped.Map(args.file_in)) {
+    compressed = mapped;
+  } else {
+    if (!ReadFile(args.file_in, &read)) return 1;
+    compressed = read;
+  }
+  fprintf(stderr, "Read %zu compressed bytes\n", compressed.size());
+
+  CodecContext codec_context;
   CodecInOut io(&codec_context);
   for (size_t i = 0; i < args.num_reps; ++i) {
     if (!Decompress(&codec_context, compressed, args.params, &pool, &io,
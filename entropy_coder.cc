@@ -200,16 +200,14 @@ void ExpandDC(const Rect& rect_dc, Image3S* PIK_RESTRICT dc,
   }
 }
 
-void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
-                       int32_t* PIK_RESTRICT order) {
+void CountZeroCoefficients(const Image3S& ac, const Rect& rect,
+                           int32_t* PIK_RESTRICT num_zeros) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
   size_t xsize_blocks = rect.xsize() / block_size;
   size_t ysize_blocks = rect.ysize();
-  const int32_t* natural_coeff_order = NaturalCoeffOrder();
 
   // Count number of zero coefficients, separately for each DCT band.
-  int32_t num_zeros[block_size * kOrderContexts] = {0};
   for (int c = 0; c < 3; ++c) {
     for (size_t by = 0; by < ysize_blocks; ++by) {
       const int16_t* PIK_RESTRICT row = rect.ConstPlaneRow(ac, c, by);
@@ -222,6 +220,13 @@ void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
       }
     }
   }
+}
+
+void ComputeCoeffOrder(const int32_t* PIK_RESTRICT num_zeros,
+                       int32_t* PIK_RESTRICT order) {
+  constexpr int N = kBlockDim;
+  constexpr int block_size = N * N;
+  const int32_t* natural_coeff_order = NaturalCoeffOrder();
 
   for (uint8_t ctx = 0; ctx < kOrderContexts; ++ctx) {
     struct PosAndCount {
@@ -254,6 +259,15 @@ void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
   }
 }
 
+void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
+                       int32_t* PIK_RESTRICT order) {
+  constexpr int N = kBlockDim;
+  constexpr int block_size = N * N;
+  int32_t num_zeros[block_size * kOrderContexts] = {0};
+  CountZeroCoefficients(ac, rect, num_zeros);
+  ComputeCoeffOrder(num_zeros, order);
+}
+
 void EncodeCoeffOrder(const int32_t* PIK_RESTRICT order,
                       size_t* PIK_RESTRICT storage_ix, uint8_t* storage) {
   constexpr int N = kBlockDim;
@@ -316,21 +330,23 @@ void ExtractNumNZeroes(const Rect& rect, const ImageS& coeffs,
   }
 }
 
-std::string EncodeCoeffOrders(const int32_t* order, PikInfo* pik_info) {
+void EncodeCoeffOrders(const int32_t* order, BitWriter* writer,
+                       PikInfo* pik_info) {
   constexpr int N = kBlockDim;
   constexpr int block_size = N * N;
-  std::string encoded_coeff_order(kOrderContexts * 1024, 0);
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&encoded_coeff_order[0]);
-  size_t storage_ix = 0;
+  const size_t max_bits = kOrderContexts * 1024 * kBitsPerByte;
+  const size_t begin = writer->BitsWritten();
+  writer->ReserveBits(max_bits);
   for (size_t c = 0; c < kOrderContexts; c++) {
-    EncodeCoeffOrder(&order[c * block_size], &storage_ix, storage);
+    EncodeCoeffOrder(&order[c * block_size], writer->storage_ix(),
+                     writer->storage());
   }
-  PIK_CHECK(storage_ix < encoded_coeff_order.size() * kBitsPerByte);
-  encoded_coeff_order.resize((storage_ix + 7) / kBitsPerByte);
+  PIK_CHECK(writer->BitsWritten() - begin < max_bits);
+  writer->ZeroPadToByte();
   if (pik_info) {
-    pik_info->layers[kLayerOrder].total_size += encoded_coeff_order.size();
+    pik_info->layers[kLayerOrder].total_size +=
+        (writer->BitsWritten() - begin) / kBitsPerByte;
   }
-  return encoded_coeff_order;
 }
 
 // Number of clusters is encoded with VarLenUint8 - see EncodeContextMap and
@@ -632,10 +648,11 @@ class HistogramBuilder {
 
 }  // namespace
 
-std::string BuildAndEncodeHistograms(
-    size_t num_contexts, const std::vector<std::vector<Token>>& tokens,
-    std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info) {
+void BuildAndEncodeHistograms(size_t num_contexts,
+                              const std::vector<std::vector<Token>>& tokens,
+                              std::vector<ANSEncodingData>* codes,
+                              std::vector<uint8_t>* context_map,
+                              BitWriter* writer, PikImageSizeInfo* info) {
   // Build histograms.
   HistogramBuilder builder(num_contexts);
   for (size_t i = 0; i < tokens.size(); ++i) {
@@ -646,31 +663,25 @@ std::string BuildAndEncodeHistograms(
   }
   // Encode histograms.
   const size_t max_out_size = 1024 * (num_contexts + 4);
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
-  builder.BuildAndStoreEntropyCodes(codes, context_map, &storage_ix, storage,
-                                    info);
+  const size_t begin = writer->BitsWritten();
+  writer->ReserveBits(max_out_size * kBitsPerByte);
+  builder.BuildAndStoreEntropyCodes(codes, context_map, writer->storage_ix(),
+                                    writer->storage(), info);
   // Close the histogram bit stream.
-  size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
-  WriteBits(jump_bits, 0, &storage_ix, storage);
-  PIK_ASSERT(storage_ix % kBitsPerByte == 0);
-  const size_t histo_bytes = storage_ix >> 3;
+  writer->ZeroPadToByte();
+  const size_t histo_bytes = (writer->BitsWritten() - begin) / kBitsPerByte;
   PIK_CHECK(histo_bytes <= max_out_size);
-  output.resize(histo_bytes);
   if (info) {
     info->num_clustered_histograms += codes->size();
     info->histogram_size += histo_bytes;
     info->total_size += histo_bytes;
   }
-  return output;
 }
 
-std::string BuildAndEncodeHistogramsFast(
+void BuildAndEncodeHistogramsFast(
     const std::vector<std::vector<Token>>& tokens,
     std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info) {
+    BitWriter* writer, PikImageSizeInfo* info) {
   *context_map = StaticContextMap();
   // Build histograms from tokens.
   std::vector<uint32_t> histograms(kNumStaticContexts << 8);
@@ -687,80 +698,81 @@ std::string BuildAndEncodeHistogramsFast(
     }
   }
   const size_t max_out_size = kNumStaticContexts * 1024;
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  const size_t begin = writer->BitsWritten();
+  writer->ReserveBits(max_out_size * kBitsPerByte);
   // Encode the histograms.
-  EncodeContextMap(*context_map, kNumStaticContexts, &storage_ix, storage);
+  EncodeContextMap(*context_map, kNumStaticContexts, writer->storage_ix(),
+                   writer->storage());
   for (size_t c = 0; c < kNumStaticContexts; ++c) {
     ANSEncodingData code;
-    code.BuildAndStore(&histograms[c << 8], 256, &storage_ix, storage);
+    code.BuildAndStore(&histograms[c << 8], 256, writer->storage_ix(),
+                       writer->storage());
     codes->emplace_back(std::move(code));
   }
   // Close the histogram bit stream.
-  WriteZeroesToByteBoundary(&storage_ix, storage);
-  const size_t histo_bytes = (storage_ix >> 3);
+  writer->ZeroPadToByte();
+  const size_t histo_bytes = (writer->BitsWritten() - begin) / kBitsPerByte;
   PIK_CHECK(histo_bytes <= max_out_size);
-  output.resize(histo_bytes);
   if (info) {
     info->num_clustered_histograms += codes->size();
     info->histogram_size += histo_bytes;
   }
-  return output;
 }
 
-std::string WriteTokens(const std::vector<Token>& tokens,
-                        const std::vector<ANSEncodingData>& codes,
-                        const std::vector<uint8_t>& context_map,
-                        PikImageSizeInfo* pik_info) {
+void WriteTokens(const std::vector<Token>& tokens,
+                 const std::vector<ANSEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info, size_t num_ans_states) {
+  PIK_ASSERT(1 <= num_ans_states && num_ans_states <= kANSMaxStates);
   const size_t max_out_size = 4 * tokens.size() + 4096;
-  std::string output(max_out_size, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  const size_t begin = writer->BitsWritten();
+  writer->ReserveBits(max_out_size * kBitsPerByte);
+  size_t* storage_ix = writer->storage_ix();
+  uint8_t* storage = writer->storage();
   size_t num_extra_bits = 0;
   PIK_ASSERT(kANSBufferSize <= (1 << 16));
   for (int start = 0; start < tokens.size(); start += kANSBufferSize) {
     std::vector<uint32_t> out;
     out.reserve(kANSBufferSize);
     const int end = std::min<int>(start + kANSBufferSize, tokens.size());
-    ANSCoder ans;
+    ANSCoder ans[kANSMaxStates];
     for (int i = end - 1; i >= start; --i) {
       const Token token = tokens[i];
       const uint8_t histo_idx = context_map[token.context];
       const ANSEncSymbolInfo info = codes[histo_idx].ans_table[token.symbol];
       uint8_t nbits = 0;
-      uint32_t bits = ans.PutSymbol(info, &nbits);
+      uint32_t bits = ans[(i - start) % num_ans_states].PutSymbol(info, &nbits);
       if (nbits == 16) {
         out.push_back(((i - start) << 16) | bits);
       }
     }
-    const uint32_t state = ans.GetState();
-    WriteBits(16, (state >> 16) & 0xffff, &storage_ix, storage);
-    WriteBits(16, state & 0xffff, &storage_ix, storage);
+    for (size_t s = 0; s < num_ans_states; ++s) {
+      const uint32_t state = ans[s].GetState();
+      WriteBits(16, (state >> 16) & 0xffff, storage_ix, storage);
+      WriteBits(16, state & 0xffff, storage_ix, storage);
+    }
     int tokenidx = start;
     for (int i = out.size(); i >= 0; --i) {
       int nextidx = i > 0 ? start + (out[i - 1] >> 16) : end;
       for (; tokenidx < nextidx; ++tokenidx) {
         const Token token = tokens[tokenidx];
-        WriteBits(token.nbits, token.bits, &storage_ix, storage);
+        WriteBits(token.nbits, token.bits, storage_ix, storage);
         num_extra_bits += token.nbits;
       }
       if (i > 0) {
-        WriteBits(16, out[i - 1] & 0xffff, &storage_ix, storage);
+        WriteBits(16, out[i - 1] & 0xffff, storage_ix, storage);
       }
     }
   }
-  const size_t out_size = (storage_ix + 7) >> 3;
+  const size_t num_bits = writer->BitsWritten() - begin;
+  writer->ZeroPadToByte();
+  const size_t out_size = (writer->BitsWritten() - begin) / kBitsPerByte;
   PIK_CHECK(out_size <= max_out_size);
-  output.resize(out_size);
   if (pik_info) {
-    pik_info->entropy_coded_bits += storage_ix - num_extra_bits;
+    pik_info->entropy_coded_bits += num_bits - num_extra_bits;
     pik_info->extra_bits += num_extra_bits;
     pik_info->total_size += out_size;
   }
-  return output;
 }
 
 namespace {
@@ -768,12 +780,14 @@ namespace {
 const constexpr int kRleSymStart = 18;
 }  // namespace
 
-std::string EncodeImageData(const Rect& rect, const Image3S& img,
-                            PikImageSizeInfo* info) {
+void EncodeImageData(const Rect& rect, const Image3S& img, BitWriter* writer,
+                     PikImageSizeInfo* info) {
   const size_t xsize = rect.xsize();
   const size_t ysize = rect.ysize();
 
-  std::string best;
+  // Both candidates are written to `writer`; the larger one is then removed.
+  const size_t begin = writer->BitsWritten();
+  size_t best_bits = 0;
   PikImageSizeInfo best_info;
 
   for (bool rle : {true, false}) {
@@ -811,18 +825,24 @@ std::string EncodeImageData(const Rect& rect, const Image3S& img,
     std::vector<ANSEncodingData> codes;
     std::vector<uint8_t> context_map;
     PikImageSizeInfo info;
-    std::string enc =
-        BuildAndEncodeHistograms(3, tokens, &codes, &context_map, &info);
-    enc += WriteTokens(tokens[0], codes, context_map, &info);
-    if (best.empty() || best.size() > enc.size()) {
-      best = std::move(enc);
+    const size_t candidate_begin = writer->BitsWritten();
+    BuildAndEncodeHistograms(3, tokens, &codes, &context_map, writer, &info);
+    WriteTokens(tokens[0], codes, context_map, writer, &info);
+    const size_t candidate_bits = writer->BitsWritten() - candidate_begin;
+    if (candidate_begin == begin) {
+      best_bits = candidate_bits;
       best_info = info;
+    } else if (candidate_bits < best_bits) {
+      writer->Erase(begin, candidate_begin);
+      best_bits = candidate_bits;
+      best_info = info;
+    } else {
+      writer->Rewind(candidate_begin);
     }
   }
   if (info) {
     info->Assimilate(best_info);
   }
-  return best;
 }
 
 bool DecodeHistograms(BitReader* br, const size_t num_contexts,
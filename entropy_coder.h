@@ -32,6 +32,7 @@
 #include "multipass_handler.h"
 #include "pik_info.h"
 #include "status.h"
+#include "write_bits.h"
 
 // Entropy coding and context modeling of DC and AC coefficients, as well as AC
 // strategy and quantization field.
@@ -193,14 +194,23 @@ void ExpandDC(const Rect& rect_dc, Image3S* PIK_RESTRICT dc,
 void ComputeCoeffOrder(const Image3S& ac, const Rect& rect,
                        int32_t* PIK_RESTRICT order);
 
-std::string EncodeCoeffOrders(const int32_t* PIK_RESTRICT order,
-                              PikInfo* PIK_RESTRICT pik_info);
+// The two steps of the above, which allow computing one order for several
+// images: adds the number of zero coefficients in `rect` of `ac` to
+// num_zeros[kOrderContexts * kBlockDim * kBlockDim], separately for each DCT
+// band, and then derives the order from these counts.
+void CountZeroCoefficients(const Image3S& ac, const Rect& rect,
+                           int32_t* PIK_RESTRICT num_zeros);
+void ComputeCoeffOrder(const int32_t* PIK_RESTRICT num_zeros,
+                       int32_t* PIK_RESTRICT order);
+
+void EncodeCoeffOrders(const int32_t* PIK_RESTRICT order, BitWriter* writer,
+                       PikInfo* PIK_RESTRICT pik_info);
 
 // Encodes the `rect` area of `img`.
 // Typically used for DC.
 // See also DecodeImageData.
-std::string EncodeImageData(const Rect& rect, const Image3S& img,
-                            PikImageSizeInfo* info);
+void EncodeImageData(const Rect& rect, const Image3S& img, BitWriter* writer,
+                     PikImageSizeInfo* info);
 
 // See also EncodeImageData.
 bool DecodeImageData(BitReader* PIK_RESTRICT br,
@@ -264,22 +274,27 @@ bool DecodeAcStrategy(BitReader* PIK_RESTRICT br,
                       const AcStrategyImage* PIK_RESTRICT hint);
 
 // Apply context clustering, compute histograms and encode them.
-std::string BuildAndEncodeHistograms(
-    size_t num_contexts, const std::vector<std::vector<Token> >& tokens,
-    std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info);
+// The encoders below append to the byte-aligned `writer` and leave it
+// byte-aligned.
+void BuildAndEncodeHistograms(size_t num_contexts,
+                              const std::vector<std::vector<Token> >& tokens,
+                              std::vector<ANSEncodingData>* codes,
+                              std::vector<uint8_t>* context_map,
+                              BitWriter* writer, PikImageSizeInfo* info);
 
 // Same as BuildAndEncodeHistograms, but with static context clustering.
-std::string BuildAndEncodeHistogramsFast(
+void BuildAndEncodeHistogramsFast(
     const std::vector<std::vector<Token> >& tokens,
     std::vector<ANSEncodingData>* codes, std::vector<uint8_t>* context_map,
-    PikImageSizeInfo* info);
-
-// Write the tokens to a string.
-std::string WriteTokens(const std::vector<Token>& tokens,
-                        const std::vector<ANSEncodingData>& codes,
-                        const std::vector<uint8_t>& context_map,
-                        PikImageSizeInfo* pik_info);
+    BitWriter* writer, PikImageSizeInfo* info);
+
+// Write the tokens to `writer`. With num_ans_states > 1, consecutive tokens
+// are coded with that many interleaved ANS states; the decoder must construct
+// its ANSSymbolReader with the same number.
+void WriteTokens(const std::vector<Token>& tokens,
+                 const std::vector<ANSEncodingData>& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer,
+                 PikImageSizeInfo* pik_info, size_t num_ans_states = 1);
 
 bool DecodeCoeffOrder(int32_t* order, BitReader* br);
 
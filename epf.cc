@@ -12,6 +12,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <cmath>
 #include <numeric>  // std::accumulate
 
 #ifndef EPF_DUMP_SIGMA
@@ -21,8 +23,6 @@
 #define EPF_ENABLE_STATS 0
 #endif
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "ac_strategy.h"
 #include "common.h"
 #include "descriptive_statistics.h"
@@ -49,6 +49,28 @@ namespace pik {
 
 EpfParams::EpfParams() { Bundle::Init(this); }
 
+void EncodeEpfRange(const float range_min, const float range_max,
+                    uint32_t range_bits[2]) {
+  static_assert(sizeof(float) == sizeof(uint32_t), "Float size mismatch");
+  memcpy(&range_bits[0], &range_min, sizeof(float));
+  memcpy(&range_bits[1], &range_max, sizeof(float));
+}
+
+Status DecodeEpfRange(const uint32_t range_bits[2],
+                      EpfParams* PIK_RESTRICT epf_params) {
+  float range_min, range_max;
+  memcpy(&range_min, &range_bits[0], sizeof(float));
+  memcpy(&range_max, &range_bits[1], sizeof(float));
+  // Also rejects NaN.
+  if (!(range_min <= range_max) || !std::isfinite(range_max - range_min)) {
+    return PIK_FAILURE("Invalid EPF range");
+  }
+  epf_params->nonserialized_has_range = true;
+  epf_params->nonserialized_range_min = range_min;
+  epf_params->nonserialized_range_max = range_max;
+  return true;
+}
+
 }  // namespace pik
 
 // Must include "normally" so the build system understands the dependency.
@@ -13,6 +13,7 @@
 #include "ac_strategy.h"
 #include "field_encodings.h"
 #include "image.h"
+#include "status.h"
 
 namespace pik {
 
@@ -43,8 +44,22 @@ struct EpfParams {
   uint32_t sigma;  // ignored if !enable_adaptive, otherwise >= kMinSigma.
 
   bool use_sharpened;
+
+  // Not serialized; set by DecodeEpfRange. If true, the guide is scaled by
+  // this range rather than the min/max of the entire input, which makes the
+  // filter output independent of pixels outside the kBorder neighborhood.
+  bool nonserialized_has_range = false;
+  float nonserialized_range_min = 0.0f;
+  float nonserialized_range_max = 0.0f;
 };
 
+// Stores the range of the guide as float bits (see PassHeader::kEpfRange).
+void EncodeEpfRange(float range_min, float range_max, uint32_t range_bits[2]);
+
+// Sets the nonserialized range of "epf_params" from EncodeEpfRange output.
+// Fails if the range is not finite or empty.
+Status DecodeEpfRange(const uint32_t range_bits[2], EpfParams* epf_params);
+
 // Unit test. Call via dispatch::ForeachTarget.
 struct EdgePreservingFilterTest {
   template <class Target>
@@ -15,6 +15,50 @@
 #endif
 
 namespace pik {
+
+// TODO(user): native AVX-512. The filter hard-codes AVX2 vector sizes (e.g. the
+// SAD buffers and mpsadbw), so the AVX512 instantiation only forwards to the
+// AVX2 code, i.e. Dispatch runs AVX2 instructions on AVX-512 CPUs.
+// foreach_target generates AVX2 before AVX512.
+#if SIMD_TARGET_VALUE == SIMD_AVX512
+
+template <>
+void InitEdgePreservingFilter::operator()<SIMD_TARGET>() const {
+  operator()<AVX2>();
+}
+
+template <>
+void EdgePreservingFilter::operator()<SIMD_TARGET>(
+    const Image3F& in_guide, const Image3F& in, const ImageI* ac_quant,
+    float sigma_mul, const AcStrategyImage& ac_strategy,
+    const EpfParams& epf_params, ThreadPool* pool, Image3F* smoothed,
+    EpfStats* epf_stats) const {
+  operator()<AVX2>(in_guide, in, ac_quant, sigma_mul, ac_strategy, epf_params,
+                   pool, smoothed, epf_stats);
+}
+
+template <>
+void EdgePreservingFilter::operator()<SIMD_TARGET>(const Image3F& in_guide,
+                                                   const Image3F& in,
+                                                   const EpfParams& epf_params,
+                                                   float* PIK_RESTRICT stretch,
+                                                   Image3F* smoothed) const {
+  operator()<AVX2>(in_guide, in, epf_params, stretch, smoothed);
+}
+
+template <>
+void EdgePreservingFilterTest::operator()<SIMD_TARGET>() const {
+  operator()<AVX2>();
+}
+
+template <>
+float EdgePreservingFilterTest::operator()<SIMD_TARGET>(int sigma,
+                                                        int sad) const {
+  return operator()<AVX2>(sigma, sad);
+}
+
+#else  // SIMD_TARGET_VALUE != SIMD_AVX512
+
 namespace SIMD_NAMESPACE {
 namespace {
 
@@ -1011,6 +1055,16 @@ SIMD_ATTR void MinMax(const Image3F& in, ThreadPool* pool,
   workers[0].Finalize(min, max);
 }
 
+// Replaces the min/max of the guide input by the range from the bitstream, if
+// any, because the former depend on the entire image.
+SIMD_ATTR void UseEpfRange(const EpfParams& epf_params,
+                           std::array<float, 3>* SIMD_RESTRICT min,
+                           std::array<float, 3>* SIMD_RESTRICT max) {
+  if (!epf_params.nonserialized_has_range) return;
+  min->fill(epf_params.nonserialized_range_min);
+  max->fill(epf_params.nonserialized_range_max);
+}
+
 // Returns a guide image for "in" (padded). u8 is required for the SAD
 // hardware acceleration; precomputing is faster than converting a window for
 // each pixel.
@@ -1048,6 +1102,7 @@ SIMD_ATTR Image3B MakeGuide(const Image3F& padded,
   c_min[0] = c_min[1] = c_min[2] = all_min;
 #endif
 
+  const auto v255 = set1(df, 255.0f);
   RunOnPool(pool, 0, ysize, [&](const int task, const int thread) SIMD_ATTR {
     const size_t y = task;
     for (size_t c = 0; c < 3; ++c) {
@@ -1059,7 +1114,10 @@ SIMD_ATTR Image3B MakeGuide(const Image3F& padded,
 
       size_t x = 0;
       for (; x < xsize; x += df.N) {
-        const auto scaled = (load(df, padded_row + x) - vmin) * vmul;
+        auto scaled = (load(df, padded_row + x) - vmin) * vmul;
+        // Only pixels outside of a range from the bitstream exceed [0, 255].
+        // (Qualified because the min/max arguments hide the functions.)
+        scaled = pik::min(pik::max(scaled, setzero(df)), v255);
         const auto i32 = convert_to(di, scaled);
         const auto bytes = u8_from_u32(cast_to(du, i32));
         store(bytes, d8, guide_row + x);
@@ -1156,6 +1214,7 @@ SIMD_ATTR void AdaptiveFilter(const Image3F& in_guide, const Image3F& in,
       epf_stats->s_ranges[c].Notify(max[c] - min[c]);
     }
   }
+  UseEpfRange(epf_params, &min, &max);
   const float all_max = *std::max_element(max.begin(), max.end());
   const float all_min = *std::min_element(min.begin(), min.end());
   const float stretch = all_min == all_max ? 1.f : 255.0f / (all_max - all_min);
@@ -1342,6 +1401,7 @@ void Filter(const Image3F& in_guide, const Image3F& in,
   Image3F padded_guide(xsize + 2 * kBorder, ysize + 2 * kBorder);
   MinMax(epf_params.use_sharpened ? in : in_guide, /*pool=*/nullptr, &min, &max,
          &padded_guide);
+  UseEpfRange(epf_params, &min, &max);
 
   const float all_max = *std::max_element(max.begin(), max.end());
   const float all_min = *std::min_element(min.begin(), min.end());
@@ -1397,6 +1457,7 @@ float EdgePreservingFilterTest::operator()<SIMD_TARGET>(int sigma,
   return SIMD_NAMESPACE::GetWeightForTest(weight_func, sad);
 }
 
+#endif  // SIMD_TARGET_VALUE == SIMD_AVX512
 }  // namespace pik
 
 #endif  // SIMD_ATTR_IMPL
@@ -31,6 +31,9 @@ static constexpr uint32_t kU32Direct3Plus8 = 0x52828180u;
 static constexpr uint32_t kU32Direct2348 = 0x88848382u;
 static constexpr uint32_t kU32Direct1248 = 0x88848281u;
 
+// Four direct values [1, 4].
+static constexpr uint32_t kU32Direct1To4 = 0x84838281u;
+
 enum class BytesEncoding {
   // Values are determined by kU32Direct3Plus8.
   kNone = 0,  // Not present, don't write size
@@ -6,7 +6,13 @@
 
 #include "gaborish.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "common.h"
 #include "convolve.h"
+#include "simd/simd.h"
 
 namespace pik {
 
@@ -88,7 +94,42 @@ struct Gaborish3_500 {
 
 }  // namespace kernel
 
-Image3F GaborishInverse(const Image3F& in, double mul) {
+// Per-target implementations of the functions in gaborish.h.
+struct PadAndGaborishInverseImpl {
+  // "weights" are the lower-right quadrant of the normalized 5x5 kernel.
+  template <class Target>
+  void operator()(const Image3F& in, const float (&weights)[9],
+                  ThreadPool* pool, Image3F* out) const;
+};
+
+struct ConvolveGaborishImpl {
+  template <class Target>
+  Image3F operator()(Image3F&& in, GaborishStrength strength,
+                     ThreadPool* pool) const;
+};
+
+struct AddGaborishImpl {
+  template <class Target>
+  TFNode* operator()(const TFPorts& xyb, GaborishStrength strength,
+                     TFBuilder* builder) const;
+};
+
+}  // namespace pik
+
+// Must include "normally" so the build system understands the dependency.
+#include "gaborish_target.cc"
+
+#define SIMD_ATTR_IMPL "gaborish_target.cc"
+#include "simd/foreach_target.h"
+
+namespace pik {
+
+Image3F GaborishInverse(const Image3F& in, double mul, ThreadPool* pool) {
+  return PadAndGaborishInverse(in, 1, mul, pool);
+}
+
+Image3F PadAndGaborishInverse(const Image3F& in, const size_t N,
+                              const double mul, ThreadPool* pool) {
   PIK_ASSERT(mul > 0.0);
   PROFILER_FUNC;
 
@@ -111,34 +152,36 @@ Image3F GaborishInverse(const Image3F& in, double mul) {
       static_cast<float>(mul * kGaborish[3]),
       static_cast<float>(mul * kGaborish[4]),
   };
-  Image3F sharpened(in.xsize(), in.ysize());
-  slow::SymmetricConvolution<2, WrapClamp>::Run(in, in.xsize(), in.ysize(),
-                                                smooth_weights5, &sharpened);
+  // Normalize as slow::SymmetricConvolution does (sum of the whole kernel).
+  double sum = 0.0;
+  for (int ky = -2; ky <= 2; ++ky) {
+    for (int kx = -2; kx <= 2; ++kx) {
+      sum += smooth_weights5[std::abs(ky) * 3 + std::abs(kx)];
+    }
+  }
+  const float norm = sum == 0.0 ? 1.0f : 1.0 / sum;
+  float normalized[9];
+  for (size_t i = 0; i < 9; ++i) {
+    normalized[i] = smooth_weights5[i] * norm;
+  }
+
+  Image3F sharpened(DivCeil(in.xsize(), N) * N, DivCeil(in.ysize(), N) * N);
+  Dispatch(TargetBitfield().Best(), PadAndGaborishInverseImpl(), in,
+           normalized, pool, &sharpened);
   return sharpened;
 }
 
-SIMD_ATTR Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
-                                   ThreadPool* pool) {
+Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
+                         ThreadPool* pool) {
   if (strength == GaborishStrength::kOff) return std::move(in);
+  return Dispatch(TargetBitfield().Best(), ConvolveGaborishImpl(),
+                  std::move(in), strength, pool);
+}
 
-  PROFILER_FUNC;
-  Image3F out(in.xsize(), in.ysize());
-  using Conv3 = ConvolveT<strategy::Symmetric3>;
-  const BorderNeverUsed border;
-  const ExecutorPool executor(pool);
-  if (strength == GaborishStrength::k1000) {
-    Conv3::Run(border, executor, in, kernel::Gaborish3_1000(), &out);
-  } else if (strength == GaborishStrength::k875) {
-    Conv3::Run(border, executor, in, kernel::Gaborish3_875(), &out);
-  } else if (strength == GaborishStrength::k750) {
-    Conv3::Run(border, executor, in, kernel::Gaborish3_750(), &out);
-  } else if (strength == GaborishStrength::k500) {
-    Conv3::Run(border, executor, in, kernel::Gaborish3_500(), &out);
-  } else {
-    PIK_ASSERT(false);
-  }
-  out.CheckSizesSame();
-  return out;
+TFNode* AddGaborish(const TFPorts& xyb, GaborishStrength strength,
+                    TFBuilder* builder) {
+  return Dispatch(TargetBitfield().Best(), AddGaborishImpl(), xyb, strength,
+                  builder);
 }
 
 }  // namespace pik
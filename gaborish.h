@@ -11,6 +11,7 @@
 
 #include "data_parallel.h"
 #include "image.h"
+#include "tile_flow.h"
 
 namespace pik {
 
@@ -28,13 +29,26 @@ enum class GaborishStrength : uint32_t {
 };
 
 // Used in encoder to reduce the impact of the decoder's smoothing.
-// This is approximate and slow (unoptimized 5x5 convolution).
-Image3F GaborishInverse(const Image3F& opsin, double mul);
+// This is approximate (5x5 convolution).
+Image3F GaborishInverse(const Image3F& opsin, double mul,
+                        ThreadPool* pool = nullptr);
+
+// Returns GaborishInverse(PadImageToMultiple(opsin, N), mul) without
+// materializing the padded image: each stripe of rows pads its inputs on the
+// fly.
+Image3F PadAndGaborishInverse(const Image3F& opsin, size_t N, double mul,
+                              ThreadPool* pool);
 
 // Returns "in" unchanged if strength == kOff (need rvalue to avoid copying).
 Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
                          ThreadPool* pool);
 
+// Adds a TFGraph node with the same output as ConvolveGaborish. "xyb" must
+// have three ports and mirrored borders (e.g. a TFWrap::kMirror source).
+// "strength" must not be kOff.
+TFNode* AddGaborish(const TFPorts& xyb, GaborishStrength strength,
+                    TFBuilder* builder);
+
 }  // namespace pik
 
 #endif  // GABORISH_H_
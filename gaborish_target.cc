@@ -0,0 +1,196 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+// Per-target, hence included here (for every target).
+#include "convolve.h"
+
+namespace pik {
+
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Rows per task; each task re-pads kRadius rows above and below its stripe.
+constexpr size_t kGaborishInverseStripe = 32;
+
+// Writes the source row that PadImageToMultiple would place at padded row
+// "y_padded", extended by kRadius mirrored columns on either side, to "ext".
+SIMD_ATTR void PadRowWithBorders(const ImageF& in, const int64_t y_padded,
+                                 const int64_t xsize_padded, float* ext) {
+  constexpr int64_t kRadius = 2;
+  const int64_t xsize = in.xsize();
+  const float* PIK_RESTRICT row_in =
+      in.ConstRow(std::min<int64_t>(y_padded, in.ysize() - 1));
+  memcpy(ext + kRadius, row_in, xsize * sizeof(float));
+  for (int64_t x = xsize; x < xsize_padded; ++x) {
+    ext[kRadius + x] = row_in[xsize - 1];
+  }
+  for (int64_t x = 1; x <= kRadius; ++x) {
+    const int64_t left = Mirror(-x, xsize_padded);
+    const int64_t right = Mirror(xsize_padded - 1 + x, xsize_padded);
+    ext[kRadius - x] = row_in[std::min(left, xsize - 1)];
+    ext[kRadius + xsize_padded - 1 + x] = row_in[std::min(right, xsize - 1)];
+  }
+}
+
+// Same result as slow::SymmetricConvolution<2, WrapClamp> of the padded
+// image, i.e. rows are clamped and columns mirrored.
+SIMD_ATTR void PadAndGaborishInverse(const Image3F& in,
+                                     const float (&weights)[9],
+                                     ThreadPool* pool, Image3F* out) {
+  constexpr int64_t kRadius = 2;
+  const SIMD_FULL(float) d;
+  const int64_t xsize = out->xsize();
+  const int64_t ysize = out->ysize();
+  const size_t num_stripes = DivCeil<size_t>(ysize, kGaborishInverseStripe);
+
+  RunOnPool(
+      pool, 0, num_stripes,
+      [&](const int task, const int thread) SIMD_ATTR {
+        const int64_t y_begin = task * kGaborishInverseStripe;
+        const int64_t y_end =
+            std::min<int64_t>(y_begin + kGaborishInverseStripe, ysize);
+        // Ring of the 2 * kRadius + 1 padded input rows around the current
+        // output row; slot (y mod 5) holds clamped row y. The extra vector
+        // allows loading whole vectors past the right border.
+        ImageF ring(xsize + 2 * kRadius + d.N, 2 * kRadius + 1);
+        const auto slot = [&](const int64_t y) {
+          constexpr int64_t kRows = 2 * kRadius + 1;
+          return static_cast<size_t>((y % kRows + kRows) % kRows);
+        };
+
+        for (size_t c = 0; c < 3; ++c) {
+          const ImageF& plane = in.Plane(c);
+          const auto fill = [&](const int64_t y) SIMD_ATTR {
+            float* PIK_RESTRICT ext = ring.Row(slot(y));
+            PadRowWithBorders(plane, std::min(std::max<int64_t>(y, 0),
+                                              ysize - 1),
+                              xsize, ext);
+            std::fill(ext + xsize + 2 * kRadius, ext + ring.xsize(), 0.0f);
+          };
+          for (int64_t y = y_begin - kRadius; y < y_begin + kRadius; ++y) {
+            fill(y);
+          }
+
+          for (int64_t y = y_begin; y < y_end; ++y) {
+            fill(y + kRadius);
+            const float* PIK_RESTRICT rows[2 * kRadius + 1];
+            for (int64_t ky = -kRadius; ky <= kRadius; ++ky) {
+              rows[ky + kRadius] = ring.ConstRow(slot(y + ky)) + kRadius;
+            }
+            float* PIK_RESTRICT row_out = out->PlaneRow(c, y);
+            for (int64_t x = 0; x < xsize; x += d.N) {
+              auto sum = setzero(d);
+              for (int64_t ky = -kRadius; ky <= kRadius; ++ky) {
+                const float* PIK_RESTRICT row = rows[ky + kRadius] + x;
+                const int64_t wy = std::abs(ky) * (kRadius + 1);
+                for (int64_t kx = -kRadius; kx <= kRadius; ++kx) {
+                  const auto w = set1(d, weights[wy + std::abs(kx)]);
+                  sum += load_unaligned(d, row + kx) * w;
+                }
+              }
+              store(sum, d, row_out + x);
+            }
+          }
+        }
+      },
+      "GaborishInverse");
+}
+
+SIMD_ATTR Image3F ConvolveGaborish(Image3F&& in, GaborishStrength strength,
+                                   ThreadPool* pool) {
+  PROFILER_FUNC;
+  Image3F out(in.xsize(), in.ysize());
+  using Conv3 = ConvolveT<strategy::Symmetric3>;
+  const BorderNeverUsed border;
+  const ExecutorPool executor(pool);
+  if (strength == GaborishStrength::k1000) {
+    Conv3::Run(border, executor, in, kernel::Gaborish3_1000(), &out);
+  } else if (strength == GaborishStrength::k875) {
+    Conv3::Run(border, executor, in, kernel::Gaborish3_875(), &out);
+  } else if (strength == GaborishStrength::k750) {
+    Conv3::Run(border, executor, in, kernel::Gaborish3_750(), &out);
+  } else if (strength == GaborishStrength::k500) {
+    Conv3::Run(border, executor, in, kernel::Gaborish3_500(), &out);
+  } else {
+    PIK_ASSERT(false);
+  }
+  out.CheckSizesSame();
+  return out;
+}
+
+template <class Kernel>
+TFNode* AddGaborishT(const TFPorts& xyb, TFBuilder* builder) {
+  return builder->AddClosure(
+      "gaborish", Borders(strategy::Symmetric3::kRadius), Scale(), {xyb}, 3,
+      TFType::kF32,
+      [](const ConstImageViewF* in, const OutputRegion& output_region,
+         const MutableImageViewF* PIK_RESTRICT out) SIMD_ATTR {
+        // Inputs include the mirrored border, hence LeftRightValid; the
+        // arithmetic is identical to ConvolveGaborish.
+        const Weights3x3& weights = Kernel().Weights();
+        for (size_t c = 0; c < 3; ++c) {
+          const int64_t stride = in[c].bytes_per_row() / sizeof(float);
+          for (uint32_t y = 0; y < output_region.ysize; ++y) {
+            strategy::Symmetric3::ConvolveRow<0>(
+                LeftRightValid(), in[c].ConstRow(y), output_region.xsize,
+                stride, WrapRowUnchanged(), weights, out[c].Row(y));
+          }
+        }
+      });
+}
+
+TFNode* AddGaborish(const TFPorts& xyb, GaborishStrength strength,
+                    TFBuilder* builder) {
+  switch (strength) {
+    case GaborishStrength::k1000:
+      return AddGaborishT<kernel::Gaborish3_1000>(xyb, builder);
+    case GaborishStrength::k875:
+      return AddGaborishT<kernel::Gaborish3_875>(xyb, builder);
+    case GaborishStrength::k750:
+      return AddGaborishT<kernel::Gaborish3_750>(xyb, builder);
+    case GaborishStrength::k500:
+      return AddGaborishT<kernel::Gaborish3_500>(xyb, builder);
+    default:
+      PIK_ASSERT(false);
+      return nullptr;
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void PadAndGaborishInverseImpl::operator()<SIMD_TARGET>(
+    const Image3F& in, const float (&weights)[9], ThreadPool* pool,
+    Image3F* out) const {
+  SIMD_NAMESPACE::PadAndGaborishInverse(in, weights, pool, out);
+}
+
+template <>
+Image3F ConvolveGaborishImpl::operator()<SIMD_TARGET>(
+    Image3F&& in, GaborishStrength strength, ThreadPool* pool) const {
+#if SIMD_TARGET_VALUE == SIMD_AVX512
+  // Convolve requires more than one vector per row; AVX2 vectors are narrower.
+  if (in.xsize() < SIMD_NAMESPACE::kConvolveMinWidth) {
+    return operator()<AVX2>(std::move(in), strength, pool);
+  }
+#endif
+  return SIMD_NAMESPACE::ConvolveGaborish(std::move(in), strength, pool);
+}
+
+template <>
+TFNode* AddGaborishImpl::operator()<SIMD_TARGET>(const TFPorts& xyb,
+                                                 GaborishStrength strength,
+                                                 TFBuilder* builder) const {
+  return SIMD_NAMESPACE::AddGaborish(xyb, strength, builder);
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
@@ -9,8 +9,6 @@
 #include <math.h>
 #include <algorithm>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "compiler_specific.h"
 #include "profiler.h"
 
@@ -31,17 +29,20 @@ inline void ExtrapolateBorders(const float* const PIK_RESTRICT row_in,
 
 ImageF ConvolveXSampleAndTranspose(const ImageF& in,
                                    const std::vector<float>& kernel,
-                                   const size_t res) {
+                                   const size_t res, ThreadPool* pool) {
   PIK_ASSERT(kernel.size() % 2 == 1);
   PIK_ASSERT(in.xsize() % res == 0);
   const int offset = res / 2;
   const int out_xsize = in.xsize() / res;
   ImageF out(in.ysize(), out_xsize);
   const int r = kernel.size() / 2;
-  std::vector<float> row_tmp(in.xsize() + 2 * r);
-  float* const PIK_RESTRICT rowp = &row_tmp[r];
+  // One extrapolated row per thread.
+  std::vector<std::vector<float>> row_tmp(NumThreads(pool));
   const float* const kernelp = &kernel[r];
-  for (int y = 0; y < in.ysize(); ++y) {
+  const auto convolve_row = [&](const int y, const int thread) {
+    std::vector<float>& my_row_tmp = row_tmp[thread];
+    if (my_row_tmp.empty()) my_row_tmp.resize(in.xsize() + 2 * r);
+    float* const PIK_RESTRICT rowp = &my_row_tmp[r];
     ExtrapolateBorders(in.Row(y), rowp, in.xsize(), r);
     for (int x = offset, ox = 0; x < in.xsize(); x += res, ++ox) {
       float sum = 0.0f;
@@ -50,10 +51,17 @@ ImageF ConvolveXSampleAndTranspose(const ImageF& in,
       }
       out.Row(ox)[y] = sum;
     }
-  }
+  };
+  RunOnPool(pool, 0, in.ysize(), convolve_row, "ConvolveXSampleAndTranspose");
   return out;
 }
 
+ImageF ConvolveXSampleAndTranspose(const ImageF& in,
+                                   const std::vector<float>& kernel,
+                                   const size_t res) {
+  return ConvolveXSampleAndTranspose(in, kernel, res, /*pool=*/nullptr);
+}
+
 Image3F ConvolveXSampleAndTranspose(const Image3F& in,
                                     const std::vector<float>& kernel,
                                     const size_t res) {
@@ -89,6 +97,17 @@ ImageF Convolve(const ImageF& in, const std::vector<float>& kernel) {
   return ConvolveAndSample(in, kernel, 1);
 }
 
+ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel,
+                         const size_t res, ThreadPool* pool) {
+  ImageF tmp = ConvolveXSampleAndTranspose(in, kernel, res, pool);
+  return ConvolveXSampleAndTranspose(tmp, kernel, res, pool);
+}
+
+ImageF Convolve(const ImageF& in, const std::vector<float>& kernel,
+                ThreadPool* pool) {
+  return ConvolveAndSample(in, kernel, 1, pool);
+}
+
 Image3F Convolve(const Image3F& in, const std::vector<float>& kernel) {
   return Convolve(in, kernel, kernel);
 }
@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <vector>
 
+#include "data_parallel.h"
 #include "image.h"
 
 namespace pik {
@@ -55,11 +56,20 @@ ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel,
                          const size_t res);
 ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel_x,
                          const std::vector<float>& kernel_y, const size_t res);
+// Multithreaded versions; the result is identical to the above.
+ImageF ConvolveAndSample(const ImageF& in, const std::vector<float>& kernel,
+                         const size_t res, ThreadPool* pool);
+ImageF Convolve(const ImageF& in, const std::vector<float>& kernel,
+                ThreadPool* pool);
 
 // TODO(janwas): Use ConvolveT instead (if |kernel| <= 5 and res == 1).
 ImageF ConvolveXSampleAndTranspose(const ImageF& in,
                                    const std::vector<float>& kernel,
                                    const size_t res);
+// As above, but input rows are processed in parallel on "pool" (may be null).
+ImageF ConvolveXSampleAndTranspose(const ImageF& in,
+                                   const std::vector<float>& kernel,
+                                   const size_t res, ThreadPool* pool);
 Image3F ConvolveXSampleAndTranspose(const Image3F& in,
                                     const std::vector<float>& kernel,
                                     const size_t res);
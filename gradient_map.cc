@@ -456,7 +456,7 @@ void ApplyGradientMap(const GradientMap& gradient, const Quantizer& quantizer,
 }
 
 void SerializeGradientMap(const GradientMap& gradient, const Rect& rect,
-                          const Quantizer& quantizer, PaddedBytes* compressed) {
+                          const Quantizer& quantizer, BitWriter* writer) {
   PIK_ASSERT(rect.x0() % kNumBlocks == 0);
   PIK_ASSERT(rect.y0() % kNumBlocks == 0);
   Rect map_rect(rect.x0() / kNumBlocks, rect.y0() / kNumBlocks,
@@ -465,17 +465,13 @@ void SerializeGradientMap(const GradientMap& gradient, const Rect& rect,
   Image3S quantized = Quantize(gradient, map_rect, quantizer);
   Image3S residuals(map_rect.xsize(), map_rect.ysize());
   ShrinkDC(map_rect, quantized, &residuals);
-  std::string encoded = EncodeImageData(Rect(residuals), residuals, nullptr);
-  size_t pos = compressed->size();
-  compressed->resize(compressed->size() + encoded.size());
-  for (size_t i = 0; i < encoded.size(); i++) {
-    compressed->data()[pos++] = encoded[i];
-  }
+  EncodeImageData(Rect(residuals), residuals, writer, nullptr);
 }
 
 Status DeserializeGradientMap(size_t xsize_dc, size_t ysize_dc, bool grayscale,
                               const Quantizer& quantizer,
-                              const PaddedBytes& compressed, size_t* byte_pos,
+                              const Span<const uint8_t> compressed,
+                              size_t* byte_pos,
                               GradientMap* gradient) {
   InitGradientMap(xsize_dc, ysize_dc, grayscale, gradient);
 
@@ -16,6 +16,8 @@
 #include "image.h"
 #include "padded_bytes.h"
 #include "quantizer.h"
+#include "span.h"
+#include "write_bits.h"
 
 namespace pik {
 
@@ -31,13 +33,14 @@ void ComputeGradientMap(const Image3F& opsin, bool grayscale,
                         GradientMap* gradient);
 
 void SerializeGradientMap(const GradientMap& gradient, const Rect& rect,
-                          const Quantizer& quantizer, PaddedBytes* compressed);
+                          const Quantizer& quantizer, BitWriter* writer);
 
 // For decoding
 
 Status DeserializeGradientMap(size_t xsize_dc, size_t ysize_dc, bool grayscale,
                               const Quantizer& quantizer,
-                              const PaddedBytes& compressed, size_t* byte_pos,
+                              const Span<const uint8_t> compressed,
+                              size_t* byte_pos,
                               GradientMap* gradient);
 
 // Applies the gradient map to the decoded DC image.
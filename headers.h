@@ -104,6 +104,16 @@ constexpr size_t kNumTilesPerGroup = (kGroupWidthInBlocks / kTileDimInBlocks) *
                                      (kGroupHeightInBlocks / kTileDimInBlocks);
 
 struct GroupHeader {
+  // Bits of `extensions`.
+  enum Extensions {
+    // AC coefficients are coded with num_ac_ans_states interleaved ANS states.
+    kInterleavedANS = 1,
+
+    // The AC coefficients of each tile are a separate ANS stream, preceded by
+    // a table of their sizes, so that tiles can be decoded independently.
+    kTileTOC = 2,
+  };
+
   GroupHeader();
   static const char* Name() { return "GroupHeader"; }
 
@@ -122,6 +132,11 @@ struct GroupHeader {
 
     visitor->BeginExtensions(&extensions);
     // Extensions: in chronological order of being added to the format.
+
+    if (visitor->Conditional(extensions & kInterleavedANS)) {
+      visitor->U32(kU32Direct1To4, 1, &num_ac_ans_states);
+    }
+
     return visitor->EndExtensions();
   }
 
@@ -133,6 +148,8 @@ struct GroupHeader {
   TileHeader tile_headers[kNumTilesPerGroup];
 
   uint64_t extensions;
+
+  uint32_t num_ac_ans_states;  // [1, kANSMaxStates]
 };
 
 //------------------------------------------------------------------------------
@@ -195,6 +212,23 @@ struct PassHeader {
     kNoise = 4,
   };
 
+  // Bits of `extensions`.
+  enum Extensions {
+    // The noise parameters are stored here rather than in each group, and the
+    // noise is generated from a hash of the pixel coordinates (AddTileNoise),
+    // so it can be added per tile during finalization.
+    kTileNoise = 1,
+
+    // The coefficient orders and clustered histograms are stored once for the
+    // whole pass, between the DC and the group TOC, and groups omit them.
+    kSharedEntropyCode = 2,
+
+    // Adaptive reconstruction scales its guide by this range of the original
+    // image instead of the min/max of the entire decoded image, so that any
+    // region can be reconstructed independently (e.g. for crops).
+    kEpfRange = 4,
+  };
+
   PassHeader();
   static const char* Name() { return "PassHeader"; }
 
@@ -241,6 +275,19 @@ struct PassHeader {
 
     visitor->BeginExtensions(&extensions);
     // Extensions: in chronological order of being added to the format.
+
+    if (visitor->Conditional(extensions & kTileNoise)) {
+      for (uint32_t& param : noise_params) {
+        visitor->U32(kU32RawBits + 17, 0, &param);
+      }
+    }
+
+    if (visitor->Conditional(extensions & kEpfRange)) {
+      for (uint32_t& bits : epf_range) {
+        visitor->U32(kU32RawBits + 32, 0, &bits);
+      }
+    }
+
     return visitor->EndExtensions();
   }
 
@@ -280,6 +327,12 @@ struct PassHeader {
   // TODO(janwas): quantization setup (reuse from previous passes)
 
   uint64_t extensions;
+
+  // Only if kTileNoise: alpha, gamma, beta (see QuantizeNoiseParams).
+  uint32_t noise_params[3];
+
+  // Only if kEpfRange: min, max (see EncodeEpfRange).
+  uint32_t epf_range[2];
 };
 
 //------------------------------------------------------------------------------
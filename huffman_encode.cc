@@ -549,7 +549,7 @@ void BuildAndVisitHuffmanTree(const uint32_t* histogram, const size_t length,
 void BuildAndStoreHuffmanTree(const uint32_t* histogram, const size_t length,
                               uint8_t* depth, uint16_t* bits,
                               size_t* storage_ix, uint8_t* storage) {
-  BitWriter bit_writer(storage_ix, storage);
+  StorageBitWriter bit_writer(storage_ix, storage);
   BuildAndVisitHuffmanTree(histogram, length, depth, bits, &bit_writer);
 }
 
@@ -7,35 +7,23 @@
 #include "image.h"
 
 #include <stdint.h>
-#include <atomic>
 
 #include "common.h"
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
+#include "data_parallel.h"
 #include "profiler.h"
 
 namespace pik {
 
-// Offset for the allocated pointer to avoid 2K aliasing (see BytesPerRow)
-// between the planes of an Image3. Necessary because consecutive large
-// allocations on Linux often return pointers with the same alignment.
-static size_t Avoid2K() {
-  static std::atomic<int32_t> next{0};
-  const int32_t kGroups = 8;
-  const int32_t group = next.fetch_add(1, std::memory_order_relaxed) % kGroups;
-  return (2048 / kGroups) * group;
-}
-
-CacheAlignedUniquePtr AllocateImageBytes(size_t size) {
+ImageBytes AllocateImageBytes(size_t size) {
   PROFILER_FUNC;
   // Note: size may be zero.
-  CacheAlignedUniquePtr bytes = AllocateArray(size, Avoid2K());
+  ImageAllocator* allocator = CurrentImageAllocator();
+  ImageBytes bytes = allocator == nullptr ? AllocateFreshImageBytes(size)
+                                          : allocator->Allocate(size);
   PIK_ASSERT(reinterpret_cast<uintptr_t>(bytes.get()) % kImageAlign == 0);
   return bytes;
 }
 
-
-
 ImageB ImageFromPacked(const uint8_t* packed, const size_t xsize,
                        const size_t ysize, const size_t bytes_per_row) {
   PIK_ASSERT(bytes_per_row >= xsize);
@@ -50,35 +38,31 @@ ImageB ImageFromPacked(const uint8_t* packed, const size_t xsize,
 }
 
 // Note that using mirroring here gives slightly worse results.
-Image3F PadImageToMultiple(const Image3F& in, const size_t N) {
+Image3F PadImageToMultiple(const Image3F& in, const size_t N,
+                           ThreadPool* pool) {
   PROFILER_FUNC;
   const size_t xsize_blocks = DivCeil(in.xsize(), N);
   const size_t ysize_blocks = DivCeil(in.ysize(), N);
   const size_t xsize = N * xsize_blocks;
   const size_t ysize = N * ysize_blocks;
   Image3F out(xsize, ysize);
-  for (int c = 0; c < 3; ++c) {
-    int y = 0;
-    for (; y < in.ysize(); ++y) {
-      const float* PIK_RESTRICT row_in = in.ConstPlaneRow(c, y);
-      float* PIK_RESTRICT row_out = out.PlaneRow(c, y);
-      memcpy(row_out, row_in, in.xsize() * sizeof(row_in[0]));
-      const int lastcol = in.xsize() - 1;
-      const float lastval = row_out[lastcol];
-      for (int x = in.xsize(); x < xsize; ++x) {
-        row_out[x] = lastval;
-      }
-    }
-
-    // TODO(janwas): no need to copy if we can 'extend' image: if rows are
-    // pointers to any memory? Or allocate larger image before IO?
-    const int lastrow = in.ysize() - 1;
-    for (; y < ysize; ++y) {
-      const float* PIK_RESTRICT row_in = out.ConstPlaneRow(c, lastrow);
-      float* PIK_RESTRICT row_out = out.PlaneRow(c, y);
-      memcpy(row_out, row_in, xsize * sizeof(row_out[0]));
-    }
-  }
+  // Rows are independent: padding rows copy from the input, not from out.
+  RunOnPool(
+      pool, 0, ysize,
+      [&](const int task, const int thread) {
+        const size_t y_in = std::min<size_t>(task, in.ysize() - 1);
+        for (int c = 0; c < 3; ++c) {
+          const float* PIK_RESTRICT row_in = in.ConstPlaneRow(c, y_in);
+          float* PIK_RESTRICT row_out = out.PlaneRow(c, task);
+          memcpy(row_out, row_in, in.xsize() * sizeof(row_in[0]));
+          const int lastcol = in.xsize() - 1;
+          const float lastval = row_out[lastcol];
+          for (int x = in.xsize(); x < xsize; ++x) {
+            row_out[x] = lastval;
+          }
+        }
+      },
+      "PadImageToMultiple");
   return out;
 }
 
@@ -28,6 +28,7 @@
 
 #include "cache_aligned.h"
 #include "compiler_specific.h"
+#include "image_allocator.h"
 #include "status.h"
 
 namespace pik {
@@ -69,8 +70,9 @@ static inline size_t BytesPerRow(const size_t valid_bytes) {
   return bytes_per_row;
 }
 
-// Factored out of Image<> to avoid dependency on profiler.h and <atomic>.
-CacheAlignedUniquePtr AllocateImageBytes(size_t size);
+// Factored out of Image<> to avoid dependency on profiler.h.
+// Uses the calling thread's CurrentImageAllocator, if any.
+ImageBytes AllocateImageBytes(size_t size);
 
 // Single channel, aligned rows separated by padding. T must be POD.
 //
@@ -217,7 +219,7 @@ class Image {
   size_t xsize_;  // original intended pixels, not including any padding.
   size_t ysize_;
   size_t bytes_per_row_;  // [bytes] including padding.
-  CacheAlignedUniquePtr bytes_;
+  ImageBytes bytes_;
 };
 
 using ImageB = Image<uint8_t>;
@@ -1274,9 +1276,12 @@ Image3<T> Image3FromInterleaved(const T* const interleaved, const size_t xsize,
   return image3;
 }
 
+class ThreadPool;
+
 // First, image is padded horizontally, with the rightmost value.
 // Next, image is padded vertically, by repeating the last line.
-Image3F PadImageToMultiple(const Image3F& in, const size_t N);
+Image3F PadImageToMultiple(const Image3F& in, const size_t N,
+                           ThreadPool* pool = nullptr);
 
 }  // namespace pik
 
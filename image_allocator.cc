@@ -0,0 +1,218 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "image_allocator.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "status.h"
+
+namespace pik {
+namespace {
+
+constexpr size_t kAlign = CacheAligned::kAlignment;
+
+// Offset for allocated pointers to avoid 2K aliasing (see BytesPerRow)
+// between the planes of an Image3. Necessary because consecutive large
+// allocations on Linux often return pointers with the same alignment.
+size_t Avoid2K(const size_t index) {
+  constexpr size_t kGroups = 8;
+  return (2048 / kGroups) * (index % kGroups);
+}
+
+size_t NextAvoid2K() {
+  static std::atomic<size_t> next{0};
+  return Avoid2K(next.fetch_add(1, std::memory_order_relaxed));
+}
+
+std::atomic<uint64_t> num_allocated{0};
+std::atomic<uint64_t> bytes_allocated{0};
+std::atomic<uint64_t> num_reused{0};
+std::atomic<uint64_t> bytes_reused{0};
+
+void CountAllocated(const size_t size) {
+  num_allocated.fetch_add(1, std::memory_order_relaxed);
+  bytes_allocated.fetch_add(size, std::memory_order_relaxed);
+}
+
+void CountReused(const size_t size) {
+  num_reused.fetch_add(1, std::memory_order_relaxed);
+  bytes_reused.fetch_add(size, std::memory_order_relaxed);
+}
+
+thread_local ImageAllocator* tls_allocator = nullptr;
+
+// Pool buffers are preceded by a header that stores their capacity, so that
+// Free does not need a lookup table.
+constexpr size_t kPoolHeader = kAlign;
+static_assert(kPoolHeader >= sizeof(size_t), "Header too small");
+
+}  // namespace
+
+void ImageBytesDeleter::operator()(uint8_t* bytes) const {
+  if (allocator != nullptr) {
+    allocator->Free(bytes);
+  } else {
+    CacheAligned::Free(bytes);
+  }
+}
+
+ImageBytes AllocateFreshImageBytes(const size_t size) {
+  CountAllocated(size);
+  return ImageBytes(
+      static_cast<uint8_t*>(CacheAligned::Allocate(size, NextAvoid2K())),
+      ImageBytesDeleter());
+}
+
+ImageAllocator* CurrentImageAllocator() { return tls_allocator; }
+
+ImageAllocatorScope::ImageAllocatorScope(ImageAllocator* allocator)
+    : previous_(tls_allocator) {
+  tls_allocator = allocator;
+}
+
+ImageAllocatorScope::~ImageAllocatorScope() { tls_allocator = previous_; }
+
+ImageArena::~ImageArena() {
+  PIK_ASSERT(num_live_.load() == 0);
+  CacheAligned::Free(block_);
+}
+
+ImageBytes ImageArena::Allocate(const size_t size) {
+  if (num_live_.load(std::memory_order_acquire) == 0) {
+    // All previous images are gone: rewind, and grow if they did not all fit.
+    if (demand_ > capacity_) {
+      CacheAligned::Free(block_);
+      capacity_ = demand_;
+      block_ = static_cast<uint8_t*>(CacheAligned::Allocate(capacity_));
+      CountAllocated(capacity_);
+    }
+    used_ = 0;
+    demand_ = 0;
+  }
+
+  // Multiples of kAlign; the offset rotates like NextAvoid2K.
+  const size_t offset = Avoid2K(num_allocations_++);
+  const size_t rounded_size = (size + kAlign - 1) & ~(kAlign - 1);
+  demand_ += offset + rounded_size;
+  const size_t begin = used_ + offset;
+  if (block_ == nullptr || begin + rounded_size > capacity_) {
+    return pool_->Allocate(size);
+  }
+
+  used_ = begin + rounded_size;
+  num_live_.fetch_add(1, std::memory_order_relaxed);
+  pool_->AddRef();
+  CountReused(size);
+  return ImageBytes(block_ + begin, ImageBytesDeleter(this));
+}
+
+void ImageArena::Free(uint8_t* bytes) {
+  PIK_ASSERT(block_ <= bytes && bytes <= block_ + capacity_);
+  num_live_.fetch_sub(1, std::memory_order_release);
+  pool_->Release();
+}
+
+std::shared_ptr<ImageBufferPool> ImageBufferPool::Create(
+    const size_t max_retained_bytes) {
+  return std::shared_ptr<ImageBufferPool>(
+      new ImageBufferPool(max_retained_bytes),
+      [](ImageBufferPool* pool) { pool->Release(); });
+}
+
+constexpr size_t ImageBufferPool::kDefaultMaxRetainedBytes;
+
+ImageBufferPool::~ImageBufferPool() {
+  for (const FreeBuffer& buffer : free_) {
+    CacheAligned::Free(buffer.bytes - kPoolHeader);
+  }
+}
+
+void ImageBufferPool::Release() {
+  if (num_refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete this;
+  }
+}
+
+ImageBytes ImageBufferPool::Allocate(const size_t size) {
+  AddRef();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Smallest sufficient buffer, unless that would waste too much memory.
+    const auto it = free_by_capacity_.lower_bound(size);
+    if (it != free_by_capacity_.end() && it->first <= size + size / 2) {
+      uint8_t* bytes = it->second->bytes;
+      retained_bytes_ -= it->first;
+      free_.erase(it->second);
+      free_by_capacity_.erase(it);
+      CountReused(size);
+      return ImageBytes(bytes, ImageBytesDeleter(this));
+    }
+  }
+
+  uint8_t* allocated = static_cast<uint8_t*>(
+      CacheAligned::Allocate(kPoolHeader + size, NextAvoid2K()));
+  memcpy(allocated, &size, sizeof(size));
+  CountAllocated(size);
+  return ImageBytes(allocated + kPoolHeader, ImageBytesDeleter(this));
+}
+
+void ImageBufferPool::Free(uint8_t* bytes) {
+  size_t capacity;
+  memcpy(&capacity, bytes - kPoolHeader, sizeof(capacity));
+  // Freed outside the lock.
+  std::vector<uint8_t*> evicted;
+  if (capacity > max_retained_bytes_) {
+    evicted.push_back(bytes - kPoolHeader);
+  } else {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (retained_bytes_ + capacity > max_retained_bytes_) {
+      evicted.push_back(EvictOldest());
+    }
+    free_.push_back(FreeBuffer{capacity, bytes});
+    free_by_capacity_.emplace(capacity, std::prev(free_.end()));
+    retained_bytes_ += capacity;
+  }
+  for (uint8_t* allocated : evicted) {
+    CacheAligned::Free(allocated);
+  }
+  Release();
+}
+
+uint8_t* ImageBufferPool::EvictOldest() {
+  const FreeList::iterator oldest = free_.begin();
+  auto range = free_by_capacity_.equal_range(oldest->capacity);
+  while (range.first->second != oldest) ++range.first;
+  free_by_capacity_.erase(range.first);
+  retained_bytes_ -= oldest->capacity;
+  uint8_t* allocated = oldest->bytes - kPoolHeader;
+  free_.erase(oldest);
+  return allocated;
+}
+
+ImageArena* ImageBufferPool::Arena(const int thread) {
+  PIK_ASSERT(thread >= 0);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (arenas_.size() <= static_cast<size_t>(thread)) {
+    arenas_.resize(thread + 1);
+  }
+  if (!arenas_[thread]) {
+    arenas_[thread].reset(new ImageArena(this));
+  }
+  return arenas_[thread].get();
+}
+
+ImageMemoryCounters GetImageMemoryCounters() {
+  ImageMemoryCounters counters;
+  counters.num_allocated = num_allocated.load(std::memory_order_relaxed);
+  counters.bytes_allocated = bytes_allocated.load(std::memory_order_relaxed);
+  counters.num_reused = num_reused.load(std::memory_order_relaxed);
+  counters.bytes_reused = bytes_reused.load(std::memory_order_relaxed);
+  return counters;
+}
+
+}  // namespace pik
@@ -0,0 +1,170 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef IMAGE_ALLOCATOR_H_
+#define IMAGE_ALLOCATOR_H_
+
+// Pluggable storage for image pixels. By default, each Image mallocs its own
+// bytes. Decoders instead install (per thread) an allocator that recycles
+// buffers, so that repeated decodes neither page-fault nor contend on malloc.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "cache_aligned.h"
+
+namespace pik {
+
+class ImageAllocator;
+
+// Returns image bytes to the allocator that provided them (or frees them if
+// there was none). Stateful so that images remain movable between threads.
+struct ImageBytesDeleter {
+  ImageBytesDeleter() = default;
+  explicit ImageBytesDeleter(ImageAllocator* allocator)
+      : allocator(allocator) {}
+
+  void operator()(uint8_t* bytes) const;
+
+  ImageAllocator* allocator = nullptr;
+};
+
+using ImageBytes = std::unique_ptr<uint8_t[], ImageBytesDeleter>;
+
+class ImageAllocator {
+ public:
+  virtual ~ImageAllocator() = default;
+
+  // Returns CacheAligned::kAlignment-aligned storage for "size" bytes. The
+  // result's deleter may refer to another allocator (e.g. a fallback).
+  virtual ImageBytes Allocate(size_t size) = 0;
+
+  // Called for each pointer returned by Allocate, possibly by another thread.
+  virtual void Free(uint8_t* bytes) = 0;
+};
+
+// Allocates directly from the system; the result is freed the same way.
+ImageBytes AllocateFreshImageBytes(size_t size);
+
+// Returns the allocator used for new images on this thread, or nullptr if
+// they are allocated from the system.
+ImageAllocator* CurrentImageAllocator();
+
+// Installs "allocator" (may be nullptr) for the calling thread for the
+// lifetime of this object. Scopes may be nested.
+class ImageAllocatorScope {
+ public:
+  explicit ImageAllocatorScope(ImageAllocator* allocator);
+  ~ImageAllocatorScope();
+
+  ImageAllocatorScope(const ImageAllocatorScope&) = delete;
+  ImageAllocatorScope& operator=(const ImageAllocatorScope&) = delete;
+
+ private:
+  ImageAllocator* previous_;
+};
+
+class ImageBufferPool;
+
+// Bump allocator for the short-lived images of one thread (e.g. per group).
+// Rewinds whenever all its images have been freed; allocations that do not fit
+// are forwarded to the pool, and the next rewind grows the arena accordingly.
+// Allocate must only be called by one thread at a time.
+class ImageArena : public ImageAllocator {
+ public:
+  explicit ImageArena(ImageBufferPool* pool) : pool_(pool) {}
+  ~ImageArena() override;
+
+  ImageBytes Allocate(size_t size) override;
+  void Free(uint8_t* bytes) override;
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  ImageBufferPool* pool_;  // Not owned.
+  uint8_t* block_ = nullptr;
+  size_t capacity_ = 0;
+  size_t used_ = 0;
+  // Bytes that would have been required to serve all requests since the
+  // last rewind, including those forwarded to the pool.
+  size_t demand_ = 0;
+  size_t num_allocations_ = 0;  // Rotates the 2K-aliasing offset.
+  std::atomic<size_t> num_live_{0};
+};
+
+// Thread-safe cache of buffers that outlive individual decodes; typically owned
+// by CodecContext. Also owns one ImageArena per worker thread. Reference-counted
+// because images (e.g. the decoded output) may outlive the owner.
+class ImageBufferPool : public ImageAllocator {
+ public:
+  // Retains all pass-level images of decodes up to about 1.5 megapixels (a
+  // 1536x1024 decode allocates 126 MiB). Larger decodes still recycle most
+  // buffers because the least recently freed ones are evicted first.
+  static constexpr size_t kDefaultMaxRetainedBytes = size_t(128) << 20;
+
+  // At most "max_retained_bytes" of free buffers are cached; when a freed
+  // buffer would exceed that, the least recently freed buffers are released.
+  static std::shared_ptr<ImageBufferPool> Create(
+      size_t max_retained_bytes = kDefaultMaxRetainedBytes);
+
+  ImageBytes Allocate(size_t size) override;
+  void Free(uint8_t* bytes) override;
+
+  // Returns the arena for worker "thread" (as passed to RunOnPool callbacks).
+  ImageArena* Arena(int thread);
+
+  // Each outstanding buffer of the pool or its arenas holds a reference, as
+  // does the shared_ptr returned by Create.
+  void AddRef() { num_refs_.fetch_add(1, std::memory_order_relaxed); }
+  void Release();
+
+ private:
+  explicit ImageBufferPool(size_t max_retained_bytes)
+      : max_retained_bytes_(max_retained_bytes) {}
+  ~ImageBufferPool() override;
+
+  const size_t max_retained_bytes_;
+  std::atomic<size_t> num_refs_{1};
+
+  struct FreeBuffer {
+    size_t capacity;  // [bytes]
+    uint8_t* bytes;
+  };
+  using FreeList = std::list<FreeBuffer>;
+
+  // Removes the least recently freed buffer from free_ and returns its
+  // allocation. Requires mutex_ and a non-empty free_.
+  uint8_t* EvictOldest();
+
+  std::mutex mutex_;
+  FreeList free_;  // Least recently freed first.
+  std::multimap<size_t, FreeList::iterator> free_by_capacity_;
+  size_t retained_bytes_ = 0;
+  std::vector<std::unique_ptr<ImageArena>> arenas_;
+};
+
+// Process-wide totals for verifying that steady-state decoding does not
+// allocate: compare the values before and after the operation of interest.
+struct ImageMemoryCounters {
+  // Allocations that went to the system (including arena blocks).
+  uint64_t num_allocated;
+  uint64_t bytes_allocated;
+  // Allocations served from a pool or arena.
+  uint64_t num_reused;
+  uint64_t bytes_reused;
+};
+
+ImageMemoryCounters GetImageMemoryCounters();
+
+}  // namespace pik
+
+#endif  // IMAGE_ALLOCATOR_H_
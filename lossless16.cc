@@ -388,8 +388,8 @@ struct State {
     return true;
   }
 
-  bool Grayscale16bit_decompress(const PaddedBytes& bytes, size_t* bytes_pos,
-                                 ImageU* result) {
+  bool Grayscale16bit_decompress(const Span<const uint8_t> bytes,
+                                 size_t* bytes_pos, ImageU* result) {
     WithSIGN = WithSIGN_1, BitsMAX = BitsMAX_1, NUMCONTEXTS = NUMCONTEXTS_1;
     if (*bytes_pos > bytes.size()) return PIK_FAILURE("lossless16");
     size_t compressedSize = bytes.size() - *bytes_pos;
@@ -570,12 +570,14 @@ struct State {
     Rm2_G_BB = 29,
   };
 
-  bool dcmprs512x512(pik::Image3U* img, int planeToDecompress, size_t& pos,
-                     size_t groupY, size_t groupX,
-                     const uint8_t* compressedData, size_t compressedSize,
-                     size_t maxDecodedSize, size_t maxDecodedSize2) {
-    size_t esize[NUMCONTEXTS_3], xsize = img->xsize(), ysize = img->ysize();
-    memset(esize, 0, sizeof(esize));
+  // Reads the residuals of one plane of a group into edata. Planes are stored
+  // back to back without sizes, so this must run in stream order; the
+  // prediction in dcmprs512x512 may then run concurrently on another State.
+  bool read512x512(const pik::Image3U& img, size_t& pos, size_t groupY,
+                   size_t groupX, const uint8_t* compressedData,
+                   size_t compressedSize, size_t maxDecodedSize,
+                   size_t maxDecodedSize2) {
+    size_t xsize = img.xsize(), ysize = img.ysize();
     size_t decompressedSize = 0;  // is used only for the assert()
     for (int i = 0; i < NUMCONTEXTS_3; ++i) {
       size_t ds, ds1, ds2, ds3;
@@ -635,9 +637,16 @@ struct State {
               std::min((size_t)kGroupSize, xsize - groupX))) {
       return PIK_FAILURE("lossless16");
     }
+    return true;
+  }
 
-    size_t yEnd = std::min((size_t)kGroupSize, ysize - groupY);
-    width = std::min((size_t)kGroupSize, xsize - groupX) - 1;
+  // Reconstructs one plane of a group from the residuals of read512x512.
+  void dcmprs512x512(pik::Image3U* img, int planeToDecompress, size_t groupY,
+                     size_t groupX) {
+    size_t esize[NUMCONTEXTS_3];
+    memset(esize, 0, sizeof(esize));
+    size_t yEnd = std::min((size_t)kGroupSize, img->ysize() - groupY);
+    width = std::min((size_t)kGroupSize, img->xsize() - groupX) - 1;
     size_t area = yEnd * (width + 1);
     int maxerrShift =
         (area > 25600
@@ -668,12 +677,31 @@ struct State {
         Update_Size_And_Errors
       }  // x
     }    // y
-    return true;
   }
 
-  bool Colorful16bit_decompress(const PaddedBytes& bytes, size_t* bytes_pos,
-                                Image3U* result) {
+  // Returns a State for each color plane: this one if the planes are coded
+  // one after another, otherwise two more in "helper_states".
+  void InitPlaneStates(ThreadPool* pool, std::unique_ptr<State>* helper_states,
+                       State** plane_states) {
+    plane_states[0] = plane_states[1] = plane_states[2] = this;
+    if (NumThreads(pool) <= 1) return;
+    for (int c = 1; c < 3; ++c) {
+      helper_states[c - 1].reset(new State());
+      helper_states[c - 1]->WithSIGN = WithSIGN;
+      helper_states[c - 1]->BitsMAX = BitsMAX;
+      helper_states[c - 1]->NUMCONTEXTS = NUMCONTEXTS;
+      plane_states[c] = helper_states[c - 1].get();
+    }
+  }
+
+  bool Colorful16bit_decompress(const Span<const uint8_t> bytes,
+                                size_t* bytes_pos, Image3U* result,
+                                ThreadPool* pool) {
     WithSIGN = WithSIGN_3, BitsMAX = BitsMAX_3, NUMCONTEXTS = NUMCONTEXTS_3;
+    State* plane_states[3];
+    std::unique_ptr<State> helper_states[2];
+    InitPlaneStates(pool, helper_states, plane_states);
+    const bool concurrent_planes = plane_states[1] != this;
     if (*bytes_pos > bytes.size()) return PIK_FAILURE("lossless16");
     size_t compressedSize = bytes.size() - *bytes_pos;
     const uint8_t* compressedData = bytes.data() + *bytes_pos;
@@ -738,15 +766,23 @@ struct State {
           uint16_t *PIK_RESTRICT row1, *PIK_RESTRICT row2, *PIK_RESTRICT row3;
           size_t yEnd = std::min((size_t)kGroupSize, ysize - groupY);
           size_t xEnd = std::min((size_t)kGroupSize, xsize - groupX);
-          if (!dcmprs512x512(&img, PL1, pos, groupY, groupX, compressedData,
-                             compressedSize, maxDecodedSize, maxDecodedSize2))
-            return PIK_FAILURE("lossless16");
-          if (!dcmprs512x512(&img, PL2, pos, groupY, groupX, compressedData,
-                             compressedSize, maxDecodedSize, maxDecodedSize2))
-            return PIK_FAILURE("lossless16");
-          if (!dcmprs512x512(&img, PL3, pos, groupY, groupX, compressedData,
-                             compressedSize, maxDecodedSize, maxDecodedSize2))
-            return PIK_FAILURE("lossless16");
+          for (int c = PL1; c <= PL3; ++c) {
+            State* state = plane_states[c];
+            if (!state->read512x512(img, pos, groupY, groupX, compressedData,
+                                    compressedSize, maxDecodedSize,
+                                    maxDecodedSize2))
+              return PIK_FAILURE("lossless16");
+            if (!concurrent_planes)
+              state->dcmprs512x512(&img, c, groupY, groupX);
+          }
+          if (concurrent_planes) {
+            const auto process_plane = [&](const int c, const int thread) {
+              plane_states[c]->dcmprs512x512(&img, c, groupY, groupX);
+            };
+            RunOnPool(pool, PL1, PL3 + 1, process_plane,
+                      "Colorful16bitPlanes");
+          }
+          if (pos >= compressedSize) return PIK_FAILURE("lossless16");
           int planeMethod = compressedData[pos++];
 
 #define T3bgn                                      \
@@ -877,15 +913,17 @@ struct State {
           assert(pos == compressedSize);
 #endif
 
-      for (int channel = 0; channel < 3; ++channel)
-        if (imageMethod & (1 << channel)) {
-          int* p = &palette[0x10000 * channel];
-          for (size_t y = 0; y < ysize; ++y) {
+      const auto apply_palette = [&](const int y, const int thread) {
+        for (int channel = 0; channel < 3; ++channel)
+          if (imageMethod & (1 << channel)) {
+            int* p = &palette[0x10000 * channel];
             uint16_t* const PIK_RESTRICT rowImg = img.PlaneRow(channel, y);
-            for (size_t x = 0; x < xsize; ++x)  // UNROLL AND PARALLELIZE ME!
-              rowImg[x] = p[rowImg[x]];
+            for (size_t x = 0; x < xsize; ++x) rowImg[x] = p[rowImg[x]];
           }
-        }
+      };
+      if (imageMethod) {
+        RunOnPool(pool, 0, ysize, apply_palette, "Colorful16bitPalette");
+      }
     }  // run
     if (NumRuns > 1)
       printf("%d runs, %1.5f seconds", NumRuns,
@@ -993,8 +1031,14 @@ struct State {
     FWr(&byte, 1);    \
   }
 
-  bool Colorful16bit_compress(const Image3U& img_in, PaddedBytes* bytes) {
+  bool Colorful16bit_compress(const Image3U& img_in, PaddedBytes* bytes,
+                              ThreadPool* pool) {
     WithSIGN = WithSIGN_3, BitsMAX = BitsMAX_3, NUMCONTEXTS = NUMCONTEXTS_3;
+    // As in Colorful8bit_compress, the independent trials of a group run
+    // concurrently, each on its own State.
+    State* plane_states[3];
+    std::unique_ptr<State> helper_states[2];
+    InitPlaneStates(pool, helper_states, plane_states);
     clock_t start = clock();
 
     // The code modifies the image for palette so must copy for now.
@@ -1078,9 +1122,17 @@ struct State {
           int planeMethod;  // Here we try guessing which of the 30 PlaneMethods
                             // is best, after trying just six color planes.
 
-          s1 = cmprs512x512(img, PL1, PL1, groupY, groupX, compressedData);
-          s2 = cmprs512x512(img, PL2, PL2, groupY, groupX, compressedData2);
-          s3 = cmprs512x512(img, PL3, PL3, groupY, groupX, compressedData3);
+          uint8_t* plane_outputs[3] = {compressedData, compressedData2,
+                                       compressedData3};
+          size_t plane_sizes[3];
+          const auto compress_plane = [&](const int c, const int thread) {
+            plane_sizes[c] = plane_states[c]->cmprs512x512(
+                img, c, c, groupY, groupX, plane_outputs[c]);
+          };
+          RunOnPool(pool, PL1, PL3 + 1, compress_plane, "Colorful16bitPlanes");
+          s1 = plane_sizes[PL1];
+          s2 = plane_sizes[PL2];
+          s3 = plane_sizes[PL3];
 
           S1 = s2, p1 = PL2, cd1 = compressedData2, planeMethod = 10;
           S2 = s1, p2 = PL1, cd2 = compressedData;
@@ -1094,8 +1146,17 @@ struct State {
             S2 = s1, p2 = PL1, cd2 = compressedData;
             S3 = s2, p3 = PL2, cd3 = compressedData2;
           }
-          S4 = cmprs512x512(img, p2, p1, groupY, groupX, cd4); /* R-G+0x8000 */
-          S5 = cmprs512x512(img, p3, p1, groupY, groupX, cd5); /* B-G+0x8000 */
+          const auto compress_difference = [&](const int task,
+                                               const int thread) {
+            if (task == 0) {
+              S4 = plane_states[0]->cmprs512x512(img, p2, p1, groupY, groupX,
+                                                 cd4); /* R-G+0x8000 */
+            } else {
+              S5 = plane_states[1]->cmprs512x512(img, p3, p1, groupY, groupX,
+                                                 cd5); /* B-G+0x8000 */
+            }
+          };
+          RunOnPool(pool, 0, 2, compress_difference, "Colorful16bitPlanes");
           if (p1 == PL1)
             FWr(cd1, S1)
 
@@ -1183,21 +1244,22 @@ bool Grayscale16bit_compress(const ImageU& img, PaddedBytes* bytes) {
   return state->Grayscale16bit_compress(img, bytes);
 }
 
-bool Grayscale16bit_decompress(const PaddedBytes& bytes, size_t* pos,
+bool Grayscale16bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
                                ImageU* result) {
   std::unique_ptr<State> state(new State());
   return state->Grayscale16bit_decompress(bytes, pos, result);
 }
 
-bool Colorful16bit_compress(const Image3U& img, PaddedBytes* bytes) {
+bool Colorful16bit_compress(const Image3U& img, PaddedBytes* bytes,
+                            ThreadPool* pool) {
   std::unique_ptr<State> state(new State());
-  return state->Colorful16bit_compress(img, bytes);
+  return state->Colorful16bit_compress(img, bytes, pool);
 }
 
-bool Colorful16bit_decompress(const PaddedBytes& bytes, size_t* pos,
-                              Image3U* result) {
+bool Colorful16bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
+                              Image3U* result, ThreadPool* pool) {
   std::unique_ptr<State> state(new State());
-  return state->Colorful16bit_decompress(bytes, pos, result);
+  return state->Colorful16bit_decompress(bytes, pos, result, pool);
 }
 
 }  // namespace pik
@@ -9,18 +9,23 @@
 #ifndef LOSSLESS16_H_
 #define LOSSLESS16_H_
 
+#include "data_parallel.h"
 #include "image.h"
 #include "padded_bytes.h"
+#include "span.h"
 
 namespace pik {
 
 bool Grayscale16bit_compress(const ImageU& img, PaddedBytes* bytes);
-bool Grayscale16bit_decompress(const PaddedBytes& bytes, size_t* pos,
+bool Grayscale16bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
                                ImageU* result);
 
-bool Colorful16bit_compress(const Image3U& img, PaddedBytes* bytes);
-bool Colorful16bit_decompress(const PaddedBytes& bytes, size_t* pos,
-                              Image3U* result);
+// The three planes of each group are coded concurrently on "pool", which may
+// be null. The bitstream is the same either way.
+bool Colorful16bit_compress(const Image3U& img, PaddedBytes* bytes,
+                            ThreadPool* pool = nullptr);
+bool Colorful16bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
+                              Image3U* result, ThreadPool* pool = nullptr);
 }  // namespace pik
 
 #endif  // LOSSLESS16_H_
@@ -626,8 +626,8 @@ struct State {
     return true;
   }
 
-  bool Grayscale8bit_decompress(const PaddedBytes& bytes, size_t* bytes_pos,
-                                ImageB* result) {
+  bool Grayscale8bit_decompress(const Span<const uint8_t> bytes,
+                                size_t* bytes_pos, ImageB* result) {
     if (*bytes_pos > bytes.size()) return PIK_FAILURE("lossless8");
     size_t compressedSize = bytes.size() - *bytes_pos;
     const uint8_t* compressedData = bytes.data() + *bytes_pos;
@@ -798,11 +798,14 @@ struct State {
     Rm2_G_BB = 29,
   };
 
-  bool dcmprs512x512(pik::Image3B* img, int planeToDecompress, size_t& pos,
-                     size_t groupY, size_t groupX,
-                     const uint8_t* compressedData, size_t compressedSize,
-                     size_t maxDecodedSize) {
-    size_t esize[NUMCONTEXTS], xsize = img->xsize(), ysize = img->ysize();
+  // Reads the residuals of one plane of a group into edata. Planes are stored
+  // back to back without sizes, so this must run in stream order; the
+  // prediction in dcmprs512x512 may then run concurrently on another State.
+  bool read512x512(const pik::Image3B& img, size_t& pos, size_t groupY,
+                   size_t groupX, const uint8_t* compressedData,
+                   size_t compressedSize, size_t maxDecodedSize,
+                   PredictMode* groupMode) {
+    size_t xsize = img.xsize(), ysize = img.ysize();
     size_t yEnd = std::min((size_t)kGroupSize, ysize - groupY);
     width = std::min((size_t)kGroupSize, xsize - groupX) - 1;
     size_t area = yEnd * (width + 1);
@@ -844,7 +847,15 @@ struct State {
     if (decompressedSize != area) return PIK_FAILURE("lossless8");
     // if (groupY + kGroupSize >= ysize && groupX + kGroupSize >= xsize)
     //  /* if the last group */  assert(inpSize == pos);
+    *groupMode = pMode;
+    return true;
+  }
 
+  // Reconstructs one plane of a group from the residuals of read512x512.
+  void dcmprs512x512(pik::Image3B* img, int planeToDecompress, size_t groupY,
+                     size_t groupX, PredictMode pMode) {
+    size_t esize[NUMCONTEXTS];
+    size_t yEnd = std::min((size_t)kGroupSize, img->ysize() - groupY);
     memset(esize, 0, sizeof(esize));
 
     if (pMode == PM_Regular)
@@ -871,11 +882,24 @@ struct State {
           AfterPredictWhenDecompressing
         }
       }
-    return true;
   }
 
-  bool Colorful8bit_decompress(const PaddedBytes& bytes, size_t* bytes_pos,
-                               Image3B* result) {
+  // Returns a State for each color plane: this one if the planes are coded
+  // one after another, otherwise two more in "helper_states".
+  void InitPlaneStates(ThreadPool* pool, std::unique_ptr<State>* helper_states,
+                       State** plane_states) {
+    plane_states[0] = plane_states[1] = plane_states[2] = this;
+    if (NumThreads(pool) <= 1) return;
+    for (int c = 1; c < 3; ++c) {
+      helper_states[c - 1].reset(new State());
+      helper_states[c - 1]->pb255 = pb255;
+      plane_states[c] = helper_states[c - 1].get();
+    }
+  }
+
+  bool Colorful8bit_decompress(const Span<const uint8_t> bytes,
+                               size_t* bytes_pos, Image3B* result,
+                               ThreadPool* pool) {
     if (*bytes_pos > bytes.size()) return PIK_FAILURE("lossless8");
     size_t compressedSize = bytes.size() - *bytes_pos;
     const uint8_t* compressedData = bytes.data() + *bytes_pos;
@@ -898,6 +922,10 @@ struct State {
 
     clock_t start = clock();
     pb255 = 255 << PBits;
+    State* plane_states[3];
+    std::unique_ptr<State> helper_states[2];
+    InitPlaneStates(pool, helper_states, plane_states);
+    const bool concurrent_planes = plane_states[1] != this;
     for (int run = 0; run < NumRuns; ++run) {
       size_t pos = pos0;
       if (xsize * ysize > 4 * 0x100) {  // TODO: smarter decision making here
@@ -938,15 +966,23 @@ struct State {
           uint8_t *PIK_RESTRICT row1, *PIK_RESTRICT row2, *PIK_RESTRICT row3;
           size_t yEnd = std::min((size_t)kGroupSize, ysize - groupY);
           size_t xEnd = std::min((size_t)kGroupSize, xsize - groupX);
-          if (!dcmprs512x512(&img, PL1, pos, groupY, groupX, compressedData,
-                             compressedSize, maxDecodedSize))
-            return PIK_FAILURE("lossless8");
-          if (!dcmprs512x512(&img, PL2, pos, groupY, groupX, compressedData,
-                             compressedSize, maxDecodedSize))
-            return PIK_FAILURE("lossless8");
-          if (!dcmprs512x512(&img, PL3, pos, groupY, groupX, compressedData,
-                             compressedSize, maxDecodedSize))
-            return PIK_FAILURE("lossless8");
+          PredictMode modes[3];
+          for (int c = PL1; c <= PL3; ++c) {
+            State* state = plane_states[c];
+            if (!state->read512x512(img, pos, groupY, groupX, compressedData,
+                                    compressedSize, maxDecodedSize,
+                                    &modes[c]))
+              return PIK_FAILURE("lossless8");
+            if (!concurrent_planes)
+              state->dcmprs512x512(&img, c, groupY, groupX, modes[c]);
+          }
+          if (concurrent_planes) {
+            const auto process_plane = [&](const int c, const int thread) {
+              plane_states[c]->dcmprs512x512(&img, c, groupY, groupX,
+                                             modes[c]);
+            };
+            RunOnPool(pool, PL1, PL3 + 1, process_plane, "Colorful8bitPlanes");
+          }
           if (pos >= compressedSize) return PIK_FAILURE("lossless8");
           int planeMethod = compressedData[pos++];
 
@@ -1078,15 +1114,17 @@ struct State {
       assert(pos == compressedSize);
 #endif
 
-      for (int channel = 0; channel < 3; ++channel)
-        if (imageMethod & (1 << channel)) {
-          int* p = &palette[0x100 * channel];
-          for (size_t y = 0; y < ysize; ++y) {
+      const auto apply_palette = [&](const int y, const int thread) {
+        for (int channel = 0; channel < 3; ++channel)
+          if (imageMethod & (1 << channel)) {
+            int* p = &palette[0x100 * channel];
             uint8_t* const PIK_RESTRICT rowImg = img.PlaneRow(channel, y);
-            for (size_t x = 0; x < xsize; ++x)  // UNROLL AND PARALLELIZE ME!
-              rowImg[x] = p[rowImg[x]];
+            for (size_t x = 0; x < xsize; ++x) rowImg[x] = p[rowImg[x]];
           }
-        }
+      };
+      if (imageMethod) {
+        RunOnPool(pool, 0, ysize, apply_palette, "Colorful8bitPalette");
+      }
     }  // run
     if (NumRuns > 1)
       printf("%d runs, %1.5f seconds", NumRuns,
@@ -1197,7 +1235,8 @@ struct State {
     FWr(&byte, 1);    \
   }
 
-  bool Colorful8bit_compress(const Image3B& img_in, pik::PaddedBytes* bytes) {
+  bool Colorful8bit_compress(const Image3B& img_in, pik::PaddedBytes* bytes,
+                             ThreadPool* pool) {
     clock_t start = clock();
 
     // The code modifies the image for palette so must copy for now.
@@ -1207,6 +1246,12 @@ struct State {
     compressedData = temp_buffer.data();
 
     pb255 = 255 << PBits;
+    // The first three trials of a group only read the image, and the next two
+    // write disjoint planes, so each runs on its own State if there are
+    // threads to spare. Sizes and plane methods do not depend on this.
+    State* plane_states[3];
+    std::unique_ptr<State> helper_states[2];
+    InitPlaneStates(pool, helper_states, plane_states);
     for (int run = 0; run < NumRuns; ++run) {
       size_t xsize = img.xsize(), ysize = img.ysize(), pos;
       pos = encodeVarInt(xsize, &compressedData[0]);
@@ -1283,9 +1328,17 @@ struct State {
           int planeMethod;  // Here we try guessing which of the 30 PlaneMethods
                             // is best, after trying just six color planes.
 
-          s1 = cmprs512x512(img, PL1, PL1, groupY, groupX, compressedData);
-          s2 = cmprs512x512(img, PL2, PL2, groupY, groupX, compressedData2);
-          s3 = cmprs512x512(img, PL3, PL3, groupY, groupX, compressedData3);
+          uint8_t* plane_outputs[3] = {compressedData, compressedData2,
+                                       compressedData3};
+          size_t plane_sizes[3];
+          const auto compress_plane = [&](const int c, const int thread) {
+            plane_sizes[c] = plane_states[c]->cmprs512x512(
+                img, c, c, groupY, groupX, plane_outputs[c]);
+          };
+          RunOnPool(pool, PL1, PL3 + 1, compress_plane, "Colorful8bitPlanes");
+          s1 = plane_sizes[PL1];
+          s2 = plane_sizes[PL2];
+          s3 = plane_sizes[PL3];
 
           S1 = s2, p1 = PL2, cd1 = compressedData2, planeMethod = 10;
           S2 = s1, p2 = PL1, cd2 = compressedData;
@@ -1299,8 +1352,17 @@ struct State {
             S2 = s1, p2 = PL1, cd2 = compressedData;
             S3 = s2, p3 = PL2, cd3 = compressedData2;
           }
-          S4 = cmprs512x512(img, p2, p1, groupY, groupX, cd4); /* R-G+0x80 */
-          S5 = cmprs512x512(img, p3, p1, groupY, groupX, cd5); /* B-G+0x80 */
+          const auto compress_difference = [&](const int task,
+                                               const int thread) {
+            if (task == 0) {
+              S4 = plane_states[0]->cmprs512x512(img, p2, p1, groupY, groupX,
+                                                 cd4); /* R-G+0x80 */
+            } else {
+              S5 = plane_states[1]->cmprs512x512(img, p3, p1, groupY, groupX,
+                                                 cd5); /* B-G+0x80 */
+            }
+          };
+          RunOnPool(pool, 0, 2, compress_difference, "Colorful8bitPlanes");
           if (p1 == PL1)
             FWr(cd1, S1)
 
@@ -1389,21 +1451,22 @@ bool Grayscale8bit_compress(const ImageB& img, PaddedBytes* bytes) {
   return state->Grayscale8bit_compress(img, bytes);
 }
 
-bool Grayscale8bit_decompress(const PaddedBytes& bytes, size_t* pos,
+bool Grayscale8bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
                               ImageB* result) {
   std::unique_ptr<State> state(new State());
   return state->Grayscale8bit_decompress(bytes, pos, result);
 }
 
-bool Colorful8bit_compress(const Image3B& img, PaddedBytes* bytes) {
+bool Colorful8bit_compress(const Image3B& img, PaddedBytes* bytes,
+                           ThreadPool* pool) {
   std::unique_ptr<State> state(new State());
-  return state->Colorful8bit_compress(img, bytes);
+  return state->Colorful8bit_compress(img, bytes, pool);
 }
 
-bool Colorful8bit_decompress(const PaddedBytes& bytes, size_t* pos,
-                             Image3B* result) {
+bool Colorful8bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
+                             Image3B* result, ThreadPool* pool) {
   std::unique_ptr<State> state(new State());
-  return state->Colorful8bit_decompress(bytes, pos, result);
+  return state->Colorful8bit_decompress(bytes, pos, result, pool);
 }
 
 }  // namespace pik
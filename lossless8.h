@@ -9,18 +9,23 @@
 #ifndef LOSSLESS8_H_
 #define LOSSLESS8_H_
 
+#include "data_parallel.h"
 #include "image.h"
 #include "padded_bytes.h"
+#include "span.h"
 
 namespace pik {
 
 bool Grayscale8bit_compress(const ImageB& img, PaddedBytes* bytes);
-bool Grayscale8bit_decompress(const PaddedBytes& bytes, size_t* pos,
+bool Grayscale8bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
                               ImageB* result);
 
-bool Colorful8bit_compress(const Image3B& img, PaddedBytes* bytes);
-bool Colorful8bit_decompress(const PaddedBytes& bytes, size_t* pos,
-                              Image3B* result);
+// The three planes of each group are coded concurrently on "pool", which may
+// be null. The bitstream is the same either way.
+bool Colorful8bit_compress(const Image3B& img, PaddedBytes* bytes,
+                           ThreadPool* pool = nullptr);
+bool Colorful8bit_decompress(const Span<const uint8_t> bytes, size_t* pos,
+                             Image3B* result, ThreadPool* pool = nullptr);
 }  // namespace pik
 
 #endif  // LOSSLESS8_H_
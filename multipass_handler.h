@@ -84,6 +84,10 @@ class MultipassManager {
   // This version is only called if we decoded a lossless pass.
   virtual void SetDecodedPass(CodecInOut* io) = 0;
 
+  // Whether RestoreOpsin and SetDecodedPass are no-ops for the current pass,
+  // which allows the decoder to finalize it tile by tile.
+  virtual bool IsStandalonePass() const { return false; }
+
   // Used *on the encoder only* to forcibly enable adaptive reconstruction in
   // GetQuantizer.
   virtual void UseAdaptiveReconstruction() {}
@@ -95,12 +99,15 @@ class MultipassManager {
                                             const Rect& group_rect) = 0;
 
   // Methods to retrieve color correlation, ac strategy and quantizer.
-  virtual void GetColorCorrelationMap(const Image3F& opsin,
+  // `opsin_dct` and `src_dct` are TransposedScaledDCT of the opsin image.
+  virtual void GetColorCorrelationMap(const Image3F& opsin_dct,
+                                      ThreadPool* pool,
                                       ColorCorrelationMap* cmap) = 0;
 
   virtual void GetAcStrategy(float butteraugli_target,
                              const ImageF* quant_field, const Image3F& src,
-                             ThreadPool* pool, AcStrategyImage* ac_strategy,
+                             const Image3F& src_dct, ThreadPool* pool,
+                             AcStrategyImage* ac_strategy,
                              PikInfo* aux_out) = 0;
 
   virtual std::shared_ptr<Quantizer> GetQuantizer(
@@ -4,11 +4,14 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
+#include <string.h>
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <numeric>
 #include <random>
 
+#include "common.h"
 #include "convolve.h"
 #include "descriptive_statistics.h"
 #include "noise.h"
@@ -350,6 +353,149 @@ SIMD_ATTR void AddNoiseT(const StrengthEval& noise_model, Image3F* opsin) {
   }
 }
 
+// Counter-based generator for AddTileNoise: the random number of a pixel is a
+// hash of its coordinates and plane, so each tile generates its noise without
+// shared generator state and without reading neighboring tiles. Mix32 is the
+// "lowbias32" integer finalizer by C. Wellons; it only requires 32-bit
+// multiplication, which (unlike Philox) is available on all SIMD targets.
+constexpr uint32_t kTileNoiseSeed = 123456789;
+
+PIK_INLINE uint32_t Mix32(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+template <class DU>
+SIMD_ATTR PIK_INLINE typename DU::V Mix32(DU du, typename DU::V h) {
+  h = h ^ shift_right<16>(h);
+  h = h * set1(du, 0x7FEB352Du);
+  h = h ^ shift_right<15>(h);
+  h = h * set1(du, 0x846CA68Bu);
+  return h ^ shift_right<16>(h);
+}
+
+// Holds the hashed column coordinates of a tile and, for each plane, a ring of
+// three rows of uniform random numbers. Index i of a row corresponds to
+// column x0 - 1 + i, so that the Laplacian can read one pixel to either side.
+template <class DF>
+class TileNoiseRows {
+  using DU = Desc<uint32_t, DF::N, typename DF::Target>;
+
+ public:
+  SIMD_ATTR TileNoiseRows(const int64_t x0, const int64_t y0,
+                          const size_t xsize)
+      : y0_(y0),
+        xsize_(DivCeil(xsize + 2, DF::N) * DF::N),
+        rows_(xsize_, 1 + 3 * kPlanes) {
+    const DF df;
+    const DU du;
+    float* PIK_RESTRICT row_keys = rows_.Row(0);
+    for (size_t i = 0; i < xsize_; i += du.N) {
+      const auto x = iota(du, static_cast<uint32_t>(x0 - 1 + i));
+      store(cast_to(df, Mix32(du, x)), df, row_keys + i);
+    }
+  }
+
+  // Generates row y (relative to y0, >= -1) of all planes. Each row must be
+  // generated before the rows at y + 3 (which reuse its storage).
+  SIMD_ATTR void Generate(const int64_t y) {
+    const DF df;
+    const DU du;
+    const float* PIK_RESTRICT row_keys = rows_.ConstRow(0);
+    for (uint32_t c = 0; c < kPlanes; ++c) {
+      const uint32_t row_key =
+          Mix32(kTileNoiseSeed ^ Mix32(static_cast<uint32_t>(y0_ + y) * 3 + c));
+      const auto key = set1(du, row_key);
+      float* PIK_RESTRICT row = MutableRow(c, y);
+      for (size_t i = 0; i < xsize_; i += du.N) {
+        const auto bits = Mix32(du, cast_to(du, load(df, row_keys + i)) ^ key);
+        // 1.0 + 23 random mantissa bits = [1, 2)
+        const auto rand12 =
+            cast_to(df, shift_right<9>(bits) | set1(du, 0x3F800000));
+        store(rand12 - set1(df, 1.0f), df, row + i);
+      }
+    }
+  }
+
+  // Returns Laplacian3 of the random numbers (see RandomImage) at pixels
+  // [x, x + N) of row y, which requires rows y - 1 to y + 1.
+  SIMD_ATTR PIK_INLINE typename DF::V Laplacian(const uint32_t c,
+                                                const int64_t y,
+                                                const size_t x) const {
+    const DF df;
+    const float* PIK_RESTRICT row_t = ConstRow(c, y - 1);
+    const float* PIK_RESTRICT row_m = ConstRow(c, y);
+    const float* PIK_RESTRICT row_b = ConstRow(c, y + 1);
+    const auto center = load_unaligned(df, row_m + x + 1);
+    const auto sum_nsew = load_unaligned(df, row_t + x + 1) +
+                          load_unaligned(df, row_b + x + 1) +
+                          load_unaligned(df, row_m + x) +
+                          load_unaligned(df, row_m + x + 2);
+    return sum_nsew - set1(df, 4.0f) * center;
+  }
+
+ private:
+  static constexpr uint32_t kPlanes = 3;
+
+  size_t RowIndex(const uint32_t c, const int64_t y) const {
+    return 1 + c * 3 + static_cast<size_t>(y + 1) % 3;
+  }
+  float* MutableRow(const uint32_t c, const int64_t y) {
+    return rows_.Row(RowIndex(c, y));
+  }
+  const float* ConstRow(const uint32_t c, const int64_t y) const {
+    return rows_.ConstRow(RowIndex(c, y));
+  }
+
+  const int64_t y0_;
+  const size_t xsize_;
+  ImageF rows_;
+};
+
+// Adds noise to rows [0, ysize) of the planes returned by get_row(c, y), whose
+// first pixel has image coordinates x0, y0. Equivalent to AddNoiseT except for
+// the random numbers, which only depend on the coordinates.
+template <class StrengthEval, class GetRow>
+SIMD_ATTR void AddTileNoiseT(const StrengthEval& noise_model, const int64_t x0,
+                             const int64_t y0, const size_t xsize,
+                             const size_t ysize, const GetRow& get_row) {
+  using D = typename StrengthEval::D;
+  const D d;
+  const auto half = set1(d, 0.5f);
+  // See AddNoiseT.
+  const auto norm_const = set1(d, 0.22f);
+
+  TileNoiseRows<D> rnd(x0, y0, xsize);
+  rnd.Generate(-1);
+  rnd.Generate(0);
+  for (size_t y = 0; y < ysize; ++y) {
+    rnd.Generate(y + 1);
+    float* PIK_RESTRICT row_x = get_row(0, y);
+    float* PIK_RESTRICT row_y = get_row(1, y);
+    float* PIK_RESTRICT row_b = get_row(2, y);
+    for (size_t x = 0; x < xsize; x += d.N) {
+      const auto vx = load(d, row_x + x);
+      const auto vy = load(d, row_y + x);
+      const auto in_g = half * (vy - vx);
+      const auto in_r = half * (vy + vx);
+      const auto clamped_g =
+          clamp(in_g, set1(d, -kXybRadius[1]), set1(d, kXybRadius[1]));
+      const auto clamped_r =
+          clamp(in_r, set1(d, -kXybRadius[1]), set1(d, kXybRadius[1]));
+      const auto noise_strength_g = NoiseStrength(noise_model, clamped_g);
+      const auto noise_strength_r = NoiseStrength(noise_model, clamped_r);
+      AddNoiseToRGB<D>(rnd.Laplacian(0, y, x) * norm_const,
+                       rnd.Laplacian(1, y, x) * norm_const,
+                       rnd.Laplacian(2, y, x) * norm_const, noise_strength_g,
+                       noise_strength_r, row_x + x, row_y + x, row_b + x);
+    }
+  }
+}
+
 // Returns max absolute error at uniformly spaced x.
 template <class EvalApprox>
 SIMD_ATTR float MaxAbsError(const NoiseParams& noise_params,
@@ -378,31 +524,126 @@ SIMD_ATTR float MaxAbsError(const NoiseParams& noise_params,
   return max_abs_err;
 }
 
-}  // namespace
-
-SIMD_ATTR void AddNoise(const NoiseParams& noise_params, Image3F* opsin) {
-  // SIMD descriptor.
-  using D = SIMD_FULL(float);
+// Cheapest evaluator of the noise strength that is accurate enough.
+enum class StrengthEvalType { kNone, kLinear, kPoly, kPow };
 
+SIMD_ATTR StrengthEvalType ChooseStrengthEval(const NoiseParams& noise_params) {
   if (noise_params.alpha == 0.0f) {
     // No noise at all
-    if (noise_params.beta == 0.0f && noise_params.gamma == 0.0f) return;
+    if (noise_params.beta == 0.0f && noise_params.gamma == 0.0f) {
+      return StrengthEvalType::kNone;
+    }
 
     // Constant noise strength independent of pixel intensity
-    AddNoiseT(StrengthEvalLinear<D>(noise_params), opsin);
-    return;
+    return StrengthEvalType::kLinear;
   }
 
-  const StrengthEvalPoly<D> poly(noise_params);
+  const StrengthEvalPoly<SIMD_FULL(float)> poly(noise_params);
   if (MaxAbsError(noise_params, poly) < 1E-3f) {
-    AddNoiseT(poly, opsin);
-  } else {
-    printf("Reverting to pow: %.3f %.3f ^%.3f\n", noise_params.alpha,
-           noise_params.beta, noise_params.gamma);
-    AddNoiseT(StrengthEvalPow(noise_params), opsin);
+    return StrengthEvalType::kPoly;
+  }
+  return StrengthEvalType::kPow;
+}
+
+template <class GetRow>
+SIMD_ATTR void AddTileNoiseRows(const NoiseParams& noise_params,
+                                const StrengthEvalType type, const int64_t x0,
+                                const int64_t y0, const size_t xsize,
+                                const size_t ysize, const GetRow& get_row) {
+  using D = SIMD_FULL(float);
+  switch (type) {
+    case StrengthEvalType::kNone:
+      return;
+    case StrengthEvalType::kLinear:
+      return AddTileNoiseT(StrengthEvalLinear<D>(noise_params), x0, y0, xsize,
+                           ysize, get_row);
+    case StrengthEvalType::kPoly:
+      return AddTileNoiseT(StrengthEvalPoly<D>(noise_params), x0, y0, xsize,
+                           ysize, get_row);
+    case StrengthEvalType::kPow:
+      return AddTileNoiseT(StrengthEvalPow(noise_params), x0, y0, xsize, ysize,
+                           get_row);
+  }
+}
+
+// Row accessors for AddTileNoiseT.
+struct GetImageRow {
+  float* operator()(const size_t c, const size_t y) const {
+    return image->PlaneRow(c, y0 + y);
+  }
+  Image3F* image;
+  size_t y0;
+};
+
+struct GetViewRow {
+  float* operator()(const size_t c, const size_t y) const {
+    return views[c].Row(y);
+  }
+  const MutableImageViewF* views;
+};
+
+}  // namespace
+
+SIMD_ATTR void AddNoise(const NoiseParams& noise_params, Image3F* opsin) {
+  // SIMD descriptor.
+  using D = SIMD_FULL(float);
+
+  switch (ChooseStrengthEval(noise_params)) {
+    case StrengthEvalType::kNone:
+      return;
+    case StrengthEvalType::kLinear:
+      AddNoiseT(StrengthEvalLinear<D>(noise_params), opsin);
+      return;
+    case StrengthEvalType::kPoly:
+      AddNoiseT(StrengthEvalPoly<D>(noise_params), opsin);
+      return;
+    case StrengthEvalType::kPow:
+      AddNoiseT(StrengthEvalPow(noise_params), opsin);
+      return;
   }
 }
 
+SIMD_ATTR void AddTileNoise(const NoiseParams& noise_params, const size_t x0,
+                            const size_t y0, ThreadPool* pool, Image3F* opsin) {
+  const StrengthEvalType type = ChooseStrengthEval(noise_params);
+  if (type == StrengthEvalType::kNone) return;
+
+  const size_t xsize = opsin->xsize();
+  const size_t ysize = opsin->ysize();
+  const size_t num_stripes = DivCeil(ysize, kTileDim);
+  RunOnPool(
+      pool, 0, num_stripes,
+      [&](const int task, const int thread) SIMD_ATTR {
+        const size_t stripe_y0 = task * kTileDim;
+        const size_t stripe_ysize = std::min(kTileDim, ysize - stripe_y0);
+        AddTileNoiseRows(noise_params, type, x0, y0 + stripe_y0, xsize,
+                         stripe_ysize, GetImageRow{opsin, stripe_y0});
+      },
+      "AddTileNoise");
+}
+
+TFNode* AddTileNoise(const TFPorts& opsin, const NoiseParams& noise_params,
+                     const size_t x0, const size_t y0, TFBuilder* builder) {
+  const StrengthEvalType type = ChooseStrengthEval(noise_params);
+  return builder->AddClosure(
+      "noise", Borders(), Scale(), {opsin}, 3, TFType::kF32,
+      [noise_params, type, x0, y0](const ConstImageViewF* in,
+                                   const OutputRegion& output_region,
+                                   const MutableImageViewF* out) SIMD_ATTR {
+        // Unless in-place, start from a copy of the input.
+        for (size_t c = 0; c < 3; ++c) {
+          if (in[c].ConstRow(0) == out[c].Row(0)) continue;
+          for (uint32_t y = 0; y < output_region.ysize; ++y) {
+            memcpy(out[c].Row(y), in[c].ConstRow(y),
+                   output_region.xsize * sizeof(float));
+          }
+        }
+        AddTileNoiseRows(noise_params, type, x0 + output_region.x,
+                         y0 + output_region.y, output_region.xsize,
+                         output_region.ysize, GetViewRow{out});
+      });
+}
+
 // F(alpha, beta, gamma| x,y) = (1-n) * sum_i(y_i - (alpha x_i ^ gamma +
 // beta))^2 + n * alpha * gamma.
 struct LossFunction {
@@ -503,27 +744,21 @@ void DecodeFloatParam(float precision, float* val, BitReader* br) {
   *val = sign * absval_quant / precision;
 }
 
-std::string EncodeNoise(const NoiseParams& noise_params) {
+void EncodeNoise(const NoiseParams& noise_params, BitWriter* writer) {
   const size_t kMaxNoiseSize = 16;
-  std::string output(kMaxNoiseSize, 0);
-  size_t storage_ix = 0;
-  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
-  storage[0] = 0;
+  writer->ReserveBits(kMaxNoiseSize * kBitsPerByte);
+  size_t* storage_ix = writer->storage_ix();
+  uint8_t* storage = writer->storage();
   const bool have_noise =
       (noise_params.alpha != 0.0f || noise_params.gamma != 0.0f ||
        noise_params.beta != 0.0f);
-  WriteBits(1, have_noise, &storage_ix, storage);
+  WriteBits(1, have_noise, storage_ix, storage);
   if (have_noise) {
-    EncodeFloatParam(noise_params.alpha, kNoisePrecision, &storage_ix, storage);
-    EncodeFloatParam(noise_params.gamma, kNoisePrecision, &storage_ix, storage);
-    EncodeFloatParam(noise_params.beta, kNoisePrecision, &storage_ix, storage);
-  }
-  size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
-  WriteBits(jump_bits, 0, &storage_ix, storage);
-  PIK_ASSERT(storage_ix % 8 == 0);
-  size_t output_size = storage_ix >> 3;
-  output.resize(output_size);
-  return output;
+    EncodeFloatParam(noise_params.alpha, kNoisePrecision, storage_ix, storage);
+    EncodeFloatParam(noise_params.gamma, kNoisePrecision, storage_ix, storage);
+    EncodeFloatParam(noise_params.beta, kNoisePrecision, storage_ix, storage);
+  }
+  WriteZeroesToByteBoundary(storage_ix, storage);
 }
 
 bool DecodeNoise(BitReader* br, NoiseParams* noise_params) {
@@ -538,6 +773,31 @@ bool DecodeNoise(BitReader* br, NoiseParams* noise_params) {
   return br->JumpToByteBoundary();
 }
 
+void QuantizeNoiseParams(const NoiseParams& noise_params,
+                         uint32_t quantized[3]) {
+  const float params[3] = {noise_params.alpha, noise_params.gamma,
+                           noise_params.beta};
+  for (size_t i = 0; i < 3; ++i) {
+    const uint32_t absval_quant =
+        static_cast<uint32_t>(std::abs(params[i]) * kNoisePrecision + 0.5f);
+    PIK_ASSERT(absval_quant < (1 << 16));
+    quantized[i] = absval_quant | (params[i] < 0 ? 1 << 16 : 0);
+  }
+}
+
+NoiseParams DequantizeNoiseParams(const uint32_t quantized[3]) {
+  float params[3];
+  for (size_t i = 0; i < 3; ++i) {
+    const float absval = (quantized[i] & 0xFFFF) / kNoisePrecision;
+    params[i] = (quantized[i] & (1 << 16)) ? -absval : absval;
+  }
+  NoiseParams noise_params;
+  noise_params.alpha = params[0];
+  noise_params.gamma = params[1];
+  noise_params.beta = params[2];
+  return noise_params;
+}
+
 void OptimizeNoiseParameters(const std::vector<NoiseLevel>& noise_level,
                              NoiseParams* noise_params) {
   static const double kPrecision = 1e-8;
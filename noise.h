@@ -10,7 +10,10 @@
 // Noise synthesis. Currently disabled.
 
 #include "bit_reader.h"
+#include "data_parallel.h"
 #include "image.h"
+#include "tile_flow.h"
+#include "write_bits.h"
 
 namespace pik {
 
@@ -31,14 +34,32 @@ struct NoiseLevel {
 // Add a noise to Opsin image
 void AddNoise(const NoiseParams& noise_params, Image3F* opsin);
 
+// As above, but the random numbers are a hash of each pixel's coordinates
+// instead of a sequential generator, so the result does not depend on how the
+// image is partitioned. Used if PassHeader::kTileNoise. (x0, y0) are the image
+// coordinates of the first pixel of "opsin", e.g. the origin of a crop.
+void AddTileNoise(const NoiseParams& noise_params, size_t x0, size_t y0,
+                  ThreadPool* pool, Image3F* opsin);
+
+// Returns a node that adds the same noise as AddTileNoise to each tile;
+// (x0, y0) is added to the tile coordinates.
+TFNode* AddTileNoise(const TFPorts& opsin, const NoiseParams& noise_params,
+                     size_t x0, size_t y0, TFBuilder* builder);
+
 // Get parameters of the noise for NoiseParams model
 void GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
                        float quality_coef);
 
-std::string EncodeNoise(const NoiseParams& noise_params);
+void EncodeNoise(const NoiseParams& noise_params, BitWriter* writer);
 
 bool DecodeNoise(BitReader* br, NoiseParams* noise_params);
 
+// Converts to/from the integers stored in PassHeader::noise_params, with the
+// same precision as EncodeNoise.
+void QuantizeNoiseParams(const NoiseParams& noise_params,
+                         uint32_t quantized[3]);
+NoiseParams DequantizeNoiseParams(const uint32_t quantized[3]);
+
 // Texture Strength is defined as tr(A), A = [Gh, Gv]^T[[Gh, Gv]]
 std::vector<float> GetTextureStrength(const Image3F& opsin, const int block_s);
 
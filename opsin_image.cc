@@ -8,13 +8,29 @@
 
 #include <stddef.h>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "approx_cube_root.h"
 #include "codec.h"
 #include "compiler_specific.h"
 #include "external_image.h"
 #include "profiler.h"
+#include "simd/simd.h"
+
+namespace pik {
+
+// Per-target implementation of the opsin transform in OpsinDynamicsImage.
+struct LinearToOpsinImpl {
+  template <class Target>
+  void operator()(const Image3F& linear, const Rect& rect, ThreadPool* pool,
+                  Image3F* PIK_RESTRICT opsin) const;
+};
+
+}  // namespace pik
+
+// Must include "normally" so the build system understands the dependency.
+#include "opsin_image_target.cc"
+
+#define SIMD_ATTR_IMPL "opsin_image_target.cc"
+#include "simd/foreach_target.h"
 
 namespace pik {
 
@@ -48,7 +64,8 @@ void LinearToXyb(const float r, const float g, const float b,
 
 // This is different from butteraugli::OpsinDynamicsImage() in the sense that
 // it does not contain a sensitivity multiplier based on the blurred image.
-Image3F OpsinDynamicsImage(const CodecInOut* in, const Rect& in_rect) {
+Image3F OpsinDynamicsImage(const CodecInOut* in, const Rect& in_rect,
+                           ThreadPool* pool) {
   PROFILER_FUNC;
 
   // Convert to linear sRGB (unless already in that space)
@@ -57,31 +74,15 @@ Image3F OpsinDynamicsImage(const CodecInOut* in, const Rect& in_rect) {
   Rect linear_rect = in_rect;
   if (!in->IsLinearSRGB()) {
     const ColorEncoding& c = in->Context()->c_linear_srgb[in->IsGray()];
-    PIK_CHECK(in->CopyTo(in_rect, c, &copy));
+    PIK_CHECK(in->CopyTo(in_rect, c, &copy, pool));
     linear_srgb = &copy;
     // We've cut out the rectangle, start at x0=y0=0 in copy.
     linear_rect = Rect(copy);
   }
 
-  const size_t xsize = in_rect.xsize();
-  const size_t ysize = in_rect.ysize();
-  Image3F opsin(xsize, ysize);
-
-  for (size_t y = 0; y < ysize; ++y) {
-    const float* PIK_RESTRICT row_in0 =
-        linear_rect.ConstPlaneRow(*linear_srgb, 0, y);
-    const float* PIK_RESTRICT row_in1 =
-        linear_rect.ConstPlaneRow(*linear_srgb, 1, y);
-    const float* PIK_RESTRICT row_in2 =
-        linear_rect.ConstPlaneRow(*linear_srgb, 2, y);
-    float* PIK_RESTRICT row_xyb0 = opsin.PlaneRow(0, y);
-    float* PIK_RESTRICT row_xyb1 = opsin.PlaneRow(1, y);
-    float* PIK_RESTRICT row_xyb2 = opsin.PlaneRow(2, y);
-    for (size_t x = 0; x < xsize; x++) {
-      LinearToXyb(row_in0[x], row_in1[x], row_in2[x], &row_xyb0[x],
-                  &row_xyb1[x], &row_xyb2[x]);
-    }
-  }
+  Image3F opsin(in_rect.xsize(), in_rect.ysize());
+  Dispatch(TargetBitfield().Best(), LinearToOpsinImpl(), *linear_srgb,
+           linear_rect, pool, &opsin);
   return opsin;
 }
 
@@ -15,6 +15,7 @@
 
 #include "codec.h"
 #include "compiler_specific.h"
+#include "data_parallel.h"
 #include "opsin_params.h"
 
 namespace pik {
@@ -33,8 +34,11 @@ void LinearToXyb(const float r, const float g, const float b,
                  float* PIK_RESTRICT valx, float* PIK_RESTRICT valy,
                  float* PIK_RESTRICT valz);
 
-// Returns the opsin XYB for the part of the image bounded by rect.
-Image3F OpsinDynamicsImage(const CodecInOut* in, const Rect& rect);
+// Returns the opsin XYB for the part of the image bounded by rect. Uses the
+// best SIMD target supported by the CPU and, if not null, the pool for both
+// the conversion to linear sRGB and the opsin transform.
+Image3F OpsinDynamicsImage(const CodecInOut* in, const Rect& rect,
+                           ThreadPool* pool = nullptr);
 
 // DEPRECATED, used by opsin_image_wrapper.
 Image3F OpsinDynamicsImage(const Image3B& srgb);
@@ -0,0 +1,89 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Vector version of ApproxCubeRoot for y >= 0. The initial guess divides the
+// bits by 3 in floating-point, so results may differ in the last bits.
+template <class D, class V>
+SIMD_ATTR PIK_INLINE V ApproxCubeRootV(D d, const V y) {
+  const SIMD_FULL(int32_t) di;
+  const auto third = set1(d, 1.0f / 3);
+  const auto bits = convert_to(d, cast_to(di, y));
+  const auto x0 =
+      cast_to(d, convert_to(di, bits * third) + set1(di, 0x2a50f200));
+  const auto two = set1(d, 2.0f);
+  const auto x1 = third * (two * x0 + y / (x0 * x0));
+  return third * (two * x1 + y / (x1 * x1));
+}
+
+SIMD_ATTR void LinearToOpsin(const Image3F& linear, const Rect& rect,
+                             ThreadPool* pool, Image3F* PIK_RESTRICT opsin) {
+  const size_t xsize = rect.xsize();
+  const SIMD_FULL(float) d;
+
+  RunOnPool(
+      pool, 0, rect.ysize(),
+      [&](const int task, const int thread) SIMD_ATTR {
+        const size_t y = task;
+        // Constants are set here rather than in a static initializer, which
+        // would run instructions the CPU might not support.
+        const float* mix = &kOpsinAbsorbanceMatrix[0];
+        const float* bias = &kOpsinAbsorbanceBias[0];
+        const auto zero = setzero(d);
+        const auto half = set1(d, 0.5f);
+        const auto scale_r = set1(d, kScaleR);
+        const auto scale_g = set1(d, kScaleG);
+
+        const float* PIK_RESTRICT row_in0 = rect.ConstPlaneRow(linear, 0, y);
+        const float* PIK_RESTRICT row_in1 = rect.ConstPlaneRow(linear, 1, y);
+        const float* PIK_RESTRICT row_in2 = rect.ConstPlaneRow(linear, 2, y);
+        float* PIK_RESTRICT row_xyb0 = opsin->PlaneRow(0, y);
+        float* PIK_RESTRICT row_xyb1 = opsin->PlaneRow(1, y);
+        float* PIK_RESTRICT row_xyb2 = opsin->PlaneRow(2, y);
+        for (size_t x = 0; x < xsize; x += d.N) {
+          const auto r = load_unaligned(d, row_in0 + x);
+          const auto g = load_unaligned(d, row_in1 + x);
+          const auto b = load_unaligned(d, row_in2 + x);
+          // Same as OpsinAbsorbance; mixed should be non-negative even for
+          // wide-gamut, so clamp. The bias ensures it is never -0.
+          auto mixed0 = set1(d, mix[0]) * r + set1(d, mix[1]) * g +
+                        set1(d, mix[2]) * b + set1(d, bias[0]);
+          auto mixed1 = set1(d, mix[3]) * r + set1(d, mix[4]) * g +
+                        set1(d, mix[5]) * b + set1(d, bias[1]);
+          auto mixed2 = set1(d, mix[6]) * r + set1(d, mix[7]) * g +
+                        set1(d, mix[8]) * b + set1(d, bias[2]);
+          mixed0 = ApproxCubeRootV(d, max(mixed0, zero));
+          mixed1 = ApproxCubeRootV(d, max(mixed1, zero));
+          mixed2 = ApproxCubeRootV(d, max(mixed2, zero));
+
+          // LinearXybTransform
+          store((scale_r * mixed0 - scale_g * mixed1) * half, d, row_xyb0 + x);
+          store((scale_r * mixed0 + scale_g * mixed1) * half, d, row_xyb1 + x);
+          store(mixed2, d, row_xyb2 + x);
+        }
+      },
+      "LinearToOpsin");
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void LinearToOpsinImpl::operator()<SIMD_TARGET>(
+    const Image3F& linear, const Rect& rect, ThreadPool* pool,
+    Image3F* PIK_RESTRICT opsin) const {
+  SIMD_NAMESPACE::LinearToOpsin(linear, rect, pool, opsin);
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
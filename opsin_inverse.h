@@ -7,23 +7,70 @@
 #ifndef OPSIN_INVERSE_H_
 #define OPSIN_INVERSE_H_
 
-// XYB -> linear sRGB.
+// XYB -> linear sRGB, or directly to sRGB-encoded interleaved samples.
+
+#include <stddef.h>
+#include <stdint.h>
 
 #include "data_parallel.h"
 #include "image.h"
 #include "simd/simd.h"
+#include "tile_flow.h"
 
 namespace pik {
 
+// The functions below use the best SIMD target supported by the CPU.
+
 // Converts to linear sRGB. "linear" may alias "opsin".
 // Prefer to replace this parallelize-across-image version with the one below,
 // which is suitable for parallelize-across-group.
-SIMD_ATTR void OpsinToLinear(const Image3F& opsin, ThreadPool* pool,
-                             Image3F* linear);
+void OpsinToLinear(const Image3F& opsin, ThreadPool* pool, Image3F* linear);
 
 // Converts to linear sRGB, writing to linear:rect_out.
-SIMD_ATTR void OpsinToLinear(const Image3F& opsin, const Rect& rect_out,
-                             Image3F* PIK_RESTRICT linear);
+void OpsinToLinear(const Image3F& opsin, const Rect& rect_out,
+                   Image3F* PIK_RESTRICT linear);
+
+// Adds a TFGraph node that converts the three ports of "opsin" to linear sRGB,
+// typically followed by TFBuilder::SetSink. The node may run in-place.
+TFNode* AddOpsinToLinear(const TFPorts& opsin, TFBuilder* builder);
+
+// Caller-provided destination for sRGB-encoded, interleaved RGB or RGBA
+// samples (e.g. a display buffer). 16-bit samples are in native byte order.
+struct InterleavedOutput {
+  size_t Channels() const { return has_alpha ? 4 : 3; }
+  size_t BytesPerPixel() const { return Channels() * bits_per_sample / 8; }
+  uint8_t* Row(const size_t y) const { return bytes + y * stride; }
+
+  uint8_t* bytes = nullptr;  // Top-left pixel; not owned.
+  size_t xsize = 0;
+  size_t ysize = 0;
+  size_t stride = 0;  // [bytes] between the start of consecutive rows.
+  size_t bits_per_sample = 8;  // 8 or 16.
+  bool has_alpha = false;
+  // Adds an ordered dither pattern before rounding to 8 bits, which hides
+  // banding in smooth gradients.
+  bool dither = false;
+};
+
+// Converts the top-left out.xsize x out.ysize pixels of "opsin" to sRGB and
+// writes their color channels to "out" (alpha is left unchanged). If
+// "grayscale", all channels are set to the luminance.
+void OpsinToInterleaved(const Image3F& opsin, bool grayscale, ThreadPool* pool,
+                        const InterleavedOutput& out);
+
+// Adds a TFGraph node that writes the three ports of "opsin" to "out" like
+// OpsinToInterleaved. The node's own output is unused, so this is the last
+// node of a graph without sinks. Pixels outside "out" are skipped, hence the
+// graph's sink_size may include padding.
+TFNode* AddOpsinToInterleaved(const TFPorts& opsin, bool grayscale,
+                              const InterleavedOutput& out,
+                              TFBuilder* builder);
+
+// Writes "alpha" (whose samples have "bits_per_alpha" = 8 or 16) to the alpha
+// channel of "out", or sets it to opaque if "alpha" is null (then
+// "bits_per_alpha" is ignored).
+void AlphaToInterleaved(const ImageU* alpha, size_t bits_per_alpha,
+                        const InterleavedOutput& out);
 
 }  // namespace pik
 
@@ -0,0 +1,394 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Empty if not included by foreach_target.
+#ifdef SIMD_ATTR_IMPL
+
+#include "transfer_functions.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Broadcasts the 3x3 entries of the (row-major) opsin absorbance matrix
+// inverse into 9 vectors. Computed per call rather than in a static
+// initializer, which would run instructions the CPU might not support.
+template <class D>
+SIMD_ATTR PIK_INLINE void BroadcastInverseMatrix(
+    D d, float* PIK_RESTRICT inverse_matrix) {
+  const float* PIK_RESTRICT inverse = GetOpsinAbsorbanceInverseMatrix();
+  for (size_t i = 0; i < 9; ++i) {
+    store(set1(d, inverse[i]), d, &inverse_matrix[i * d.N]);
+  }
+}
+
+// Inverts the pixel-wise RGB->XYB conversion in OpsinDynamicsImage() (including
+// the gamma mixing and simple gamma). Avoids clamping to [0, 255] - out of
+// (sRGB) gamut values may be in-gamut after transforming to a wider space.
+// "inverse_matrix" points to 9 broadcasted vectors, which are the 3x3 entries
+// of the (row-major) opsin absorbance matrix inverse. Pre-multiplying its
+// entries by c is equivalent to multiplying linear_* by c afterwards.
+template <class D, class V>
+SIMD_ATTR PIK_INLINE void XybToRgb(D d, const V opsin_x, const V opsin_y,
+                                   const V opsin_b,
+                                   const float* PIK_RESTRICT inverse_matrix,
+                                   V* const PIK_RESTRICT linear_r,
+                                   V* const PIK_RESTRICT linear_g,
+                                   V* const PIK_RESTRICT linear_b) {
+#if SIMD_TARGET_VALUE == SIMD_NONE
+  const auto inv_scale_x = set1(d, kInvScaleR);
+  const auto inv_scale_y = set1(d, kInvScaleG);
+  const auto neg_bias_r = set1(d, kNegOpsinAbsorbanceBiasRGB[0]);
+  const auto neg_bias_g = set1(d, kNegOpsinAbsorbanceBiasRGB[1]);
+  const auto neg_bias_b = set1(d, kNegOpsinAbsorbanceBiasRGB[2]);
+#else
+  const auto neg_bias_rgb = load_dup128(d, kNegOpsinAbsorbanceBiasRGB);
+  SIMD_ALIGN const float inv_scale_lanes[4] = {kInvScaleR, kInvScaleG};
+  const auto inv_scale = load_dup128(d, inv_scale_lanes);
+  const auto inv_scale_x = broadcast<0>(inv_scale);
+  const auto inv_scale_y = broadcast<1>(inv_scale);
+  const auto neg_bias_r = broadcast<0>(neg_bias_rgb);
+  const auto neg_bias_g = broadcast<1>(neg_bias_rgb);
+  const auto neg_bias_b = broadcast<2>(neg_bias_rgb);
+#endif
+
+  // Color space: XYB -> RGB
+  const auto gamma_r = inv_scale_x * (opsin_y + opsin_x);
+  const auto gamma_g = inv_scale_y * (opsin_y - opsin_x);
+  const auto gamma_b = opsin_b;
+
+  // Undo gamma compression: linear = gamma^3 for efficiency.
+  const auto gamma_r2 = gamma_r * gamma_r;
+  const auto gamma_g2 = gamma_g * gamma_g;
+  const auto gamma_b2 = gamma_b * gamma_b;
+  const auto mixed_r = mul_add(gamma_r2, gamma_r, neg_bias_r);
+  const auto mixed_g = mul_add(gamma_g2, gamma_g, neg_bias_g);
+  const auto mixed_b = mul_add(gamma_b2, gamma_b, neg_bias_b);
+
+  // Unmix (multiply by 3x3 inverse_matrix)
+  *linear_r = load(d, &inverse_matrix[0 * d.N]) * mixed_r;
+  *linear_g = load(d, &inverse_matrix[3 * d.N]) * mixed_r;
+  *linear_b = load(d, &inverse_matrix[6 * d.N]) * mixed_r;
+  const auto tmp_r = load(d, &inverse_matrix[1 * d.N]) * mixed_g;
+  const auto tmp_g = load(d, &inverse_matrix[4 * d.N]) * mixed_g;
+  const auto tmp_b = load(d, &inverse_matrix[7 * d.N]) * mixed_g;
+  *linear_r = mul_add(load(d, &inverse_matrix[2 * d.N]), mixed_b, *linear_r);
+  *linear_g = mul_add(load(d, &inverse_matrix[5 * d.N]), mixed_b, *linear_g);
+  *linear_b = mul_add(load(d, &inverse_matrix[8 * d.N]), mixed_b, *linear_b);
+  *linear_r += tmp_r;
+  *linear_g += tmp_g;
+  *linear_b += tmp_b;
+}
+
+SIMD_ATTR void OpsinToLinear(const Image3F& opsin, ThreadPool* pool,
+                             Image3F* linear) {
+  PIK_CHECK(linear->xsize() != 0);
+  PROFILER_FUNC;
+  // Opsin is padded to blocks; only produce valid output pixels.
+  const size_t xsize = linear->xsize();
+  const size_t ysize = linear->ysize();
+
+  const SIMD_FULL(float) d;
+  SIMD_ALIGN float inverse_matrix[9 * d.N];
+  BroadcastInverseMatrix(d, inverse_matrix);
+
+  RunOnPool(
+      pool, 0, ysize,
+      [&](const int task, const int thread) SIMD_ATTR {
+        const size_t y = task;
+
+        // Faster than adding via ByteOffset at end of loop.
+        const float* row_opsin_x = opsin.ConstPlaneRow(0, y);
+        const float* row_opsin_y = opsin.ConstPlaneRow(1, y);
+        const float* row_opsin_b = opsin.ConstPlaneRow(2, y);
+
+        // Potentially aliased with input.
+        float* row_linear_r = linear->PlaneRow(0, y);
+        float* row_linear_g = linear->PlaneRow(1, y);
+        float* row_linear_b = linear->PlaneRow(2, y);
+
+        for (size_t x = 0; x < xsize; x += d.N) {
+          const auto in_opsin_x = load(d, row_opsin_x + x);
+          const auto in_opsin_y = load(d, row_opsin_y + x);
+          const auto in_opsin_b = load(d, row_opsin_b + x);
+          PIK_COMPILER_FENCE;
+          SIMD_FULL(float)::V linear_r, linear_g, linear_b;
+          XybToRgb(d, in_opsin_x, in_opsin_y, in_opsin_b, inverse_matrix,
+                   &linear_r, &linear_g, &linear_b);
+
+          store(linear_r, d, row_linear_r + x);
+          store(linear_g, d, row_linear_g + x);
+          store(linear_b, d, row_linear_b + x);
+        }
+      },
+      "OpsinToLinear");
+}
+
+SIMD_ATTR void OpsinToLinear(const Image3F& opsin, const Rect& rect_out,
+                             Image3F* PIK_RESTRICT linear) {
+  PROFILER_ZONE("OpsinToLinear(Rect)");
+  PIK_ASSERT(linear->xsize() != 0);
+  // Opsin is padded to blocks; only produce valid output pixels.
+  const size_t xsize = rect_out.xsize();
+  const size_t ysize = rect_out.ysize();
+  PIK_ASSERT(xsize <= opsin.xsize());
+  PIK_ASSERT(ysize <= opsin.ysize());
+
+  const SIMD_FULL(float) d;
+  SIMD_ALIGN float inverse_matrix[9 * d.N];
+  BroadcastInverseMatrix(d, inverse_matrix);
+
+  for (size_t y = 0; y < ysize; ++y) {
+    // Faster than adding via ByteOffset at end of loop.
+    const float* PIK_RESTRICT row_opsin_x = opsin.ConstPlaneRow(0, y);
+    const float* PIK_RESTRICT row_opsin_y = opsin.ConstPlaneRow(1, y);
+    const float* PIK_RESTRICT row_opsin_b = opsin.ConstPlaneRow(2, y);
+
+    float* PIK_RESTRICT row_linear_r = rect_out.PlaneRow(linear, 0, y);
+    float* PIK_RESTRICT row_linear_g = rect_out.PlaneRow(linear, 1, y);
+    float* PIK_RESTRICT row_linear_b = rect_out.PlaneRow(linear, 2, y);
+
+    for (size_t x = 0; x < xsize; x += d.N) {
+      const auto in_opsin_x = load(d, row_opsin_x + x);
+      const auto in_opsin_y = load(d, row_opsin_y + x);
+      const auto in_opsin_b = load(d, row_opsin_b + x);
+      PIK_COMPILER_FENCE;
+      SIMD_FULL(float)::V linear_r, linear_g, linear_b;
+      XybToRgb(d, in_opsin_x, in_opsin_y, in_opsin_b, inverse_matrix, &linear_r,
+               &linear_g, &linear_b);
+
+      store(linear_r, d, row_linear_r + x);
+      store(linear_g, d, row_linear_g + x);
+      store(linear_b, d, row_linear_b + x);
+    }
+  }
+}
+
+// Pixels per call to StoreInterleaved; bounds the size of stack buffers.
+constexpr size_t kInterleavedChunk = 256;
+
+// 8x8 Bayer matrix for ordered dithering.
+constexpr uint8_t kBayer8[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+
+// Quantizes "num" pixels of sRGB-encoded "planes" (kInterleavedChunk apart,
+// values in [0, 1]) and stores their color channels to "out" starting at x0, y.
+template <typename T>
+void StoreInterleaved(const float* PIK_RESTRICT planes, const size_t x0,
+                      const size_t y, const size_t num,
+                      const InterleavedOutput& out) {
+  const size_t channels = out.Channels();
+  T* PIK_RESTRICT row = reinterpret_cast<T*>(out.Row(y)) + x0 * channels;
+  const float mul = static_cast<float>(T(~T(0)));
+
+  // Rounding offsets: 0.5 (nearest) or dither thresholds in (0, 1).
+  float offsets[8];
+  for (size_t i = 0; i < 8; ++i) {
+    const size_t x = (x0 + i) & 7;
+    offsets[i] = (out.dither && sizeof(T) == 1)
+                     ? (kBayer8[y & 7][x] + 0.5f) * (1.0f / 64)
+                     : 0.5f;
+  }
+
+  const float* PIK_RESTRICT plane_r = planes;
+  const float* PIK_RESTRICT plane_g = planes + kInterleavedChunk;
+  const float* PIK_RESTRICT plane_b = planes + 2 * kInterleavedChunk;
+  for (size_t i = 0; i < num; ++i) {
+    const float offset = offsets[i & 7];
+    row[i * channels + 0] = static_cast<T>(plane_r[i] * mul + offset);
+    row[i * channels + 1] = static_cast<T>(plane_g[i] * mul + offset);
+    row[i * channels + 2] = static_cast<T>(plane_b[i] * mul + offset);
+  }
+}
+
+// Converts "xsize" pixels of opsin rows to sRGB and stores them to "out"
+// starting at x0, y. Rows must be padded to a multiple of the vector size.
+template <class D>
+SIMD_ATTR void OpsinRowToInterleaved(D d, const float* PIK_RESTRICT row_x,
+                                     const float* PIK_RESTRICT row_y,
+                                     const float* PIK_RESTRICT row_b,
+                                     const size_t x0, const size_t y,
+                                     const size_t xsize, const bool grayscale,
+                                     const float* PIK_RESTRICT inverse_matrix,
+                                     const InterleavedOutput& out) {
+  SIMD_ALIGN float planes[3 * kInterleavedChunk];
+  const auto zero = setzero(d);
+  const auto one = set1(d, 1.0f);
+  const auto inv_255 = set1(d, 1.0f / 255);
+  const auto weight_r = set1(d, 0.299f);
+  const auto weight_g = set1(d, 0.587f);
+  const auto weight_b = set1(d, 0.114f);
+
+  for (size_t begin = 0; begin < xsize; begin += kInterleavedChunk) {
+    const size_t num = std::min(kInterleavedChunk, xsize - begin);
+    for (size_t i = 0; i < num; i += d.N) {
+      const auto in_opsin_x = load(d, row_x + begin + i);
+      const auto in_opsin_y = load(d, row_y + begin + i);
+      const auto in_opsin_b = load(d, row_b + begin + i);
+      PIK_COMPILER_FENCE;
+      SIMD_FULL(float)::V linear_r, linear_g, linear_b;
+      XybToRgb(d, in_opsin_x, in_opsin_y, in_opsin_b, inverse_matrix,
+               &linear_r, &linear_g, &linear_b);
+      if (grayscale) {
+        linear_r = mul_add(linear_r, weight_r,
+                           mul_add(linear_g, weight_g, linear_b * weight_b));
+        linear_g = linear_r;
+        linear_b = linear_r;
+      }
+
+      // The transfer function requires [0, 1]; out of gamut values are
+      // clipped as when writing to integer images.
+      linear_r = min(max(linear_r * inv_255, zero), one);
+      linear_g = min(max(linear_g * inv_255, zero), one);
+      linear_b = min(max(linear_b * inv_255, zero), one);
+      store(TF_SRGB().EncodedFromDisplay(linear_r), d, planes + i);
+      store(TF_SRGB().EncodedFromDisplay(linear_g), d,
+            planes + kInterleavedChunk + i);
+      store(TF_SRGB().EncodedFromDisplay(linear_b), d,
+            planes + 2 * kInterleavedChunk + i);
+    }
+
+    if (out.bits_per_sample == 8) {
+      StoreInterleaved<uint8_t>(planes, x0 + begin, y, num, out);
+    } else {
+      StoreInterleaved<uint16_t>(planes, x0 + begin, y, num, out);
+    }
+  }
+}
+
+SIMD_ATTR void OpsinToInterleaved(const Image3F& opsin, const bool grayscale,
+                                  ThreadPool* pool,
+                                  const InterleavedOutput& out) {
+  PROFILER_FUNC;
+  PIK_CHECK(out.xsize <= opsin.xsize() && out.ysize <= opsin.ysize());
+
+  const SIMD_FULL(float) d;
+  SIMD_ALIGN float inverse_matrix[9 * d.N];
+  BroadcastInverseMatrix(d, inverse_matrix);
+
+  RunOnPool(
+      pool, 0, out.ysize,
+      [&](const int task, const int thread) SIMD_ATTR {
+        const size_t y = task;
+        OpsinRowToInterleaved(d, opsin.ConstPlaneRow(0, y),
+                              opsin.ConstPlaneRow(1, y),
+                              opsin.ConstPlaneRow(2, y), 0, y, out.xsize,
+                              grayscale, inverse_matrix, out);
+      },
+      "OpsinToInterleaved");
+}
+
+TFNode* AddOpsinToInterleaved(const TFPorts& opsin, const bool grayscale,
+                              const InterleavedOutput& out,
+                              TFBuilder* builder) {
+  return builder->AddClosure(
+      "interleave", Borders(), Scale(), {opsin}, 1, TFType::kU8,
+      [grayscale, out](const ConstImageViewF* in,
+                       const OutputRegion& output_region,
+                       const MutableImageViewF* unused) SIMD_ATTR {
+        const SIMD_FULL(float) d;
+        SIMD_ALIGN float inverse_matrix[9 * d.N];
+        BroadcastInverseMatrix(d, inverse_matrix);
+
+        // Skip padding (if any) beyond the bottom/right of "out".
+        if (output_region.x >= out.xsize || output_region.y >= out.ysize) {
+          return;
+        }
+        const size_t xsize =
+            std::min<size_t>(output_region.partial_xsize,
+                             out.xsize - output_region.x);
+        const size_t ysize =
+            std::min<size_t>(output_region.partial_ysize,
+                             out.ysize - output_region.y);
+
+        for (size_t y = 0; y < ysize; ++y) {
+          OpsinRowToInterleaved(d, in[0].ConstRow(y), in[1].ConstRow(y),
+                                in[2].ConstRow(y), output_region.x,
+                                output_region.y + y, xsize, grayscale,
+                                inverse_matrix, out);
+        }
+      });
+}
+
+TFNode* AddOpsinToLinear(const TFPorts& opsin, TFBuilder* builder) {
+  return builder->AddClosure(
+      "opsin_to_linear", Borders(), Scale(), {opsin}, 3, TFType::kF32,
+      [](const ConstImageViewF* in, const OutputRegion& output_region,
+         const MutableImageViewF* out) SIMD_ATTR {
+        const SIMD_FULL(float) d;
+        SIMD_ALIGN float inverse_matrix[9 * d.N];
+        BroadcastInverseMatrix(d, inverse_matrix);
+
+        for (uint32_t y = 0; y < output_region.ysize; ++y) {
+          const float* row_opsin_x = in[0].ConstRow(y);
+          const float* row_opsin_y = in[1].ConstRow(y);
+          const float* row_opsin_b = in[2].ConstRow(y);
+
+          // Aliased with the input if in-place.
+          float* row_linear_r = out[0].Row(y);
+          float* row_linear_g = out[1].Row(y);
+          float* row_linear_b = out[2].Row(y);
+
+          for (uint32_t x = 0; x < output_region.xsize; x += d.N) {
+            const auto in_opsin_x = load_unaligned(d, row_opsin_x + x);
+            const auto in_opsin_y = load_unaligned(d, row_opsin_y + x);
+            const auto in_opsin_b = load_unaligned(d, row_opsin_b + x);
+            PIK_COMPILER_FENCE;
+            SIMD_FULL(float)::V linear_r, linear_g, linear_b;
+            XybToRgb(d, in_opsin_x, in_opsin_y, in_opsin_b, inverse_matrix,
+                     &linear_r, &linear_g, &linear_b);
+
+            store(linear_r, d, row_linear_r + x);
+            store(linear_g, d, row_linear_g + x);
+            store(linear_b, d, row_linear_b + x);
+          }
+        }
+      });
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+template <>
+void OpsinToLinearImpl::operator()<SIMD_TARGET>(const Image3F& opsin,
+                                                ThreadPool* pool,
+                                                Image3F* linear) const {
+  SIMD_NAMESPACE::OpsinToLinear(opsin, pool, linear);
+}
+
+template <>
+void OpsinToLinearImpl::operator()<SIMD_TARGET>(
+    const Image3F& opsin, const Rect& rect_out,
+    Image3F* PIK_RESTRICT linear) const {
+  SIMD_NAMESPACE::OpsinToLinear(opsin, rect_out, linear);
+}
+
+template <>
+TFNode* AddOpsinToLinearImpl::operator()<SIMD_TARGET>(
+    const TFPorts& opsin, TFBuilder* builder) const {
+  return SIMD_NAMESPACE::AddOpsinToLinear(opsin, builder);
+}
+
+template <>
+void OpsinToInterleavedImpl::operator()<SIMD_TARGET>(
+    const Image3F& opsin, const bool grayscale, ThreadPool* pool,
+    const InterleavedOutput& out) const {
+  SIMD_NAMESPACE::OpsinToInterleaved(opsin, grayscale, pool, out);
+}
+
+template <>
+TFNode* AddOpsinToInterleavedImpl::operator()<SIMD_TARGET>(
+    const TFPorts& opsin, const bool grayscale, const InterleavedOutput& out,
+    TFBuilder* builder) const {
+  return SIMD_NAMESPACE::AddOpsinToInterleaved(opsin, grayscale, out, builder);
+}
+
+}  // namespace pik
+
+#endif  // SIMD_ATTR_IMPL
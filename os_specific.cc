@@ -28,8 +28,13 @@
 
 #ifdef __linux__
 #define OS_LINUX 1
+#include <dirent.h>
+#include <fcntl.h>
 #include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -39,8 +44,13 @@
 
 #ifdef __MACH__
 #define OS_MAC 1
+#include <dirent.h>
+#include <fcntl.h>
 #include <mach/mach.h>
 #include <mach/mach_time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -50,8 +60,13 @@
 
 #ifdef __FreeBSD__
 #define OS_FREEBSD 1
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/cpuset.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -85,6 +100,16 @@ double Now() {
 #endif
 }
 
+uint64_t PageFaults() {
+#if OS_WIN
+  return 0;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return usage.ru_minflt + usage.ru_majflt;
+#endif
+}
+
 struct ThreadAffinity {
 #if OS_WIN
   DWORD_PTR mask;
@@ -266,4 +291,82 @@ Status RunCommand(const std::vector<std::string>& args) {
 #endif
 }
 
+Status ListDirectory(const std::string& dir, std::vector<std::string>* names) {
+  names->clear();
+#if OS_WIN
+  WIN32_FIND_DATAA data;
+  const HANDLE handle = FindFirstFileA((dir + "\\*").c_str(), &data);
+  if (handle == INVALID_HANDLE_VALUE) return false;
+  do {
+    if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      names->push_back(data.cFileName);
+    }
+  } while (FindNextFileA(handle, &data));
+  FindClose(handle);
+#else
+  DIR* handle = opendir(dir.c_str());
+  if (handle == nullptr) return false;
+  while (const struct dirent* entry = readdir(handle)) {
+    if (entry->d_name[0] == '.') continue;  // also skips "." and ".."
+    names->push_back(entry->d_name);
+  }
+  closedir(handle);
+#endif
+  std::sort(names->begin(), names->end());
+  return true;
+}
+
+MappedFile::~MappedFile() { Unmap(); }
+
+void MappedFile::Unmap() {
+  if (data_ == nullptr) return;
+#if OS_WIN
+  UnmapViewOfFile(data_);
+#else
+  munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+  data_ = nullptr;
+  size_ = 0;
+}
+
+Status MappedFile::Map(const std::string& pathname) {
+  Unmap();
+#if OS_WIN
+  const HANDLE file =
+      CreateFileA(pathname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return PIK_FAILURE("Failed to open file");
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return PIK_FAILURE("Failed to get size or zero-length file");
+  }
+  const HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) return PIK_FAILURE("Failed to create mapping");
+  // The view keeps the mapping alive after its handle is closed.
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (view == nullptr) return PIK_FAILURE("Failed to map file");
+  size_ = static_cast<size_t>(size.QuadPart);
+#else
+  const int fd = open(pathname.c_str(), O_RDONLY);
+  if (fd < 0) return PIK_FAILURE("Failed to open file");
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return PIK_FAILURE("Failed to stat or zero-length file");
+  }
+  const size_t size = static_cast<size_t>(info.st_size);
+  // The mapping remains valid after closing the descriptor.
+  void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED) return PIK_FAILURE("Failed to map file");
+  size_ = size;
+#endif
+  data_ = static_cast<const uint8_t*>(view);
+  return true;
+}
+
 }  // namespace pik
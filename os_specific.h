@@ -9,6 +9,8 @@
 
 // OS-specific functions (e.g. timing and thread affinity)
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -20,6 +22,11 @@ namespace pik {
 // starting point - only suitable for computing elapsed time.
 double Now();
 
+// Returns the number of page faults (minor and major) of this process so far,
+// or 0 if not supported. The difference across an operation indicates how much
+// memory it touched for the first time.
+uint64_t PageFaults();
+
 // Returns CPU numbers in [0, N), where N is the number of bits in the
 // thread's initial affinity (unaffected by any SetThreadAffinity).
 std::vector<int> AvailableCPUs();
@@ -45,6 +52,33 @@ Status PinThreadToRandomCPU();
 // Executes a command in a subprocess.
 Status RunCommand(const std::vector<std::string>& args);
 
+// Returns the names of the files in "dir" (excluding subdirectories on Windows
+// and hidden files elsewhere), sorted so that the order is reproducible.
+Status ListDirectory(const std::string& dir, std::vector<std::string>* names);
+
+// Read-only view of an entire file. The OS pages it in on demand, which avoids
+// copying large inputs before decoding can start. Reading past size() may
+// fault, so consumers must be bounds-checked (as BitReader is).
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  // Replaces any previous mapping. Fails for empty or unreadable files.
+  Status Map(const std::string& pathname);
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void Unmap();
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
 }  // namespace pik
 
 #endif  // OS_SPECIFIC_H_
@@ -6,18 +6,22 @@
 
 #include "pik.h"
 
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "adaptive_quantization.h"
+#include "byte_order.h"
 #include "common.h"
 #include "compressed_image.h"
+#include "external_image.h"
 #include "headers.h"
 #include "image.h"
+#include "image_allocator.h"
 #include "multipass_handler.h"
 #include "noise.h"
+#include "opsin_inverse.h"
 #include "os_specific.h"
 #include "pik_multipass.h"
 #include "pik_params.h"
@@ -35,7 +39,7 @@ static const uint8_t kBrunsliMagic[] = {
 };
 
 // TODO(user): use VerifySignature, when brunsli codebase is attached.
-bool IsBrunsliFile(const PaddedBytes& compressed) {
+bool IsBrunsliFile(const Span<const uint8_t> compressed) {
   const size_t magic_size = sizeof(kBrunsliMagic);
   if (compressed.size() < magic_size) {
     return false;
@@ -47,16 +51,17 @@ bool IsBrunsliFile(const PaddedBytes& compressed) {
 }
 
 Status BrunsliToPixels(const DecompressParams& dparams,
-                       const PaddedBytes& compressed, CodecInOut* io,
+                       const Span<const uint8_t> compressed, CodecInOut* io,
                        PikInfo* aux_out, ThreadPool* pool) {
   return PIK_FAILURE("Brunsli decoding is not implemented yet.");
 }
 
-}  // namespace
-
-Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
-                   PaddedBytes* compressed, PikInfo* aux_out,
-                   ThreadPool* pool) {
+// `image_cache` is only used for non-progressive images without a lossless
+// base, i.e. if there is a single pass.
+Status PixelsToPikWithCache(const CompressParams& cparams, const CodecInOut* io,
+                            const PassEncImageCache* image_cache,
+                            PaddedBytes* compressed, PikInfo* aux_out,
+                            ThreadPool* pool) {
   if (io->xsize() == 0 || io->ysize() == 0) {
     return PIK_FAILURE("Empty image");
   }
@@ -108,7 +113,8 @@ Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
     pass_params.is_last = true;
     SingleImageManager transform;
     PIK_RETURN_IF_ERROR(PixelsToPikPass(cparams, pass_params, io, pool,
-                                        compressed, pos, aux_out, &transform));
+                                        compressed, pos, aux_out, &transform,
+                                        image_cache));
   } else {
     bool lossless = cparams.lossless_mode;
     SingleImageManager transform;
@@ -167,11 +173,195 @@ Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
   return true;
 }
 
-Status PikToPixels(const DecompressParams& dparams,
-                   const PaddedBytes& compressed, CodecInOut* io,
-                   PikInfo* aux_out, ThreadPool* pool) {
-  PROFILER_ZONE("PikToPixels uninstrumented");
+// Bounds of the target size search.
+constexpr float kMinTargetSizeDistance = 0.01f;
+constexpr float kMaxTargetSizeDistance = 16.0f;
+constexpr size_t kMaxTargetSizeRounds = 7;
+constexpr size_t kMaxTargetSizeCandidatesPerRound = 8;
+
+// Proposes a distance to try for a given bpp target. This could depend
+// on the entropy in the image, too, but let's start with something.
+double ApproximateDistanceForBPP(double bpp) {
+  return 1.704 * pow(bpp, -0.804);
+}
+
+// Returns the distance at which the size is expected to reach `target_size`,
+// assuming that log(size) is linear in log(distance) through (d0, s0) and
+// (d1, s1). Falls back to size ~ 1/distance if the points are degenerate.
+double SecantDistance(double d0, double s0, double d1, double s1,
+                      double target_size) {
+  double slope = -1.0;
+  if (d0 != d1 && s0 != s1) {
+    slope = (std::log(s1) - std::log(s0)) / (std::log(d1) - std::log(d0));
+  }
+  // Larger distances must yield smaller files; otherwise the points are noise.
+  if (!(slope < -0.1)) slope = -1.0;
+  return d0 * std::exp((std::log(target_size) - std::log(s0)) / slope);
+}
+
+struct TargetSizeCandidate {
+  float distance;
+  bool ok = false;
+  PaddedBytes compressed;
+  PikInfo info;
+};
+
+}  // namespace
+
+Status PixelsToPik(const CompressParams& cparams, const CodecInOut* io,
+                   PaddedBytes* compressed, PikInfo* aux_out,
+                   ThreadPool* pool) {
+  return PixelsToPikWithCache(cparams, io, /*image_cache=*/nullptr, compressed,
+                              aux_out, pool);
+}
+
+Status PixelsToPikTargetSize(const CompressParams& cparams,
+                             const CodecInOut* io, PaddedBytes* compressed,
+                             PikInfo* aux_out, ThreadPool* pool) {
+  PROFILER_FUNC;
+  const double t0 = Now();
+  const double target_size = cparams.TargetSize(Rect(io->color()));
+  if (target_size == 0) {
+    return PIK_FAILURE("Missing target size");
+  }
+  if (io->xsize() == 0 || io->ysize() == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+
+  // Only the last (single) pass benefits from the cache.
+  const bool single_pass = !cparams.progressive_mode &&
+                           cparams.lossless_base.empty() &&
+                           !cparams.lossless_mode;
+  PassEncImageCache image_cache;
+  if (single_pass) {
+    PIK_RETURN_IF_ERROR(InitPassEncImageCache(cparams, io, pool, &image_cache));
+  }
+
+  // Encoding is mostly serial per candidate, so we encode one candidate per
+  // thread; their nested parallel sections share the pool. Lossless mode
+  // ignores the distance.
+  const size_t candidates_per_round =
+      cparams.lossless_mode
+          ? 1
+          : std::min(std::max<size_t>(NumWorkerThreads(pool), 1),
+                     kMaxTargetSizeCandidatesPerRound);
+
+  // Distances known to give sizes above (lo) or at most (hi) the target.
+  double lo = kMinTargetSizeDistance, size_lo = 0.0;
+  double hi = kMaxTargetSizeDistance, size_hi = 0.0;
+  bool has_lo = false, has_hi = false;
+
+  TargetSizeCandidate best;
+  double best_loss = 1E99;
+  size_t num_candidates = 0;
+
+  // Distance (and its size) of the previous candidate closest to the target;
+  // used for the secant step until the target is bracketed.
+  double prev_distance = 0.0, prev_size = 0.0;
+
+  for (size_t round = 0; round < kMaxTargetSizeRounds; ++round) {
+    double center;
+    double step = 1.25;
+    if (round == 0) {
+      const double bpp =
+          target_size * kBitsPerByte / (io->xsize() * io->ysize());
+      center = ApproximateDistanceForBPP(bpp);
+    } else if (has_lo && has_hi) {
+      center = SecantDistance(lo, size_lo, hi, size_hi, target_size);
+      if (!(center > lo && center < hi)) center = std::sqrt(lo * hi);  // Bisect.
+      step = std::pow(hi / lo, 0.5 / candidates_per_round);
+    } else {
+      const double d0 = has_lo ? lo : hi;
+      const double s0 = has_lo ? size_lo : size_hi;
+      center = SecantDistance(d0, s0, prev_distance, prev_size, target_size);
+    }
+    step = std::max(step, 1.0 + cparams.target_size_tolerance * 0.25);
+
+    // Spread the candidates of this round around the center.
+    std::vector<TargetSizeCandidate> candidates(candidates_per_round);
+    for (size_t i = 0; i < candidates_per_round; ++i) {
+      const double exponent = i - (candidates_per_round - 1) * 0.5;
+      double distance = center * std::pow(step, exponent);
+      distance = std::min<double>(
+          std::max<double>(distance, kMinTargetSizeDistance),
+          kMaxTargetSizeDistance);
+      if (has_lo && distance <= lo) distance = std::sqrt(lo * center);
+      if (has_hi && distance >= hi) distance = std::sqrt(hi * center);
+      candidates[i].distance = distance;
+      if (aux_out != nullptr) candidates[i].info = *aux_out;
+    }
+
+    const auto encode_candidate = [&](const int task, const int thread) {
+      TargetSizeCandidate& candidate = candidates[task];
+      CompressParams p = cparams;
+      p.butteraugli_distance = candidate.distance;
+      p.target_size = 0;
+      p.target_bitrate = 0.0f;
+      candidate.ok = PixelsToPikWithCache(
+          p, io, single_pass ? &image_cache : nullptr, &candidate.compressed,
+          aux_out != nullptr ? &candidate.info : nullptr, pool);
+    };
+    if (candidates_per_round == 1) {
+      encode_candidate(0, 0);
+    } else {
+      RunOnPool(pool, 0, candidates_per_round, encode_candidate,
+                "TargetSizeSearch");
+    }
+    num_candidates += candidates_per_round;
+
+    double round_best_loss = 1E99;
+    for (TargetSizeCandidate& candidate : candidates) {
+      if (!candidate.ok) return PIK_FAILURE("Failed to encode a candidate");
+      const double size = candidate.compressed.size();
+      if (size > target_size) {
+        if (!has_lo || candidate.distance > lo) {
+          lo = candidate.distance;
+          size_lo = size;
+          has_lo = true;
+        }
+      } else {
+        if (!has_hi || candidate.distance < hi) {
+          hi = candidate.distance;
+          size_hi = size;
+          has_hi = true;
+        }
+      }
+      const double ratio = size / target_size;
+      const double loss = std::max(ratio, 1.0 / std::max(ratio, 1E-30));
+      if (loss < round_best_loss) {
+        round_best_loss = loss;
+        prev_distance = candidate.distance;
+        prev_size = size;
+      }
+      if (loss < best_loss) {
+        best_loss = loss;
+        best = std::move(candidate);
+      }
+    }
 
+    if (best_loss <= 1.0 + cparams.target_size_tolerance) break;
+    if (has_lo && has_hi && hi <= lo * (1.0 + 1E-4)) break;
+    if (cparams.lossless_mode) break;
+  }
+
+  compressed->swap(best.compressed);
+  if (aux_out != nullptr) {
+    *aux_out = best.info;
+    aux_out->num_target_size_candidates = num_candidates;
+    aux_out->target_size_distance = best.distance;
+    aux_out->target_size_seconds = Now() - t0;
+  }
+  return true;
+}
+
+namespace {
+
+// Decodes to `io`, or if `interleaved` is non-null, possibly directly to there
+// (see PikPassToPixels), in which case `io` ends up without pixels.
+Status DecodeToPixels(const DecompressParams& dparams,
+                      const Span<const uint8_t> compressed, CodecInOut* io,
+                      const InterleavedOutput* interleaved, PikInfo* aux_out,
+                      ThreadPool* pool) {
   if (IsBrunsliFile(compressed)) {
     return BrunsliToPixels(dparams, compressed, io, aux_out, pool);
   }
@@ -189,10 +379,15 @@ Status PikToPixels(const DecompressParams& dparams,
     reader.SkipBits(preview_size_bits);
   }
 
+  // Pass-level images (and the output) are recycled across decodes; see also
+  // the per-group arenas in PikPassToPixels.
+  ImageAllocatorScope allocator_scope(io->Context()->image_pool.get());
+
   SingleImageManager transform;
   do {
     PIK_RETURN_IF_ERROR(PikPassToPixels(dparams, compressed, container, pool,
-                                        &reader, io, aux_out, &transform));
+                                        &reader, io, aux_out, &transform,
+                                        interleaved));
   } while (!transform.IsLastPass());
 
   if (dparams.check_decompressed_size &&
@@ -205,4 +400,108 @@ Status PikToPixels(const DecompressParams& dparams,
   return true;
 }
 
+// Fallback for images that were not decoded directly to `out`: converts the
+// decoded `io` to sRGB and copies it there.
+Status CopyToInterleaved(const CodecInOut& io, const InterleavedOutput& out,
+                         ThreadPool* pool) {
+  PROFILER_FUNC;
+  if (io.xsize() != out.xsize || io.ysize() != out.ysize) {
+    return PIK_FAILURE("Output size does not match the image");
+  }
+
+  const bool is_gray = io.IsGray();
+  const ExternalImage external(
+      pool, io.color(), Rect(io.color()), io.c_current(),
+      io.Context()->c_srgb[is_gray], /*has_alpha=*/false,
+      /*alpha=*/nullptr, /*bits_per_alpha=*/0, out.bits_per_sample,
+      /*big_endian=*/!IsLittleEndian(), /*temp_intervals=*/nullptr);
+  PIK_RETURN_IF_ERROR(external.IsHealthy());
+
+  const size_t bytes_per_sample = out.bits_per_sample / 8;
+  const size_t in_channels = is_gray ? 1 : 3;
+  for (size_t y = 0; y < out.ysize; ++y) {
+    const uint8_t* PIK_RESTRICT row_in = external.ConstRow(y);
+    uint8_t* PIK_RESTRICT row_out = out.Row(y);
+    for (size_t x = 0; x < out.xsize; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        const size_t c_in = is_gray ? 0 : c;
+        memcpy(row_out + (x * out.Channels() + c) * bytes_per_sample,
+               row_in + (x * in_channels + c_in) * bytes_per_sample,
+               bytes_per_sample);
+      }
+    }
+  }
+
+  if (out.has_alpha) {
+    AlphaToInterleaved(io.HasAlpha() ? &io.alpha() : nullptr,
+                       io.HasAlpha() ? io.AlphaBits() : 0, out);
+  }
+  return true;
+}
+
+}  // namespace
+
+Status PikToPixels(const DecompressParams& dparams,
+                   const Span<const uint8_t> compressed, CodecInOut* io,
+                   PikInfo* aux_out, ThreadPool* pool) {
+  PROFILER_ZONE("PikToPixels uninstrumented");
+  return DecodeToPixels(dparams, compressed, io, /*interleaved=*/nullptr,
+                        aux_out, pool);
+}
+
+Status PikDecoder::Decode(const DecompressParams& params,
+                          const Span<const uint8_t> compressed, CodecInOut* io,
+                          PikInfo* aux_out) {
+  PIK_CHECK(io->Context() == &context_);
+  return PikToPixels(params, compressed, io, aux_out, pool_);
+}
+
+void PikDecoder::PartitionBySize(
+    const std::vector<Span<const uint8_t>>& inputs, std::vector<size_t>* small,
+    std::vector<size_t>* large) {
+  small->clear();
+  large->clear();
+  for (size_t index = 0; index < inputs.size(); ++index) {
+    const Span<const uint8_t> compressed = inputs[index];
+    bool is_small = false;
+    if (!IsBrunsliFile(compressed)) {
+      BitReader reader(compressed.data(), compressed.size());
+      FileHeader container;
+      is_small = ReadFileHeader(&reader, &container) &&
+                 container.xsize() * container.ysize() <= kMaxSmallPixels;
+    }
+    (is_small ? small : large)->push_back(index);
+  }
+}
+
+void PikDecoder::CreateWorkerContexts() {
+  const size_t num_threads = NumThreads(pool_);
+  // The worker contexts together retain at most as many buffers as context_.
+  const size_t max_retained_bytes =
+      ImageBufferPool::kDefaultMaxRetainedBytes / num_threads;
+  while (worker_contexts_.size() < num_threads) {
+    worker_contexts_.emplace_back(new CodecContext);
+    worker_contexts_.back()->image_pool =
+        ImageBufferPool::Create(max_retained_bytes);
+  }
+}
+
+Status PikToInterleaved(const DecompressParams& dparams,
+                        const Span<const uint8_t> compressed, CodecInOut* io,
+                        const InterleavedOutput& out, PikInfo* aux_out,
+                        ThreadPool* pool) {
+  PROFILER_ZONE("PikToInterleaved uninstrumented");
+  if (out.bits_per_sample != 8 && out.bits_per_sample != 16) {
+    return PIK_FAILURE("Interleaved output must have 8 or 16 bits per sample");
+  }
+  if (out.bytes == nullptr || out.stride < out.xsize * out.BytesPerPixel()) {
+    return PIK_FAILURE("Invalid interleaved output buffer");
+  }
+
+  PIK_RETURN_IF_ERROR(
+      DecodeToPixels(dparams, compressed, io, &out, aux_out, pool));
+  if (io->xsize() == 0) return true;  // Already written to `out`.
+  return CopyToInterleaved(*io, out, pool);
+}
+
 }  // namespace pik
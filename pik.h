@@ -9,11 +9,18 @@
 
 // Top-level interface for PIK encoding/decoding.
 
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "codec.h"
 #include "data_parallel.h"
+#include "opsin_inverse.h"
 #include "padded_bytes.h"
 #include "pik_info.h"
 #include "pik_params.h"
+#include "span.h"
 #include "status.h"
 
 namespace pik {
@@ -24,15 +31,110 @@ Status PixelsToPik(const CompressParams& params, const CodecInOut* io,
                    PaddedBytes* compressed, PikInfo* aux_out = nullptr,
                    ThreadPool* pool = nullptr);
 
+// Compresses `io` with the butteraugli distance whose encoding is closest to
+// params.TargetSize (within params.target_size_tolerance if possible). The
+// distance-independent work is done once, and each round of the
+// secant/bisection search encodes several candidate distances concurrently
+// on `pool`. Reports the search statistics in `aux_out`.
+Status PixelsToPikTargetSize(const CompressParams& params,
+                             const CodecInOut* io, PaddedBytes* compressed,
+                             PikInfo* aux_out = nullptr,
+                             ThreadPool* pool = nullptr);
+
 // Implementation detail: currently decodes to linear sRGB. The contract is:
 // `io` appears 'identical' (modulo compression artifacts) to the encoder input
 // in a color-aware viewer. Note that `io`->dec_c_original identifies the color
 // space that was passed to the encoder; clients that need that encoding must
 // call `io`->TransformTo afterwards.
 Status PikToPixels(const DecompressParams& params,
-                   const PaddedBytes& compressed, CodecInOut* io,
+                   const Span<const uint8_t> compressed, CodecInOut* io,
                    PikInfo* aux_out = nullptr, ThreadPool* pool = nullptr);
 
+// Decodes to sRGB samples in the caller's `out` (e.g. a display buffer), whose
+// size must match the (possibly cropped) image. For lossy images, the color
+// conversion and quantization are fused into the final per-tile stage, so no
+// full-size linear image is stored. Other images are decoded via `io` and then
+// copied, in which case `out`.dither has no effect. Afterwards, `io` holds the
+// metadata, and pixels only if they were not written directly.
+Status PikToInterleaved(const DecompressParams& params,
+                        const Span<const uint8_t> compressed, CodecInOut* io,
+                        const InterleavedOutput& out,
+                        PikInfo* aux_out = nullptr, ThreadPool* pool = nullptr);
+
+// Decodes many images (e.g. thumbnails) with state that PikToPixels would
+// otherwise set up for each: CodecContext (color encodings, filter tables and
+// recycled image buffers) and, via ColorSpaceTransform, the color transforms.
+// Not thread-safe; use one instance per thread that issues decodes.
+class PikDecoder {
+ public:
+  // Images with at most this many pixels have too few groups to keep all
+  // threads busy, so DecodeBatch decodes several of them at a time instead.
+  static constexpr size_t kMaxSmallPixels = 1024 * 1024;
+
+  // `pool` is not owned and may be null; pinning its threads (see dpik) helps
+  // because they are reused for every image.
+  explicit PikDecoder(ThreadPool* pool = nullptr) : pool_(pool) {}
+
+  // Context for CodecInOut passed to Decode.
+  CodecContext* Context() { return &context_; }
+
+  // Same as PikToPixels using the pool passed to the constructor; `io` must
+  // have been constructed with Context().
+  Status Decode(const DecompressParams& params,
+                const Span<const uint8_t> compressed, CodecInOut* io,
+                PikInfo* aux_out = nullptr);
+
+  // Decodes each of `inputs` and calls `func(index, io)` with a CodecInOut
+  // that is only valid during the call. Small images are decoded concurrently,
+  // each by a single thread, so `func` may be called from several threads and
+  // in any order. Returns false if any decode or `func` failed.
+  template <class Func>
+  Status DecodeBatch(const DecompressParams& params,
+                     const std::vector<Span<const uint8_t>>& inputs,
+                     const Func& func) {
+    std::vector<size_t> small;
+    std::vector<size_t> large;
+    PartitionBySize(inputs, &small, &large);
+    std::atomic<int> num_errors{0};
+
+    if (!small.empty()) CreateWorkerContexts();
+    RunOnPool(
+        pool_, 0, small.size(),
+        [&](const int task, const int thread) {
+          const size_t index = small[task];
+          CodecInOut io(worker_contexts_[thread].get());
+          if (!PikToPixels(params, inputs[index], &io) || !func(index, &io)) {
+            num_errors.fetch_add(1, std::memory_order_relaxed);
+          }
+        },
+        "DecodeBatch");
+
+    for (const size_t index : large) {
+      CodecInOut io(&context_);
+      if (!Decode(params, inputs[index], &io) || !func(index, &io)) {
+        num_errors.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    return num_errors.load(std::memory_order_relaxed) == 0;
+  }
+
+ private:
+  // Sorts indices of `inputs` by whether their image is small. Invalid
+  // headers count as large, so their error is reported by Decode.
+  static void PartitionBySize(const std::vector<Span<const uint8_t>>& inputs,
+                              std::vector<size_t>* small,
+                              std::vector<size_t>* large);
+
+  // Ensures there is one context per thread: separate contexts give each
+  // concurrent decode its own buffer arenas. Reused by subsequent batches.
+  // Their pools divide the default retention budget among themselves.
+  void CreateWorkerContexts();
+
+  ThreadPool* pool_;  // Not owned.
+  CodecContext context_;
+  std::vector<std::unique_ptr<CodecContext>> worker_contexts_;
+};
+
 }  // namespace pik
 
 #endif  // PIK_H_
@@ -0,0 +1,377 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Encodes and decodes every PNG/PNM image in a directory with a list of
+// encoder settings, and reports speed, size, quality and the CPU time of each
+// profiler zone. Sizes and distances are reproducible; only the timings vary
+// between runs.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "arch_specific.h"
+#include "args.h"
+#include "butteraugli_distance.h"
+#include "cmdline.h"
+#include "codec.h"
+#include "common.h"
+#include "data_parallel.h"
+#include "file_io.h"
+#include "os_specific.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_params.h"
+#include "profiler.h"
+#include "simd/targets.h"
+#include "status.h"
+
+namespace pik {
+namespace {
+
+struct BenchmarkArgs {
+  BenchmarkArgs() { num_threads = AvailableCPUs().size() / 2; }
+
+  void AddCommandLineOptions(tools::CommandLineParser* cmdline) {
+    cmdline->AddPositionalOption(
+        "INPUT_DIR", "directory with PNG/PPM/PGM/PFM images to compress.",
+        &input_dir);
+    cmdline->AddOptionValue(
+        '\0', "settings", "LIST",
+        ("comma-separated encoder settings, each a colon-separated list of\n"
+         "    d<distance>, fast, progressive and lossless. Default: d1."),
+        &settings, &ParseString);
+    cmdline->AddOptionValue('\0', "num_reps", "N",
+                            "how often to encode and decode each image.",
+                            &num_reps, &ParseUnsigned);
+    cmdline->AddOptionValue('\0', "num_threads", "N",
+                            "number of worker threads (zero = none).",
+                            &num_threads, &ParseUnsigned);
+    cmdline->AddOptionValue('\0', "csv", "FILE", "writes results as CSV.",
+                            &csv_path, &ParseString);
+    cmdline->AddOptionValue('\0', "json", "FILE", "writes results as JSON.",
+                            &json_path, &ParseString);
+  }
+
+  Status ValidateArgs() {
+    if (input_dir == nullptr) {
+      fprintf(stderr, "Missing INPUT_DIR.\n");
+      return false;
+    }
+    if (num_reps == 0) {
+      fprintf(stderr, "--num_reps must be at least 1.\n");
+      return false;
+    }
+    return true;
+  }
+
+  const char* input_dir = nullptr;
+  std::string settings = "d1";
+  size_t num_reps = 3;
+  size_t num_threads;
+  std::string csv_path;
+  std::string json_path;
+};
+
+struct Setting {
+  std::string name;
+  CompressParams params;
+};
+
+std::vector<std::string> Split(const std::string& s, const char separator) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  for (;;) {
+    const size_t end = s.find(separator, begin);
+    parts.push_back(s.substr(begin, end - begin));
+    if (end == std::string::npos) return parts;
+    begin = end + 1;
+  }
+}
+
+Status ParseSettings(const std::string& list, std::vector<Setting>* settings) {
+  for (const std::string& name : Split(list, ',')) {
+    Setting setting;
+    setting.name = name;
+    for (const std::string& token : Split(name, ':')) {
+      if (token == "fast") {
+        setting.params.fast_mode = true;
+      } else if (token == "progressive") {
+        setting.params.progressive_mode = true;
+      } else if (token == "lossless") {
+        setting.params.lossless_mode = true;
+      } else if (token.size() > 1 && token[0] == 'd' &&
+                 ParseFloat(token.c_str() + 1,
+                            &setting.params.butteraugli_distance)) {
+      } else {
+        fprintf(stderr, "Invalid setting '%s' in '%s'.\n", token.c_str(),
+                name.c_str());
+        return false;
+      }
+    }
+    settings->push_back(setting);
+  }
+  return true;
+}
+
+struct StageTime {
+  std::string name;
+  double cpu_seconds;  // summed over all threads
+};
+
+struct Result {
+  std::string image;
+  std::string setting;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  size_t compressed_bytes = 0;
+  // Best of all repetitions, which is the least noisy summary.
+  double encode_seconds = 0.0;
+  double decode_seconds = 0.0;
+  float distance = 0.0f;
+
+  double Megapixels() const { return xsize * ysize * 1E-6; }
+  double BitsPerPixel() const {
+    return compressed_bytes * kBitsPerByte / (Megapixels() * 1E6);
+  }
+  double EncodeMPS() const { return Megapixels() / encode_seconds; }
+  double DecodeMPS() const { return Megapixels() / decode_seconds; }
+};
+
+bool IsSupportedImage(const std::string& filename) {
+  const std::string extension = Extension(filename);
+  return extension == ".png" || extension == ".pnm" || extension == ".ppm" ||
+         extension == ".pgm" || extension == ".pfm";
+}
+
+// Returns the self time of each profiler zone entered during the entire run
+// (including image loading and the distance computation), sorted by decreasing
+// time. Zones of concurrent threads are added, so this is CPU time, not wall
+// time. Call once after all threads have exited all zones.
+std::vector<StageTime> StageCpuTimes() {
+  std::vector<ProfilerZoneTotal> totals;
+  PROFILER_GET_RESULTS(&totals);
+  std::vector<StageTime> stages;
+  if (totals.empty()) return stages;
+  const double seconds_per_tick = 1.0 / InvariantTicksPerSecond();
+  for (const ProfilerZoneTotal& total : totals) {
+    stages.push_back({total.name, total.total_duration * seconds_per_tick});
+  }
+  std::sort(stages.begin(), stages.end(),
+            [](const StageTime& a, const StageTime& b) {
+              return a.cpu_seconds > b.cpu_seconds;
+            });
+  return stages;
+}
+
+Status RunSetting(const BenchmarkArgs& args, const Setting& setting,
+                  const CodecInOut& io, ThreadPool* pool, Result* result) {
+  PaddedBytes compressed;
+  CodecInOut decoded(io.Context());
+  DecompressParams dparams;
+  for (size_t rep = 0; rep < args.num_reps; ++rep) {
+    compressed.clear();
+    const double t0 = Now();
+    if (!PixelsToPik(setting.params, &io, &compressed, nullptr, pool)) {
+      return PIK_FAILURE("Failed to compress");
+    }
+    const double t1 = Now();
+    if (!PikToPixels(dparams, compressed, &decoded, nullptr, pool)) {
+      return PIK_FAILURE("Failed to decompress");
+    }
+    const double t2 = Now();
+    if (rep == 0 || t1 - t0 < result->encode_seconds) {
+      result->encode_seconds = t1 - t0;
+    }
+    if (rep == 0 || t2 - t1 < result->decode_seconds) {
+      result->decode_seconds = t2 - t1;
+    }
+  }
+  result->xsize = io.xsize();
+  result->ysize = io.ysize();
+  result->compressed_bytes = compressed.size();
+  result->distance = ButteraugliDistance(&io, &decoded,
+                                         setting.params.hf_asymmetry,
+                                         /*distmap=*/nullptr, pool);
+  return true;
+}
+
+// Sums all images of one setting, as if they were a single image.
+Result Aggregate(const std::vector<Result>& results,
+                 const std::string& setting) {
+  Result all;
+  all.image = "(all)";
+  all.setting = setting;
+  double pixels = 0.0;
+  for (const Result& r : results) {
+    if (r.setting != setting || r.image == all.image) continue;
+    pixels += r.xsize * r.ysize;
+    all.compressed_bytes += r.compressed_bytes;
+    all.encode_seconds += r.encode_seconds;
+    all.decode_seconds += r.decode_seconds;
+    all.distance = std::max(all.distance, r.distance);
+  }
+  // Keeps Megapixels() consistent with the totals above.
+  all.xsize = static_cast<size_t>(pixels);
+  all.ysize = 1;
+  return all;
+}
+
+// Quotes "s" for CSV and JSON: both escape a quote by prefixing it.
+std::string Quoted(const std::string& s, const char escape) {
+  std::string quoted = "\"";
+  for (const char c : s) {
+    if (c == '"' || c == escape) quoted += escape;
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+Status WriteCSV(const std::vector<Result>& results, const std::string& path) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) return PIK_FAILURE("Failed to open CSV file");
+  fprintf(file,
+          "image,setting,xsize,ysize,bytes,bpp,encode_mps,decode_mps,"
+          "butteraugli\n");
+  for (const Result& r : results) {
+    fprintf(file, "%s,%s,%zu,%zu,%zu,%.6f,%.4f,%.4f,%.6f\n",
+            Quoted(r.image, '"').c_str(), Quoted(r.setting, '"').c_str(),
+            r.xsize, r.ysize, r.compressed_bytes, r.BitsPerPixel(),
+            r.EncodeMPS(), r.DecodeMPS(), r.distance);
+  }
+  return fclose(file) == 0;
+}
+
+Status WriteJSON(const std::vector<Result>& results,
+                 const std::vector<StageTime>& stages, const std::string& path,
+                 ThreadPool* pool, const size_t num_reps) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) return PIK_FAILURE("Failed to open JSON file");
+  fprintf(file, "{\n  \"num_threads\": %zu,\n  \"num_reps\": %zu,\n",
+          NumWorkerThreads(pool), num_reps);
+  fprintf(file, "  \"results\": [");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    fprintf(file,
+            "%s\n    {\"image\": %s, \"setting\": %s, \"xsize\": %zu, "
+            "\"ysize\": %zu, \"bytes\": %zu, \"bpp\": %.6f, "
+            "\"encode_mps\": %.4f, \"decode_mps\": %.4f, "
+            "\"butteraugli\": %.6f}",
+            i == 0 ? "" : ",", Quoted(r.image, '\\').c_str(),
+            Quoted(r.setting, '\\').c_str(), r.xsize, r.ysize,
+            r.compressed_bytes, r.BitsPerPixel(), r.EncodeMPS(),
+            r.DecodeMPS(), r.distance);
+  }
+  fprintf(file, "\n  ],\n  \"stage_cpu_seconds\": {");
+  for (size_t i = 0; i < stages.size(); ++i) {
+    fprintf(file, "%s\n    %s: %.6f", i == 0 ? "" : ",",
+            Quoted(stages[i].name, '\\').c_str(), stages[i].cpu_seconds);
+  }
+  fprintf(file, "\n  }\n}\n");
+  return fclose(file) == 0;
+}
+
+void PrintResult(const Result& r) {
+  printf("%-24s %-20s %8.3f %9.2f %9.2f %11.4f\n", r.image.c_str(),
+         r.setting.c_str(), r.BitsPerPixel(), r.EncodeMPS(), r.DecodeMPS(),
+         r.distance);
+}
+
+void PrintStages(const std::vector<StageTime>& stages) {
+  if (stages.empty()) return;
+  printf("\n%-40s %14s\n", "zone", "CPU seconds");
+  for (size_t i = 0; i < std::min<size_t>(stages.size(), 20); ++i) {
+    printf("%-40s %14.6f\n", stages[i].name.c_str(), stages[i].cpu_seconds);
+  }
+}
+
+int BenchmarkMain(int argc, char** argv) {
+  BenchmarkArgs args;
+  tools::CommandLineParser cmdline;
+  args.AddCommandLineOptions(&cmdline);
+  if (!cmdline.Parse(argc, argv) || !args.ValidateArgs()) {
+    cmdline.PrintHelp();
+    return 1;
+  }
+
+  const int bits = TargetBitfield().Bits();
+  // Dispatched code (e.g. AVX-512) is optional; static code is not.
+  if ((bits & SIMD_TARGET::value) != SIMD_TARGET::value) {
+    fprintf(stderr, "CPU does not support the static target => exiting.\n");
+    return 1;
+  }
+
+#if !PROFILER_ENABLED
+  fprintf(stderr,
+          "Zone CPU times are empty: build with PROFILER=1 (make) or "
+          "PIK_ENABLE_PROFILER=ON (cmake).\n");
+#endif
+
+  std::vector<Setting> settings;
+  if (!ParseSettings(args.settings, &settings)) return 1;
+
+  std::vector<std::string> filenames;
+  if (!ListDirectory(args.input_dir, &filenames)) {
+    fprintf(stderr, "Failed to list %s\n", args.input_dir);
+    return 1;
+  }
+  filenames.erase(std::remove_if(filenames.begin(), filenames.end(),
+                                 [](const std::string& filename) {
+                                   return !IsSupportedImage(filename);
+                                 }),
+                  filenames.end());
+  if (filenames.empty()) {
+    fprintf(stderr, "No images in %s\n", args.input_dir);
+    return 1;
+  }
+
+  ThreadPool pool(args.num_threads);
+  CodecContext codec_context;
+  std::vector<Result> results;
+  printf("%-24s %-20s %8s %9s %9s %11s\n", "image", "setting", "bpp",
+         "enc MP/s", "dec MP/s", "butteraugli");
+  for (const std::string& filename : filenames) {
+    const std::string pathname = std::string(args.input_dir) + "/" + filename;
+    CodecInOut io(&codec_context);
+    if (!io.SetFromFile(pathname, &pool)) {
+      fprintf(stderr, "Failed to read image %s.\n", pathname.c_str());
+      return 1;
+    }
+    for (const Setting& setting : settings) {
+      Result result;
+      result.image = filename;
+      result.setting = setting.name;
+      if (!RunSetting(args, setting, io, &pool, &result)) {
+        fprintf(stderr, "Failed on %s with %s.\n", filename.c_str(),
+                setting.name.c_str());
+        return 1;
+      }
+      PrintResult(result);
+      results.push_back(result);
+    }
+  }
+  for (const Setting& setting : settings) {
+    results.push_back(Aggregate(results, setting.name));
+    PrintResult(results.back());
+  }
+  // Workers are idle, i.e. outside of all zones.
+  const std::vector<StageTime> stages = StageCpuTimes();
+  PrintStages(stages);
+
+  if (!args.csv_path.empty() && !WriteCSV(results, args.csv_path)) return 1;
+  if (!args.json_path.empty() &&
+      !WriteJSON(results, stages, args.json_path, &pool, args.num_reps)) {
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main(int argc, char** argv) { return pik::BenchmarkMain(argc, argv); }
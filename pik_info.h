@@ -81,6 +81,8 @@ struct PikInfo {
     num_dct32_blocks += victim.num_dct32_blocks;
     entropy_estimate += victim.entropy_estimate;
     num_butteraugli_iters += victim.num_butteraugli_iters;
+    num_target_size_candidates += victim.num_target_size_candidates;
+    target_size_seconds += victim.target_size_seconds;
     adaptive_reconstruction_aux.Assimilate(victim.adaptive_reconstruction_aux);
   }
 
@@ -104,6 +106,11 @@ struct PikInfo {
     }
     printf("Total image size           ");
     TotalImageSize().Print(num_inputs);
+    if (num_target_size_candidates != 0) {
+      printf("Target size search: %10.2f candidates, %8.3f s\n",
+             num_target_size_candidates * 1.0 / num_inputs,
+             target_size_seconds / num_inputs);
+    }
     adaptive_reconstruction_aux.Print();
   }
 
@@ -132,6 +139,11 @@ struct PikInfo {
   // Estimate of compressed size according to entropy-given lower bounds.
   float entropy_estimate = 0;
   int num_butteraugli_iters = 0;
+  // Set by PixelsToPikTargetSize: number of encoded candidates, the distance
+  // that was chosen and the wall time of the search.
+  size_t num_target_size_candidates = 0;
+  float target_size_distance = 0.0f;
+  double target_size_seconds = 0.0;
   // If not empty, additional debugging information (e.g. debug images) is
   // saved in files with this prefix.
   std::string debug_prefix;
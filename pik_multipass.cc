@@ -88,7 +88,7 @@ Status PikMultipassEncoder::Finalize() {
   return true;
 }
 
-PikMultipassDecoder::PikMultipassDecoder(const PaddedBytes* input,
+PikMultipassDecoder::PikMultipassDecoder(const Span<const uint8_t> input,
                                          MultipassManager* manager,
                                          PikInfo* info)
     : input_(input), info_(info), multipass_manager_(manager) {}
@@ -116,10 +116,10 @@ Status PikMultipassDecoder::NextPass(CodecInOut* pass, ThreadPool* pool) {
   // TODO(veluca): metadata.
 
   // Not an error, end of file.
-  if (reader_.Position() >= input_->size()) return false;
+  if (reader_.Position() >= input_.size()) return false;
 
   DecompressParams params;
-  PIK_RETURN_IF_ERROR(PikPassToPixels(params, *input_, container_, pool,
+  PIK_RETURN_IF_ERROR(PikPassToPixels(params, input_, container_, pool,
                                       &reader_, pass, info_,
                                       multipass_manager_));
   return true;
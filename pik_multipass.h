@@ -13,6 +13,7 @@
 #include "pik_info.h"
 #include "pik_params.h"
 #include "pik_pass.h"
+#include "span.h"
 
 // Encodes a sequence of images as a PIK multipass image. During decoding, this
 // simply decodes passes as long as they are present. During encoding, this
@@ -52,16 +53,17 @@ class PikMultipassEncoder {
 class PikMultipassDecoder {
  public:
   // input must remain valid thoroughout the lifetime of the Decoder object.
-  PikMultipassDecoder(const PaddedBytes* input, MultipassManager* manager,
-                      PikInfo* info = nullptr);
+  // It is not copied, so it may also be a MappedFile.
+  PikMultipassDecoder(const Span<const uint8_t> input,
+                      MultipassManager* manager, PikInfo* info = nullptr);
 
   // Returns the next frame, if any, otherwise returns false.
   Status NextPass(CodecInOut* pass, ThreadPool* pool);
 
  private:
-  const PaddedBytes* input_;
+  const Span<const uint8_t> input_;
   PikInfo* info_;
-  BitReader reader_{input_->data(), input_->size()};
+  BitReader reader_{input_.data(), input_.size()};
   FileHeader container_;
   MultipassManager* multipass_manager_;
 };
@@ -42,6 +42,9 @@ struct CompressParams {
   float butteraugli_distance = 1.0f;
   size_t target_size = 0;
   float target_bitrate = 0.0f;
+  // The target size search stops once a candidate is within this fraction of
+  // the target size.
+  float target_size_tolerance = 0.01f;
 
   // 0.0 means search for the adaptive quantization map that matches the
   // butteraugli distance, positive values mean quantize everywhere with that
@@ -122,6 +125,25 @@ struct CompressParams {
   // Edge-preserving filter parameters for AdaptiveReconstruction.
   EpfParams epf_params;
 
+  // Number of interleaved ANS states for AC coefficients, [1, 4]. Values above
+  // one speed up decoding at the cost of a few bytes per group.
+  size_t num_ac_ans_states = 1;
+
+  // If true, the AC coefficients of each tile are coded independently and
+  // indexed by a per-group table of contents, so decoders can process the
+  // tiles of one group in parallel. Costs a few bytes per tile.
+  bool tile_toc = false;
+
+  // If true and noise is enabled, its parameters are stored in the pass
+  // header and the decoder synthesizes it per tile from a counter-based
+  // generator (PassHeader::kTileNoise) instead of one sequential pass.
+  bool tile_noise = false;
+
+  // If true, coefficient orders and histograms are computed once from all
+  // groups of a pass and stored before the group TOC
+  // (PassHeader::kSharedEntropyCode) instead of once per group.
+  bool shared_entropy_code = false;
+
   float GetIntensityMultiplier() const {
     return intensity_target * kIntensityMultiplier;
   }
@@ -137,6 +159,17 @@ struct CompressParams {
   }
 };
 
+// Region of the image to decode, in pixels. A crop with zero size (the default)
+// means the whole image.
+struct CropRect {
+  bool IsEmpty() const { return xsize == 0 || ysize == 0; }
+
+  size_t x0 = 0;
+  size_t y0 = 0;
+  size_t xsize = 0;
+  size_t ysize = 0;
+};
+
 struct DecompressParams {
   uint64_t max_num_pixels = (1 << 30) - 1;
   // If true, checks at the end of decoding that all of the compressed data
@@ -158,6 +191,12 @@ struct DecompressParams {
   // as long as both old and new implementation co-exist, and eventually
   // only the new implementation should remain.
   bool use_new_dc = false;
+
+  // If not empty, the output image has the size of this region and equals
+  // the same region of a full decode. Groups that do not overlap it (plus the
+  // border required by gaborish) are skipped, unless the pass uses filters
+  // that depend on the entire image, e.g. adaptive reconstruction.
+  CropRect crop;
 };
 
 // Enable features for distances >= these thresholds:
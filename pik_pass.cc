@@ -16,16 +16,16 @@
 #include <atomic>
 #include <cstdint>
 #include <limits>
+#include <numeric>
 #include <memory>
 #include <string>
 #include <vector>
 #include "noise.h"
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "ac_strategy.h"
 #include "adaptive_quantization.h"
 #include "alpha.h"
+#include "ans_params.h"
 #include "arch_specific.h"
 #include "bits.h"
 #include "byte_order.h"
@@ -38,12 +38,14 @@
 #include "dct.h"
 #include "dct_util.h"
 #include "entropy_coder.h"
+#include "epf.h"
 #include "external_image.h"
 #include "fast_log.h"
 #include "gaborish.h"
 #include "gamma_correct.h"
 #include "headers.h"
 #include "image.h"
+#include "image_allocator.h"
 #include "image_io.h"
 #include "lossless16.h"
 #include "lossless8.h"
@@ -82,6 +84,25 @@ uint32_t PassFlagsFromParams(const CompressParams& cparams,
   return flags;
 }
 
+GaborishStrength GaborishFromParams(const CompressParams& cparams,
+                                    const CodecInOut* io) {
+  if (io->xsize() <= 8 || io->ysize() <= 8) {
+    // Broken, disable.
+    return GaborishStrength::kOff;
+  }
+  return cparams.gaborish;
+}
+
+// Returns the opsin image of `io`, downsampled if requested.
+Image3F EncoderOpsin(const CodecInOut* io, const size_t resampling_factor2,
+                     ThreadPool* pool) {
+  Image3F opsin_orig = OpsinDynamicsImage(io, Rect(io->color()), pool);
+  if (resampling_factor2 != 2) {
+    opsin_orig = DownsampleImage(opsin_orig, resampling_factor2);
+  }
+  return opsin_orig;
+}
+
 void OverrideFlag(const Override o, const uint32_t flag,
                   uint32_t* PIK_RESTRICT flags) {
   if (o == Override::kOn) {
@@ -192,7 +213,7 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
                                 const CodecInOut* io, const Rect& rect,
                                 const Image3F& previous_pass,
                                 PaddedBytes* compressed, size_t& pos,
-                                PikInfo* aux_out) {
+                                ThreadPool* pool, PikInfo* aux_out) {
   size_t xsize = rect.xsize();
   size_t ysize = rect.ysize();
   if (pass_header.lossless_grayscale) {
@@ -218,7 +239,7 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
       LosslessChannelPass(1, io, rect, previous_pass, image.MutablePlane(1));
       LosslessChannelPass(2, io, rect, previous_pass, image.MutablePlane(2));
       compressed->resize(pos / 8);
-      if (!Colorful16bit_compress(image, compressed)) {
+      if (!Colorful16bit_compress(image, compressed, pool)) {
         return PIK_FAILURE("Lossless compression failed");
       }
     } else {
@@ -227,7 +248,7 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
       LosslessChannelPass(1, io, rect, previous_pass, image.MutablePlane(1));
       LosslessChannelPass(2, io, rect, previous_pass, image.MutablePlane(2));
       compressed->resize(pos / 8);
-      if (!Colorful8bit_compress(image, compressed)) {
+      if (!Colorful8bit_compress(image, compressed, pool)) {
         return PIK_FAILURE("Lossless compression failed");
       }
     }
@@ -236,13 +257,17 @@ Status PixelsToPikLosslessFrame(CompressParams cparams,
   return true;
 }
 
+// `opsin_dct` is TransposedScaledDCT(opsin).
 Status PikPassHeuristics(CompressParams cparams, const PassHeader& pass_header,
                          const Image3F& opsin_orig, const Image3F& opsin,
+                         const Image3F& opsin_dct,
                          MultipassManager* multipass_manager,
                          GroupHeader* template_group_header,
                          ColorCorrelationMap* full_cmap,
                          std::shared_ptr<Quantizer>* full_quantizer,
-                         AcStrategyImage* full_ac_strategy, PikInfo* aux_out) {
+                         AcStrategyImage* full_ac_strategy,
+                         const PassEncImageCache* image_cache, ThreadPool* pool,
+                         PikInfo* aux_out) {
   size_t target_size = cparams.TargetSize(Rect(opsin_orig));
   // TODO(robryk): This should take *template_group_header size, and size of
   // other passes into account.
@@ -259,41 +284,64 @@ Status PikPassHeuristics(CompressParams cparams, const PassHeader& pass_header,
     return true;
   }
 
+  if (cparams.num_ac_ans_states < 1 ||
+      cparams.num_ac_ans_states > kANSMaxStates) {
+    return PIK_FAILURE("Invalid number of ANS states");
+  }
+  if (cparams.num_ac_ans_states != 1) {
+    template_group_header->extensions |= GroupHeader::kInterleavedANS;
+    template_group_header->num_ac_ans_states = cparams.num_ac_ans_states;
+  }
+  if (cparams.tile_toc) {
+    template_group_header->extensions |= GroupHeader::kTileTOC;
+  }
+
   constexpr size_t N = kBlockDim;
   PROFILER_ZONE("enc OpsinToPik uninstrumented");
   const size_t xsize = opsin_orig.xsize();
   const size_t ysize = opsin_orig.ysize();
   const size_t xsize_blocks = DivCeil(xsize, N);
   const size_t ysize_blocks = DivCeil(ysize, N);
-  multipass_manager->GetColorCorrelationMap(opsin, &*full_cmap);
-  ImageF quant_field = InitialQuantField(
-      cparams.butteraugli_distance, cparams.GetIntensityMultiplier(),
-      opsin_orig, cparams, /*pool=*/nullptr, 1.0);
-
-  multipass_manager->GetAcStrategy(cparams.butteraugli_distance, &quant_field,
-                                   opsin,
-                                   /*pool=*/nullptr, full_ac_strategy, aux_out);
-
-  *full_quantizer = multipass_manager->GetQuantizer(
-      cparams, xsize_blocks, ysize_blocks, opsin_orig, opsin, pass_header,
-      *template_group_header, *full_cmap, *full_ac_strategy, quant_field,
-      /*pool=*/nullptr, aux_out);
+  {
+    PROFILER_ZONE("enc heuristics cmap");
+    if (image_cache != nullptr) {
+      *full_cmap = image_cache->cmap.Copy();
+    } else {
+      multipass_manager->GetColorCorrelationMap(opsin_dct, pool, &*full_cmap);
+    }
+  }
+  ImageF quant_field;
+  {
+    PROFILER_ZONE("enc heuristics initial quant");
+    quant_field = InitialQuantField(
+        cparams.butteraugli_distance, cparams.GetIntensityMultiplier(),
+        opsin_orig, cparams, pool, 1.0);
+  }
+
+  {
+    PROFILER_ZONE("enc heuristics ac strategy");
+    multipass_manager->GetAcStrategy(cparams.butteraugli_distance,
+                                     &quant_field, opsin, opsin_dct, pool,
+                                     full_ac_strategy, aux_out);
+  }
+
+  {
+    PROFILER_ZONE("enc heuristics quantizer");
+    *full_quantizer = multipass_manager->GetQuantizer(
+        cparams, xsize_blocks, ysize_blocks, opsin_orig, opsin, pass_header,
+        *template_group_header, *full_cmap, *full_ac_strategy, quant_field,
+        pool, aux_out);
+  }
   return true;
 }
 
-Status PixelsToPikGroup(CompressParams cparams, const PassHeader& pass_header,
-                        GroupHeader header, const AcStrategyImage& ac_strategy,
-                        const Quantizer* full_quantizer,
-                        const ColorCorrelationMap& full_cmap,
-                        const CodecInOut* io, const Image3F& opsin_in,
-                        const NoiseParams& noise_params,
-                        PaddedBytes* compressed, size_t& pos,
-                        const PassEncCache& pass_enc_cache, PikInfo* aux_out,
-                        MultipassHandler* multipass_handler) {
+// Writes the (byte-aligned) header of a group, including its alpha.
+Status WritePikGroupHeader(const CompressParams& cparams,
+                           const PassHeader& pass_header, GroupHeader header,
+                           const CodecInOut* io, BitWriter* writer,
+                           PikInfo* aux_out,
+                           MultipassHandler* multipass_handler) {
   const Rect& rect = multipass_handler->GroupRect();
-  const Rect& padded_rect = multipass_handler->PaddedGroupRect();
-  const Rect area_to_encode =
-      Rect(0, 0, padded_rect.xsize(), padded_rect.ysize());
 
   // In progressive mode, encoders may choose to send alpha in any pass, the
   // decoder shouldn't care in which pass it comes. Since at the moment it is
@@ -308,23 +356,28 @@ Status PixelsToPikGroup(CompressParams cparams, const PassHeader& pass_header,
 
   size_t extension_bits, total_bits;
   PIK_RETURN_IF_ERROR(CanEncode(header, &extension_bits, &total_bits));
-  compressed->resize(DivCeil(pos + total_bits, kBitsPerByte));
-  PIK_RETURN_IF_ERROR(
-      WriteGroupHeader(header, extension_bits, &pos, compressed->data()));
-  WriteZeroesToByteBoundary(&pos, compressed->data());
+  writer->ReserveBits(total_bits);
+  PIK_RETURN_IF_ERROR(WriteGroupHeader(header, extension_bits,
+                                       writer->storage_ix(), writer->storage()));
+  writer->ZeroPadToByte();
   if (aux_out != nullptr) {
     aux_out->layers[kLayerHeader].total_size +=
         DivCeil(total_bits, kBitsPerByte);
   }
+  return true;
+}
 
-  if (cparams.lossless_mode) {
-    Image3F previous_pass;
-    PIK_RETURN_IF_ERROR(multipass_handler->GetPreviousPass(
-        io->dec_c_original, /*pool=*/nullptr, &previous_pass));
-    return PixelsToPikLosslessFrame(cparams, pass_header, io, rect,
-                                    previous_pass, compressed, pos, aux_out);
-  }
-
+// Computes the quantized coefficients of a group into `cache`.
+void ComputeGroupCoefficients(const CompressParams& cparams,
+                              const PassHeader& pass_header,
+                              const GroupHeader& header,
+                              const AcStrategyImage& ac_strategy,
+                              const Quantizer& quantizer,
+                              const ColorCorrelationMap& full_cmap,
+                              const PassEncCache& pass_enc_cache,
+                              PikInfo* aux_out,
+                              MultipassHandler* multipass_handler,
+                              EncCache* cache) {
   Rect group_in_color_tiles(
       multipass_handler->BlockGroupRect().x0() / kColorTileDimInBlocks,
       multipass_handler->BlockGroupRect().y0() / kColorTileDimInBlocks,
@@ -333,42 +386,169 @@ Status PixelsToPikGroup(CompressParams cparams, const PassHeader& pass_header,
       DivCeil(multipass_handler->BlockGroupRect().ysize(),
               kColorTileDimInBlocks));
   ColorCorrelationMap cmap = full_cmap.Copy(group_in_color_tiles);
-  EncCache cache;
-  cache.saliency_threshold = cparams.saliency_threshold;
-  cache.saliency_debug_skip_nonsalient = cparams.saliency_debug_skip_nonsalient;
+  cache->saliency_threshold = cparams.saliency_threshold;
+  cache->saliency_debug_skip_nonsalient =
+      cparams.saliency_debug_skip_nonsalient;
 
   InitializeEncCache(pass_header, header, pass_enc_cache,
-                     multipass_handler->PaddedGroupRect(), &cache);
-  cache.ac_strategy = ac_strategy.Copy(multipass_handler->BlockGroupRect());
+                     multipass_handler->PaddedGroupRect(), cache);
+  cache->ac_strategy = ac_strategy.Copy(multipass_handler->BlockGroupRect());
 
-  Quantizer quantizer =
-      full_quantizer->Copy(multipass_handler->BlockGroupRect());
-
-  ComputeCoefficients(quantizer, cmap, /*pool=*/nullptr, &cache,
+  ComputeCoefficients(quantizer, cmap, /*pool=*/nullptr, cache,
                       multipass_handler->Manager(), aux_out);
 
-  multipass_handler->Manager()->StripInfo(&cache);
+  multipass_handler->Manager()->StripInfo(cache);
+}
 
-  PaddedBytes compressed_data =
-      EncodeToBitstream(cache, area_to_encode, quantizer, noise_params, cmap,
-                        cparams.fast_mode, multipass_handler, aux_out);
+Status PixelsToPikGroup(CompressParams cparams, const PassHeader& pass_header,
+                        GroupHeader header, const AcStrategyImage& ac_strategy,
+                        const Quantizer* full_quantizer,
+                        const ColorCorrelationMap& full_cmap,
+                        const CodecInOut* io, const Image3F& opsin_in,
+                        const NoiseParams& noise_params, BitWriter* writer,
+                        const PassEncCache& pass_enc_cache, ThreadPool* pool,
+                        PikInfo* aux_out, MultipassHandler* multipass_handler) {
+  const Rect& rect = multipass_handler->GroupRect();
+  const Rect& padded_rect = multipass_handler->PaddedGroupRect();
+  const Rect area_to_encode =
+      Rect(0, 0, padded_rect.xsize(), padded_rect.ysize());
 
-  compressed->append(compressed_data);
-  pos += compressed_data.size() * kBitsPerByte;
+  PIK_RETURN_IF_ERROR(WritePikGroupHeader(cparams, pass_header, header, io,
+                                          writer, aux_out, multipass_handler));
 
+  if (cparams.lossless_mode) {
+    Image3F previous_pass;
+    PIK_RETURN_IF_ERROR(multipass_handler->GetPreviousPass(
+        io->dec_c_original, /*pool=*/nullptr, &previous_pass));
+    // The lossless codecs append to a PaddedBytes.
+    PaddedBytes lossless;
+    size_t lossless_pos = 0;
+    PIK_RETURN_IF_ERROR(PixelsToPikLosslessFrame(
+        cparams, pass_header, io, rect, previous_pass, &lossless, lossless_pos,
+        pool, aux_out));
+    writer->Append(lossless);
+    return true;
+  }
+
+  Quantizer quantizer =
+      full_quantizer->Copy(multipass_handler->BlockGroupRect());
+  EncCache cache;
+  ComputeGroupCoefficients(cparams, pass_header, header, ac_strategy,
+                           quantizer, full_cmap, pass_enc_cache, aux_out,
+                           multipass_handler, &cache);
+
+  EncodeToBitstream(cache, area_to_encode, quantizer, noise_params, full_cmap,
+                    cparams.fast_mode, header, multipass_handler, writer,
+                    aux_out);
   return true;
 }
 
+// Encodes all groups into `group_writers` with one set of coefficient orders
+// and histograms (PassHeader::kSharedEntropyCode), which are written to
+// `writer`. The stages over groups run in parallel on `pool`.
+Status PixelsToPikGroupsWithSharedCode(
+    const CompressParams& cparams, const PassHeader& pass_header,
+    const GroupHeader& header, const AcStrategyImage& ac_strategy,
+    const Quantizer& full_quantizer, const ColorCorrelationMap& full_cmap,
+    const CodecInOut* io, const NoiseParams& noise_params,
+    const PassEncCache& pass_enc_cache, ThreadPool* pool,
+    const std::vector<MultipassHandler*>& handlers,
+    const std::vector<std::unique_ptr<PikInfo>>& aux_outs,
+    GroupWriters* group_writers, BitWriter* writer, PikInfo* aux_out) {
+  const size_t num_groups = handlers.size();
+  std::vector<EncCache> caches(num_groups);
+  RunOnPool(
+      pool, 0, num_groups,
+      [&](const int group_index, const int thread) {
+        MultipassHandler* handler = handlers[group_index];
+        const Quantizer quantizer =
+            full_quantizer.Copy(handler->BlockGroupRect());
+        ComputeGroupCoefficients(cparams, pass_header, header, ac_strategy,
+                                 quantizer, full_cmap, pass_enc_cache,
+                                 aux_outs[group_index].get(), handler,
+                                 &caches[group_index]);
+      },
+      "ComputeGroupCoefficients");
+
+  PassEntropyCode code;
+  ComputePassCoeffOrder(caches, pool, &code);
+
+  std::vector<GroupTokens> group_tokens(num_groups);
+  RunOnPool(
+      pool, 0, num_groups,
+      [&](const int group_index, const int thread) {
+        const Rect& padded_rect = handlers[group_index]->PaddedGroupRect();
+        const Rect area_to_encode(0, 0, padded_rect.xsize(),
+                                  padded_rect.ysize());
+        group_tokens[group_index] =
+            TokenizeGroup(caches[group_index], area_to_encode, code.order,
+                          handlers[group_index]);
+      },
+      "TokenizeGroup");
+  // Coefficients are no longer needed.
+  caches.clear();
+
+  EncodePassEntropyCode(&group_tokens, cparams.fast_mode, &code, writer,
+                        aux_out);
+
+  std::atomic<int> num_errors{0};
+  RunOnPool(
+      pool, 0, num_groups,
+      [&](const int group_index, const int thread) {
+        BitWriter* group_writer = group_writers->Begin(group_index, thread);
+        if (!WritePikGroupHeader(cparams, pass_header, header, io,
+                                 group_writer, aux_outs[group_index].get(),
+                                 handlers[group_index])) {
+          num_errors.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          EncodeToBitstream(group_tokens[group_index], noise_params, code,
+                            header, group_writer,
+                            aux_outs[group_index].get());
+        }
+        group_writers->Finish(group_index);
+      },
+      "EncodeGroupTokens");
+  return num_errors.load(std::memory_order_relaxed) == 0;
+}
+
 // Max observed: 1.1M on RGB noise with d0.1.
 // 512*512*4*2 = 2M should be enough for 16-bit RGBA images.
 using GroupSizeCoder = SizeCoderT<0x150F0E0C>;
 
 }  // namespace
 
+Status InitPassEncImageCache(const CompressParams& cparams,
+                             const CodecInOut* io, ThreadPool* pool,
+                             PassEncImageCache* cache) {
+  PROFILER_FUNC;
+  cache->resampling_factor2 = cparams.resampling_factor2;
+  cache->gaborish = GaborishFromParams(cparams, io) != GaborishStrength::kOff;
+
+  cache->opsin_orig = EncoderOpsin(io, cache->resampling_factor2, pool);
+  if (cache->opsin_orig.xsize() == 0 || cache->opsin_orig.ysize() == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+  if (cache->gaborish) {
+    cache->opsin = PadAndGaborishInverse(cache->opsin_orig, kBlockDim,
+                                         0.92718927264540152, pool);
+  } else {
+    cache->opsin = PadImageToMultiple(cache->opsin_orig, kBlockDim, pool);
+  }
+
+  cache->opsin_dct = Image3F(cache->opsin.xsize() * kBlockDim,
+                             cache->opsin.ysize() / kBlockDim);
+  TransposedScaledDCT(cache->opsin, pool, &cache->opsin_dct);
+
+  cache->cmap = ColorCorrelationMap(io->xsize(), io->ysize());
+  FindBestColorCorrelationMap(cache->opsin_dct, pool, &cache->cmap);
+  return true;
+}
+
 Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
                        const CodecInOut* io, ThreadPool* pool,
                        PaddedBytes* compressed, size_t& pos, PikInfo* aux_out,
-                       MultipassManager* multipass_manager) {
+                       MultipassManager* multipass_manager,
+                       const PassEncImageCache* image_cache) {
   PassHeader pass_header;
   pass_header.have_adaptive_reconstruction = false;
   if (cparams.lossless_mode) {
@@ -386,12 +566,7 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
     pass_header.flags = PassFlagsFromParams(cparams, io);
     pass_header.predict_hf = cparams.predict_hf;
     pass_header.predict_lf = cparams.predict_lf;
-    pass_header.gaborish = cparams.gaborish;
-
-    if (io->xsize() <= 8 || io->ysize() <= 8) {
-      // Broken, disable.
-      pass_header.gaborish = GaborishStrength::kOff;
-    }
+    pass_header.gaborish = GaborishFromParams(cparams, io);
 
     if (ApplyOverride(cparams.adaptive_reconstruction,
                       cparams.butteraugli_distance >=
@@ -413,15 +588,85 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
     }
   }
 
+  // The noise parameters are estimated before writing the header, which stores
+  // them if kTileNoise.
+  Image3F opsin_orig;
+  NoiseParams noise_params;
+  if (pass_header.encoding == ImageEncoding::kPasses) {
+    if (image_cache != nullptr) {
+      if (image_cache->resampling_factor2 != pass_header.resampling_factor2 ||
+          image_cache->gaborish !=
+              (pass_header.gaborish != GaborishStrength::kOff)) {
+        return PIK_FAILURE("Image cache does not match the pass parameters");
+      }
+      opsin_orig = CopyImage(image_cache->opsin_orig);
+    } else {
+      opsin_orig = EncoderOpsin(io, pass_header.resampling_factor2, pool);
+    }
+
+    if (opsin_orig.xsize() == 0 || opsin_orig.ysize() == 0) {
+      return PIK_FAILURE("Empty image");
+    }
+    if (pass_header.flags & PassHeader::kNoise) {
+      PROFILER_ZONE("enc GetNoiseParam");
+      // Don't start at zero amplitude since adding noise is expensive -- it
+      // significantly slows down decoding, and this is unlikely to completely
+      // go away even with advanced optimizations. After the
+      // kNoiseModelingRampUpDistanceRange we have reached the full level, i.e.
+      // noise is no longer represented by the compressed image, so we can add
+      // full noise by the noise modeling itself.
+      static const double kNoiseModelingRampUpDistanceRange = 0.6;
+      static const double kNoiseLevelAtStartOfRampUp = 0.25;
+      // TODO(user) test and properly select quality_coef with smooth filter
+      float quality_coef = 1.0f;
+      const double rampup =
+          (cparams.butteraugli_distance - kMinButteraugliForNoise) /
+          kNoiseModelingRampUpDistanceRange;
+      if (rampup < 1.0) {
+        quality_coef = kNoiseLevelAtStartOfRampUp +
+                       (1.0 - kNoiseLevelAtStartOfRampUp) * rampup;
+      }
+      GetNoiseParameter(PadImageToMultiple(opsin_orig, kBlockDim, pool),
+                        &noise_params, quality_coef);
+    }
+    if ((pass_header.flags & PassHeader::kNoise) && cparams.tile_noise) {
+      pass_header.extensions |= PassHeader::kTileNoise;
+      QuantizeNoiseParams(noise_params, pass_header.noise_params);
+      // Groups only store parameters for the sequential AddNoise.
+      noise_params = NoiseParams();
+    }
+    if (pass_header.have_adaptive_reconstruction) {
+      // Approximates the range of the decoded image, which the decoder would
+      // otherwise only know after reconstructing all of it.
+      std::array<float, 3> min, max;
+      Image3MinMax(opsin_orig, &min, &max);
+      pass_header.extensions |= PassHeader::kEpfRange;
+      EncodeEpfRange(*std::min_element(min.begin(), min.end()),
+                     *std::max_element(max.begin(), max.end()),
+                     pass_header.epf_range);
+      // The encoder reconstructs with the same range as the decoder.
+      PIK_RETURN_IF_ERROR(
+          DecodeEpfRange(pass_header.epf_range, &pass_header.epf_params));
+    }
+  }
+
+  if (pass_header.encoding == ImageEncoding::kPasses &&
+      cparams.shared_entropy_code) {
+    pass_header.extensions |= PassHeader::kSharedEntropyCode;
+  }
+
   multipass_manager->StartPass(pass_header);
 
+  // The whole pass is appended to `writer`, which takes over `compressed`.
+  BitWriter writer(std::move(*compressed), pos);
+
   // TODO(veluca): delay writing the header until we know the total pass size.
   size_t extension_bits, total_bits;
   PIK_RETURN_IF_ERROR(CanEncode(pass_header, &extension_bits, &total_bits));
-  compressed->resize(DivCeil(pos + total_bits, kBitsPerByte));
-  PIK_RETURN_IF_ERROR(
-      WritePassHeader(pass_header, extension_bits, &pos, compressed->data()));
-  WriteZeroesToByteBoundary(&pos, compressed->data());
+  writer.ReserveBits(total_bits);
+  PIK_RETURN_IF_ERROR(WritePassHeader(pass_header, extension_bits,
+                                      writer.storage_ix(), writer.storage()));
+  writer.ZeroPadToByte();
   if (aux_out != nullptr) {
     aux_out->layers[kLayerHeader].total_size +=
         DivCeil(total_bits, kBitsPerByte);
@@ -449,107 +694,90 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
   ColorCorrelationMap full_cmap(io->xsize(), io->ysize());
   std::shared_ptr<Quantizer> full_quantizer;
   AcStrategyImage full_ac_strategy;
-  Image3F opsin_orig, opsin;
-  NoiseParams noise_params;
+  Image3F opsin;
   PassEncCache pass_enc_cache;
 
   if (pass_header.encoding == ImageEncoding::kPasses) {
-    opsin_orig = OpsinDynamicsImage(io, Rect(io->color()));
-    if (pass_header.resampling_factor2 != 2) {
-      opsin_orig = DownsampleImage(opsin_orig, pass_header.resampling_factor2);
-    }
-
     constexpr size_t N = kBlockDim;
     PROFILER_ZONE("enc OpsinToPik uninstrumented");
-    const size_t xsize = opsin_orig.xsize();
-    const size_t ysize = opsin_orig.ysize();
-    if (xsize == 0 || ysize == 0) return PIK_FAILURE("Empty image");
-    opsin = PadImageToMultiple(opsin_orig, N);
-
-    if (pass_header.flags & PassHeader::kNoise) {
-      PROFILER_ZONE("enc GetNoiseParam");
-      // Don't start at zero amplitude since adding noise is expensive -- it
-      // significantly slows down decoding, and this is unlikely to completely
-      // go away even with advanced optimizations. After the
-      // kNoiseModelingRampUpDistanceRange we have reached the full level, i.e.
-      // noise is no longer represented by the compressed image, so we can add
-      // full noise by the noise modeling itself.
-      static const double kNoiseModelingRampUpDistanceRange = 0.6;
-      static const double kNoiseLevelAtStartOfRampUp = 0.25;
-      // TODO(user) test and properly select quality_coef with smooth filter
-      float quality_coef = 1.0f;
-      const double rampup =
-          (cparams.butteraugli_distance - kMinButteraugliForNoise) /
-          kNoiseModelingRampUpDistanceRange;
-      if (rampup < 1.0) {
-        quality_coef = kNoiseLevelAtStartOfRampUp +
-                       (1.0 - kNoiseLevelAtStartOfRampUp) * rampup;
-      }
-      GetNoiseParameter(opsin, &noise_params, quality_coef);
-    }
-    if (pass_header.gaborish != GaborishStrength::kOff) {
-      opsin = GaborishInverse(opsin, 0.92718927264540152);
+    // Padding is fused into the inverse Gaborish, which reads opsin_orig.
+    if (image_cache != nullptr) {
+      opsin = CopyImage(image_cache->opsin);
+    } else if (pass_header.gaborish != GaborishStrength::kOff) {
+      opsin = PadAndGaborishInverse(opsin_orig, N, 0.92718927264540152, pool);
+    } else {
+      opsin = PadImageToMultiple(opsin_orig, N, pool);
     }
 
     multipass_manager->DecorrelateOpsin(&opsin);
 
-    PIK_RETURN_IF_ERROR(
-        PikPassHeuristics(cparams, pass_header, opsin_orig, opsin,
-                          multipass_manager, &template_group_header, &full_cmap,
-                          &full_quantizer, &full_ac_strategy, aux_out));
+    // The 8x8 DCT is computed once: the heuristics and (for blocks that keep
+    // that transform) the final coefficients all use it.
+    Image3F opsin_dct;
+    if (image_cache != nullptr) {
+      opsin_dct = CopyImage(image_cache->opsin_dct);
+    } else {
+      opsin_dct = Image3F(opsin.xsize() * N, opsin.ysize() / N);
+      TransposedScaledDCT(opsin, pool, &opsin_dct);
+    }
+
+    PIK_RETURN_IF_ERROR(PikPassHeuristics(
+        cparams, pass_header, opsin_orig, opsin, opsin_dct, multipass_manager,
+        &template_group_header, &full_cmap, &full_quantizer, &full_ac_strategy,
+        image_cache, pool, aux_out));
 
     // Initialize pass_enc_cache and encode DC.
-    InitializePassEncCache(pass_header, opsin, full_ac_strategy,
-                           *full_quantizer, full_cmap, pool, &pass_enc_cache);
+    InitializePassEncCache(pass_header,
+                           TransformToCoefficients(opsin, full_ac_strategy,
+                                                   std::move(opsin_dct), pool),
+                           full_ac_strategy, *full_quantizer, full_cmap, pool,
+                           &pass_enc_cache);
 
     multipass_manager->StripDCInfo(&pass_enc_cache);
     pass_enc_cache.use_new_dc = cparams.use_new_dc;
 
-    PaddedBytes pass_global_code;
-    size_t byte_pos = 0;
-
     // Encode quantizer DC and global scale.
     PikImageSizeInfo* quant_info =
         aux_out ? &aux_out->layers[kLayerQuant] : nullptr;
-    std::string quant_code = full_quantizer->Encode(quant_info);
+    full_quantizer->Encode(&writer, quant_info);
 
     // Encode cmap. TODO(veluca): consider encoding DC part of cmap only here,
     // and AC in groups.
     PikImageSizeInfo* cmap_info =
         aux_out ? &aux_out->layers[kLayerCmap] : nullptr;
-    std::string cmap_code =
-        EncodeColorMap(full_cmap.ytob_map, Rect(full_cmap.ytob_map),
-                       full_cmap.ytob_dc, cmap_info) +
-        EncodeColorMap(full_cmap.ytox_map, Rect(full_cmap.ytox_map),
-                       full_cmap.ytox_dc, cmap_info);
-
-    pass_global_code.resize(quant_code.size() + cmap_code.size());
-    Append(quant_code, &pass_global_code, &byte_pos);
-    Append(cmap_code, &pass_global_code, &byte_pos);
+    EncodeColorMap(full_cmap.ytob_map, Rect(full_cmap.ytob_map),
+                   full_cmap.ytob_dc, &writer, cmap_info);
+    EncodeColorMap(full_cmap.ytox_map, Rect(full_cmap.ytox_map),
+                   full_cmap.ytox_dc, &writer, cmap_info);
 
     PikImageSizeInfo* dc_info = aux_out ? &aux_out->layers[kLayerDC] : nullptr;
-    pass_global_code.append(
-        EncodeDC(*full_quantizer, pass_enc_cache, pool, dc_info));
-    compressed->append(pass_global_code);
-    pos += pass_global_code.size() * 8;
+    EncodeDC(*full_quantizer, pass_enc_cache, pool, &writer, dc_info);
   }
 
-  // Compress groups.
-  std::vector<PaddedBytes> group_codes(num_groups);
+  // Compress groups, each into the writer of the thread that encodes it.
+  GroupWriters group_writers(NumThreads(pool), num_groups);
   std::atomic<int> num_errors{0};
   const auto process_group = [&](const int group_index, const int thread) {
-    PaddedBytes* group_code = &group_codes[group_index];
-    size_t group_pos = 0;
+    BitWriter* group_writer = group_writers.Begin(group_index, thread);
     if (!PixelsToPikGroup(cparams, pass_header, template_group_header,
                           full_ac_strategy, full_quantizer.get(), full_cmap, io,
-                          opsin, noise_params, group_code, group_pos,
-                          pass_enc_cache, aux_outs[group_index].get(),
+                          opsin, noise_params, group_writer, pass_enc_cache,
+                          pool, aux_outs[group_index].get(),
                           handlers[group_index])) {
       num_errors.fetch_add(1, std::memory_order_relaxed);
-      return;
     }
+    group_writers.Finish(group_index);
   };
-  RunOnPool(pool, 0, num_groups, process_group, "PixelsToPikPass");
+  if (pass_header.extensions & PassHeader::kSharedEntropyCode) {
+    if (!PixelsToPikGroupsWithSharedCode(
+            cparams, pass_header, template_group_header, full_ac_strategy,
+            *full_quantizer, full_cmap, io, noise_params, pass_enc_cache, pool,
+            handlers, aux_outs, &group_writers, &writer, aux_out)) {
+      num_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  } else {
+    RunOnPool(pool, 0, num_groups, process_group, "PixelsToPikPass");
+  }
 
   if (aux_out != nullptr) {
     for (size_t group_index = 0; group_index < num_groups; ++group_index) {
@@ -559,31 +787,18 @@ Status PixelsToPikPass(CompressParams cparams, const PassParams& pass_params,
 
   PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
 
-  // Build TOC.
-  PaddedBytes group_toc(GroupSizeCoder::MaxSize(num_groups));
-  size_t group_toc_pos = 0;
-  uint8_t* group_toc_storage = group_toc.data();
-  size_t total_groups_size = 0;
+  // Write TOC, then gather the groups.
+  PIK_ASSERT(writer.BitsWritten() % kBitsPerByte == 0);
+  writer.ReserveBits(GroupSizeCoder::MaxSize(num_groups) * kBitsPerByte);
   for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    size_t group_size = group_codes[group_index].size();
-    GroupSizeCoder::Encode(group_size, &group_toc_pos, group_toc_storage);
-    total_groups_size += group_size;
-  }
-  WriteZeroesToByteBoundary(&group_toc_pos, group_toc_storage);
-  group_toc.resize(group_toc_pos / kBitsPerByte);
-
-  // Push output.
-  PIK_ASSERT(pos % kBitsPerByte == 0);
-  compressed->reserve(DivCeil(pos, kBitsPerByte) + group_toc.size() +
-                      total_groups_size);
-  compressed->append(group_toc);
-  pos += group_toc.size() * kBitsPerByte;
-  for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-    const PaddedBytes& group_code = group_codes[group_index];
-    compressed->append(group_code);
-    pos += group_code.size() * kBitsPerByte;
+    GroupSizeCoder::Encode(group_writers.SectionSize(group_index),
+                           writer.storage_ix(), writer.storage());
   }
+  writer.ZeroPadToByte();
+  group_writers.Gather(&writer);
 
+  pos = writer.BitsWritten();
+  *compressed = writer.TakeBytes();
   io->enc_size = compressed->size();
   return true;
 }
@@ -608,9 +823,63 @@ Status ValidateImageDimensions(const FileHeader& container,
     return PIK_FAILURE("Image too big.");
   }
 
+  if (!dparams.crop.IsEmpty() &&
+      (dparams.crop.x0 >= xsize || dparams.crop.y0 >= ysize)) {
+    return PIK_FAILURE("Crop rect is outside of the image.");
+  }
+
   return true;
 }
 
+// Returns the region of the padded opsin image that must be reconstructed so
+// that "crop" is exact: gaborish and adaptive reconstruction read a few pixels
+// around each output pixel and its varblock, which the tile margin covers.
+// Upsampling is not local in opsin coordinates, and non-tile noise and
+// adaptive reconstruction without kEpfRange depend on statistics of the
+// entire image, so such passes are reconstructed entirely.
+Rect CropReconstructionRect(const Rect& crop, const PassHeader& header,
+                            const size_t padded_xsize,
+                            const size_t padded_ysize) {
+  const bool has_image_noise = (header.flags & PassHeader::kNoise) &&
+                               !(header.extensions & PassHeader::kTileNoise);
+  const bool has_image_epf = header.have_adaptive_reconstruction &&
+                             !header.epf_params.nonserialized_has_range;
+  if (header.resampling_factor2 != 2 || has_image_epf || has_image_noise) {
+    return Rect(0, 0, padded_xsize, padded_ysize);
+  }
+  const size_t x0 = crop.x0() < kTileDim ? 0 : crop.x0() - kTileDim;
+  const size_t y0 = crop.y0() < kTileDim ? 0 : crop.y0() - kTileDim;
+  const size_t x1 = crop.x0() + crop.xsize() + kTileDim;
+  const size_t y1 = crop.y0() + crop.ysize() + kTileDim;
+  const size_t x0_aligned = x0 / kTileDim * kTileDim;
+  const size_t y0_aligned = y0 / kTileDim * kTileDim;
+  const size_t x1_aligned = std::min(DivCeil(x1, kTileDim) * kTileDim,
+                                     padded_xsize);
+  const size_t y1_aligned = std::min(DivCeil(y1, kTileDim) * kTileDim,
+                                     padded_ysize);
+  return Rect(x0_aligned, y0_aligned, x1_aligned - x0_aligned,
+              y1_aligned - y0_aligned);
+}
+
+// Returns the union of the padded rects of the groups that overlap "rect".
+Rect GroupAlignedRect(const Rect& rect, const size_t padded_xsize,
+                      const size_t padded_ysize) {
+  const size_t x0 = rect.x0() / kGroupWidth * kGroupWidth;
+  const size_t y0 = rect.y0() / kGroupHeight * kGroupHeight;
+  const size_t x1 = std::min(
+      DivCeil(rect.x0() + rect.xsize(), kGroupWidth) * kGroupWidth,
+      padded_xsize);
+  const size_t y1 = std::min(
+      DivCeil(rect.y0() + rect.ysize(), kGroupHeight) * kGroupHeight,
+      padded_ysize);
+  return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+bool Overlaps(const Rect& a, const Rect& b) {
+  return a.x0() < b.x0() + b.xsize() && b.x0() < a.x0() + a.xsize() &&
+         a.y0() < b.y0() + b.ysize() && b.y0() < a.y0() + a.ysize();
+}
+
 // Specializes a 8-bit and 16-bit of converting to float from lossless.
 float ToFloatForLossless(uint8_t in) { return static_cast<float>(in); }
 
@@ -682,10 +951,11 @@ void LosslessChannelDecodePass(int num_channels, const Image<T>** in,
   }
 }
 
-Status PikLosslessFrameToPixels(const PaddedBytes& compressed,
+Status PikLosslessFrameToPixels(const Span<const uint8_t> compressed,
                                 const PassHeader& pass_header, size_t* position,
                                 Image3F* color, const Rect& rect,
-                                const Image3F& previous_pass) {
+                                const Image3F& previous_pass,
+                                ThreadPool* pool) {
   PROFILER_FUNC;
   if (pass_header.lossless_grayscale) {
     if (pass_header.lossless_16_bits) {
@@ -712,7 +982,7 @@ Status PikLosslessFrameToPixels(const PaddedBytes& compressed,
   } else {
     if (pass_header.lossless_16_bits) {
       Image3U image;
-      if (!Colorful16bit_decompress(compressed, position, &image)) {
+      if (!Colorful16bit_decompress(compressed, position, &image, pool)) {
         return PIK_FAILURE("Lossless decompression failed");
       }
       if (!SameSize(image, rect)) {
@@ -723,7 +993,7 @@ Status PikLosslessFrameToPixels(const PaddedBytes& compressed,
       LosslessChannelDecodePass(3, array, rect, previous_pass, color);
     } else {
       Image3B image;
-      if (!Colorful8bit_decompress(compressed, position, &image)) {
+      if (!Colorful8bit_decompress(compressed, position, &image, pool)) {
         return PIK_FAILURE("Lossless decompression failed");
       }
       if (!SameSize(image, rect)) {
@@ -737,17 +1007,25 @@ Status PikLosslessFrameToPixels(const PaddedBytes& compressed,
   return true;
 }
 
+// (output_x0, output_y0) is the position of opsin_output and alpha_output
+// within the image.
 Status PikGroupToPixels(
     const DecompressParams& dparams, const FileHeader& container,
-    const PassHeader* pass_header, const PaddedBytes& compressed,
+    const PassHeader* pass_header, const Span<const uint8_t> compressed,
     const Quantizer& quantizer, const ColorCorrelationMap& full_cmap,
     BitReader* reader, Image3F* PIK_RESTRICT opsin_output, ImageU* alpha_output,
-    CodecContext* context, PikInfo* aux_out, PassDecCache* pass_dec_cache,
+    const size_t output_x0, const size_t output_y0, CodecContext* context,
+    ThreadPool* pool, PikInfo* aux_out, PassDecCache* pass_dec_cache,
     MultipassHandler* multipass_handler,
     const ColorEncoding& original_color_encoding) {
   PROFILER_FUNC;
   const Rect& padded_rect = multipass_handler->PaddedGroupRect();
   const Rect& rect = multipass_handler->GroupRect();
+  const Rect padded_output_rect(padded_rect.x0() - output_x0,
+                                padded_rect.y0() - output_y0,
+                                padded_rect.xsize(), padded_rect.ysize());
+  const Rect output_rect(rect.x0() - output_x0, rect.y0() - output_y0,
+                         rect.xsize(), rect.ysize());
   GroupHeader header;
   header.nonserialized_have_alpha = pass_header->has_alpha;
   PIK_RETURN_IF_ERROR(ReadGroupHeader(reader, &header));
@@ -766,7 +1044,8 @@ Status PikGroupToPixels(
     if (container.metadata.transcoded.original_bytes_per_alpha == 0) {
       return PIK_FAILURE("Header claims to contain alpha but the depth is 0.");
     }
-    PIK_RETURN_IF_ERROR(DecodeAlpha(dparams, header.alpha, alpha_output, rect));
+    PIK_RETURN_IF_ERROR(
+        DecodeAlpha(dparams, header.alpha, alpha_output, output_rect));
   }
 
   if (pass_header->encoding == ImageEncoding::kLossless) {
@@ -775,8 +1054,9 @@ Status PikGroupToPixels(
     Image3F previous_pass;
     PIK_RETURN_IF_ERROR(multipass_handler->GetPreviousPass(
         original_color_encoding, /*pool=*/nullptr, &previous_pass));
-    auto result = PikLosslessFrameToPixels(compressed, *pass_header, &pos,
-                                           opsin_output, rect, previous_pass);
+    auto result = PikLosslessFrameToPixels(
+        compressed, *pass_header, &pos, opsin_output, output_rect,
+        previous_pass, pool);
     reader->SkipBits((pos - before_pos) << 3);
     // Byte-wise; no need to jump to boundary.
     return result;
@@ -815,7 +1095,7 @@ Status PikGroupToPixels(
     if (!DecodeFromBitstream(*pass_header, header, compressed, reader,
                              padded_rect, multipass_handler, xsize_blocks,
                              ysize_blocks, cmap, &noise_params, quantizer,
-                             &dec_cache, pass_dec_cache)) {
+                             &dec_cache, pass_dec_cache, pool)) {
       return PIK_FAILURE("Pik decoding failed.");
     }
     if (!reader->JumpToByteBoundary()) {
@@ -829,168 +1109,375 @@ Status PikGroupToPixels(
   // Note: DecodeFromBitstream already performed dequantization.
   ReconOpsinImage(*pass_header, header, quantizer,
                   multipass_handler->BlockGroupRect(), &dec_cache,
-                  pass_dec_cache, opsin_output, padded_rect, aux_out);
+                  pass_dec_cache, opsin_output, padded_output_rect, aux_out);
 
   return true;
 }
 
 }  // namespace
 
-Status PikPassToPixels(const DecompressParams& dparams,
-                       const PaddedBytes& compressed,
-                       const FileHeader& container, ThreadPool* pool,
-                       BitReader* reader, CodecInOut* io, PikInfo* aux_out,
-                       MultipassManager* multipass_handler) {
-  PROFILER_ZONE("PikPassToPixels uninstrumented");
-  PIK_RETURN_IF_ERROR(ValidateImageDimensions(container, dparams));
+PassDecoder::PassDecoder(const DecompressParams& dparams,
+                         const FileHeader& container, CodecInOut* io,
+                         PikInfo* aux_out, MultipassManager* multipass_handler)
+    : dparams_(dparams),
+      container_(container),
+      io_(io),
+      aux_out_(aux_out),
+      multipass_handler_(multipass_handler),
+      xsize_(container.xsize()),
+      ysize_(container.ysize()),
+      padded_xsize_(DivCeil(xsize_, kBlockDim) * kBlockDim),
+      padded_ysize_(DivCeil(ysize_, kBlockDim) * kBlockDim),
+      crop_(0, 0, xsize_, ysize_),
+      recon_rect_(0, 0, padded_xsize_, padded_ysize_),
+      output_rect_(0, 0, padded_xsize_, padded_ysize_),
+      cmap_(xsize_, ysize_),
+      quantizer_(kBlockDim, 0, 0, 0) {}
+
+Rect PassDecoder::GroupRect(const size_t group_index) const {
+  const size_t xsize_groups = DivCeil(xsize_, kGroupWidth);
+  const size_t gx = group_index % xsize_groups;
+  const size_t gy = group_index / xsize_groups;
+  return Rect(gx * kGroupWidth, gy * kGroupHeight, kGroupWidth, kGroupHeight,
+              xsize_, ysize_);
+}
+
+Status PassDecoder::ReadHeaders(const Span<const uint8_t> compressed,
+                                BitReader* reader) {
+  PROFILER_FUNC;
+  PIK_RETURN_IF_ERROR(ValidateImageDimensions(container_, dparams_));
 
-  io->metadata = container.metadata;
+  io_->metadata = container_.metadata;
 
   // Used when writing the output file unless DecoderHints overrides it.
-  io->SetOriginalBitsPerSample(
-      container.metadata.transcoded.original_bit_depth);
-  io->dec_c_original = container.metadata.transcoded.original_color_encoding;
-  if (io->dec_c_original.icc.empty()) {
+  io_->SetOriginalBitsPerSample(
+      container_.metadata.transcoded.original_bit_depth);
+  io_->dec_c_original = container_.metadata.transcoded.original_color_encoding;
+  if (io_->dec_c_original.icc.empty()) {
     // Removed by MaybeRemoveProfile; fail unless we successfully restore it.
     PIK_RETURN_IF_ERROR(
-        ColorManagement::SetProfileFromFields(&io->dec_c_original));
+        ColorManagement::SetProfileFromFields(&io_->dec_c_original));
   }
 
-  const size_t xsize = container.xsize();
-  const size_t ysize = container.ysize();
-  size_t padded_xsize = DivCeil(xsize, kBlockDim) * kBlockDim;
-  size_t padded_ysize = DivCeil(ysize, kBlockDim) * kBlockDim;
-
-  PassHeader header;
-  PIK_RETURN_IF_ERROR(ReadPassHeader(reader, &header));
+  PIK_RETURN_IF_ERROR(ReadPassHeader(reader, &header_));
 
   PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
   // TODO(veluca): add kProgressive.
-  if (header.encoding != ImageEncoding::kPasses &&
-      header.encoding != ImageEncoding::kLossless) {
+  if (header_.encoding != ImageEncoding::kPasses &&
+      header_.encoding != ImageEncoding::kLossless) {
     return PIK_FAILURE("Unsupported bitstream");
   }
 
-  multipass_handler->StartPass(header);
+  multipass_handler_->StartPass(header_);
 
-  OverridePassFlags(dparams, &header);
+  OverridePassFlags(dparams_, &header_);
+  if (header_.have_adaptive_reconstruction &&
+      (header_.extensions & PassHeader::kEpfRange)) {
+    PIK_RETURN_IF_ERROR(
+        DecodeEpfRange(header_.epf_range, &header_.epf_params));
+  }
 
-  ImageU alpha;
-  if (header.has_alpha) {
-    alpha = ImageU(xsize, ysize);
+  is_cropped_ = !dparams_.crop.IsEmpty();
+  crop_ = is_cropped_
+              ? Rect(dparams_.crop.x0, dparams_.crop.y0, dparams_.crop.xsize,
+                     dparams_.crop.ysize, xsize_, ysize_)
+              : Rect(0, 0, xsize_, ysize_);
+  // Pixels outside this region do not influence the crop.
+  recon_rect_ = is_cropped_ ? CropReconstructionRect(crop_, header_,
+                                                     padded_xsize_,
+                                                     padded_ysize_)
+                            : Rect(0, 0, padded_xsize_, padded_ysize_);
+  // Standalone lossy passes only store the groups that overlap recon_rect_;
+  // other passes are restored from or saved for the previous ones entirely.
+  output_rect_ = is_cropped_ && header_.encoding == ImageEncoding::kPasses &&
+                         multipass_handler_->IsStandalonePass()
+                     ? GroupAlignedRect(recon_rect_, padded_xsize_,
+                                        padded_ysize_)
+                     : Rect(0, 0, padded_xsize_, padded_ysize_);
+
+  if (header_.has_alpha) {
+    alpha_ = ImageU(std::min(output_rect_.xsize(), xsize_ - output_rect_.x0()),
+                    std::min(output_rect_.ysize(), ysize_ - output_rect_.y0()));
   }
 
-  const size_t xsize_groups = DivCeil(xsize, kGroupWidth);
-  const size_t ysize_groups = DivCeil(ysize, kGroupHeight);
+  const size_t xsize_groups = DivCeil(xsize_, kGroupWidth);
+  const size_t ysize_groups = DivCeil(ysize_, kGroupHeight);
   const size_t num_groups = xsize_groups * ysize_groups;
 
-  std::vector<PikInfo> aux_outs;
-  if (aux_out != nullptr) {
-    aux_outs.resize(num_groups, *aux_out);
+  if (aux_out_ != nullptr) {
+    aux_outs_.resize(num_groups, *aux_out_);
   }
-  std::vector<MultipassHandler*> handlers(num_groups);
+  handlers_.resize(num_groups);
+  // Groups that do not overlap recon_rect_ are not decoded (nor reconstructed).
+  is_group_needed_.resize(num_groups);
   {
     PROFILER_ZONE("Get handlers");
     for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-      const size_t gx = group_index % xsize_groups;
-      const size_t gy = group_index / xsize_groups;
-      const size_t x = gx * kGroupWidth;
-      const size_t y = gy * kGroupHeight;
-      Rect rect(x, y, kGroupWidth, kGroupHeight, xsize, ysize);
-      handlers[group_index] =
-          multipass_handler->GetGroupHandler(group_index, rect);
+      const Rect rect = GroupRect(group_index);
+      handlers_[group_index] =
+          multipass_handler_->GetGroupHandler(group_index, rect);
+      is_group_needed_[group_index] = Overlaps(rect, recon_rect_);
     }
   }
 
-  const size_t xsize_blocks = padded_xsize / kBlockDim;
-  const size_t ysize_blocks = padded_ysize / kBlockDim;
+  const size_t xsize_blocks = padded_xsize_ / kBlockDim;
+  const size_t ysize_blocks = padded_ysize_ / kBlockDim;
 
-  PassDecCache pass_dec_cache;
-  pass_dec_cache.use_new_dc = dparams.use_new_dc;
-  pass_dec_cache.grayscale = header.flags & PassHeader::kGrayscaleOpt;
-  pass_dec_cache.ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
-  pass_dec_cache.raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
-  ColorCorrelationMap cmap(xsize, ysize);
-  Quantizer quantizer(kBlockDim, 0, 0, 0);
+  pass_dec_cache_.use_new_dc = dparams_.use_new_dc;
+  pass_dec_cache_.grayscale = header_.flags & PassHeader::kGrayscaleOpt;
+  pass_dec_cache_.ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
+  pass_dec_cache_.raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
 
-  if (header.encoding == ImageEncoding::kPasses) {
-    PROFILER_ZONE("DecodeColorMap+DC");
-    PIK_RETURN_IF_ERROR(quantizer.Decode(reader));
+  if (header_.encoding == ImageEncoding::kPasses) {
+    PROFILER_ZONE("DecodeColorMap+DC headers");
+    PIK_RETURN_IF_ERROR(quantizer_.Decode(reader));
     PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
-    DecodeColorMap(reader, &cmap.ytob_map, &cmap.ytob_dc);
-    DecodeColorMap(reader, &cmap.ytox_map, &cmap.ytox_dc);
-    PIK_RETURN_IF_ERROR(DecodeDC(reader, compressed, header, xsize_blocks,
-                                 ysize_blocks, quantizer, cmap, pool,
-                                 &pass_dec_cache));
+    DecodeColorMap(reader, &cmap_.ytob_map, &cmap_.ytob_dc);
+    DecodeColorMap(reader, &cmap_.ytox_map, &cmap_.ytox_dc);
+    PIK_RETURN_IF_ERROR(dc_decoder_.ReadHeaders(
+        reader, compressed, header_, xsize_blocks, ysize_blocks, quantizer_,
+        cmap_, &pass_dec_cache_));
+    is_dc_group_decoded_.assign(dc_decoder_.NumGroups(), 0);
+    if (header_.extensions & PassHeader::kSharedEntropyCode) {
+      PIK_RETURN_IF_ERROR(DecodePassEntropyCode(reader, &pass_dec_cache_));
+    }
   }
 
   // Read TOC.
-  std::vector<size_t> group_offsets;
   {
     PROFILER_ZONE("Read TOC");
-    group_offsets.reserve(num_groups + 1);
-    group_offsets.push_back(0);
+    group_offsets_.clear();
+    group_offsets_.reserve(num_groups + 1);
+    group_offsets_.push_back(0);
     for (size_t group_index = 0; group_index < num_groups; ++group_index) {
       const uint32_t size = GroupSizeCoder::Decode(reader);
-      group_offsets.push_back(group_offsets.back() + size);
+      group_offsets_.push_back(group_offsets_.back() + size);
     }
     PIK_RETURN_IF_ERROR(reader->JumpToByteBoundary());
   }
 
-  // Pretend all groups are read.
-  size_t group_codes_begin = reader->Position();
-  reader->SkipBits(group_offsets.back() * kBitsPerByte);
-  if (reader->Position() > compressed.size()) {
-    return PIK_FAILURE("Group code extends after stream end");
+  group_codes_begin_ = reader->Position();
+  opsin_ = Image3F(output_rect_.xsize(), output_rect_.ysize());
+  return true;
+}
+
+Status PassDecoder::DecodeGroups(const Span<const uint8_t> compressed,
+                                 const uint32_t* group_indices,
+                                 const size_t num_indices, ThreadPool* pool) {
+  return RunGroups(compressed, group_indices, num_indices, pool,
+                   /*finalize_graph=*/nullptr);
+}
+
+Status PassDecoder::RunGroups(const Span<const uint8_t> compressed,
+                              const uint32_t* group_indices,
+                              const size_t num_indices, ThreadPool* pool,
+                              TFGraph* finalize_graph) {
+  for (size_t i = 0; i < num_indices; ++i) {
+    if (GroupEnd(group_indices[i]) > compressed.size()) {
+      return PIK_FAILURE("Group code extends after stream end");
+    }
+  }
+
+  // DC groups that are read by the groups to decode, and the tasks that
+  // decode them.
+  std::vector<uint32_t> dc_groups;
+  std::vector<std::vector<uint32_t>> dc_groups_needed(num_indices);
+  std::vector<int> dc_task(is_dc_group_decoded_.size(), -1);
+  if (header_.encoding == ImageEncoding::kPasses) {
+    for (size_t i = 0; i < num_indices; ++i) {
+      if (!is_group_needed_[group_indices[i]]) continue;
+      dc_groups_needed[i] =
+          dc_decoder_.GroupsNeededFor(GroupRect(group_indices[i]));
+      for (const uint32_t dc_group : dc_groups_needed[i]) {
+        if (is_dc_group_decoded_[dc_group] || dc_task[dc_group] >= 0) continue;
+        dc_task[dc_group] = dc_groups.size();
+        dc_groups.push_back(dc_group);
+      }
+    }
+  }
+  const bool finish_dc = dc_decoder_.HasGradientMap() && !is_dc_finished_ &&
+                         !dc_groups.empty();
+
+  // Tasks are numbered in the order DC groups, applying the gradient map, AC
+  // groups, tiles of finalize_graph, so that dependencies come first.
+  const size_t dc_end = dc_groups.size();
+  const size_t finish_dc_end = dc_end + finish_dc;
+  const size_t groups_end = finish_dc_end + num_indices;
+  const size_t num_tiles_x =
+      finalize_graph == nullptr ? 0 : finalize_graph->NumTilesX();
+  const size_t num_tiles_y =
+      finalize_graph == nullptr ? 0 : finalize_graph->NumTilesY();
+  TaskGraph graph(groups_end + num_tiles_x * num_tiles_y);
+
+  if (finish_dc) {
+    for (size_t task = 0; task < dc_end; ++task) {
+      graph.AddDependency(task, dc_end);
+    }
+  }
+  std::vector<int> group_task(NumGroups(), -1);
+  for (size_t i = 0; i < num_indices; ++i) {
+    const int task = finish_dc_end + i;
+    group_task[group_indices[i]] = task;
+    if (finish_dc) {
+      graph.AddDependency(dc_end, task);
+      continue;
+    }
+    for (const uint32_t dc_group : dc_groups_needed[i]) {
+      if (dc_task[dc_group] >= 0) graph.AddDependency(dc_task[dc_group], task);
+    }
   }
 
-  Image3F opsin(padded_xsize, padded_ysize);
+  // Each tile depends on the groups that overlap it, including the pixels that
+  // the finalization reads around it.
+  const size_t xsize_groups = DivCeil(xsize_, kGroupWidth);
+  const size_t ysize_groups = DivCeil(ysize_, kGroupHeight);
+  for (size_t ty = 0; ty < num_tiles_y; ++ty) {
+    const size_t y0 = ty * kTileDim;
+    const size_t gy0 =
+        (y0 < kFinalizeTileBorder ? 0 : y0 - kFinalizeTileBorder) /
+        kGroupHeight;
+    const size_t gy1 =
+        std::min((y0 + kTileDim + kFinalizeTileBorder - 1) / kGroupHeight,
+                 ysize_groups - 1);
+    for (size_t tx = 0; tx < num_tiles_x; ++tx) {
+      const size_t x0 = tx * kTileDim;
+      const size_t gx0 =
+          (x0 < kFinalizeTileBorder ? 0 : x0 - kFinalizeTileBorder) /
+          kGroupWidth;
+      const size_t gx1 =
+          std::min((x0 + kTileDim + kFinalizeTileBorder - 1) / kGroupWidth,
+                   xsize_groups - 1);
+      const int task = groups_end + ty * num_tiles_x + tx;
+      for (size_t gy = gy0; gy <= gy1; ++gy) {
+        for (size_t gx = gx0; gx <= gx1; ++gx) {
+          const int dependency = group_task[gy * xsize_groups + gx];
+          if (dependency >= 0) graph.AddDependency(dependency, task);
+        }
+      }
+    }
+  }
 
-  // Decode groups.
   std::atomic<int> num_errors{0};
-  const auto process_group = [&](const int group_index, const int thread) {
-    size_t group_code_offset = group_offsets[group_index];
-    size_t group_reader_limit = group_offsets[group_index + 1];
-    // TODO(user): this looks ugly; we should get rid of PaddedBytes parameter
-    //               once it is wrapped into BitReader; otherwise it is easy to
-    //               screw the things up.
-    BitReader group_reader(compressed.data(),
-                           group_codes_begin + group_reader_limit);
-    group_reader.SkipBits((group_codes_begin + group_code_offset) *
-                          kBitsPerByte);
-
-    PikInfo* my_aux_out = aux_out ? &aux_outs[group_index] : nullptr;
-    if (!PikGroupToPixels(dparams, container, &header, compressed, quantizer,
-                          cmap, &group_reader, &opsin, &alpha, io->Context(),
-                          my_aux_out, &pass_dec_cache, handlers[group_index],
-                          io->dec_c_original)) {
-      num_errors.fetch_add(1);
+  ImageBufferPool* image_pool = io_->Context()->image_pool.get();
+  const auto process_group = [&](const size_t group_index) {
+    PikInfo* my_aux_out = aux_out_ ? &aux_outs_[group_index] : nullptr;
+    BitReader group_reader(compressed.data(), GroupEnd(group_index));
+    group_reader.SkipBits(GroupBegin(group_index) * kBitsPerByte);
+    return PikGroupToPixels(dparams_, container_, &header_, compressed,
+                            quantizer_, cmap_, &group_reader, &opsin_, &alpha_,
+                            output_rect_.x0(), output_rect_.y0(),
+                            io_->Context(), pool, my_aux_out, &pass_dec_cache_,
+                            handlers_[group_index], io_->dec_c_original);
+  };
+  const auto run_task = [&](const int task, const int thread) {
+    // Later tasks may depend on the failed one.
+    if (num_errors.load(std::memory_order_relaxed) != 0) return;
+    if (static_cast<size_t>(task) >= groups_end) {
+      const size_t tile = task - groups_end;
+      finalize_graph->RunTile(tile % num_tiles_x, tile / num_tiles_x, thread);
+      return;
+    }
+    if (static_cast<size_t>(task) < finish_dc_end && task >= dc_end) {
+      dc_decoder_.Finish(&pass_dec_cache_);
+      return;
+    }
+
+    // Temporaries of the group are freed before the next group on this thread
+    // starts, which allows the arena to rewind.
+    ImageAllocatorScope allocator_scope(image_pool->Arena(thread));
+    if (static_cast<size_t>(task) < dc_end) {
+      if (!dc_decoder_.DecodeGroup(compressed, dc_groups[task],
+                                   &pass_dec_cache_)) {
+        num_errors.fetch_add(1);
+      }
       return;
     }
+    const size_t group_index = group_indices[task - finish_dc_end];
+    if (!is_group_needed_[group_index]) return;
+    if (!process_group(group_index)) {
+      num_errors.fetch_add(1);
+    }
   };
   {
     PROFILER_ZONE("PikPassToPixels pool");
-    RunOnPool(pool, 0, num_groups, process_group, "PikPassToPixels");
+    RunGraphOnPool(pool, graph, run_task, "PikPassToPixels");
   }
+  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
 
-  if (aux_out != nullptr) {
-    for (size_t group_index = 0; group_index < num_groups; ++group_index) {
-      aux_out->Assimilate(aux_outs[group_index]);
+  for (const uint32_t dc_group : dc_groups) {
+    is_dc_group_decoded_[dc_group] = 1;
+  }
+  if (finish_dc) is_dc_finished_ = true;
+  return true;
+}
+
+Status PassDecoder::Finish(ThreadPool* pool,
+                           const InterleavedOutput* interleaved) {
+  if (aux_out_ != nullptr) {
+    for (const PikInfo& group_aux_out : aux_outs_) {
+      aux_out_->Assimilate(group_aux_out);
     }
   }
 
-  PIK_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+  CodecInOut* io = io_;
+  if (header_.encoding == ImageEncoding::kPasses) {
+    // (If already finalized, these are no-ops; see IsStandalonePass.)
+    if (!is_finalized_) {
+      multipass_handler_->RestoreOpsin(&opsin_);
+      multipass_handler_->SetDecodedPass(opsin_);
+    }
 
-  if (header.encoding == ImageEncoding::kPasses) {
-    multipass_handler->RestoreOpsin(&opsin);
-    multipass_handler->SetDecodedPass(opsin);
+    if (UsesInterleaved(interleaved)) {
+      if (!is_finalized_) {
+        FinalizePassDecoding(std::move(opsin_), header_, NoiseParams(),
+                             quantizer_, pool, &pass_dec_cache_, /*x0=*/0,
+                             /*y0=*/0, *interleaved, aux_out_);
+      }
+      if (interleaved->has_alpha) {
+        AlphaToInterleaved(
+            header_.has_alpha ? &alpha_ : nullptr,
+            8 * container_.metadata.transcoded.original_bytes_per_alpha,
+            *interleaved);
+      }
+      // No pixels; only the metadata set above remains valid.
+      io->SetFromImage(Image3F(), io->Context()->c_srgb[0]);
+      io->RemoveAlpha();
+      return true;
+    }
 
-    Image3F color(padded_xsize, padded_ysize);
-    FinalizePassDecoding(std::move(opsin), header, NoiseParams(), quantizer,
-                         pool, &pass_dec_cache, &color, aux_out);
+    Image3F color;
+    if (is_finalized_) {
+      color = std::move(linear_);
+    } else if (is_cropped_) {
+      color = Image3F(recon_rect_.xsize(), recon_rect_.ysize());
+      // Only the fields used by FinalizePassDecoding.
+      const Rect recon_blocks(recon_rect_.x0() / kBlockDim,
+                              recon_rect_.y0() / kBlockDim,
+                              recon_rect_.xsize() / kBlockDim,
+                              recon_rect_.ysize() / kBlockDim);
+      PassDecCache recon_cache;
+      recon_cache.raw_quant_field =
+          CopyImage(recon_blocks, pass_dec_cache_.raw_quant_field);
+      recon_cache.ac_strategy = pass_dec_cache_.ac_strategy.Copy(recon_blocks);
+      const Rect recon_in_opsin(recon_rect_.x0() - output_rect_.x0(),
+                                recon_rect_.y0() - output_rect_.y0(),
+                                recon_rect_.xsize(), recon_rect_.ysize());
+      Image3F recon_opsin = SameSize(recon_rect_, opsin_)
+                                ? std::move(opsin_)
+                                : CopyImage(recon_in_opsin, opsin_);
+      // Noise depends on the image coordinates, hence the origin.
+      FinalizePassDecoding(std::move(recon_opsin), header_, NoiseParams(),
+                           quantizer_, pool, &recon_cache, recon_rect_.x0(),
+                           recon_rect_.y0(), &color, aux_out_);
+    } else {
+      color = Image3F(recon_rect_.xsize(), recon_rect_.ysize());
+      FinalizePassDecoding(std::move(opsin_), header_, NoiseParams(),
+                           quantizer_, pool, &pass_dec_cache_, /*x0=*/0,
+                           /*y0=*/0, &color, aux_out_);
+    }
 
-    if (header.flags & PassHeader::kGrayscaleOpt) {
+    if (header_.flags & PassHeader::kGrayscaleOpt) {
       PROFILER_ZONE("Grayscale opt");
       // Force all channels to gray
       for (size_t y = 0; y < color.ysize(); ++y) {
@@ -1003,25 +1490,88 @@ Status PikPassToPixels(const DecompressParams& dparams,
         }
       }
     }
+    if (is_cropped_) {
+      const Rect crop_in_color(crop_.x0() - recon_rect_.x0(),
+                               crop_.y0() - recon_rect_.y0(), crop_.xsize(),
+                               crop_.ysize());
+      color = CopyImage(crop_in_color, color);
+    }
     const ColorEncoding& c =
         io->Context()->c_linear_srgb[io->dec_c_original.IsGray()];
     io->SetFromImage(std::move(color), c);
-  } else if (header.encoding == ImageEncoding::kLossless) {
-    io->SetFromImage(std::move(opsin), io->dec_c_original);
-    io->ShrinkTo(xsize, ysize);
-    multipass_handler->SetDecodedPass(io);
+  } else if (header_.encoding == ImageEncoding::kLossless) {
+    io->SetFromImage(std::move(opsin_), io->dec_c_original);
+    io->ShrinkTo(xsize_, ysize_);
+    multipass_handler_->SetDecodedPass(io);
+    if (is_cropped_) {
+      io->SetFromImage(CopyImage(crop_, io->color()), io->dec_c_original);
+    }
   } else {
     return PIK_FAILURE("Unsupported image encoding");
   }
 
-  if (header.has_alpha) {
-    io->SetAlpha(std::move(alpha),
-                 8 * container.metadata.transcoded.original_bytes_per_alpha);
+  if (header_.has_alpha) {
+    if (is_cropped_) {
+      const Rect crop_in_alpha(crop_.x0() - output_rect_.x0(),
+                               crop_.y0() - output_rect_.y0(), crop_.xsize(),
+                               crop_.ysize());
+      alpha_ = CopyImage(crop_in_alpha, alpha_);
+    }
+    io->SetAlpha(std::move(alpha_),
+                 8 * container_.metadata.transcoded.original_bytes_per_alpha);
   }
 
-  io->ShrinkTo(xsize, ysize);
+  io->ShrinkTo(crop_.xsize(), crop_.ysize());
 
   return true;
 }
 
+Status PassDecoder::DecodeAndFinish(const Span<const uint8_t> compressed,
+                                    ThreadPool* pool,
+                                    const InterleavedOutput* interleaved) {
+  std::vector<uint32_t> group_indices(NumGroups());
+  std::iota(group_indices.begin(), group_indices.end(), 0);
+
+  // Finalizing tiles early requires that Finish would not first modify the
+  // whole opsin_ image, nor need it afterwards. This excludes passes with
+  // adaptive reconstruction, i.e. those from default encoder settings.
+  TFGraphPtr finalize_graph;
+  if (header_.encoding == ImageEncoding::kPasses && !is_cropped_ &&
+      multipass_handler_->IsStandalonePass()) {
+    if (UsesInterleaved(interleaved)) {
+      finalize_graph =
+          MakeFinalizePassGraph(opsin_, header_, pool, *interleaved);
+    } else {
+      linear_ = Image3F(recon_rect_.xsize(), recon_rect_.ysize());
+      finalize_graph = MakeFinalizePassGraph(opsin_, header_, pool, &linear_);
+      if (finalize_graph == nullptr) linear_ = Image3F();
+    }
+  }
+
+  PIK_RETURN_IF_ERROR(RunGroups(compressed, group_indices.data(),
+                                group_indices.size(), pool,
+                                finalize_graph.get()));
+  is_finalized_ = finalize_graph != nullptr;
+  return Finish(pool, interleaved);
+}
+
+Status PikPassToPixels(const DecompressParams& dparams,
+                       const Span<const uint8_t> compressed,
+                       const FileHeader& container, ThreadPool* pool,
+                       BitReader* reader, CodecInOut* io, PikInfo* aux_out,
+                       MultipassManager* multipass_handler,
+                       const InterleavedOutput* interleaved) {
+  PROFILER_ZONE("PikPassToPixels uninstrumented");
+  PassDecoder decoder(dparams, container, io, aux_out, multipass_handler);
+  PIK_RETURN_IF_ERROR(decoder.ReadHeaders(compressed, reader));
+
+  // Pretend all groups are read.
+  reader->SkipBits((decoder.PassEnd() - reader->Position()) * kBitsPerByte);
+  if (reader->Position() > compressed.size()) {
+    return PIK_FAILURE("Group code extends after stream end");
+  }
+
+  return decoder.DecodeAndFinish(compressed, pool, interleaved);
+}
+
 }  // namespace pik
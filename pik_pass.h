@@ -7,7 +7,12 @@
 #ifndef PIK_PASS_H_
 #define PIK_PASS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
 #include "codec.h"
+#include "compressed_dc.h"
 #include "compressed_image.h"
 #include "data_parallel.h"
 #include "headers.h"
@@ -16,7 +21,9 @@
 #include "pik_info.h"
 #include "pik_params.h"
 #include "quantizer.h"
+#include "span.h"
 #include "status.h"
+#include "tile_flow.h"
 
 // Encode and decode a single pass of an image. A pass can be either a
 // decomposition of an image (eg. DC-only pass), or a frame in an animation.
@@ -29,23 +36,156 @@ struct PassParams {
   FrameInfo frame_info;
 };
 
+// Encoder state that depends only on the image and not on the distance.
+// Computing it once allows encoding the same image at several distances (e.g.
+// when searching for a target size) without repeating the color transform,
+// GaborishInverse and the color correlation search (and its DCT).
+struct PassEncImageCache {
+  // The pass parameters that the cached images depend on.
+  size_t resampling_factor2;
+  bool gaborish;
+
+  // Opsin image, downsampled according to resampling_factor2.
+  Image3F opsin_orig;
+  // opsin_orig padded to whole blocks, after GaborishInverse if enabled.
+  Image3F opsin;
+  // TransposedScaledDCT(opsin), shared by the heuristics of all encodes.
+  Image3F opsin_dct;
+  ColorCorrelationMap cmap;
+};
+
+// Fills `cache` for encoding `io` as the first pass with `params`.
+Status InitPassEncImageCache(const CompressParams& params, const CodecInOut* io,
+                             ThreadPool* pool, PassEncImageCache* cache);
+
 // These process each group in parallel.
 
 // Encodes an input image `io` in a byte stream, without adding a container.
 // `pos` represents the bit position in the output data that we should
-// start writing to.
+// start writing to. If not null, `image_cache` must have been initialized for
+// `io` with compatible `params` and replaces the distance-independent work of
+// the first pass.
 Status PixelsToPikPass(CompressParams params, const PassParams& pass_params,
                        const CodecInOut* io, ThreadPool* pool,
                        PaddedBytes* compressed, size_t& pos, PikInfo* aux_out,
-                       MultipassManager* multipass_manager);
+                       MultipassManager* multipass_manager,
+                       const PassEncImageCache* image_cache = nullptr);
+
+// Decodes one pass in stages, which allows decoding groups as soon as their
+// bytes are available (see PikStreamingDecoder). PikPassToPixels runs all
+// stages. The arguments to the constructor must outlive this object.
+class PassDecoder {
+ public:
+  PassDecoder(const DecompressParams& params, const FileHeader& container,
+              CodecInOut* io, PikInfo* aux_out,
+              MultipassManager* multipass_manager);
+
+  // Reads the pass header, quantizer, color map and the tables of contents of
+  // the DC and of the groups, starting at `reader`'s position within
+  // `compressed`, and leaves `reader` at the first group. The DC itself is
+  // decoded along with the first groups that need it.
+  Status ReadHeaders(const Span<const uint8_t> compressed, BitReader* reader);
+
+  // Valid after ReadHeaders. Byte ranges are relative to the file start.
+  size_t NumGroups() const { return group_offsets_.size() - 1; }
+  size_t GroupBegin(size_t group_index) const {
+    return group_codes_begin_ + group_offsets_[group_index];
+  }
+  size_t GroupEnd(size_t group_index) const {
+    return group_codes_begin_ + group_offsets_[group_index + 1];
+  }
+  size_t PassEnd() const { return group_codes_begin_ + group_offsets_.back(); }
+
+  // Decodes the listed groups and the DC groups they read, which are not yet
+  // decoded, in parallel. Each group starts as soon as its DC is ready rather
+  // than after all of the DC. `compressed` may differ from the span passed to
+  // ReadHeaders (e.g. after appending), but must contain the same bytes up to
+  // PassEnd(). Each group must be decoded once.
+  Status DecodeGroups(const Span<const uint8_t> compressed,
+                      const uint32_t* group_indices, size_t num_indices,
+                      ThreadPool* pool);
+
+  // Post-processes after all groups were decoded and stores the result in
+  // `io` (or `interleaved`, see PikPassToPixels).
+  Status Finish(ThreadPool* pool,
+                const InterleavedOutput* interleaved = nullptr);
+
+  // Equivalent to DecodeGroups for all groups followed by Finish, but if the
+  // post-processing allows, also finalizes each tile as soon as the groups
+  // around it are decoded.
+  Status DecodeAndFinish(const Span<const uint8_t> compressed,
+                         ThreadPool* pool,
+                         const InterleavedOutput* interleaved = nullptr);
+
+ private:
+  // Pixel rectangle of a group, clamped to the image.
+  Rect GroupRect(size_t group_index) const;
+
+  // Whether Finish writes to `interleaved` rather than `io`.
+  bool UsesInterleaved(const InterleavedOutput* interleaved) const {
+    return interleaved != nullptr &&
+           header_.encoding == ImageEncoding::kPasses && !is_cropped_ &&
+           interleaved->xsize == xsize_ && interleaved->ysize == ysize_;
+  }
+
+  // DecodeGroups, plus running the tiles of `finalize_graph` (if not null)
+  // once the groups they read are done.
+  Status RunGroups(const Span<const uint8_t> compressed,
+                   const uint32_t* group_indices, size_t num_indices,
+                   ThreadPool* pool, TFGraph* finalize_graph);
+
+  const DecompressParams& dparams_;
+  const FileHeader& container_;
+  CodecInOut* io_;
+  PikInfo* aux_out_;
+  MultipassManager* multipass_handler_;
+
+  const size_t xsize_;
+  const size_t ysize_;
+  const size_t padded_xsize_;
+  const size_t padded_ysize_;
+
+  PassHeader header_;
+  bool is_cropped_ = false;
+  Rect crop_;
+  Rect recon_rect_;   // Region of the image that influences crop_.
+  Rect output_rect_;  // Region of the image stored in opsin_ and alpha_.
+
+  std::vector<PikInfo> aux_outs_;
+  std::vector<MultipassHandler*> handlers_;
+  std::vector<uint8_t> is_group_needed_;
+  PassDecCache pass_dec_cache_;
+  ColorCorrelationMap cmap_;
+  Quantizer quantizer_;
+
+  DCDecoder dc_decoder_;
+  std::vector<uint8_t> is_dc_group_decoded_;
+  bool is_dc_finished_ = false;  // Gradient map applied.
+
+  std::vector<size_t> group_offsets_{0};  // Relative to group_codes_begin_.
+  size_t group_codes_begin_ = 0;
+
+  Image3F opsin_;
+  ImageU alpha_;
+
+  // Set by DecodeAndFinish if the tiles were already finalized, in which case
+  // linear_ holds the result (unless it was written to the interleaved
+  // output).
+  bool is_finalized_ = false;
+  Image3F linear_;
+};
 
 // Decodes an input image from a byte stream, using the provided container
 // information. See PikToPixels for explanation of `io` color space.
+// If `interleaved` is non-null (and matches the image size), lossy uncropped
+// passes are instead written there as sRGB (see PikToInterleaved), in which
+// case `io` receives the metadata but no pixels.
 Status PikPassToPixels(const DecompressParams& params,
-                       const PaddedBytes& compressed,
+                       const Span<const uint8_t> compressed,
                        const FileHeader& container, ThreadPool* pool,
                        BitReader* reader, CodecInOut* io, PikInfo* aux_out,
-                       MultipassManager* multipass_manager);
+                       MultipassManager* multipass_manager,
+                       const InterleavedOutput* interleaved = nullptr);
 
 }  // namespace pik
 
@@ -0,0 +1,171 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "pik_streaming.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "bit_reader.h"
+#include "common.h"
+#include "image_allocator.h"
+#include "profiler.h"
+#include "span.h"
+
+namespace pik {
+namespace {
+
+// After an unsuccessful attempt to parse the headers of a pass, wait for at
+// least this many (or a quarter of the buffered) bytes before retrying.
+constexpr size_t kMinRetryBytes = 1024;
+
+}  // namespace
+
+PikStreamingDecoder::PikStreamingDecoder(const DecompressParams& params,
+                                         CodecInOut* io, ThreadPool* pool,
+                                         PikInfo* aux_out)
+    : params_(params), io_(io), pool_(pool), aux_out_(aux_out) {}
+
+Status PikStreamingDecoder::Append(const uint8_t* bytes, const size_t size) {
+  if (failed_) return PIK_FAILURE("Stream already failed");
+  const size_t old_size = buffer_.size();
+  // Grow geometrically so that appending many small chunks does not copy the
+  // buffered stream each time.
+  if (old_size + size > buffer_.capacity()) {
+    buffer_.reserve(std::max(old_size + size, buffer_.capacity() * 3 / 2));
+  }
+  // A failed reserve discards the buffer (capacity becomes zero).
+  if (buffer_.capacity() >= old_size + size) buffer_.resize(old_size + size);
+  if (buffer_.size() != old_size + size || buffer_.data() == nullptr) {
+    failed_ = true;
+    return PIK_FAILURE("Failed to grow stream buffer");
+  }
+  if (size != 0) memcpy(buffer_.data() + old_size, bytes, size);
+  return Advance(/*is_final=*/false);
+}
+
+Status PikStreamingDecoder::Finish() {
+  if (failed_) return PIK_FAILURE("Stream already failed");
+  PIK_RETURN_IF_ERROR(Advance(/*is_final=*/true));
+  if (state_ != State::kDone) {
+    failed_ = true;
+    return PIK_FAILURE("Stream ended before the last pass");
+  }
+  // pass_begin_bits_ is now the (byte-aligned) end of the last pass.
+  if (params_.check_decompressed_size &&
+      pass_begin_bits_ / kBitsPerByte != buffer_.size()) {
+    failed_ = true;
+    return PIK_FAILURE("Pik compressed data size mismatch.");
+  }
+  io_->enc_size = buffer_.size();
+  return true;
+}
+
+Status PikStreamingDecoder::Advance(const bool is_final) {
+  PROFILER_FUNC;
+  // As in PikToPixels, pass-level images are recycled across decodes.
+  ImageAllocatorScope allocator_scope(io_->Context()->image_pool.get());
+
+  for (;;) {
+    const State state = state_;
+    const size_t num_groups_ready = num_groups_ready_;
+    Status ok = true;
+    switch (state) {
+      case State::kFileHeader:
+        ok = ParseFileHeader(is_final);
+        break;
+      case State::kPassHeaders:
+        ok = ParsePassHeaders(is_final);
+        break;
+      case State::kGroups:
+        ok = DecodeReadyGroups();
+        break;
+      case State::kDone:
+        return true;
+    }
+    if (!ok) {
+      failed_ = true;
+      return false;
+    }
+    // No progress: wait for more data.
+    if (state_ == state && num_groups_ready_ == num_groups_ready) break;
+  }
+  return true;
+}
+
+Status PikStreamingDecoder::ParseFileHeader(const bool is_final) {
+  BitReader reader(buffer_.data(), buffer_.size());
+  const Status ok = pik::ReadFileHeader(&reader, &container_);
+  // Reading past the end yields zeros, which may or may not be a valid
+  // header. Either way, the header is incomplete.
+  if (!reader.Healthy()) {
+    if (is_final) return PIK_FAILURE("Truncated file header");
+    return true;
+  }
+  PIK_RETURN_IF_ERROR(ok);
+
+  // The preview is discardable; skip it, as does PikToPixels.
+  pass_begin_bits_ = reader.BitsRead() + container_.preview.size_bits;
+  state_ = State::kPassHeaders;
+  return true;
+}
+
+Status PikStreamingDecoder::ParsePassHeaders(const bool is_final) {
+  if (!is_final && buffer_.size() < min_size_for_retry_) return true;
+  PROFILER_FUNC;
+
+  // Each attempt starts from scratch because ReadHeaders is not resumable.
+  BitReader reader(buffer_.data(), buffer_.size());
+  reader.SkipBits(pass_begin_bits_);
+  std::unique_ptr<PassDecoder> pass(
+      new PassDecoder(params_, container_, io_, aux_out_, &transform_));
+  const Status ok = pass->ReadHeaders(buffer_, &reader);
+  if (!reader.Healthy()) {
+    if (is_final) return PIK_FAILURE("Truncated pass header or DC");
+    min_size_for_retry_ =
+        buffer_.size() + std::max(buffer_.size() / 4, kMinRetryBytes);
+    return true;
+  }
+  PIK_RETURN_IF_ERROR(ok);
+
+  pass_ = std::move(pass);
+  groups_ready_.assign(pass_->NumGroups(), 0);
+  num_groups_ready_ = 0;
+  state_ = State::kGroups;
+  return true;
+}
+
+Status PikStreamingDecoder::DecodeReadyGroups() {
+  std::vector<uint32_t> group_indices;
+  for (size_t group_index = 0; group_index < groups_ready_.size();
+       ++group_index) {
+    if (!groups_ready_[group_index] &&
+        pass_->GroupEnd(group_index) <= buffer_.size()) {
+      group_indices.push_back(group_index);
+    }
+  }
+  if (!group_indices.empty()) {
+    PIK_RETURN_IF_ERROR(pass_->DecodeGroups(buffer_, group_indices.data(),
+                                            group_indices.size(), pool_));
+    for (const uint32_t group_index : group_indices) {
+      groups_ready_[group_index] = 1;
+    }
+    num_groups_ready_ += group_indices.size();
+  }
+  if (num_groups_ready_ != groups_ready_.size()) return true;
+
+  PIK_RETURN_IF_ERROR(pass_->Finish(pool_));
+  ++num_passes_done_;
+  pass_begin_bits_ = pass_->PassEnd() * kBitsPerByte;
+  pass_.reset();
+  groups_ready_.clear();
+  num_groups_ready_ = 0;
+  min_size_for_retry_ = 0;
+  state_ = transform_.IsLastPass() ? State::kDone : State::kPassHeaders;
+  return true;
+}
+
+}  // namespace pik
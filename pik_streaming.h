@@ -0,0 +1,106 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef PIK_STREAMING_H_
+#define PIK_STREAMING_H_
+
+// Push-style decoding of a PIK bitstream that arrives in pieces (e.g. from the
+// network), which overlaps transfer with decoding.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "codec.h"
+#include "data_parallel.h"
+#include "headers.h"
+#include "padded_bytes.h"
+#include "pik_info.h"
+#include "pik_params.h"
+#include "pik_pass.h"
+#include "single_image_handler.h"
+#include "status.h"
+
+namespace pik {
+
+// Decodes the file header, the headers of each pass, and each group (with the
+// DC it needs) as soon as the bytes described by the table of contents have
+// been appended.
+// The result is identical to PikToPixels of the concatenated input. Brunsli
+// files are not supported. Not thread-safe, but uses `pool` internally.
+//
+// Usage: call Append for each chunk (possibly querying progress in between),
+// then Finish once the input is complete.
+class PikStreamingDecoder {
+ public:
+  // None of the pointers are owned; they must outlive this object. `pool` and
+  // `aux_out` may be null.
+  PikStreamingDecoder(const DecompressParams& params, CodecInOut* io,
+                      ThreadPool* pool = nullptr, PikInfo* aux_out = nullptr);
+
+  // Appends the next `size` bytes of the stream and decodes everything that
+  // has become available. Returns false if the stream is invalid; once that
+  // happens, all subsequent calls also fail.
+  Status Append(const uint8_t* bytes, size_t size);
+
+  // Signals the end of input. Returns false if the stream was incomplete or
+  // invalid. Afterwards, `io` holds the decoded image.
+  Status Finish();
+
+  // Number of passes whose result has been stored in `io`.
+  size_t NumPassesDone() const { return num_passes_done_; }
+
+  // Whether the header and tables of contents of the current pass have been
+  // decoded. If so, NumGroups and GroupsReady refer to this pass.
+  bool HasHeaders() const { return state_ == State::kGroups; }
+
+  size_t NumGroups() const { return HasHeaders() ? pass_->NumGroups() : 0; }
+
+  // Per group of the current pass: nonzero if it has been decoded.
+  const std::vector<uint8_t>& GroupsReady() const { return groups_ready_; }
+
+  // Whether all passes have been decoded (Finish may still reject trailing
+  // bytes).
+  bool IsDone() const { return state_ == State::kDone; }
+
+ private:
+  enum class State { kFileHeader, kPassHeaders, kGroups, kDone };
+
+  // Makes as much progress as the buffered bytes allow. If `is_final`, the
+  // input is complete and lack of data is an error.
+  Status Advance(bool is_final);
+
+  Status ParseFileHeader(bool is_final);
+  Status ParsePassHeaders(bool is_final);
+  Status DecodeReadyGroups();
+
+  const DecompressParams params_;
+  CodecInOut* io_;
+  ThreadPool* pool_;
+  PikInfo* aux_out_;
+
+  PaddedBytes buffer_;
+  State state_ = State::kFileHeader;
+  bool failed_ = false;
+
+  FileHeader container_;
+  SingleImageManager transform_;
+  // Bit offset of the current pass within buffer_.
+  size_t pass_begin_bits_ = 0;
+  // Header parsing is retried once buffer_ reaches this size, which avoids
+  // quadratic cost when the DC arrives in many small chunks.
+  size_t min_size_for_retry_ = 0;
+
+  std::unique_ptr<PassDecoder> pass_;
+  std::vector<uint8_t> groups_ready_;
+  size_t num_groups_ready_ = 0;
+  size_t num_passes_done_ = 0;
+};
+
+}  // namespace pik
+
+#endif  // PIK_STREAMING_H_
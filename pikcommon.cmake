@@ -9,8 +9,10 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/simd/targets.h
   ${CMAKE_CURRENT_LIST_DIR}/ac_predictions.cc
   ${CMAKE_CURRENT_LIST_DIR}/ac_predictions.h
+  ${CMAKE_CURRENT_LIST_DIR}/ac_predictions_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/ac_strategy.cc
   ${CMAKE_CURRENT_LIST_DIR}/ac_strategy.h
+  ${CMAKE_CURRENT_LIST_DIR}/ac_strategy_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/adaptive_quantization.cc
   ${CMAKE_CURRENT_LIST_DIR}/adaptive_quantization.h
   ${CMAKE_CURRENT_LIST_DIR}/adaptive_reconstruction.cc
@@ -36,6 +38,7 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/brotli.h
   ${CMAKE_CURRENT_LIST_DIR}/butteraugli/butteraugli.cc
   ${CMAKE_CURRENT_LIST_DIR}/butteraugli/butteraugli.h
+  ${CMAKE_CURRENT_LIST_DIR}/butteraugli/butteraugli_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/butteraugli_comparator.cc
   ${CMAKE_CURRENT_LIST_DIR}/butteraugli_comparator.h
   ${CMAKE_CURRENT_LIST_DIR}/butteraugli_distance.cc
@@ -62,6 +65,7 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/compressed_image.cc
   ${CMAKE_CURRENT_LIST_DIR}/compressed_image_fwd.h
   ${CMAKE_CURRENT_LIST_DIR}/compressed_image.h
+  ${CMAKE_CURRENT_LIST_DIR}/compressed_image_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/context_map_decode.cc
   ${CMAKE_CURRENT_LIST_DIR}/context_map_decode.h
   ${CMAKE_CURRENT_LIST_DIR}/context_map_encode.cc
@@ -71,6 +75,7 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/data_parallel.h
   ${CMAKE_CURRENT_LIST_DIR}/dc_predictor.cc
   ${CMAKE_CURRENT_LIST_DIR}/dc_predictor.h
+  ${CMAKE_CURRENT_LIST_DIR}/dc_predictor_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/dct.cc
   ${CMAKE_CURRENT_LIST_DIR}/dct.h
   ${CMAKE_CURRENT_LIST_DIR}/dct_simd_4.h
@@ -78,6 +83,7 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/dct_simd_any.h
   ${CMAKE_CURRENT_LIST_DIR}/dct_util.cc
   ${CMAKE_CURRENT_LIST_DIR}/dct_util.h
+  ${CMAKE_CURRENT_LIST_DIR}/dct_util_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/decode_and_encode.cc
   ${CMAKE_CURRENT_LIST_DIR}/deconvolve.cc
   ${CMAKE_CURRENT_LIST_DIR}/deconvolve.h
@@ -98,6 +104,7 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/file_io.h
   ${CMAKE_CURRENT_LIST_DIR}/gaborish.cc
   ${CMAKE_CURRENT_LIST_DIR}/gaborish.h
+  ${CMAKE_CURRENT_LIST_DIR}/gaborish_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/gamma_correct.h
   ${CMAKE_CURRENT_LIST_DIR}/gauss_blur.cc
   ${CMAKE_CURRENT_LIST_DIR}/gauss_blur.h
@@ -111,6 +118,8 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/huffman_encode.h
   ${CMAKE_CURRENT_LIST_DIR}/image.cc
   ${CMAKE_CURRENT_LIST_DIR}/image.h
+  ${CMAKE_CURRENT_LIST_DIR}/image_allocator.cc
+  ${CMAKE_CURRENT_LIST_DIR}/image_allocator.h
   ${CMAKE_CURRENT_LIST_DIR}/image_io.cc
   ${CMAKE_CURRENT_LIST_DIR}/image_io.h
   ${CMAKE_CURRENT_LIST_DIR}/lehmer_code.cc
@@ -130,8 +139,10 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/noise.h
   ${CMAKE_CURRENT_LIST_DIR}/opsin_image.cc
   ${CMAKE_CURRENT_LIST_DIR}/opsin_image.h
+  ${CMAKE_CURRENT_LIST_DIR}/opsin_image_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/opsin_inverse.cc
   ${CMAKE_CURRENT_LIST_DIR}/opsin_inverse.h
+  ${CMAKE_CURRENT_LIST_DIR}/opsin_inverse_target.cc
   ${CMAKE_CURRENT_LIST_DIR}/opsin_params.cc
   ${CMAKE_CURRENT_LIST_DIR}/opsin_params.h
   ${CMAKE_CURRENT_LIST_DIR}/optimize.h
@@ -148,7 +159,10 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/pik_params.h
   ${CMAKE_CURRENT_LIST_DIR}/pik_pass.cc
   ${CMAKE_CURRENT_LIST_DIR}/pik_pass.h
+  ${CMAKE_CURRENT_LIST_DIR}/pik_streaming.cc
+  ${CMAKE_CURRENT_LIST_DIR}/pik_streaming.h
   ${CMAKE_CURRENT_LIST_DIR}/profiler.h
+  ${CMAKE_CURRENT_LIST_DIR}/quant_bias.h
   ${CMAKE_CURRENT_LIST_DIR}/quantizer.cc
   ${CMAKE_CURRENT_LIST_DIR}/quantizer.h
   ${CMAKE_CURRENT_LIST_DIR}/quant_weights.cc
@@ -161,9 +175,11 @@ add_library(pikcommon STATIC
   ${CMAKE_CURRENT_LIST_DIR}/single_image_handler.cc
   ${CMAKE_CURRENT_LIST_DIR}/single_image_handler.h
   ${CMAKE_CURRENT_LIST_DIR}/size_coder.h
+  ${CMAKE_CURRENT_LIST_DIR}/span.h
   ${CMAKE_CURRENT_LIST_DIR}/status.h
   ${CMAKE_CURRENT_LIST_DIR}/tile_flow.cc
   ${CMAKE_CURRENT_LIST_DIR}/tile_flow.h
+  ${CMAKE_CURRENT_LIST_DIR}/transfer_functions.h
   ${CMAKE_CURRENT_LIST_DIR}/tsc_timer.h
   ${CMAKE_CURRENT_LIST_DIR}/upscaler.cc
   ${CMAKE_CURRENT_LIST_DIR}/upscaler.h
@@ -174,7 +190,15 @@ add_library(pikcommon STATIC
 
 target_include_directories(pikcommon
     PUBLIC "${CMAKE_CURRENT_LIST_DIR}" "${CMAKE_CURRENT_SOURCE_DIR}")
-target_compile_options(pikcommon PUBLIC -mavx2)
+# Baseline matching the static SIMD target; faster code paths are selected at
+# runtime (see simd/foreach_target.h), so do not raise this.
+target_compile_options(pikcommon PUBLIC -msse4.2)
+
+# Records PROFILER_ZONE timings, e.g. for the pik_benchmark stage columns.
+option(PIK_ENABLE_PROFILER "Enable the zone profiler (profiler.h)" OFF)
+if (PIK_ENABLE_PROFILER)
+  target_compile_definitions(pikcommon PUBLIC PROFILER_ENABLED=1)
+endif ()
 
 target_link_libraries(pikcommon PRIVATE
   brotlicommon-static
@@ -32,8 +32,21 @@
 #define PROFILER_THREAD_STORAGE 16ULL
 #endif
 
-// Temporarily disabled.
-#if PROFILER_ENABLED && 0
+#include <stdint.h>
+#include <vector>
+
+namespace pik {
+
+// Total self time of one zone, summed over all threads.
+struct ProfilerZoneTotal {
+  const char* name;  // string literal passed to PROFILER_ZONE
+  uint64_t num_calls;
+  uint64_t total_duration;  // [CPU cycles]
+};
+
+}  // namespace pik
+
+#if PROFILER_ENABLED
 
 #define PROFILER_PRINT_OVERHEAD 0
 
@@ -273,6 +286,18 @@ class Results {
     printf("Total clocks measured: %" PRIu64 "\n", total_visible_duration);
   }
 
+  // Single-threaded. Appends all visible zones to "totals" (unsorted).
+  void GetTotals(std::vector<ProfilerZoneTotal>* totals) {
+    MergeDuplicates();
+    const char* string_origin = StringOrigin();
+    for (size_t i = 0; i < num_zones_; ++i) {
+      const Accumulator& r = zones_[i];
+      const char* name = string_origin + r.BiasedOffset();
+      if (name[0] == '@') continue;
+      totals->push_back({name, r.NumCalls(), r.total_duration});
+    }
+  }
+
   // Single-threaded. Clears all results as if no zones had been recorded.
   void Reset() {
     analyze_elapsed_ = 0;
@@ -531,26 +556,45 @@ class ThreadList {
 
   // Single-threaded.
   void PrintResults() {
+    Results* results = CombineResults();
+    if (results != nullptr) {
+      results->Print();
+      ResetResults();
+    }
+  }
+
+  // Single-threaded. Like PrintResults, but returns the zones in "totals".
+  void GetResults(std::vector<ProfilerZoneTotal>* totals) {
+    totals->clear();
+    Results* results = CombineResults();
+    if (results != nullptr) {
+      results->GetTotals(totals);
+      ResetResults();
+    }
+  }
+
+ private:
+  // Returns all threads' results combined into the first one, or null if no
+  // thread has entered a zone.
+  Results* CombineResults() {
     const uint32_t num_threads = num_threads_.load(std::memory_order_relaxed);
     for (uint32_t i = 0; i < num_threads; ++i) {
       threads_[i]->AnalyzeRemainingPackets();
     }
 
-    // Combine all threads into a single Result.
     for (uint32_t i = 1; i < num_threads; ++i) {
       threads_[0]->GetResults().Assimilate(threads_[i]->GetResults());
     }
+    return num_threads == 0 ? nullptr : &threads_[0]->GetResults();
+  }
 
-    if (num_threads != 0) {
-      threads_[0]->GetResults().Print();
-
-      for (uint32_t i = 0; i < num_threads; ++i) {
-        threads_[i]->GetResults().Reset();
-      }
+  void ResetResults() {
+    const uint32_t num_threads = num_threads_.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < num_threads; ++i) {
+      threads_[i]->GetResults().Reset();
     }
   }
 
- private:
   // Owning pointers.
   alignas(64) ThreadSpecific* threads_[kMaxThreads];
   std::atomic<uint32_t> num_threads_{0};
@@ -589,6 +633,11 @@ class Zone {
   // Call exactly once after all threads have exited all zones.
   static void PrintResults() { Threads().PrintResults(); }
 
+  // Same requirements as PrintResults.
+  static void GetResults(std::vector<ProfilerZoneTotal>* totals) {
+    Threads().GetResults(totals);
+  }
+
  private:
   // Returns reference to the thread's ThreadSpecific pointer (initially null).
   // Function-local static avoids needing a separate definition.
@@ -621,6 +670,9 @@ class Zone {
 
 #define PROFILER_PRINT_RESULTS Zone::PrintResults
 
+// Stores the results in a std::vector<ProfilerZoneTotal>* instead of printing.
+#define PROFILER_GET_RESULTS Zone::GetResults
+
 inline void ThreadSpecific::ComputeOverhead() {
   // Delay after capturing timestamps before/after the actual zone runs. Even
   // with frequency throttling disabled, this has a multimodal distribution,
@@ -710,6 +762,7 @@ inline void ThreadSpecific::ComputeOverhead() {
 #define PROFILER_ZONE(name)
 #define PROFILER_FUNC
 #define PROFILER_PRINT_RESULTS()
+#define PROFILER_GET_RESULTS(totals) (totals)->clear()
 #endif
 
 #endif  // PROFILER_H_
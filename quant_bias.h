@@ -0,0 +1,82 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef QUANT_BIAS_H_
+#define QUANT_BIAS_H_
+
+// Reconstruction of quantized AC coefficients.
+
+#include <stdint.h>
+
+#include "compiler_specific.h"
+#include "simd/simd.h"
+
+namespace pik {
+
+// Quantization biases.
+// The residuals of AC coefficients that we quantize are not uniformly
+// distributed. Numerical experiments show that they have a distribution with
+// the "shape" of 1/(1+x^2) [up to some coefficients]. This means that the
+// expected value of a coefficient that gets quantized to x will not be x
+// itself, but (at least with reasonable approximation):
+// - 0 if x is 0
+// - x * (1 - kOneBias[c]) if x is 1 or -1
+// - x - kBiasNumerator/x otherwise
+// This follows from computing the distribution of the quantization bias, which
+// can be approximated fairly well by <constant>/x when |x| is at least two. If
+// |x| is 1, kZeroBias creates a different bias for each channel, thus we look
+// it up in the kOneBias LUT.
+static constexpr float kOneBias[3] = {
+    0.05465007330715401f, 0.07005449891748593f, 0.049935103337343655f};
+static constexpr float kBiasNumerator = 0.145f;
+
+// Returns adjusted version of a quantized integer, such that its value is
+// closer to the expected value of the original (see comment above).
+template <int c>
+PIK_INLINE float AdjustQuantBias(int16_t quant) {
+  if (quant == 0) return 0;
+  if (quant == 1) return 1 - kOneBias[c];
+  if (quant == -1) return kOneBias[c] - 1;
+  return quant - kBiasNumerator / quant;
+}
+
+}  // namespace pik
+
+#endif  // QUANT_BIAS_H_
+
+// The SIMD version is compiled for every target if included from a
+// foreach_target.h file (the dequantizer is dispatched at runtime).
+#if defined(QUANT_BIAS_TARGET_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef QUANT_BIAS_TARGET_H_
+#undef QUANT_BIAS_TARGET_H_
+#else
+#define QUANT_BIAS_TARGET_H_
+#endif
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+
+// SIMD version of the method above.
+template <int c>
+SIMD_ATTR PIK_INLINE SIMD_FULL(float)::V
+    AdjustQuantBias(const SIMD_FULL(float)::V quant) {
+  SIMD_FULL(float) df;
+  SIMD_FULL(uint32_t) du;
+  const auto quant_sign = quant & cast_to(df, set1(du, 0x80000000u));
+  const auto quant_abs = andnot(quant_sign, quant);
+  const auto quant_one = select(quant, set1(df, 1 - kOneBias[c]) ^ quant_sign,
+                                quant_abs >= set1(df, 0.5f));
+  const auto quant_minus_inv = quant - set1(df, kBiasNumerator) / quant;
+  return select(quant_one, quant_minus_inv, quant_abs >= set1(df, 1.5f));
+}
+
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
+}  // namespace pik
+
+#endif  // QUANT_BIAS_TARGET_H_
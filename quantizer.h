@@ -20,8 +20,10 @@
 #include "image.h"
 #include "linalg.h"
 #include "pik_info.h"
+#include "quant_bias.h"
 #include "robust_statistics.h"
 #include "simd/simd.h"
+#include "write_bits.h"
 
 // Quantizes DC and AC coefficients, with separate quantization tables according
 // to the quant_kind (which is currently computed from the AC strategy and the
@@ -38,47 +40,6 @@ static const int kQuantDefault = 0;
 // zero-biases for quantizing channels X, Y, B
 static constexpr float kZeroBiasDefault[3] = {0.65f, 0.6f, 0.7f};
 
-// Quantization biases.
-// The residuals of AC coefficients that we quantize are not uniformly
-// distributed. Numerical experiments show that they have a distribution with
-// the "shape" of 1/(1+x^2) [up to some coefficients]. This means that the
-// expected value of a coefficient that gets quantized to x will not be x
-// itself, but (at least with reasonable approximation):
-// - 0 if x is 0
-// - x * (1 - kOneBias[c]) if x is 1 or -1
-// - x - kBiasNumerator/x otherwise
-// This follows from computing the distribution of the quantization bias, which
-// can be approximated fairly well by <constant>/x when |x| is at least two. If
-// |x| is 1, kZeroBias creates a different bias for each channel, thus we look
-// it up in the kOneBias LUT.
-static constexpr float kOneBias[3] = {
-    0.05465007330715401f, 0.07005449891748593f, 0.049935103337343655f};
-static constexpr float kBiasNumerator = 0.145f;
-
-// Returns adjusted version of a quantized integer, such that its value is
-// closer to the expected value of the original (see comment above).
-template <int c>
-PIK_INLINE float AdjustQuantBias(int16_t quant) {
-  if (quant == 0) return 0;
-  if (quant == 1) return 1 - kOneBias[c];
-  if (quant == -1) return kOneBias[c] - 1;
-  return quant - kBiasNumerator / quant;
-}
-
-// SIMD version of the method above.
-template <int c>
-SIMD_ATTR PIK_INLINE SIMD_FULL(float)::V
-    AdjustQuantBias(const SIMD_FULL(float)::V quant) {
-  SIMD_FULL(float) df;
-  SIMD_FULL(uint32_t) du;
-  const auto quant_sign = quant & cast_to(df, set1(du, 0x80000000u));
-  const auto quant_abs = andnot(quant_sign, quant);
-  const auto quant_one = select(quant, set1(df, 1 - kOneBias[c]) ^ quant_sign,
-                                quant_abs >= set1(df, 0.5f));
-  const auto quant_minus_inv = quant - set1(df, kBiasNumerator) / quant;
-  return select(quant_one, quant_minus_inv, quant_abs >= set1(df, 1.5f));
-}
-
 // ac_strategy.h GetQuantKind static_asserts these values remain unchanged.
 enum QuantKinds {
   kQuantKindDCT8 = 0,
@@ -293,9 +254,9 @@ class Quantizer {
 
   const float* DequantMatrix(int c, size_t quant_kind) const;
 
-  void QuantizeBlockAC(int32_t quant, size_t quant_kind, int c,
-                       const float* PIK_RESTRICT block_in,
-                       int16_t* PIK_RESTRICT block_out) const {
+  SIMD_ATTR void QuantizeBlockAC(int32_t quant, size_t quant_kind, int c,
+                                 const float* PIK_RESTRICT block_in,
+                                 int16_t* PIK_RESTRICT block_out) const {
     const size_t n = block_dim_;
     const size_t block_size = n * n;
     const float* PIK_RESTRICT bq = GetBlockQuantizer(quant, quant_kind);
@@ -390,7 +351,7 @@ class Quantizer {
     return std::round(dc * dc_quant_[c]);
   }
 
-  std::string Encode(PikImageSizeInfo* info) const;
+  void Encode(BitWriter* writer, PikImageSizeInfo* info) const;
 
   bool Decode(BitReader* br);
 
@@ -4,15 +4,43 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
-#ifndef RATIONAL_POLYNOMIAL_H_
+#if defined(RATIONAL_POLYNOMIAL_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef RATIONAL_POLYNOMIAL_H_
+#undef RATIONAL_POLYNOMIAL_H_
+#else
 #define RATIONAL_POLYNOMIAL_H_
+#endif
 
 // Fast SIMD evaluation of rational polynomials for approximating functions.
+// Compiled for every target if included from a foreach_target.h file.
 
 #include "compiler_specific.h"
 #include "simd/simd.h"
 
 namespace pik {
+namespace SIMD_NAMESPACE {
+
+// One Newton-Raphson iteration.
+template <class V>
+SIMD_ATTR PIK_INLINE V ReciprocalNR(const V x) {
+  const auto rcp = approximate_reciprocal(x);
+  const auto sum = rcp + rcp;
+  const auto x_rcp = x * rcp;
+  return nmul_add(x_rcp, rcp, sum);
+}
+
+// Primary template: default to actual division.
+template <typename T, class V>
+struct FastDivision {
+  SIMD_ATTR V operator()(const V n, const V d) const { return n / d; }
+};
+// Partial specialization for float vectors.
+template <class V>
+struct FastDivision<float, V> {
+  SIMD_ATTR V operator()(const V n, const V d) const {
+    return n * ReciprocalNR(d);
+  }
+};
 
 // Approximates smooth functions via rational polynomials (i.e. dividing two
 // polynomials). Supports V = SIMD or Scalar<T> inputs.
@@ -243,6 +271,10 @@ SIMD_ATTR void EvalRationalPolynomialTriple(const V x0, const V x1, const V x2,
   *y2 = FastDivision<T, V>()(yp2, yq2);
 }
 
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
 }  // namespace pik
 
 #endif  // RATIONAL_POLYNOMIAL_H_
@@ -13,8 +13,6 @@
 #include <atomic>
 #include <cmath>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "data_parallel.h"
 #include "image.h"
 #include "profiler.h"
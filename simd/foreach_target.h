@@ -5,38 +5,116 @@
 // https://opensource.org/licenses/MIT.
 
 // Includes a specified file for every enabled SIMD_TARGET. This is used to
-// generate template instantiations to be called via runtime dispatche.
+// generate template instantiations to be called via runtime dispatch.
+// Include this header at most once per translation unit, after all others.
+//
+// The specified file may also #include headers whose code depends on
+// SIMD_TARGET (e.g. dct.h), which are then compiled once per target. Instead
+// of a normal include guard, such "per-target" headers begin with
+//
+//   #if defined(FOO_H_) == defined(SIMD_TARGET_TOGGLE)
+//   #ifdef FOO_H_
+//   #undef FOO_H_
+//   #else
+//   #define FOO_H_
+//   #endif
+//
+// and wrap their definitions in namespace SIMD_NAMESPACE, followed by
+// "using namespace SIMD_NAMESPACE" #ifndef SIMD_ATTR_IMPL. Flipping
+// SIMD_TARGET_TOGGLE after each target re-arms all headers included for the
+// previous target. The static target comes first, so a normal include of the
+// header before this one counts as its static-target inclusion, and ordinary
+// code finds its definitions via the using-directive. Argument-dependent
+// lookup ignores using-directives, so templates taking vectors (which live in
+// the enclosing namespace) are not ambiguous between targets. To keep all
+// guards in sync, the file must include these headers for every target.
 
 #ifndef SIMD_ATTR_IMPL
 #error "Must set SIMD_ATTR_IMPL to name of include file"
 #endif
 
-#if SIMD_ENABLE & SIMD_AVX2
+#ifndef SIMD_STATIC_TARGET
+#error "Must include simd/simd.h before foreach_target.h"
+#endif
+
+#undef SIMD_TARGET
+#define SIMD_TARGET SIMD_STATIC_TARGET
+#include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
+
+#if (SIMD_ENABLE & SIMD_AVX2) && (SIMD_STATIC_VALUE != SIMD_AVX2)
 #undef SIMD_TARGET
 #define SIMD_TARGET AVX2
 #include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
+#endif
+
+// After AVX2 so that AVX512 specializations may forward to AVX2 ones.
+#if SIMD_ENABLE & SIMD_AVX512
+#undef SIMD_TARGET
+#define SIMD_TARGET AVX512
+#include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
 #endif
 
-#if SIMD_ENABLE & SIMD_SSE4
+#if (SIMD_ENABLE & SIMD_SSE4) && (SIMD_STATIC_VALUE != SIMD_SSE4)
 #undef SIMD_TARGET
 #define SIMD_TARGET SSE4
 #include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
 #endif
 
-#if SIMD_ENABLE & SIMD_PPC8
+#if (SIMD_ENABLE & SIMD_PPC8) && (SIMD_STATIC_VALUE != SIMD_PPC8)
 #undef SIMD_TARGET
 #define SIMD_TARGET PPC8
 #include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
 #endif
 
-#if SIMD_ENABLE & SIMD_ARM8
+#if (SIMD_ENABLE & SIMD_ARM8) && (SIMD_STATIC_VALUE != SIMD_ARM8)
 #undef SIMD_TARGET
 #define SIMD_TARGET ARM8
 #include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
 #endif
 
+#if SIMD_STATIC_VALUE != SIMD_NONE
 #undef SIMD_TARGET
 #define SIMD_TARGET NONE
 #include SIMD_ATTR_IMPL
+#ifdef SIMD_TARGET_TOGGLE
+#undef SIMD_TARGET_TOGGLE
+#else
+#define SIMD_TARGET_TOGGLE
+#endif
+#endif
+
+// Any code after this header is again compiled for the static target.
+#undef SIMD_TARGET
+#define SIMD_TARGET SIMD_STATIC_TARGET
 
 #undef SIMD_ATTR_IMPL
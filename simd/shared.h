@@ -13,8 +13,8 @@
 #include <atomic>
 
 // Ensures an array is aligned and suitable for load()/store() functions.
-// Example: SIMD_ALIGN T lanes[d.N];
-#define SIMD_ALIGN alignas(32)
+// Example: SIMD_ALIGN T lanes[d.N]; 64 bytes suffice for AVX-512 vectors.
+#define SIMD_ALIGN alignas(64)
 
 // 4 instances of a given literal value, useful as input to load_dup128.
 #define SIMD_REP4(literal) literal, literal, literal, literal
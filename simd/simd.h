@@ -7,7 +7,7 @@
 #ifndef SIMD_SIMD_H_
 #define SIMD_SIMD_H_
 
-// Performance-portable SIMD API for SSE4/AVX2/ARMv8, later AVX-512 and POWER8.
+// Performance-portable SIMD API for SSE4/AVX2/AVX-512/ARMv8, later POWER8.
 // Each operation is efficient on all platforms.
 
 #include <stddef.h>  // size_t
@@ -18,6 +18,7 @@
 #include "simd/arm64_neon.h"
 #include "simd/scalar.h"
 #include "simd/x86_avx2.h"
+#include "simd/x86_avx512.h"
 #include "simd/x86_sse4.h"
 
 #if SIMD_ARCH == SIMD_ARCH_X86 && SIMD_ENABLE == SIMD_NONE
@@ -39,31 +40,12 @@
 // Which target is active, e.g. #if SIMD_TARGET_VALUE == SIMD_AVX2
 #define SIMD_TARGET_VALUE SIMD_CONCAT(SIMD_, SIMD_TARGET)
 
+// Target of code outside foreach_target.h, e.g. SIMD_STATIC_VALUE == SIMD_SSE4
+#define SIMD_STATIC_VALUE SIMD_CONCAT(SIMD_, SIMD_STATIC_TARGET)
+
 // Functions common to multiple targets:
 namespace pik {
 
-// One Newton-Raphson iteration.
-template <class V>
-static SIMD_ATTR SIMD_INLINE V ReciprocalNR(const V x) {
-  const auto rcp = approximate_reciprocal(x);
-  const auto sum = rcp + rcp;
-  const auto x_rcp = x * rcp;
-  return nmul_add(x_rcp, rcp, sum);
-}
-
-// Primary template: default to actual division.
-template <typename T, class V>
-struct FastDivision {
-  SIMD_ATTR V operator()(const V n, const V d) const { return n / d; }
-};
-// Partial specialization for float vectors.
-template <class V>
-struct FastDivision<float, V> {
-  SIMD_ATTR V operator()(const V n, const V d) const {
-    return n * ReciprocalNR(d);
-  }
-};
-
 // Returns a name for the vector/part/scalar. The type prefix is u/i/f for
 // unsigned/signed/floating point, followed by the number of bits per lane;
 // then 'x' followed by the number of lanes. Example: u8x16. This is useful for
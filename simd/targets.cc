@@ -82,8 +82,15 @@ enum {
   kLZCNT = 1 << 9,
   kBMI = 1 << 10,
   kBMI2 = 1 << 11,
+  kPOPCNT = 1 << 12,
+  kAVX512F = 1 << 13,
+  kAVX512DQ = 1 << 14,
+  kAVX512BW = 1 << 15,
+  kAVX512VL = 1 << 16,
 
   kGroupAVX2 = kAVX | kAVX2 | kFMA | kLZCNT | kBMI | kBMI2,
+  kGroupAVX512 =
+      kGroupAVX2 | kPOPCNT | kAVX512F | kAVX512DQ | kAVX512BW | kAVX512VL,
   kGroupSSE4 = kSSE | kSSE2 | kSSE3 | kSSSE3 | kSSE41 | kSSE42
 };
 
@@ -113,6 +120,7 @@ TargetBitfield::TargetBitfield() {
   flags |= IsBitSet(abcd[2], 9) ? kSSSE3 : 0;
   flags |= IsBitSet(abcd[2], 19) ? kSSE41 : 0;
   flags |= IsBitSet(abcd[2], 20) ? kSSE42 : 0;
+  flags |= IsBitSet(abcd[2], 23) ? kPOPCNT : 0;
   flags |= IsBitSet(abcd[2], 12) ? kFMA : 0;
   flags |= IsBitSet(abcd[2], 28) ? kAVX : 0;
   const bool has_osxsave = IsBitSet(abcd[2], 27);
@@ -127,9 +135,13 @@ TargetBitfield::TargetBitfield() {
     flags |= IsBitSet(abcd[1], 3) ? kBMI : 0;
     flags |= IsBitSet(abcd[1], 5) ? kAVX2 : 0;
     flags |= IsBitSet(abcd[1], 8) ? kBMI2 : 0;
+    flags |= IsBitSet(abcd[1], 16) ? kAVX512F : 0;
+    flags |= IsBitSet(abcd[1], 17) ? kAVX512DQ : 0;
+    flags |= IsBitSet(abcd[1], 30) ? kAVX512BW : 0;
+    flags |= IsBitSet(abcd[1], 31) ? kAVX512VL : 0;
   }
 
-  // Verify OS support for XSAVE, without which XMM/YMM registers are not
+  // Verify OS support for XSAVE, without which XMM/YMM/ZMM registers are not
   // preserved across context switches and are not safe to use.
   if (has_osxsave) {
     const uint32_t xcr0 = ReadXCR0();
@@ -142,9 +154,16 @@ TargetBitfield::TargetBitfield() {
     if (!IsBitSet(xcr0, 2)) {
       flags &= ~(kAVX | kAVX2);
     }
+    // Opmask, ZMM upper 256 bits and ZMM16-31
+    if (!IsBitSet(xcr0, 5) || !IsBitSet(xcr0, 6) || !IsBitSet(xcr0, 7)) {
+      flags &= ~(kAVX512F | kAVX512DQ | kAVX512BW | kAVX512VL);
+    }
   }
 
   // Set target bit(s) if all their group's flags are all set.
+  if ((flags & kGroupAVX512) == kGroupAVX512) {
+    bits_ |= SIMD_AVX512;
+  }
   if ((flags & kGroupAVX2) == kGroupAVX2) {
     bits_ |= SIMD_AVX2;
   }
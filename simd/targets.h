@@ -36,7 +36,7 @@ namespace pik {
 // the build system and avoids needing custom compiler options.
 #ifndef SIMD_ENABLE
 #if SIMD_ARCH == SIMD_ARCH_X86
-#define SIMD_ENABLE (SIMD_SSE4 | SIMD_AVX2)
+#define SIMD_ENABLE (SIMD_SSE4 | SIMD_AVX2 | SIMD_AVX512)
 #elif SIMD_ARCH == SIMD_ARCH_PPC
 #define SIMD_ENABLE SIMD_PPC8
 #elif SIMD_ARCH == SIMD_ARCH_ARM
@@ -45,21 +45,29 @@ namespace pik {
 #endif  // #if SIMD_ARCH
 #endif  // #ifndef SIMD_ENABLE
 
-// Sets SIMD_TARGET to the 'best' target in SIMD_ENABLE. This is only useful for
-// single-target code; for runtime dispatch, use foreach_target.h to generate
-// specializations for all enabled targets.
-#if SIMD_ENABLE & SIMD_AVX2
-#define SIMD_TARGET AVX2
-#elif SIMD_ENABLE & SIMD_SSE4
-#define SIMD_TARGET SSE4
+// Sets SIMD_STATIC_TARGET to the baseline, i.e. least capable, target in
+// SIMD_ENABLE. Code outside of foreach_target.h (e.g. the encoder's analysis
+// and all SIMD_ATTR functions) is compiled for it, so binaries run on every
+// CPU that supports any enabled target. Hot kernels instead use foreach_target
+// to generate specializations for all enabled targets and Dispatch to the best
+// one at runtime. AVX512 is never the static target: static code (e.g.
+// convolve.h) assumes at most 8 float lanes. Not every kernel has a native
+// AVX512 specialization yet; e.g. the edge-preserving filter forwards to AVX2.
+#if SIMD_ENABLE & SIMD_SSE4
+#define SIMD_STATIC_TARGET SSE4
+#elif SIMD_ENABLE & SIMD_AVX2
+#define SIMD_STATIC_TARGET AVX2
 #elif SIMD_ENABLE & SIMD_PPC8
-#define SIMD_TARGET PPC8
+#define SIMD_STATIC_TARGET PPC8
 #elif SIMD_ENABLE & SIMD_ARM8
-#define SIMD_TARGET ARM8
+#define SIMD_STATIC_TARGET ARM8
 #else
-#define SIMD_TARGET NONE
+#define SIMD_STATIC_TARGET NONE
 #endif
 
+// Redefined by foreach_target.h, which restores it afterwards.
+#define SIMD_TARGET SIMD_STATIC_TARGET
+
 // SIMD_TARGET serves two purposes: specializing functors and selecting the
 // definition of other macros (e.g. SIMD_ATTR). For the former, we use structs
 // instead of SIMD_SSE4=4 so that the mangled names are easier to understand.
@@ -104,6 +112,8 @@ struct AVX512 {
     return 64 / sizeof(T);
   }
 };
+#define SIMD_ATTR_AVX512 \
+  SIMD_TARGET_ATTR("avx,avx2,fma,popcnt,avx512f,avx512vl,avx512dq,avx512bw")
 #endif
 
 #if SIMD_ENABLE & SIMD_PPC8
@@ -130,6 +140,9 @@ struct ARM8 {
 // Strongly-typed enum ensures the argument to Dispatch is a single target, not
 // a bitfield.
 enum class Target {
+#if SIMD_ENABLE & SIMD_AVX512
+  kAVX512 = SIMD_AVX512,
+#endif
 #if SIMD_ENABLE & SIMD_AVX2
   kAVX2 = SIMD_AVX2,
 #endif
@@ -154,6 +167,11 @@ SIMD_INLINE auto Dispatch(const Target target, Func&& func, Args&&... args)
     -> decltype(std::forward<Func>(func).template operator()<NONE>(
         std::forward<Args>(args)...)) {
   switch (target) {
+#if SIMD_ENABLE & SIMD_AVX512
+    case Target::kAVX512:
+      return std::forward<Func>(func).template operator()<AVX512>(
+          std::forward<Args>(args)...);
+#endif
 #if SIMD_ENABLE & SIMD_AVX2
     case Target::kAVX2:
       return std::forward<Func>(func).template operator()<AVX2>(
@@ -176,9 +194,11 @@ SIMD_INLINE auto Dispatch(const Target target, Func&& func, Args&&... args)
 #endif
 
     case Target::kNONE:
-      return std::forward<Func>(func).template operator()<NONE>(
-          std::forward<Args>(args)...);
+      break;
   }
+  // Outside the switch so that non-void functors always return a value.
+  return std::forward<Func>(func).template operator()<NONE>(
+      std::forward<Args>(args)...);
 }
 
 // All targets supported by the current CPU. Cheap to construct.
@@ -191,6 +211,9 @@ class TargetBitfield {
 
   // Returns 'best' (widest/most recent) target amongst those supported.
   Target Best() const {
+#if SIMD_ENABLE & SIMD_AVX512
+    if (bits_ & SIMD_AVX512) return Target::kAVX512;
+#endif
 #if SIMD_ENABLE & SIMD_AVX2
     if (bits_ & SIMD_AVX2) return Target::kAVX2;
 #endif
@@ -223,6 +246,12 @@ class TargetBitfield {
           std::forward<Args>(args)...);
     }
 #endif
+#if SIMD_ENABLE & SIMD_AVX512
+    if (bits_ & SIMD_AVX512) {
+      std::forward<Func>(func).template operator()<AVX512>(
+          std::forward<Args>(args)...);
+    }
+#endif
 #if SIMD_ENABLE & SIMD_PPC8
     if (bits_ & SIMD_PPC8) {
       std::forward<Func>(func).template operator()<PPC8>(
@@ -37,10 +37,12 @@ float SingleImageManager::BlockSaliency(size_t row, size_t col) const {
 
 void SingleImageManager::SetDecodedPass(CodecInOut* io) {
   if (current_header_.is_last) return;
-  previous_pass_ =
-      PadImageToMultiple(OpsinDynamicsImage(io, Rect(io->color())), kBlockDim);
+  const Image3F opsin = OpsinDynamicsImage(io, Rect(io->color()));
   if (current_header_.gaborish != GaborishStrength::kOff) {
-    previous_pass_ = GaborishInverse(previous_pass_, 0.92718927264540152);
+    previous_pass_ = PadAndGaborishInverse(opsin, kBlockDim,
+                                           0.92718927264540152, nullptr);
+  } else {
+    previous_pass_ = PadImageToMultiple(opsin, kBlockDim);
   }
   num_passes_++;
 }
@@ -63,11 +65,12 @@ void SingleImageManager::RestoreOpsin(Image3F* img) {
   AddTo(previous_pass_, img);
 }
 
-void SingleImageManager::GetColorCorrelationMap(const Image3F& opsin,
+void SingleImageManager::GetColorCorrelationMap(const Image3F& opsin_dct,
+                                                ThreadPool* pool,
                                                 ColorCorrelationMap* cmap) {
   if (!has_cmap_) {
     cmap_ = std::move(*cmap);
-    FindBestColorCorrelationMap(opsin, &cmap_);
+    FindBestColorCorrelationMap(opsin_dct, pool, &cmap_);
     has_cmap_ = true;
   }
   *cmap = cmap_.Copy();
@@ -75,11 +78,13 @@ void SingleImageManager::GetColorCorrelationMap(const Image3F& opsin,
 
 void SingleImageManager::GetAcStrategy(float butteraugli_target,
                                        const ImageF* quant_field,
-                                       const Image3F& src, ThreadPool* pool,
+                                       const Image3F& src,
+                                       const Image3F& src_dct,
+                                       ThreadPool* pool,
                                        AcStrategyImage* ac_strategy,
                                        PikInfo* aux_out) {
   if (!has_ac_strategy_) {
-    FindBestAcStrategy(butteraugli_target, quant_field, src, pool,
+    FindBestAcStrategy(butteraugli_target, quant_field, src, src_dct, pool,
                        &ac_strategy_, aux_out);
     has_ac_strategy_ = true;
   }
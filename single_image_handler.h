@@ -81,6 +81,10 @@ class SingleImageManager : public MultipassManager {
   void SetDecodedPass(const Image3F& opsin) override;
   void SetDecodedPass(CodecInOut* io) override;
 
+  bool IsStandalonePass() const override {
+    return num_passes_ == 0 && current_header_.is_last;
+  }
+
   bool IsLastPass() const { return current_header_.is_last; }
 
   void SetProgressiveMode(ProgressiveMode mode) { mode_ = mode; }
@@ -96,12 +100,13 @@ class SingleImageManager : public MultipassManager {
   MultipassHandler* GetGroupHandler(size_t group_id,
                                     const Rect& group_rect) override;
 
-  void GetColorCorrelationMap(const Image3F& opsin,
+  void GetColorCorrelationMap(const Image3F& opsin_dct, ThreadPool* pool,
                               ColorCorrelationMap* cmap) override;
 
   void GetAcStrategy(float butteraugli_target, const ImageF* quant_field,
-                     const Image3F& src, ThreadPool* pool,
-                     AcStrategyImage* ac_strategy, PikInfo* aux_out) override;
+                     const Image3F& src, const Image3F& src_dct,
+                     ThreadPool* pool, AcStrategyImage* ac_strategy,
+                     PikInfo* aux_out) override;
 
   std::shared_ptr<Quantizer> GetQuantizer(
       const CompressParams& cparams, size_t xsize_blocks, size_t ysize_blocks,
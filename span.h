@@ -0,0 +1,58 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef SPAN_H_
+#define SPAN_H_
+
+// Non-owning view of a contiguous array (subset of C++20 std::span).
+
+#include <stddef.h>
+
+#include "status.h"
+
+namespace pik {
+
+// Lets decoders accept any contiguous input (PaddedBytes, std::vector, or a
+// MappedFile) without copying. Unlike PaddedBytes, there is no guarantee of
+// readable memory after the end, so readers must not access data()[size()].
+template <typename T>
+class Span {
+ public:
+  constexpr Span() : Span(nullptr, 0) {}
+
+  constexpr Span(T* array, size_t length) : ptr_(array), len_(length) {}
+
+  // Implicit so that existing callers can keep passing their containers.
+  template <class ArrayLike>
+  Span(const ArrayLike& other) : Span(other.data(), other.size()) {}
+
+  T* data() const { return ptr_; }
+  size_t size() const { return len_; }
+  bool empty() const { return len_ == 0; }
+
+  T* begin() const { return ptr_; }
+  T* end() const { return ptr_ + len_; }
+
+  T& operator[](const size_t i) const {
+    PIK_ASSERT(i < len_);
+    return ptr_[i];
+  }
+
+  // Removes the first "n" elements.
+  void remove_prefix(const size_t n) {
+    PIK_ASSERT(n <= len_);
+    ptr_ += n;
+    len_ -= n;
+  }
+
+ private:
+  T* ptr_;
+  size_t len_;
+};
+
+}  // namespace pik
+
+#endif  // SPAN_H_
@@ -13,8 +13,6 @@
 #include <cstdio>
 #include <cstring>
 
-#undef PROFILER_ENABLED
-#define PROFILER_ENABLED 1
 #include "arch_specific.h"
 #include "cache_aligned.h"
 #include "profiler.h"
@@ -1460,6 +1458,14 @@ void TFGraph::Run() {
       "tf div");
 }
 
+void TFGraph::RunTile(const uint32_t tile_ix, const uint32_t tile_iy,
+                      const int thread) {
+  PIK_ASSERT(tile_ix < num_tiles_x_ && tile_iy < num_tiles_y_);
+  PIK_ASSERT(0 <= thread && static_cast<uint32_t>(thread) < num_instances_);
+  const RunArg arg(tile_ix, tile_iy, num_tiles_x_, num_tiles_y_);
+  RunGraph(instances_[thread], arg);
+}
+
 TFBuilder::TFBuilder() : impl_(new TFBuilderImpl) {}
 TFBuilder::~TFBuilder() {}
 
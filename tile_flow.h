@@ -13,7 +13,8 @@
 // (small square regions). This leads to better cache utilization than
 // processing entire images in each step and also enables parallel execution.
 //
-// Usage example: tile_flow_benchmark.cc.
+// Usage example: MakeGaborishToLinear in compressed_image.cc, which
+// pik_benchmark.cc exercises.
 
 #include <stddef.h>
 #include <stdint.h>
@@ -251,6 +252,15 @@ class TFGraph {
   // or even concurrently across multiple instances.
   void Run();
 
+  uint32_t NumTilesX() const { return num_tiles_x_; }
+  uint32_t NumTilesY() const { return num_tiles_y_; }
+
+  // Runs the processing graph for a single tile, using the per-thread state of
+  // "thread" (as passed to RunOnPool callbacks of the pool given to Finalize).
+  // Allows callers to schedule tiles themselves, e.g. once their inputs are
+  // ready. Concurrent calls must pass different "thread".
+  void RunTile(uint32_t tile_ix, uint32_t tile_iy, int thread);
+
  private:
   const uint32_t num_tiles_x_;
   const uint32_t num_tiles_y_;
@@ -0,0 +1,87 @@
+// Copyright 2019 Google LLC
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#if defined(TRANSFER_FUNCTIONS_H_) == defined(SIMD_TARGET_TOGGLE)
+#ifdef TRANSFER_FUNCTIONS_H_
+#undef TRANSFER_FUNCTIONS_H_
+#else
+#define TRANSFER_FUNCTIONS_H_
+#endif
+
+// SIMD approximations of transfer functions. Compiled for every target if
+// included from a foreach_target.h file.
+
+#include "compiler_specific.h"
+#include "rational_polynomial.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+
+// sRGB. "display" is linear light and "encoded" the nonlinear signal, both
+// normalized to [0, 1]. Inputs must be non-negative.
+class TF_SRGB {
+ public:
+  template <typename V>
+  SIMD_ATTR PIK_INLINE V DisplayFromEncoded(V x) const {
+    // Computed via af_cheb_rational (k=100); replicated 4x.
+    SIMD_ALIGN constexpr float p[(4 + 1) * 4] = {
+        2.200248328e-04, 2.200248328e-04, 2.200248328e-04, 2.200248328e-04,
+        1.043637593e-02, 1.043637593e-02, 1.043637593e-02, 1.043637593e-02,
+        1.624820318e-01, 1.624820318e-01, 1.624820318e-01, 1.624820318e-01,
+        7.961564959e-01, 7.961564959e-01, 7.961564959e-01, 7.961564959e-01,
+        8.210152774e-01, 8.210152774e-01, 8.210152774e-01, 8.210152774e-01,
+    };
+    SIMD_ALIGN constexpr float q[(4 + 1) * 4] = {
+        2.631846970e-01,  2.631846970e-01,  2.631846970e-01,  2.631846970e-01,
+        1.076976492e+00,  1.076976492e+00,  1.076976492e+00,  1.076976492e+00,
+        4.987528350e-01,  4.987528350e-01,  4.987528350e-01,  4.987528350e-01,
+        -5.512498495e-02, -5.512498495e-02, -5.512498495e-02, -5.512498495e-02,
+        6.521209011e-03,  6.521209011e-03,  6.521209011e-03,  6.521209011e-03,
+    };
+    const SIMD_FULL(float) d;
+    const V linear = x * set1(d, kLowDivInv);
+    const V poly = EvalRationalPolynomial(x, p, q);
+    return select(linear, poly, x > set1(d, kThreshSRGBToLinear));
+  }
+
+  template <class V>
+  SIMD_ATTR PIK_INLINE V EncodedFromDisplay(const V x) const {
+    // Computed via af_cheb_rational (k=100); replicated 4x.
+    SIMD_ALIGN constexpr float p[(4 + 1) * 4] = {
+        -5.135152395e-04, -5.135152395e-04, -5.135152395e-04, -5.135152395e-04,
+        5.287254571e-03,  5.287254571e-03,  5.287254571e-03,  5.287254571e-03,
+        3.903842876e-01,  3.903842876e-01,  3.903842876e-01,  3.903842876e-01,
+        1.474205315e+00,  1.474205315e+00,  1.474205315e+00,  1.474205315e+00,
+        7.352629620e-01,  7.352629620e-01,  7.352629620e-01,  7.352629620e-01,
+    };
+    SIMD_ALIGN constexpr float q[(4 + 1) * 4] = {
+        1.004519624e-02, 1.004519624e-02, 1.004519624e-02, 1.004519624e-02,
+        3.036675394e-01, 3.036675394e-01, 3.036675394e-01, 3.036675394e-01,
+        1.340816930e+00, 1.340816930e+00, 1.340816930e+00, 1.340816930e+00,
+        9.258482155e-01, 9.258482155e-01, 9.258482155e-01, 9.258482155e-01,
+        2.424867759e-02, 2.424867759e-02, 2.424867759e-02, 2.424867759e-02,
+    };
+    const SIMD_FULL(float) d;
+    const V linear = x * set1(d, kLowDiv);
+    const V poly = EvalRationalPolynomial(sqrt(x), p, q);
+    return select(linear, poly, x > set1(d, kThreshLinearToSRGB));
+  }
+
+ private:
+  static constexpr double kThreshSRGBToLinear = 0.04045;
+  static constexpr double kThreshLinearToSRGB = 0.0031308;
+  static constexpr double kLowDiv = 12.92;
+  static constexpr double kLowDivInv = 1.0 / kLowDiv;
+};
+
+}  // namespace SIMD_NAMESPACE
+#ifndef SIMD_ATTR_IMPL
+using namespace SIMD_NAMESPACE;
+#endif
+}  // namespace pik
+
+#endif  // TRANSFER_FUNCTIONS_H_
@@ -11,11 +11,16 @@
 
 #include <stdint.h>
 #include <string.h>  // memcpy
+#include <algorithm>
 #include <cstddef>
+#include <vector>
 
 #include "arch_specific.h"
 #include "byte_order.h"
+#include "common.h"
 #include "compiler_specific.h"
+#include "padded_bytes.h"
+#include "span.h"
 #include "status.h"
 
 namespace pik {
@@ -88,9 +93,10 @@ PIK_INLINE void RewindStorage(const size_t pos0, size_t* PIK_RESTRICT pos,
   array[pos0 >> 3] &= kRewindMasks[pos0 & 7];
 }
 
-class BitWriter {
+// Visitor (see BitCounter) that writes to caller-allocated storage.
+class StorageBitWriter {
  public:
-  BitWriter(size_t* storage_ix, uint8_t* storage)
+  StorageBitWriter(size_t* storage_ix, uint8_t* storage)
       : storage_ix_(storage_ix), storage_(storage) {}
 
   void VisitBits(size_t nbits, uint64_t bits) {
@@ -102,6 +108,176 @@ class BitWriter {
   uint8_t* storage_;
 };
 
+// Growable bit stream for the encoder. Encoders append to it directly instead
+// of returning their own buffers. Reset retains the capacity, so a writer that
+// is reused (e.g. for all groups encoded by one thread) stops allocating.
+//
+// Writes are unchecked: callers first call ReserveBits with an upper bound of
+// the bits they are about to write, then either Write or pass storage_ix() and
+// storage() to functions using the WriteBits interface. ReserveBits and Append
+// invalidate storage().
+class BitWriter {
+ public:
+  BitWriter() : bits_written_(0) {}
+
+  // Continues after the first `bits_written` bits of `bytes`.
+  BitWriter(PaddedBytes&& bytes, size_t bits_written)
+      : bits_written_(bits_written), bytes_(std::move(bytes)) {
+    PIK_ASSERT(DivCeil(bits_written_, kBitsPerByte) <= bytes_.size());
+    ReserveBits(kBitsPerByte);
+    // A byte-aligned end need not be initialized yet.
+    if (bits_written_ % kBitsPerByte == 0) {
+      WriteBitsPrepareStorage(bits_written_, storage());
+    }
+  }
+
+  BitWriter(BitWriter&&) = default;
+  BitWriter& operator=(BitWriter&&) = default;
+
+  size_t BitsWritten() const { return bits_written_; }
+  // Including the partially written last byte, if any.
+  size_t BytesWritten() const { return DivCeil(bits_written_, kBitsPerByte); }
+
+  void ReserveBits(size_t max_bits) {
+    const size_t required_bytes = (bits_written_ + max_bits) / kBitsPerByte + 1;
+    if (required_bytes <= bytes_.capacity()) return;
+    // Within capacity; only the written bytes are copied.
+    bytes_.resize(BytesWritten());
+    bytes_.reserve(std::max(required_bytes, bytes_.capacity() * 3 / 2));
+    PIK_CHECK(bytes_.data() != nullptr);
+  }
+
+  void Write(size_t n_bits, uint64_t bits) {
+    WriteBits(n_bits, bits, &bits_written_, bytes_.data());
+  }
+
+  void ZeroPadToByte() {
+    ReserveBits(kBitsPerByte);
+    WriteZeroesToByteBoundary(&bits_written_, bytes_.data());
+  }
+
+  // Discards all bits after the first `bits`.
+  void Rewind(size_t bits) {
+    if (bytes_.data() == nullptr) return;
+    RewindStorage(bits, &bits_written_, bytes_.data());
+  }
+
+  // Removes the byte-aligned range [begin, end) of bits and moves the
+  // subsequent bits down.
+  void Erase(size_t begin, size_t end) {
+    PIK_ASSERT(begin % kBitsPerByte == 0 && end % kBitsPerByte == 0);
+    PIK_ASSERT(begin <= end && end <= bits_written_);
+    if (begin == end) return;
+    uint8_t* data = bytes_.data();
+    memmove(data + begin / kBitsPerByte, data + end / kBitsPerByte,
+            BytesWritten() - end / kBitsPerByte);
+    Rewind(bits_written_ - (end - begin));
+  }
+
+  // Appends the bytes of `other` (e.g. PaddedBytes or Span); the stream must
+  // be byte-aligned.
+  template <class ByteArray>
+  void Append(const ByteArray& other) {
+    PIK_ASSERT(bits_written_ % kBitsPerByte == 0);
+    const size_t size = other.size();
+    ReserveBits(size * kBitsPerByte);
+    memcpy(bytes_.data() + bits_written_ / kBitsPerByte, other.data(), size);
+    bits_written_ += size * kBitsPerByte;
+    WriteBitsPrepareStorage(bits_written_, bytes_.data());
+  }
+
+  // Inserts the bytes of `other` at the byte-aligned bit position `pos` and
+  // moves the subsequent bits up.
+  template <class ByteArray>
+  void Insert(size_t pos, const ByteArray& other) {
+    PIK_ASSERT(pos % kBitsPerByte == 0 && pos <= bits_written_);
+    const size_t size = other.size();
+    ReserveBits(size * kBitsPerByte);
+    uint8_t* data = bytes_.data();
+    memmove(data + pos / kBitsPerByte + size, data + pos / kBitsPerByte,
+            BytesWritten() - pos / kBitsPerByte);
+    memcpy(data + pos / kBitsPerByte, other.data(), size);
+    bits_written_ += size * kBitsPerByte;
+    if (bits_written_ % kBitsPerByte == 0) {
+      WriteBitsPrepareStorage(bits_written_, data);
+    }
+  }
+
+  size_t* storage_ix() { return &bits_written_; }
+  uint8_t* storage() { return bytes_.data(); }
+
+  // Bytes written so far; the last may be partial.
+  Span<const uint8_t> Bytes() const {
+    return Span<const uint8_t>(bytes_.data(), BytesWritten());
+  }
+
+  // Returns the bytes written and empties the writer (without capacity).
+  PaddedBytes TakeBytes() {
+    bytes_.resize(BytesWritten());
+    bits_written_ = 0;
+    return std::move(bytes_);
+  }
+
+  // Empties the writer, retaining its capacity.
+  void Reset() {
+    bits_written_ = 0;
+    if (bytes_.data() != nullptr) WriteBitsPrepareStorage(0, bytes_.data());
+  }
+
+ private:
+  size_t bits_written_;
+  PaddedBytes bytes_;
+};
+
+// Encodes independent sections (e.g. groups) in parallel: each section is
+// appended to the writer of the thread that encodes it, and Gather copies
+// them to the output in section order.
+class GroupWriters {
+ public:
+  GroupWriters(size_t num_threads, size_t num_sections)
+      : writers_(num_threads), sections_(num_sections) {}
+
+  // Returns the writer for encoding `section` on `thread`. Call Finish once
+  // the section is written.
+  BitWriter* Begin(size_t section, int thread) {
+    BitWriter* writer = &writers_[thread];
+    PIK_ASSERT(writer->BitsWritten() % kBitsPerByte == 0);
+    sections_[section].thread = thread;
+    sections_[section].begin = writer->BytesWritten();
+    return writer;
+  }
+  // Pads the section to whole bytes.
+  void Finish(size_t section) {
+    BitWriter* writer = &writers_[sections_[section].thread];
+    writer->ZeroPadToByte();
+    sections_[section].size =
+        writer->BytesWritten() - sections_[section].begin;
+  }
+
+  size_t SectionSize(size_t section) const { return sections_[section].size; }
+
+  // Appends all sections to the byte-aligned `out`.
+  void Gather(BitWriter* out) const {
+    size_t total_size = 0;
+    for (const Section& section : sections_) total_size += section.size;
+    out->ReserveBits(total_size * kBitsPerByte);
+    for (const Section& section : sections_) {
+      out->Append(Span<const uint8_t>(
+          writers_[section.thread].Bytes().data() + section.begin,
+          section.size));
+    }
+  }
+
+ private:
+  struct Section {
+    size_t thread = 0;
+    size_t begin = 0;
+    size_t size = 0;
+  };
+  std::vector<BitWriter> writers_;
+  std::vector<Section> sections_;
+};
+
 struct BitCounter {
   void VisitBits(size_t nbits, uint64_t bits) { num_bits += nbits; }
   size_t num_bits = 0;